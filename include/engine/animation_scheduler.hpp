@@ -0,0 +1,136 @@
+#ifndef ENGINE_ANIMATION_SCHEDULER_HPP
+#define ENGINE_ANIMATION_SCHEDULER_HPP
+
+#include "renderer.hpp"
+#include "animation.hpp"
+
+#include <memory>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <unordered_map>
+
+namespace engine
+{
+
+// Animates many quads and sprites from a single frame time.
+// Quads that use the same animation change frame together so each
+// animation only keeps one wake up time. Sprites get a track of their
+// own (a player) so they can have their own speed and be paused.
+// Only the tracks whose next frame is due are touched by update().
+class animation_scheduler
+{
+public:
+	typedef size_t handle;
+	static constexpr handle no_handle = static_cast<handle>(-1);
+
+	animation_scheduler();
+
+	// The quad is given the current frame of the animation.
+	// Returns no_handle if the animation has less than 2 frames.
+	handle add_quad(std::shared_ptr<const animation> pAnimation, const vertex_reference& pRef);
+	void remove_quad(handle pHandle);
+
+	// pOn_frame is called by update() with the new frame every time it
+	// changes. The player starts playing pFrame from now.
+	handle add_player(std::shared_ptr<const animation> pAnimation, frame_t pFrame, std::function<void(frame_t)> pOn_frame);
+	void remove_player(handle pHandle);
+
+	// Keeps the timing of the current frame
+	void set_player_animation(handle pHandle, std::shared_ptr<const animation> pAnimation);
+
+	// Times pFrame from now. Frames with an interval of 0 never end.
+	void set_player_frame(handle pHandle, frame_t pFrame);
+
+	// The time left of the current frame is scaled as well
+	void set_player_speed(handle pHandle, float pSpeed);
+
+	// Paused players keep the time left of their frame
+	void pause_player(handle pHandle);
+	void resume_player(handle pHandle);
+
+	void clear();
+
+	// Advance every animation by pDelta seconds
+	void update(float pDelta);
+
+	size_t get_quad_count() const;
+	size_t get_player_count() const;
+
+private:
+	// Quads of one animation in the same batch
+	struct quad_list
+	{
+		vertex_batch* batch;
+		std::vector<vertex_reference> refs;
+		std::vector<handle> handles;
+	};
+
+	struct track
+	{
+		std::shared_ptr<const animation> definition;
+		frame_t frame; // Frames advanced since the track started
+		frect rect;
+		double next; // Time of the next frame
+		bool scheduled;
+		size_t generation; // Of its entry in mWakes
+		size_t quad_count;
+		std::vector<quad_list> lists;
+	};
+
+	struct location
+	{
+		size_t track;
+		size_t list;
+		size_t index;
+	};
+
+	struct player
+	{
+		std::shared_ptr<const animation> definition;
+		std::function<void(frame_t)> on_frame;
+		frame_t frame;
+		float speed;
+		double next;
+		double remaining; // Time left of the frame while paused
+		bool playing;
+		bool scheduled;
+		size_t generation;
+	};
+
+	struct wake
+	{
+		double time;
+		size_t index; // Of the track or player
+		size_t generation; // Entries of an older generation are skipped
+		bool is_player;
+		bool operator>(const wake& pOther) const { return time > pOther.time; }
+	};
+
+	void restart(size_t pTrack);
+	void advance(track& pTrack);
+
+	double get_interval(const player& pPlayer) const;
+	void schedule_player(handle pHandle, double pWait);
+
+	double mTime;
+	size_t mQuad_count;
+
+	std::vector<track> mTracks;
+	std::unordered_map<const animation*, size_t> mTrack_indices;
+
+	std::vector<location> mLocations; // Location of each handle
+	std::vector<handle> mFree_handles;
+
+	std::vector<player> mPlayers;
+	std::vector<handle> mFree_players;
+
+	// Soonest first
+	std::priority_queue<wake, std::vector<wake>, std::greater<wake>> mWakes;
+	std::vector<size_t> mDue;
+	std::vector<wake> mDue_players;
+};
+
+}
+
+#endif // !ENGINE_ANIMATION_SCHEDULER_HPP
@@ -22,9 +22,19 @@ public:
 
 	static const size_t streaming_threshold = 1000000;
 
+	sound_file();
+
 	bool load();
 	bool unload();
 
+	// Short sounds are decoded in the background and only
+	// copied into the buffer on the main thread.
+	bool prepare_load() override;
+	bool finish_load() override;
+
+	// Streamed sounds are not counted
+	size_t get_memory_usage() const override;
+
 	const std::string& get_type() const override
 	{
 		return type;
@@ -39,6 +49,12 @@ private:
 
 	bool mBuffer_loaded;
 
+	// Decoded by prepare_load()
+	std::vector<sf::Int16> mPrepared_samples;
+	unsigned int mPrepared_channels;
+	unsigned int mPrepared_rate;
+	bool mIs_prepared;
+
 	friend class sound;
 };
 
@@ -21,6 +21,11 @@ public:
 	node();
 	virtual ~node();
 
+	// Only the transform and unit are copied.
+	// Parents and children stay with the original.
+	node(const node& pNode);
+	node& operator=(const node& pNode);
+
 	// Absolute position scaled by unit scale
 	fvector  get_exact_position() const;
 
@@ -41,11 +46,12 @@ public:
 	// This node is will not be visible to the parent node
 	void set_internal_parent(node& pNode);
 
+	// Detaching a child may change the order of its siblings
 	util::optional_pointer<node> detach_parent();
 	node_arr                     detach_children();
 
 	util::optional_pointer<node> get_parent() const;
-	node_arr                     get_children() const;
+	const node_arr&              get_children() const;
 
 	bool set_parent(node& obj);
 	bool add_child(node& obj);
@@ -58,13 +64,29 @@ private:
 	bool mIs_internal;
 	node_arr mChildren;
 
-	size_t mChild_index;
+	// Not visible to anyone but they still
+	// need to know when this node moves.
+	node_arr mInternal_children;
+
+	size_t mChild_index; // Index in the parent's children or internal children
 
 	float mUnit;
 
 	fvector mPosition;
 	float mRotation;
 	fvector mScale;
+
+	// Absolute transform. Only recalculated when this
+	// node or one of its parents has changed.
+	mutable fvector mAbsolute_position;
+	mutable float   mAbsolute_rotation;
+	mutable fvector mAbsolute_scale;
+	mutable bool    mTransform_changed;
+
+	void update_transform() const;
+
+	// Children of a changed node are always changed as well
+	void transform_changed();
 };
 
 }
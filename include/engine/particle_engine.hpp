@@ -11,6 +11,9 @@ namespace engine
 {
 
 // TODO: Add different types of emitter sources.
+// Particles are stored as one array per field so they can be updated in
+// tight loops. Live particles always come first and each one uses
+// the quad with the same index in mSprites.
 class particle_emitter :
 	public render_object
 {
@@ -24,21 +27,27 @@ public:
 	void set_rate(float a);
 	void set_texture(std::shared_ptr<texture> pTexture);
 	void set_texture_rect(frect r);
+
+	// Most particles alive at once. Nothing spawns while full.
+	void set_capacity(size_t pCapacity);
+	size_t get_capacity() const;
+
+	size_t get_count() const;
+
+	// Ages and moves every particle by pDelta seconds
+	void update(float pDelta);
+
 	int draw(renderer &_r);
 
 private:
 	clock mFrame_clock, mSpawn_clock;
 
-	struct particle
-	{
-		timer life;
-		fvector velocity;
-		bool valid;
-		engine::vertex_reference sprite;
-	};
-	std::vector<particle> mParticles;
+	size_t mCount;
+	std::vector<float> mPosition_x, mPosition_y;
+	std::vector<float> mVelocity_x, mVelocity_y;
+	std::vector<float> mLife_left; // Seconds
 
-	particle* find_unused_particle();
+	size_t mQuads_shown; // Quads that may still show a particle
 
 	fvector mRegion_size;
 	float   mRate, mLife;
@@ -49,6 +58,7 @@ private:
 	frect         mTexture_rect;
 
 	void tick();
+	void update_quads();
 };
 
 
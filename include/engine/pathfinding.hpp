@@ -2,12 +2,18 @@
 #define ENGINE_PATHFINDING_HPP
 
 #include <engine/vector.hpp>
+#include <engine/rect.hpp>
+#include <engine/time.hpp>
 #include <vector>
 #include <deque>
-#include <array>
-#include <list>
-#include <set>
+#include <map>
+#include <memory>
 #include <functional>
+#include <unordered_map>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace engine {
 
@@ -17,80 +23,164 @@ typedef std::deque<engine::fvector> path_t;
 class path_node
 {
 public:
+	// Index used when a node has no predecessor
+	static constexpr uint32_t no_node = 0xFFFFFFFF;
+
 	path_node();
 
 	// Calculate F=H+G for the cost of the node
-	float calculate_cost(fvector pStart, fvector pDestination);
+	float calculate_cost(float pG, fvector pDestination);
 
 	void set_position(fvector pPosition);
 	fvector get_position() const;
+
+	void set_grid_position(ivector pPosition);
 	ivector get_grid_position() const;
 
 	bool has_predecessor() const;
-	void set_predecessor(path_node& pPath_node);
-	path_node& get_predecessor();
+	void set_predecessor(uint32_t pIndex);
+	uint32_t get_predecessor() const;
 
 	float get_total_cost() const;
+	float get_g() const;
+	float get_h() const;
 
 	bool is_less_costly(const path_node& pNode) const;
 
-	bool operator<(const path_node& pNode);
+	bool is_closed() const;
 
 private:
 	float mTotal_cost;
+	float mG;
 	float mH;
 	engine::fvector mPosition;
-	path_node* mPredecessor;
+	engine::ivector mGrid_position;
+	uint32_t mPredecessor;
+	uint32_t mHeap_index; // Position in the open set heap
+
+	friend class path_set;
 };
 
 typedef std::function<bool(fvector&)> collision_callback;
 
+// A compact 2 bit per tile map of what is walkable.
+// Tiles only partially covered by an obstacle are marked as
+// partial so the caller can fall back to an exact check.
+class walkability_grid
+{
+public:
+	enum class cell
+	{
+		open,
+		blocked,
+		partial
+	};
+
+	walkability_grid();
+
+	// Resize to cover these tiles. Every cell becomes open.
+	void reset(irect pBounds);
+	void clear();
+
+	const irect& get_bounds() const;
+	bool is_inside(ivector pPosition) const;
+
+	void set_cell(ivector pPosition, cell pCell);
+
+	// Cells outside of the bounds are always open
+	cell get_cell(ivector pPosition) const;
+
+	// Returns the most restrictive cell that the region overlaps.
+	// Edges that only touch a cell do not count as overlapping.
+	cell test_region(const frect& pRegion) const;
+
+private:
+	irect mBounds;
+	std::vector<uint64_t> mBits;
+};
+
+// Open addressing map of grid positions to nodes.
+// Clearing only bumps a generation counter so the
+// storage is reused between searches without touching it.
 class grid_set
 {
 public:
+	// Value stored for cells that were found to be blocked
+	static constexpr uint32_t blocked = 0xFFFFFFFE;
+
+	grid_set();
 
-	// Returns all neighboring nodes that are available
-	std::vector<fvector> get_empty_neighbors_positions(path_node& pNode) const;
+	// Returns the node at this position, path_node::no_node if
+	// it has not been visited, or blocked.
+	uint32_t find(ivector pPosition) const;
 
-	// Register a node
-	void add_node(path_node& pNode);
+	// Register a node (or blocked) at a position
+	void add_node(ivector pPosition, uint32_t pNode);
 
 	void clean();
+
 private:
-	std::set<engine::ivector> mMap;
+	struct entry
+	{
+		uint64_t key;
+		uint32_t node;
+		uint32_t generation;
+	};
+
+	static uint64_t hash_position(ivector pPosition);
+	size_t find_slot(uint64_t pKey) const;
+	void grow();
+
+	std::vector<entry> mTable;
+	size_t mCount;
+	uint32_t mGeneration;
 };
 
 class path_set
 {
 public:
+	path_set();
+
 	void clean();
 
 	// Cleans up current path and starts a new one
 	void new_path(fvector pStart, fvector pDestination);
 
 	// Check collision and construct new nodes
-	bool step(collision_callback pCollision_callback);
+	bool step(const collision_callback& pCollision_callback);
 
 	// Trace path from closest node to destination
 	std::deque<engine::fvector> construct_path();
 
 	// Create nodes around the specified location
-	void create_neighbors(path_node& pNode,
-		collision_callback pCollision_callback);
+	void create_neighbors(uint32_t pNode,
+		const collision_callback& pCollision_callback);
 
 	// Check if there is no more paths to make
 	bool is_openset_empty() const;
 
 private:
-	path_node& add_node(engine::fvector pPosition);
+	uint32_t add_node(ivector pGrid_position, float pG, uint32_t pPredecessor);
+
+	// Indexed binary heap over mNodes ordered by cost
+	void heap_push(uint32_t pNode);
+	uint32_t heap_pop();
+	void heap_sift_up(size_t pIndex);
+	void heap_sift_down(size_t pIndex);
+	void heap_swap(size_t pA, size_t pB);
+
+	// Node pool. Kept around between paths so searching
+	// does not allocate once it has warmed up.
+	std::vector<path_node> mNodes;
+	std::vector<uint32_t> mOpen_set;
 
-	std::list<path_node> mOpen_set;
-	std::list<path_node> mClosed_set;
+	uint32_t mClosest; // Node with the lowest heuristic so far
+	uint32_t mFound;
 
 	engine::fvector mStart;
 	engine::fvector mDestination;
 
-	grid_set mGrid; // Keeps track of occupied spaces
+	grid_set mGrid; // Keeps track of visited and blocked spaces
 };
 
 
@@ -119,6 +209,177 @@ private:
 	path_set mPath_set;
 };
 
+// Hierarchical A* (HPA*) for long routes.
+// Tiles are grouped into square clusters. Entrances between neighboring
+// clusters and the distances between them are precomputed so a route
+// is first planned over the entrances and only the legs inside
+// each cluster are refined into tiles when the path is constructed.
+// Routes are planned on whole tiles; the returned positions keep the
+// start's offset within its tile.
+class hierarchical_pathfinder
+{
+public:
+	// Return true if the tile is blocked
+	typedef std::function<bool(ivector)> tile_callback;
+
+	hierarchical_pathfinder();
+
+	void set_cluster_size(int pSize);
+	void set_tile_callback(tile_callback pCallback);
+
+	// Build the clusters and entrance graph for these tiles
+	void build(irect pBounds);
+
+	// Recheck the tiles in this region and rebuild only the clusters affected
+	void update(irect pRegion);
+
+	void clear();
+
+	bool is_built() const;
+	const irect& get_bounds() const;
+
+	// Find shortest path to destination over the entrance graph
+	bool start(fvector pStart, fvector pDestination);
+
+	// Refine the route found by start() into individual tiles.
+	// The waypoints are the tile origins the tile callback was
+	// asked about, starting with the tile of the start.
+	path_t construct_path();
+
+private:
+	struct cluster
+	{
+		std::vector<ivector> nodes; // Entrance tiles within this cluster
+		std::vector<float> distances; // nodes x nodes matrix, -1 if unreachable
+	};
+
+	int mCluster_size;
+	tile_callback mTile_callback;
+	irect mBounds;
+	ivector mCluster_count;
+	std::vector<bool> mBlocked;
+	std::vector<cluster> mClusters;
+	std::unordered_map<uint64_t, uint32_t> mNode_lookup; // Tile to index in its cluster
+
+	std::vector<ivector> mRoute;
+
+	// Scratch space for local searches
+	std::vector<int> mDistance_map;
+	std::vector<ivector> mQueue;
+
+	static uint64_t hash_tile(ivector pTile);
+
+	bool is_blocked(ivector pTile) const;
+	ivector get_cluster_position(ivector pTile) const;
+	irect get_cluster_tiles(ivector pCluster) const;
+	cluster& get_cluster(ivector pCluster);
+
+	void build_cluster(ivector pCluster);
+	void find_entrances(ivector pCluster, ivector pNeighbor, std::vector<ivector>& pNodes) const;
+
+	// Breadth first search within a region. Fills mDistance_map.
+	void flood(ivector pFrom, const irect& pRegion);
+	int get_flood_distance(ivector pTile, const irect& pRegion) const;
+	bool local_path(ivector pFrom, ivector pTo, std::vector<ivector>& pPath);
+};
+
+// Immutable copy of the walkability of a scene so paths can
+// be found on another thread while the scene keeps changing.
+class walkability_snapshot
+{
+public:
+	// pObstacles are the regions that can partially cover tiles
+	walkability_snapshot(const walkability_grid& pGrid, const std::vector<frect>& pObstacles);
+
+	bool is_blocked(const frect& pRegion) const;
+
+private:
+	walkability_grid mGrid;
+	std::vector<frect> mObstacles;
+
+	// Partially covered tiles to the obstacles that touch them
+	std::unordered_map<uint64_t, std::vector<uint32_t>> mPartial_tiles;
+
+	static uint64_t hash_tile(ivector pTile);
+};
+
+// Finds paths on a worker thread. Results are only handed to the
+// main thread in deliver() so they arrive at a frame boundary.
+class path_request_queue
+{
+public:
+	struct result
+	{
+		bool found;
+		path_t path;
+	};
+
+	path_request_queue();
+	~path_request_queue();
+
+	void set_path_limit(size_t pLimit);
+
+	// Queue a request. Returns an id to check on it later.
+	int submit(fvector pStart, fvector pDestination, std::shared_ptr<const walkability_snapshot> pSnapshot);
+
+	// Make finished requests available. Call once per frame.
+	void deliver();
+
+	bool is_ready(int pId) const;
+
+	// Take a delivered result. Returns false if it isn't ready.
+	bool take_result(int pId, result& pResult);
+
+	void cancel(int pId);
+	void cancel_all();
+
+	// Requests waiting for or being processed by the worker
+	size_t get_queue_depth() const;
+
+	// Time from submission to delivery in milliseconds
+	float get_average_latency() const;
+	float get_max_latency() const;
+	size_t get_delivered_count() const;
+
+private:
+	struct request
+	{
+		int id;
+		fvector start;
+		fvector destination;
+		std::shared_ptr<const walkability_snapshot> snapshot;
+		engine::clock age;
+	};
+
+	struct finished
+	{
+		int id;
+		result path;
+		engine::clock age;
+	};
+
+	void start_worker();
+	void worker_loop();
+
+	std::thread mWorker;
+	mutable std::mutex mMutex;
+	std::condition_variable mCondition;
+	bool mStop;
+
+	// Shared with the worker. Guarded by mMutex.
+	std::deque<request> mPending;
+	std::vector<finished> mFinished;
+	int mIn_progress;
+	size_t mPath_limit;
+
+	// Main thread only
+	std::map<int, result> mDelivered;
+	int mNext_id;
+	size_t mDelivered_count;
+	float mTotal_latency;
+	float mMax_latency;
+};
+
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,97 @@
+#ifndef ENGINE_PROFILER_HPP
+#define ENGINE_PROFILER_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace engine {
+namespace profiler {
+
+// Times are in nanoseconds since the profiler started.
+// Real time is used even when the clocks are faked.
+
+struct zone_record
+{
+	const char* name;
+	int64_t start;
+	int64_t duration;
+	size_t thread;
+};
+
+struct counter_record
+{
+	const char* name;
+	float value;
+};
+
+struct frame_record
+{
+	int64_t start;
+	int64_t duration;
+	size_t thread; // Thread that ended the frame
+	std::vector<zone_record> zones;
+	std::vector<counter_record> counters;
+};
+
+// Nothing is recorded until enabled
+void set_enabled(bool pEnabled);
+bool is_enabled();
+
+// Number of frames kept. Older frames are overwritten.
+void set_history_size(size_t pFrames);
+size_t get_history_size();
+
+// Ends the frame being recorded and starts the next one
+void end_frame();
+
+void clear();
+
+int64_t now();
+
+// Names must stay valid for as long as they are recorded (use string literals).
+// Zones and counters may be added from any thread.
+void add_zone(const char* pName, int64_t pStart, int64_t pEnd);
+void add_counter(const char* pName, float pValue);
+
+// Finished frames, oldest first
+std::vector<frame_record> get_frames();
+std::vector<float> get_frame_times(); // Milliseconds
+
+// Average milliseconds per frame of each zone
+std::string get_summary();
+
+// Chrome trace_event format. Open in chrome://tracing.
+std::string get_chrome_trace();
+bool save_chrome_trace(const std::string& pPath);
+
+// Records the time from construction to destruction
+class zone
+{
+public:
+	zone(const char* pName);
+	~zone();
+
+private:
+	const char* mName;
+	int64_t mStart;
+};
+
+}
+}
+
+#define ENGINE_PROFILE_CONCAT_IMPL(A, B) A##B
+#define ENGINE_PROFILE_CONCAT(A, B) ENGINE_PROFILE_CONCAT_IMPL(A, B)
+
+// Zones and counters are compiled out of locked releases
+#ifndef LOCKED_RELEASE_MODE
+#define PROFILE_ZONE(pName) engine::profiler::zone ENGINE_PROFILE_CONCAT(profile_zone_, __LINE__)(pName)
+#define PROFILE_COUNTER(pName, pValue) engine::profiler::add_counter(pName, static_cast<float>(pValue))
+#define PROFILE_END_FRAME() engine::profiler::end_frame()
+#else
+#define PROFILE_ZONE(pName)
+#define PROFILE_COUNTER(pName, pValue)
+#define PROFILE_END_FRAME()
+#endif
+
+#endif // !ENGINE_PROFILER_HPP
@@ -68,6 +68,7 @@ private:
 };
 
 class renderer;
+class animation_scheduler;
 
 class render_object :
 	public node,
@@ -99,10 +100,183 @@ protected:
 
 private:
 	renderer * mRenderer;
-	size_t mIndex;
 	bool mVisible;
 	float mDepth;
 	bool mManual_render;
+
+	// Used by render_list
+	size_t mIndex;         // Position in the list
+	float mSorted_depth;   // Depth it is currently sorted by
+	size_t mSequence;      // Order it was added in. Breaks ties between equal depths.
+	bool mDepth_changed;   // Waiting to be moved
+	size_t mChanged_index; // Position in the list of changes while waiting
+
+	friend class render_list;
+};
+
+// Keeps render objects in drawing order. Higher depths come first and
+// objects of equal depth stay in the order they were added.
+// Adding, removing and changing depth only take effect in update(),
+// which moves just the objects that changed, so the list can be
+// modified while it is being drawn. A moved object is found with a binary
+// search and only the objects between its old and new place shift.
+// Many changes or far moves are merged in a single pass instead.
+class render_list
+{
+public:
+	typedef std::vector<render_object*>::const_iterator const_iterator;
+
+	render_list();
+
+	void add(render_object& pObject);
+	void remove(render_object& pObject);
+
+	// Moved to its new place in the next update()
+	void depth_changed(render_object& pObject);
+
+	// Apply the changes since the last update
+	void update();
+
+	// Sort everything again
+	void resort();
+
+	void clear();
+
+	size_t size() const;
+
+	// Objects removed since the last update() are left as null
+	const_iterator begin() const;
+	const_iterator end() const;
+
+private:
+	static bool compare(const render_object* pA, const render_object* pB);
+
+	// Returns how many objects changed place
+	size_t move(render_object& pObject);
+	void merge_changed();
+	void remove_empty();
+	void reindex(size_t pBegin, size_t pEnd);
+
+	std::vector<render_object*> mObjects;
+	std::vector<render_object*> mChanged; // Added or moved since the last update. Null if removed again.
+	std::vector<render_object*> mMerged;  // Reused between updates
+	size_t mRemoved;
+	size_t mCount;
+	size_t mNext_sequence;
+};
+
+// Counters for a single frame
+struct render_stats
+{
+	size_t draw_calls;    // Everything sent to the backend
+	size_t batches;       // Draw calls made by the render queue
+	size_t quads;         // Quads added to the render queue
+	size_t vertices;      // Vertices sent to the backend
+	size_t state_changes; // Draws with a different texture, shader or view than the last
+};
+
+// Where a renderer sends its draw calls.
+// Counts what is drawn and how often the states change.
+class render_backend
+{
+public:
+	render_backend();
+	virtual ~render_backend() {}
+
+	// Size of the target in pixels
+	virtual fvector get_size() const = 0;
+
+	render_stats& get_stats();
+	void reset_stats();
+
+	void set_view(const sf::View& pView);
+	void draw(const sf::Vertex* pVertices, size_t pCount, sf::PrimitiveType pType, const sf::RenderStates& pStates = sf::RenderStates::Default);
+	void draw(const sf::Drawable& pDrawable, const sf::RenderStates& pStates = sf::RenderStates::Default);
+
+protected:
+	virtual void submit_view(const sf::View& pView) = 0;
+	virtual void submit(const sf::Vertex* pVertices, size_t pCount, sf::PrimitiveType pType, const sf::RenderStates& pStates) = 0;
+	virtual void submit(const sf::Drawable& pDrawable, const sf::RenderStates& pStates) = 0;
+
+private:
+	void count_states(const sf::RenderStates& pStates);
+
+	render_stats mStats;
+	const sf::Texture* mLast_texture;
+	const sf::Shader* mLast_shader;
+	bool mView_changed;
+};
+
+// Draws to a window
+class window_backend :
+	public render_backend
+{
+public:
+	window_backend(sf::RenderTarget& pTarget);
+
+	fvector get_size() const override;
+
+protected:
+	void submit_view(const sf::View& pView) override;
+	void submit(const sf::Vertex* pVertices, size_t pCount, sf::PrimitiveType pType, const sf::RenderStates& pStates) override;
+	void submit(const sf::Drawable& pDrawable, const sf::RenderStates& pStates) override;
+
+private:
+	sf::RenderTarget& mTarget;
+};
+
+// Only counts what would have been drawn.
+// Lets the engine run without a display.
+class null_backend :
+	public render_backend
+{
+public:
+	null_backend(fvector pSize = fvector(800, 600));
+
+	fvector get_size() const override;
+
+protected:
+	void submit_view(const sf::View& pView) override {}
+	void submit(const sf::Vertex* pVertices, size_t pCount, sf::PrimitiveType pType, const sf::RenderStates& pStates) override {}
+	void submit(const sf::Drawable& pDrawable, const sf::RenderStates& pStates) override {}
+
+private:
+	fvector mSize;
+};
+
+// Collects textured quads and draws consecutive quads that share
+// a texture and shader in a single call. Quads are ordered by the
+// depth of the object that added them, then by texture and shader.
+class render_queue
+{
+public:
+	render_queue();
+
+	// Depth given to the quads added after this
+	void set_depth(float pDepth);
+
+	// pVertices are 4 vertices already in target coordinates
+	void add_quad(const sf::Texture* pTexture, const sf::Shader* pShader, const sf::Vertex* pVertices);
+
+	// Sort and draw everything queued
+	void flush(render_backend& pBackend);
+
+	bool is_empty() const;
+	void clear();
+
+private:
+	struct item
+	{
+		float depth;
+		const sf::Texture* texture;
+		const sf::Shader* shader;
+		size_t vertex; // First vertex in mVertices
+	};
+
+	float mDepth;
+	std::vector<item> mItems;
+	std::vector<sf::Vertex> mVertices;
+	std::vector<sf::Vertex> mSorted; // Reused between flushes
 };
 
 class renderer :
@@ -155,19 +329,39 @@ public:
 	float get_fps() const;
 	float get_delta() const;
 
+	// Advanced by draw() with the frame delta
+	std::shared_ptr<animation_scheduler> get_animation_scheduler() const;
+
+	// Creates a backend that draws to this window
 	void set_window(display_window& pWindow);
 	display_window* get_window() const;
 
+	// Draw somewhere other than a window, like a null_backend
+	// for running without a display. Input is ignored without a window.
+	void set_backend(std::unique_ptr<render_backend> pBackend);
+
 	void refresh();
 
 	void set_subwindow_enabled(bool pEnabled);
 	void set_subwindow(frect pRect);
 
+	// Counters of the last frame
+	const render_stats& get_render_stats() const;
+
+	// Queued quads are drawn first so they stay behind
+	// whatever is drawn directly next.
+	render_backend& get_backend()
+	{
+		assert(mBackend);
+		flush_queue();
+		return *mBackend;
+	}
+
 #ifdef ENGINE_INTERNAL
-	sf::RenderTarget& get_sfml_render()
+	void queue_quad(const sf::Texture& pTexture, const sf::Shader* pShader, const sf::Vertex* pVertices)
 	{
-		assert(mWindow);
-		return mWindow->mWindow;
+		mQueue.add_quad(&pTexture, pShader, pVertices);
+		++mBackend->get_stats().quads;
 	}
 #endif
 
@@ -201,9 +395,16 @@ private:
 	sf::View mView;
 	display_window* mWindow;
 
-	std::vector<render_object*> mObjects;
+	std::unique_ptr<render_backend> mBackend;
+	render_queue mQueue;
+	render_stats mLast_stats;
+
+	void flush_queue();
+
+	render_list mObjects;
 	bool mRequest_resort;
 	frame_clock mFrame_clock;
+	std::shared_ptr<animation_scheduler> mAnimations;
 
 	enum class input_state
 	{
@@ -220,12 +421,13 @@ private:
 	void refresh_pressed();
 
 	int draw_objects();
-	void sort_objects();    // Sorts the mObjects array by depth
-	void refresh_objects(); // Updates the indexs of all objects
+	// Called by render_object::set_depth()
+	void depth_changed(render_object& pObject);
 
 	color mBackground_color;
 
 	friend class scoped_clipping;
+	friend class render_object;
 };
 
 class scoped_clipping
@@ -299,7 +501,9 @@ public:
 	vertex_reference()
 		: mBatch(nullptr),
 		mRotation(0),
-		mHskew(0)
+		mHskew(0),
+		mHandle(0),
+		mGeneration(0)
 	{}
 
 	void set_position(fvector pPosition);
@@ -317,6 +521,15 @@ public:
 
 	void set_color(const color& pColor);
 
+	// Position of this quad in the batch for the bulk updates.
+	// Changes when the batch is compacted.
+	size_t get_quad_index() const;
+
+	// False once the quad is removed or the batch is cleaned.
+	// Changes through an invalid reference are ignored.
+	bool is_valid() const;
+
+	vertex_batch* get_batch() const;
 
 	friend class vertex_batch;
 private:
@@ -331,13 +544,37 @@ private:
 	void update_color();
 
 	vertex_batch* mBatch;
-	size_t mIndex;
+
+	// Quads can move so they are found through a handle
+	size_t mHandle;
+	size_t mGeneration;
+
+	size_t get_vertex_index() const;
 	
 	// TODO: Flipping
 	//bool mH_flip;
 	//bool mV_flip;
+};
 
-	sf::Vertex* get_reference();
+// Vertices [begin, end) of a vertex_batch
+struct vertex_range
+{
+	size_t begin;
+	size_t end;
+};
+
+// Keeps a copy of the vertices of a batch, like a buffer on the
+// graphics card, up to date with only the vertices that changed.
+class vertex_upload_sink
+{
+public:
+	virtual ~vertex_upload_sink() {}
+
+	// The batch changed size. Every vertex is updated afterwards.
+	virtual void resize(size_t pVertex_count) = 0;
+
+	// pVertices points to the first changed vertex
+	virtual void update(const sf::Vertex* pVertices, size_t pOffset, size_t pCount) = 0;
 };
 
 class vertex_batch :
@@ -347,8 +584,58 @@ public:
 	vertex_batch();
 
 	void set_texture(std::shared_ptr<texture> pTexture);
+	// Reuses the slot of a removed quad if there is one
 	vertex_reference add_quad(fvector pPosition, frect pTexture_rect, int pRotation = 0);
 	void reserve_quads(size_t pAmount);
+
+	// The slot is collapsed so it draws nothing and is
+	// given to the next added quad.
+	bool remove_quad(const vertex_reference& pRef);
+
+	// Removes the slots of removed quads. The order of the
+	// remaining quads is kept and their references still work.
+	void compact();
+
+	// Compact before drawing once this fraction of the quads
+	// are removed. 0 (the default) never compacts automatically.
+	void set_compaction_threshold(float pRatio);
+
+	// Includes removed quads that have not been compacted yet
+	size_t get_quad_count() const;
+	size_t get_live_quad_count() const;
+	size_t get_dead_quad_count() const;
+
+	// Update a span of quads starting at quad pFirst in a single pass.
+	// These skip the vertex_references of the quads so the
+	// references will not know about the change.
+	// Removed quads in the span are written as well.
+
+	// Axis aligned without rotation or skew
+	void set_quad_rects(size_t pFirst, const frect* pRects, size_t pCount);
+	void set_quad_texture_rects(size_t pFirst, const frect* pRects, size_t pCount);
+	void set_quad_colors(size_t pFirst, const color* pColors, size_t pCount);
+
+	// Moves every vertex of each quad by its offset
+	void translate_quads(size_t pFirst, const fvector* pOffsets, size_t pCount);
+
+	// Quads of the same size placed at the positions in pX and pY
+	void set_quad_positions(size_t pFirst, const float* pX, const float* pY, fvector pSize, size_t pCount);
+
+	// Collapse the quads so they draw nothing. The slots are kept.
+	void hide_quads(size_t pFirst, size_t pCount);
+
+	// Give every referenced quad of this batch the same texture rect.
+	// Unlike the updates above the references are kept up to date
+	// and the rotation of each quad is respected.
+	void set_texture_rect(vertex_reference* pRefs, size_t pCount, frect pRect);
+
+	// Vertices changed since the last upload. Overlapping and
+	// neighbouring changes are merged.
+	const std::vector<vertex_range>& get_dirty_ranges() const;
+
+	// Send the changed vertices to pSink. Only one sink
+	// should be used for each batch.
+	void upload(vertex_upload_sink& pSink);
 	
 	int draw(renderer &pR);
 
@@ -373,6 +660,22 @@ private:
 
 	virtual void refresh_renderer(renderer& pR);
 
+	void mark_dirty(size_t pBegin, size_t pEnd);
+
+	std::vector<vertex_range> mDirty;
+	bool mResized; // Everything is uploaded next time
+
+	static constexpr size_t no_quad = static_cast<size_t>(-1);
+
+	std::vector<size_t> mHandle_quads;       // Quad of each handle
+	std::vector<size_t> mHandle_generations; // Increased when a handle is freed
+	std::vector<size_t> mQuad_handles;       // Handle of each quad. no_quad if removed.
+	std::vector<size_t> mFree_handles;
+	std::vector<size_t> mFree_quads;
+	float mCompaction_threshold;
+
+	void compact_if_needed();
+
 	std::vector<sf::Vertex> mVertices;
 	std::shared_ptr<shader>  mShader;
 	std::shared_ptr<texture> mTexture;
@@ -539,11 +842,16 @@ class font :
 public:
 	const std::string type = "font";
 
+	font();
+
 	void set_font_source(const std::string& pFilepath);
 	void set_preferences_source(const std::string& pFilepath);
 	bool load() override;
 	bool unload() override;
 
+	// Size of the font file. Glyph pages are not counted.
+	size_t get_memory_usage() const override;
+
 	const std::string& get_type() const override
 	{
 		return type;
@@ -555,7 +863,10 @@ private:
 	std::string mFont_source;
 	std::string mPreferences_source;
 
-	std::vector<char> mFont_data; // Stores data loaded from a pack
+	// Font data from a pack. SFML reads from it while the font is in use so
+	// it is copied out of the pack, which may be reopened before the font is unloaded.
+	std::vector<char> mFont_data;
+	size_t mFont_size;
 
 	std::unique_ptr<sf::Font> mSFML_font;
 	int mCharacter_size;
@@ -712,14 +1023,17 @@ private:
 
 	fvector mSize;
 
+	// One for each quad in mVertex_batch
 	struct block_handle
 	{
 		fvector mOriginal_position;
+		fvector mOffset; // Applied by the effects
 		vertex_reference mVertices;
 		size_t mBlock_index;
 	};
 	size_t mCharacter_size;
 	std::vector<block_handle> mBlock_handles;
+	std::vector<fvector> mEffect_moves;
 	vertex_batch mVertex_batch;
 	void update_effects();
 	void update();
@@ -730,14 +1044,18 @@ class animation_node :
 {
 public:
 	animation_node();
+	~animation_node();
+
+	// The scheduler calls back into this node by address and
+	// the player handle can only be removed once.
+	animation_node(const animation_node&) = delete;
+	animation_node& operator=(const animation_node&) = delete;
 
 	size_t get_frame() const;
 	void set_frame(frame_t pFrame);
 	void set_animation(animation::ptr pAnimation, bool pSwap = false);
 	bool set_animation(const std::string& pName, bool pSwap = false);
 
-	bool tick(); // Returns true if the frame has changed.
-
 	bool is_playing() const;
 	void start();
 	void pause();
@@ -750,7 +1068,10 @@ public:
 	void set_speed(float pSpeed);
 
 private:
-	engine::clock  mClock;
+	// Frames are timed by the scheduler of the renderer
+	// this is drawn by.
+	std::shared_ptr<animation_scheduler> mScheduler;
+	size_t mPlayer;
 
 	animation::ptr mAnimation;
 
@@ -758,10 +1079,11 @@ private:
 
 	anchor mAnchor;
 
-	float mInterval;
 	float mSpeed;
 	bool mPlaying;
 
+	void attach(renderer& pR);
+	void on_frame(frame_t pFrame);
 	void update_frame();
 };
 
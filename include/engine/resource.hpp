@@ -4,6 +4,15 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <typeinfo>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <engine/resource_pack.hpp>
 
 namespace engine
@@ -18,7 +27,7 @@ public:
 	virtual ~resource() {}
 	virtual bool load() = 0;
 	virtual bool unload() = 0;
-	bool is_loaded();
+	bool is_loaded() const;
 
 	void set_name(const std::string& pName);
 	const std::string& get_name() const;
@@ -27,20 +36,56 @@ public:
 
 	void set_resource_pack(resource_pack* pPack);
 
+	// Asynchronous loading is done in two steps. prepare_load() reads and
+	// decodes on a worker thread and must not touch anything the main thread uses.
+	// finish_load() is then called on the main thread to complete it.
+	// By default everything is done in finish_load().
+	virtual bool prepare_load() { return true; }
+	virtual bool finish_load() { return load(); }
+
+	// Waiting to be loaded in the background
+	bool is_loading() const;
+
+	// Approximate bytes held while loaded
+	virtual size_t get_memory_usage() const { return 0; }
+
 protected:
+	// Also updates the memory usage of the manager (main thread only)
 	bool set_loaded(bool pIs_loaded);
 	resource_pack* mPack;
 	std::string mName;
 
 private:
 	bool mIs_loaded;
+	bool mIs_loading;
+	size_t mLast_used; // Frame this was last requested or referenced
+
+	resource_manager* mManager; // Keeps the memory usage of this resource
+	size_t mCounted_bytes; // Included in the usage of mManager
+	friend class resource_manager;
 };
 
+// Resources found by a single loader. Filled on a loader thread
+// and registered with the manager once every loader is done.
+class resource_batch
+{
+public:
+	void add_resource(std::shared_ptr<resource> pResource);
+	bool has_resource(const std::string& pType, const std::string& pName) const;
+
+	const std::vector<std::shared_ptr<resource>>& get_resources() const;
+
+private:
+	std::vector<std::shared_ptr<resource>> mResources;
+	std::unordered_set<std::string> mNames; // Type and name
+};
+
+// Loaders run concurrently so they should only touch their batch
 class resource_loader
 {
 public:
-	virtual bool load(resource_manager& pResource_manager, const std::string& mData_filepath) = 0;
-	virtual bool load_pack(resource_manager& pResource_manager, resource_pack& pPack) = 0;
+	virtual bool load(resource_batch& pBatch, const std::string& mData_filepath) = 0;
+	virtual bool load_pack(resource_batch& pBatch, resource_pack& pPack) = 0;
 };
 
 template<typename T1, typename T2>
@@ -49,25 +94,60 @@ inline std::shared_ptr<T1> cast_resource(std::shared_ptr<T2> pSrc)
 	return std::dynamic_pointer_cast<T1>(pSrc);
 }
 
-class resource_manager
+class resource_manager :
+	public util::nocopy
 {
 public:
 	resource_manager();
+	~resource_manager();
 
 	void add_resource(std::shared_ptr<resource> pResource);
 	bool has_resource(std::shared_ptr<resource> pResource) const;
 	bool has_resource(const std::string& pType, const std::string& pName) const;
 
+	// Check without loading it
+	bool is_resource_loaded(const std::string& pType, const std::string& pName) const;
+
 	template<typename T = resource>
 	std::shared_ptr<T> get_resource(const std::string& pType, const std::string& pName)
 	{
-		auto res = find_resource(pType, pName);
-		if (!res)
+		entry* e = find_entry(pType, pName);
+		if (!e)
+			return{};
+		mResources[e->index]->mLast_used = mFrame;
+		mResources[e->index]->load();
+		return cast_entry<T>(*e);
+	}
+
+	// Same as get_resource but the resource is loaded in the background.
+	// Check is_loaded() to see when it is ready.
+	template<typename T = resource>
+	std::shared_ptr<T> get_resource_async(const std::string& pType, const std::string& pName)
+	{
+		entry* e = find_entry(pType, pName);
+		if (!e)
 			return{};
-		res->load();
-		return cast_resource<T>(res);
+		mResources[e->index]->mLast_used = mFrame;
+		load_async(mResources[e->index]);
+		return cast_entry<T>(*e);
 	}
 
+	// Queue a resource to be loaded in the background
+	void load_async(std::shared_ptr<resource> pResource);
+
+	// Complete resources that were prepared in the background. Call once per frame.
+	// Stops once pBudget milliseconds have passed.
+	void finish_loading(float pBudget = 2.f);
+
+	size_t get_loading_count() const;
+
+	// Drop the queued background loads and wait for the ones being
+	// prepared. Call before the files they read from go away,
+	// like when the resource pack is reopened.
+	void cancel_loading();
+
+	void set_loader_thread_count(size_t pCount);
+
 	void add_loader(std::shared_ptr<resource_loader> pLoader);
 	void remove_loader(std::shared_ptr<resource_loader> pLoader);
 	void clear_loaders();
@@ -75,9 +155,26 @@ public:
 	void ensure_load();
 	bool reload_all();
 	void unload_all();
+
+	// Unload resources nobody is using, least recently used first,
+	// until the memory budget is met. Resources used within the
+	// grace period are always kept.
 	void unload_unused();
+
 	void clear_resources();
 
+	// Call once per frame. Keeps track of which resources are
+	// in use and evicts unused ones when over the budget.
+	void update();
+
+	void set_memory_budget(size_t pBytes);
+	size_t get_memory_budget() const;
+
+	// Frames an unused resource is kept regardless of the budget
+	void set_unload_grace_period(size_t pFrames);
+
+	size_t get_memory_usage() const;
+
 	void set_resource_pack(resource_pack* pPack);
 
 	std::string get_resource_log() const;
@@ -89,10 +186,86 @@ private:
 
 	resource_pack* mPack;
 
-	std::shared_ptr<resource> find_resource(const std::string& pType, const std::string& pName) const;
+	struct entry
+	{
+		size_t index; // Index in mResources
+
+		// Result of the last typed lookup
+		const std::type_info* cast_type;
+		void* cast;
+	};
+
+	// Resources by name for each type
+	typedef std::unordered_map<std::string, entry> registry;
+	std::unordered_map<std::string, registry> mRegistries;
+
+	entry* find_entry(const std::string& pType, const std::string& pName);
+	const entry* find_entry(const std::string& pType, const std::string& pName) const;
+
+	template<typename T>
+	std::shared_ptr<T> cast_entry(entry& pEntry)
+	{
+		const std::shared_ptr<resource>& res = mResources[pEntry.index];
+
+		// Only cast when a different type is requested
+		if (!pEntry.cast_type || *pEntry.cast_type != typeid(T))
+		{
+			pEntry.cast = dynamic_cast<T*>(res.get());
+			pEntry.cast_type = &typeid(T);
+		}
+		if (!pEntry.cast)
+			return{};
+
+		// Shares ownership with the resource without adding
+		// another reference in the manager.
+		return std::shared_ptr<T>(res, static_cast<T*>(pEntry.cast));
+	}
 
 	std::vector<std::shared_ptr<resource>> mResources;
 	std::vector<std::shared_ptr<resource_loader>> mLoaders;
+
+	size_t mFrame;
+	size_t mMemory_budget;
+	size_t mGrace_period;
+	size_t mMark_index; // Next resource checked for references by update()
+
+	// Bytes of loaded resources. Updated when resources are loaded
+	// or unloaded so the usage is known without visiting every resource.
+	size_t mUsage;
+	std::map<std::string, size_t> mType_usage;
+	std::map<std::string, size_t> mPeak_usage; // Bytes by type
+
+	void update_usage(resource& pResource);
+	friend class resource;
+
+	struct prepared
+	{
+		std::shared_ptr<resource> res;
+		bool success;
+	};
+
+	void start_workers();
+	void stop_workers();
+	void worker_loop();
+
+	// Run the jobs on the workers and wait for all of them.
+	// The calling thread helps instead of waiting idle.
+	void run_jobs(std::vector<std::function<void()>>& pJobs);
+	void run_job(std::unique_lock<std::mutex>& pLock);
+
+	std::vector<std::thread> mWorkers;
+	size_t mThread_count;
+	mutable std::mutex mLoad_mutex;
+	std::condition_variable mLoad_condition;
+	bool mStop_workers;
+
+	// Shared with the workers. Guarded by mLoad_mutex.
+	std::deque<std::shared_ptr<resource>> mLoad_queue;
+	std::deque<prepared> mPrepared;
+	size_t mPreparing;
+	std::deque<std::function<void()>> mJobs; // Taken before mLoad_queue
+	size_t mRunning_jobs;
+	std::condition_variable mJobs_condition;
 };
 
 }
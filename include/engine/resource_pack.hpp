@@ -6,6 +6,7 @@
 #include <cstdint>
 #include <fstream>
 #include <set>
+#include <unordered_map>
 #include <engine/utility.hpp>
 #include <engine/filesystem.hpp>
 
@@ -109,21 +110,91 @@ public:
 
 	uint64_t get_header_size() const;
 
+	size_t get_file_count() const;
+
 private:
 	uint64_t mHeader_size;
 	std::vector<file_info> mFiles;
+
+	// Lookup of the path string to the index in mFiles
+	std::unordered_map<std::string, size_t> mFile_lookup;
+
+	// Directory tree so listing a directory only visits what is inside of it
+	struct directory
+	{
+		std::unordered_map<std::string, size_t> subdirectories; // Index in mDirectories
+		std::vector<size_t> files; // Index in mFiles
+	};
+	std::vector<directory> mDirectories;
+
+	void index_file(size_t pIndex);
+	void clear_index();
+};
+
+// A read-only mapping of an entire file into memory
+class memory_map :
+	public util::nocopy
+{
+public:
+	memory_map();
+	~memory_map();
+
+	bool open(const std::string& pPath);
+	void close();
+
+	bool is_open() const;
+
+	const char* data() const;
+	uint64_t size() const;
+
+private:
+	const char* mData;
+	uint64_t mSize;
+#if defined(__WIN32__) || defined(WIN32)
+	void* mFile;
+	void* mMapping;
+#endif
+};
+
+// The data of a file in a resource_pack. Points directly into the pack
+// when it is memory mapped (so it must not outlive the pack),
+// otherwise it holds a copy.
+class pack_view
+{
+public:
+	pack_view();
+
+	const char* data() const;
+	size_t size() const;
+	bool empty() const;
+
+private:
+	const char* mData;
+	size_t mSize;
+	std::vector<char> mCopy;
+	friend class resource_pack;
 };
 
 // Reads the header of a pack file and generates streams for the contained files
 class resource_pack
 {
 public:
-	bool open(const encoded_path& pPath);
+	// When pMemory_map is true the pack is mapped into memory so files can be
+	// read without copying. Falls back to streams if mapping fails.
+	bool open(const encoded_path& pPath, bool pMemory_map = false);
+
+	bool is_mapped() const;
+
 	std::vector<char> read_all(const encoded_path& pPath) const;
+
+	// Avoids a copy when the pack is memory mapped
+	pack_view view(const encoded_path& pPath) const;
+
 	std::vector<encoded_path> recursive_directory(const encoded_path& pPath) const;
 private:
 	encoded_path mPath;
 	pack_header mHeader;
+	memory_map mMap;
 	friend class pack_stream;
 };
 
@@ -164,6 +235,10 @@ private:
 	const resource_pack * mPack;
 	pack_header::file_info mFile_info;
 	std::ifstream mStream;
+
+	// Used instead of mStream when the pack is memory mapped
+	const char* mMapped;
+	uint64_t mCursor;
 };
 
 bool create_resource_pack(const std::string& pSrc_directory, const std::string& pDest);
@@ -11,10 +11,13 @@
 #include "../../3rdparty/tinyxml2/tinyxml2.h"
 
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <assert.h>
 #include <set>
+#include <mutex>
+#include <cstdint>
 
 namespace engine
 {
@@ -38,9 +41,12 @@ private:
 	std::string mName;
 };
 
+// Entries are indexed by name and by the region of their root frame
 class texture_atlas
 {
 public:
+	texture_atlas();
+
 	bool load(const std::string& pPath);
 	bool load_memory(const char* pData, size_t pSize);
 	bool save(const std::string& pPath) const;
@@ -53,11 +59,15 @@ public:
 	bool add_entry(const subtexture& pEntry);
 	bool add_entry(subtexture::ptr& pEntry);
 
+	// Fails if there is already an entry with the new name
 	bool rename_entry(const std::string& pOriginal, const std::string& pRename);
 	
 	bool remove_entry(const std::string& pName);
 	bool remove_entry(subtexture::ptr& pEntry);
 
+	// Call after changing the frame rect of an entry
+	void update_regions();
+
 	std::vector<std::string> compile_list() const;
 
 	const std::vector<subtexture::ptr>& get_all() const;
@@ -68,6 +78,105 @@ private:
 	bool load_entries(tinyxml2::XMLDocument& pDoc);
 
 	std::vector<subtexture::ptr> mAtlas;
+	std::unordered_map<std::string, subtexture::ptr> mNames;
+
+	// Uniform grid of entry indexes, rebuilt when an entry is
+	// removed or moved. Each cell is sorted so the first entry
+	// in the atlas is found first. Entries that span too
+	// many cells are checked separately.
+	static uint64_t hash_cell(int pX, int pY);
+	irect calculate_cells(const frect& pRect) const;
+	void add_region(size_t pIndex) const;
+	void build_regions() const;
+
+	mutable std::unordered_map<uint64_t, std::vector<uint32_t>> mCells;
+	mutable std::vector<uint32_t> mLarge_entries;
+	mutable bool mRegions_dirty;
+};
+
+// Packs rectangles into fixed size pages using the skyline
+// bottom-left heuristic.
+class texture_packer
+{
+public:
+	texture_packer();
+
+	void set_page_size(ivector pSize);
+	ivector get_page_size() const;
+
+	// Space left around every rectangle so filtering doesn't bleed
+	void set_padding(int pPadding);
+
+	// Returns the page the rectangle was put on or -1 if it is too large.
+	// A new page is started when it doesn't fit on the others.
+	int add(ivector pSize, ivector& pPosition);
+
+	size_t get_page_count() const;
+
+	// Fraction of the page area that is used
+	float get_efficiency() const;
+
+	void clear();
+
+private:
+	struct skyline_node
+	{
+		int x, y, width;
+	};
+	typedef std::vector<skyline_node> skyline;
+
+	// Find the lowest position for a rectangle. Returns false if it doesn't fit.
+	bool find_position(const skyline& pSkyline, ivector pSize, ivector& pPosition, size_t& pNode, int& pBottom) const;
+	void place(skyline& pSkyline, size_t pNode, ivector pPosition, ivector pSize);
+
+	ivector mPage_size;
+	int mPadding;
+	std::vector<skyline> mPages;
+	uint64_t mUsed_area;
+};
+
+// A large texture that several small textures are packed into
+// so they can be drawn without switching textures.
+// The page is loaded while any of its textures are.
+class texture_page :
+	public util::nocopy
+{
+public:
+	texture_page();
+
+	void set_size(ivector pSize);
+	void add_member(const std::string& pSource, ivector pPosition);
+
+	// Decode and compose the images. Can be called from a loader thread.
+	bool prepare(resource_pack* pPack);
+
+	// Upload the page if this is the first user.
+	// Only successful calls need a release().
+	bool acquire(resource_pack* pPack);
+	void release();
+
+#ifdef ENGINE_INTERNAL
+	sf::Texture& sfml_get_texture()
+	{
+		return *mSFML_texture;
+	}
+#endif
+
+private:
+	struct member
+	{
+		std::string source;
+		ivector position;
+	};
+
+	bool compose(resource_pack* pPack);
+
+	std::mutex mMutex;
+	ivector mSize;
+	std::vector<member> mMembers;
+	size_t mUsers;
+	std::unique_ptr<sf::Image> mImage;
+	std::unique_ptr<sf::Texture> mSFML_texture;
 };
 
 class texture :
@@ -76,17 +185,33 @@ class texture :
 public:
 	const std::string type = "texture";
 
+	texture();
+
 	void set_texture_source(const std::string& pFilepath);
 	void set_atlas_source(const std::string& pFilepath);
 
+	// Use a region of a shared page instead of a texture of its own.
+	// The atlas entries are moved into page coordinates.
+	void set_page(std::shared_ptr<texture_page> pPage, fvector pOffset, fvector pSize);
+	bool is_paged() const;
+
 	bool load() override;
 	bool unload() override;
 
+	// The image is decoded in the background and only
+	// uploaded on the main thread.
+	bool prepare_load() override;
+	bool finish_load() override;
+
+	size_t get_memory_usage() const override;
+
 	const std::string& get_type() const override
 	{
 		return type;
 	}
 
+	// The atlas is always available even when the texture
+	// is still loading.
 	std::shared_ptr<subtexture> get_entry(const std::string& pName) const;
 
 	std::vector<std::string> compile_list() const;
@@ -97,15 +222,25 @@ public:
 	sf::Texture& sfml_get_texture()
 	{
 		load(); // Ensure load
+		if (mPage)
+			return mPage->sfml_get_texture();
 		return *mSFML_texture;
 	}
 #endif
 
 private:
+	void load_atlas() const;
+
 	std::string mTexture_source;
 	std::string mAtlas_source;
-	texture_atlas mAtlas;
+	mutable texture_atlas mAtlas;
+	mutable bool mAtlas_loaded;
 	std::unique_ptr<sf::Texture> mSFML_texture;
+	std::unique_ptr<sf::Image> mPrepared_image;
+
+	std::shared_ptr<texture_page> mPage;
+	fvector mPage_offset;
+	fvector mPage_size;
 };
 
 }
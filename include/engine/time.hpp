@@ -9,8 +9,17 @@ namespace engine
 namespace priv
 {
 typedef std::chrono::time_point<std::chrono::high_resolution_clock> highresclock;
+
+// Time used by every clock and timer
+highresclock now();
 }
 
+// Freezes the time seen by every clock and timer. It then only moves
+// with advance_fake_time() so a run of frames can be repeated exactly.
+void use_fake_time(bool pEnabled);
+bool is_fake_time();
+void advance_fake_time(float pSeconds);
+
 class time_converter
 {
 public:
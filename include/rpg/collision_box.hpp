@@ -4,9 +4,13 @@
 #include "../../3rdparty/tinyxml2/tinyxml2.h"
 
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
 
 #include <engine/rect.hpp>
 #include <engine/utility.hpp>
+#include <engine/pathfinding.hpp>
 
 #include <rpg/script_function.hpp>
 #include <rpg/flag_container.hpp>
@@ -35,7 +39,10 @@ private:
 	std::vector<std::shared_ptr<script_function>> mFunctions;
 };
 
-class collision_box
+class collision_box_container;
+
+class collision_box :
+	public std::enable_shared_from_this<collision_box>
 {
 public:
 	enum class type
@@ -46,10 +53,20 @@ public:
 		door
 	};
 
+	// Amount of types above. Used to size per-type tables.
+	static const size_t type_count = 4;
+
 	typedef std::shared_ptr<collision_box> ptr;
 
 	collision_box();
 	collision_box(engine::frect pRect);
+
+	// The owning container is intentionally not copied
+	collision_box(const collision_box& pBox);
+	collision_box& operator=(const collision_box& pBox);
+
+	virtual ~collision_box() {}
+
 	bool is_enabled() const;
 
 	const engine::frect& get_region() const;
@@ -76,6 +93,17 @@ protected:
 	bool mInverted;
 	std::weak_ptr<wall_group> mWall_group;
 	void generate_basic_attributes(tinyxml2::XMLElement* pEle) const;
+
+private:
+	// Bookkeeping for the container's spatial index
+	collision_box_container* mContainer;
+	size_t mSequence;
+	engine::irect mCells;
+	bool mIs_large;
+	mutable size_t mQuery_mark;
+
+	friend class collision_box_grid;
+	friend class collision_box_container;
 };
 
 class trigger :
@@ -142,9 +170,47 @@ private:
 	engine::fvector mOffset;
 };
 
+// Uniform grid broad phase for a single type of collision box.
+// Boxes that span too many cells are kept in a separate list
+// so large boundary walls don't flood the grid.
+class collision_box_grid
+{
+public:
+	collision_box_grid(float pCell_size = 4.f);
+
+	void insert(collision_box* pBox);
+	void remove(collision_box* pBox);
+	void clear();
+
+	// Calls pCallback for every box whose cells overlap the region.
+	// A box may be reported more than once; callers dedupe with mQuery_mark.
+	template<typename T>
+	void query(const engine::frect& pRect, T&& pCallback) const;
+
+	size_t get_cell_count() const;
+
+private:
+	typedef std::vector<collision_box*> bucket;
+
+	static uint64_t hash_cell(int pX, int pY);
+
+	// Returns the inclusive range of cells covered by a region.
+	// x and y are the first cell, w and h are the last cell.
+	engine::irect calculate_cells(const engine::frect& pRect) const;
+
+	float mCell_size;
+	std::unordered_map<uint64_t, bucket> mCells;
+	bucket mLarge;
+};
+
 class collision_box_container
 {
 public:
+	collision_box_container();
+	collision_box_container(const collision_box_container&) = delete;
+	collision_box_container& operator=(const collision_box_container&) = delete;
+	~collision_box_container();
+
 	void clear();
 
 	std::shared_ptr<wall_group>    get_group(const std::string& pName);
@@ -177,6 +243,12 @@ public:
 
 	size_t get_count() const;
 
+	// Rasterize all enabled walls into a grid that is sized to fit every wall
+	void rasterize_walls(engine::walkability_grid& pGrid);
+
+	// Recalculate only the cells that overlap this region
+	void rasterize_walls(engine::walkability_grid& pGrid, engine::frect pRegion);
+
 	std::vector<std::shared_ptr<collision_box>>::iterator begin();
 	std::vector<std::shared_ptr<collision_box>>::iterator end();
 
@@ -184,8 +256,66 @@ public:
 private:
 	std::vector<std::shared_ptr<wall_group>> mWall_groups;
 	std::vector<std::shared_ptr<collision_box>> mBoxes;
+
+	// Spatial index with one grid per box type so typed
+	// queries never touch other kinds of boxes.
+	collision_box_grid mGrids[collision_box::type_count];
+	size_t mSequence_counter;
+	mutable size_t mQuery_counter;
+
+	void attach_box(collision_box* pBox);
+	void detach_box(collision_box* pBox);
+	void update_box(collision_box* pBox);
+	collision_box_grid& get_grid(collision_box::type pType);
+
+	// Gathers enabled boxes overlapping the region in insertion order
+	template<typename T>
+	std::vector<std::shared_ptr<collision_box>> gather(collision_box::type* pType, const engine::frect& pRect, T&& pTest);
+
+	template<typename T>
+	std::shared_ptr<collision_box> gather_first(collision_box::type* pType, const engine::frect& pRect, T&& pTest);
+
+	friend class collision_box;
 };
 
+template<typename T>
+inline void collision_box_grid::query(const engine::frect& pRect, T&& pCallback) const
+{
+	for (auto i : mLarge)
+		pCallback(i);
+
+	if (mCells.empty())
+		return;
+
+	const engine::irect cells = calculate_cells(pRect);
+
+	// Walking the occupied cells is cheaper than walking
+	// the query range when the query covers most of the grid
+	const size_t range_count = static_cast<size_t>(cells.w - cells.x + 1)
+		* static_cast<size_t>(cells.h - cells.y + 1);
+	if (range_count > mCells.size())
+	{
+		for (auto& i : mCells)
+			for (auto j : i.second)
+				if (j->mCells.x <= cells.w && j->mCells.w >= cells.x
+					&& j->mCells.y <= cells.h && j->mCells.h >= cells.y)
+					pCallback(j);
+		return;
+	}
+
+	for (int y = cells.y; y <= cells.h; y++)
+	{
+		for (int x = cells.x; x <= cells.w; x++)
+		{
+			auto find = mCells.find(hash_cell(x, y));
+			if (find == mCells.end())
+				continue;
+			for (auto i : find->second)
+				pCallback(i);
+		}
+	}
+}
+
 
 }
 
@@ -43,6 +43,8 @@ namespace rpg {
 class collision_system
 {
 public:
+	collision_system();
+
 	std::shared_ptr<const door> get_door_entry(std::string pName);
 
 	void clear();
@@ -53,10 +55,26 @@ public:
 
 	collision_box_container& get_container();
 
+	// Enabled walls rasterized into tiles for pathfinding
+	const engine::walkability_grid& get_walkability() const;
+
+	// Incremented every time the walkability grid is rebuilt from scratch
+	size_t get_walkability_version() const;
+
+	// Regions that were rasterized again since the last rebuild
+	const std::vector<engine::frect>& get_walkability_changes() const;
+
 private:
 	util::optional_pointer<script_system> mScript;
 
 	collision_box_container mContainer;
+	engine::walkability_grid mWalkability;
+	size_t mWalkability_version;
+	std::vector<engine::frect> mWalkability_changes;
+
+	void rebuild_walkability();
+	void update_walkability(engine::frect pRegion);
+	void update_walkability(std::shared_ptr<wall_group> pGroup);
 
 	void register_collision_type(script_system& pScript);
 
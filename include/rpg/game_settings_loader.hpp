@@ -22,6 +22,10 @@ public:
 	float get_unit_pixels() const;
 	const engine::controls& get_key_bindings() const;
 
+	// 0 if textures should not be packed into pages
+	int get_texture_page_size() const;
+	int get_texture_max_packed_size() const;
+
 private:
 	bool parse_settings(tinyxml2::XMLDocument& pDoc, const std::string& pPrefix_path);
 	bool parse_key_bindings(tinyxml2::XMLElement* pEle);
@@ -34,6 +38,8 @@ private:
 	engine::fvector mScreen_size;
 	engine::controls mKey_bindings;
 	float pUnit_pixels;
+	int mTexture_page_size;
+	int mTexture_max_packed_size;
 };
 
 }
@@ -54,9 +54,16 @@ private:
 	engine::timer mRefresh_timer;
 	tgui::ListBox::Ptr mLb_autocomplete;
 
+	// Frame times recorded by the profiler. Toggled with Ctrl+P.
+	tgui::Canvas::Ptr mCv_frame_graph;
+	tgui::Label::Ptr mLb_profile;
+	engine::timer mGraph_timer;
+
 	void refresh_autocomplete();
 
 	void refresh_log();
+
+	void refresh_frame_graph();
 };
 
 class scenes_directory :
@@ -235,9 +242,13 @@ private:
 
 	bool mExit;
 
+	// Destroyed last. The loader threads of mResource_manager
+	// read from it until they are joined.
+	engine::resource_pack mPack;
+
 	scene            mScene;
 	engine::resource_manager mResource_manager;
-	engine::resource_pack mPack;
+	std::shared_ptr<texture_loader> mTexture_loader;
 	flag_container   mFlags;
 	script_system    mScript;
 	engine::controls mControls;
@@ -252,6 +263,7 @@ private:
 	std::shared_ptr<engine::terminal_command_group> mGroup_game;
 	std::shared_ptr<engine::terminal_command_group> mGroup_global1;
 	std::shared_ptr<engine::terminal_command_group> mGroup_slot;
+	std::shared_ptr<engine::terminal_command_group> mGroup_profile;
 #endif
 
 	scene_load_request mScene_load_request;
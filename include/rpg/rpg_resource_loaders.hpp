@@ -2,6 +2,7 @@
 #define RPG_RESOURCE_DIRECTORIES_HPP
 
 #include <engine/resource.hpp>
+#include <engine/texture.hpp>
 
 namespace rpg
 {
@@ -10,32 +11,51 @@ class texture_loader :
 	public engine::resource_loader
 {
 public:
-	virtual bool load(engine::resource_manager& pResource_manager, const std::string& mData_filepath);
-	virtual bool load_pack(engine::resource_manager& pResource_manager, engine::resource_pack& pPack);
+	texture_loader();
+
+	virtual bool load(engine::resource_batch& pBatch, const std::string& mData_filepath);
+	virtual bool load_pack(engine::resource_batch& pBatch, engine::resource_pack& pPack);
+
+	// Pack textures no larger than pMax_size into shared pages
+	// of pPage_size pixels. A page size of 0 disables packing.
+	void set_packing(int pPage_size, int pMax_size = 512);
+
+private:
+	struct packing_entry
+	{
+		std::shared_ptr<engine::texture> texture;
+		std::string source;
+		engine::ivector size;
+	};
+
+	void pack_textures(std::vector<packing_entry>& pEntries) const;
+
+	int mPage_size;
+	int mMax_size;
 };
 
 class font_loader :
 	public engine::resource_loader
 {
 public:
-	virtual bool load(engine::resource_manager& pResource_manager, const std::string& mData_filepath);
-	virtual bool load_pack(engine::resource_manager& pResource_manager, engine::resource_pack& pPack);
+	virtual bool load(engine::resource_batch& pBatch, const std::string& mData_filepath);
+	virtual bool load_pack(engine::resource_batch& pBatch, engine::resource_pack& pPack);
 };
 
 class audio_loader :
 	public engine::resource_loader
 {
 public:
-	virtual bool load(engine::resource_manager& pResource_manager, const std::string& mData_filepath);
-	virtual bool load_pack(engine::resource_manager& pResource_manager, engine::resource_pack& pPack);
+	virtual bool load(engine::resource_batch& pBatch, const std::string& mData_filepath);
+	virtual bool load_pack(engine::resource_batch& pBatch, engine::resource_pack& pPack);
 };
 
 class script_loader :
 	public engine::resource_loader
 {
 public:
-	virtual bool load(engine::resource_manager& pResource_manager, const std::string& mData_filepath);
-	virtual bool load_pack(engine::resource_manager& pResource_manager, engine::resource_pack& pPack);
+	virtual bool load(engine::resource_batch& pBatch, const std::string& mData_filepath);
+	virtual bool load_pack(engine::resource_batch& pBatch, engine::resource_pack& pPack);
 
 };
 
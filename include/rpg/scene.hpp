@@ -28,12 +28,48 @@ public:
 
 	void load_script_interface(script_system& pScript);
 
+	// Hand finished asynchronous paths to scripts
+	void tick();
+
+	// Cancels all asynchronous requests
+	void clear();
+
+	// Build the clusters for the current walls or apply the
+	// changes made since. Call once the walls of a scene are loaded
+	// so the first hierarchical search doesn't have to.
+	void update_hierarchical_pathfinder();
+
+	std::string get_request_log() const;
+
 private:
 	collision_system* mCollision_system;
 	engine::pathfinder mPathfinder;
 
+	// Asynchronous requests work on a copy of the walkability
+	// so the worker never touches the collision system.
+	engine::path_request_queue mRequests;
+	std::shared_ptr<const engine::walkability_snapshot> mSnapshot;
+	size_t mSnapshot_version;
+	size_t mSnapshot_changes;
+
+	std::shared_ptr<const engine::walkability_snapshot> get_snapshot();
+
+	// Long routes are planned over clusters of tiles.
+	// Kept in sync with the walkability grid of the collision system.
+	engine::hierarchical_pathfinder mHierarchical_pathfinder;
+	size_t mWalkability_version;
+	size_t mWalkability_changes_applied;
+
+	bool is_blocked(engine::fvector pPosition) const;
+
 	bool script_find_path(AS_array<engine::fvector>& pScript_path, engine::fvector pStart, engine::fvector pDestination);
 	bool script_find_path_partial(AS_array<engine::fvector>& pScript_path, engine::fvector pStart, engine::fvector pDestination, int pCount);
+	bool script_find_path_hierarchical(AS_array<engine::fvector>& pScript_path, engine::fvector pStart, engine::fvector pDestination);
+
+	int script_find_path_async(engine::fvector pStart, engine::fvector pDestination);
+	bool script_is_path_ready(int pId);
+	bool script_get_path_result(AS_array<engine::fvector>& pScript_path, int pId);
+	void script_cancel_path(int pId);
 };
 
 
@@ -82,6 +118,58 @@ private:
 	void script_music_set_second_volume(float pVolume);
 };
 
+// A neighboring scene that is read and parsed in the background
+// so walking through a door does not have to touch the disk.
+class scene_prefetch :
+	public engine::resource
+{
+public:
+	const std::string type = "scene";
+
+	scene_prefetch();
+
+	void set_directory(const engine::encoded_path& pDirectory);
+
+	bool load() override;
+	bool unload() override;
+
+	// The document is parsed on a loader thread and its
+	// settings are read on the main thread.
+	bool prepare_load() override;
+	bool finish_load() override;
+
+	const std::string& get_type() const override
+	{
+		return type;
+	}
+
+	// Hand the parsed scene over. The prefetch is unloaded afterwards.
+	std::unique_ptr<scene_loader> take_loader();
+	const scene_loader& get_loader() const;
+
+	// Keep a resource used by this scene from being unloaded
+	void add_dependency(std::shared_ptr<engine::resource> pResource);
+
+	// Closest door that leads to this scene
+	void set_door_position(engine::fvector pPosition);
+	engine::fvector get_door_position() const;
+
+	bool is_warmed() const;
+	void set_warmed(bool pWarmed);
+
+	bool is_script_attempted() const;
+	void set_script_attempted(bool pAttempted);
+
+private:
+	engine::encoded_path mDirectory;
+	std::unique_ptr<scene_loader> mLoader;
+	bool mIs_parsed;
+	std::vector<std::shared_ptr<engine::resource>> mDependencies;
+	engine::fvector mDoor_position;
+	bool mIs_warmed;
+	bool mScript_attempted;
+};
+
 class scene;
 
 class scene_visualizer :
@@ -170,6 +258,9 @@ public:
 
 	engine::mixer& get_mixer();
 
+	// Hit rates of the door prefetching
+	std::string get_prefetch_log() const;
+
 private:
 	bool mIs_ready;
 
@@ -202,10 +293,27 @@ private:
 #endif
 
 	std::string mCurrent_scene_name;
-	scene_loader mLoader;
+	std::unique_ptr<scene_loader> mLoader;
 
 	bool mFocus_player;
 
+	// Scenes behind the doors of the current scene, nearest first
+	std::vector<std::shared_ptr<scene_prefetch>> mPrefetches;
+	bool mPrefetch_requested;
+	size_t mPrefetch_loads;
+	size_t mPrefetch_scene_hits;
+	size_t mPrefetch_script_hits;
+	size_t mPrefetch_texture_hits;
+
+	engine::encoded_path get_scene_directory() const;
+
+	// Compiles the scene script if it isn't already
+	scene_script_context& get_script_context(const std::string& pName, const std::string& pScript_path);
+
+	void update_prefetch();
+	void start_prefetch();
+	std::shared_ptr<scene_prefetch> take_prefetch(const std::string& pName);
+
 	void             script_set_tile(const std::string& pAtlas
 		, engine::fvector pPosition, int pLayer, int pRotation);
 	void             script_remove_tile(engine::fvector pPosition, int pLayer);
@@ -29,6 +29,12 @@ public:
 	bool load(const engine::encoded_path& pDir, const std::string& pName, engine::resource_pack& pPack);
 	bool save();
 
+	// Only read and parse the document. Nothing is logged so this
+	// can be done on a loader thread. Call load_settings() afterwards.
+	// pPack can be null to read from the data folder.
+	bool parse(const engine::encoded_path& pDir, const std::string& pName, engine::resource_pack* pPack);
+	bool load_settings();
+
 	void clean();
 	bool has_boundary() const;
 	const engine::frect& get_boundary() const;
@@ -44,8 +50,6 @@ public:
 
 private:
 
-	bool load_settings();
-
 	// Make xml file well formed
 	void fix();
 	tinyxml2::XMLDocument      mXml_Document;
@@ -2,17 +2,24 @@
 #define RPG_TILEMAP_DISPLAY_HPP
 
 #include <engine/renderer.hpp>
+#include <engine/animation_scheduler.hpp>
 
 #include <list>
+#include <map>
+#include <unordered_map>
 
 namespace rpg {
 
 class tilemap_manipulator;
 
+// Tiles are split into square chunks that are culled
+// against the view before being drawn.
 class tilemap_display :
 	public engine::render_object
 {
 public:
+	tilemap_display();
+
 	void set_texture(std::shared_ptr<engine::texture> pTexture);
 	std::shared_ptr<engine::texture> get_texture();
 
@@ -22,37 +29,75 @@ public:
 	void highlight_layer(size_t pLayer, engine::color pHighlight, engine::color pOthers);
 	void remove_highlight();
 
+	// Rebuild every layer from the tilemap
 	void update(tilemap_manipulator& pTile_manipulator);
 
+	// Patch a single tile without rebuilding the layer.
+	// Returns false if the atlas does not exist (the tile is removed).
+	bool set_tile(engine::fvector pPosition, const std::string& pAtlas, size_t pLayer, int pRotation);
+	bool remove_tile(engine::fvector pPosition, size_t pLayer);
+
 	void set_layer_visible(size_t pIndex, bool pIs_visible);
 	bool is_layer_visible(size_t pIndex);
 
-private:
-	bool add_tile(engine::fvector pPosition, const std::string& pAtlas, int pLayer, int pRotation);
+	// Select the chunks that overlap this region (in pixels relative to this node).
+	// draw() calls this with the area shown by the renderer.
+	void cull(engine::frect pView);
+
+	// Tiles drawn and skipped by the last cull
+	size_t get_submitted_quad_count() const;
+	size_t get_culled_quad_count() const;
 
+	// Size of a chunk in tiles
+	static constexpr int chunk_size = 32;
+
+private:
 	void update_animations();
 
+	engine::frect get_view(engine::renderer& pR) const;
+
 	std::shared_ptr<engine::texture> mTexture;
 
-	class animated_tile
+	struct chunk
 	{
-	public:
-		engine::vertex_reference mRef;
+		chunk() : tile_count(0) {}
 
-		animated_tile() : mAnimation(nullptr) {}
+		engine::vertex_batch batch;
+		size_t tile_count;
 
-		void set_animation(std::shared_ptr<const engine::animation> pAnimation);
-		void update_animation();
+		// Covers every quad in this chunk. Only grows.
+		engine::frect bounds;
+	};
 
-	private:
-		engine::timer mTimer;
-		engine::frame_t mFrame;
-		std::shared_ptr<const engine::animation> mAnimation;
+	struct tile_slot
+	{
+		engine::vertex_reference ref;
+		chunk* owner;
+		engine::animation_scheduler::handle animation;
 	};
 
-	std::vector<animated_tile> mAnimated_tiles;
-	std::list<engine::vertex_batch> mLayers;
+	struct layer
+	{
+		layer() : visible(true) {}
+
+		std::unordered_map<uint64_t, tile_slot> tiles;
+		std::map<uint64_t, chunk> chunks; // Ordered so overlapping quads always draw the same way
+		bool visible;
+	};
+
+	layer& get_layer(size_t pIndex);
+
+	// Keys sort the chunks by row then column
+	static uint64_t hash_chunk(engine::fvector pPosition);
+
+	// Every animated tile advances from the time of one clock
+	engine::animation_scheduler mAnimations;
+	engine::clock mAnimation_clock;
+	std::list<layer> mLayers;
 
+	std::vector<engine::vertex_batch*> mVisible_chunks;
+	size_t mSubmitted_quads;
+	size_t mCulled_quads;
 
 };
 
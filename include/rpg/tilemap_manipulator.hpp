@@ -7,8 +7,10 @@
 #include <engine/texture.hpp>
 
 #include <map>
+#include <unordered_map>
 #include <memory>
 #include <string>
+#include <cstdint>
 
 namespace rpg {
 
@@ -84,6 +86,8 @@ private:
 class tilemap_layer
 {
 public:
+	tilemap_layer();
+
 	void set_name(const std::string& pName);
 	const std::string& get_name() const;
 
@@ -128,10 +132,20 @@ public:
 
 	void sort();
 
+	// Key used to look up tiles by position
+	static uint64_t hash_position(engine::fvector pPosition);
+
 private:
 	tile_atlas_pool mAtlas_pool;
 	std::vector<tile> mTiles;
 	std::string mName;
+
+	// Position to index in mTiles. Rebuilt lazily after
+	// operations that move many tiles around.
+	std::unordered_map<uint64_t, size_t> mIndex;
+	bool mIndex_dirty;
+
+	void update_index();
 };
 
 class tilemap_manipulator
@@ -1,6 +1,7 @@
 #define ENGINE_INTERNAL
 
 #include <engine/renderer.hpp>
+#include <engine/animation_scheduler.hpp>
 #include <engine/utility.hpp>
 #include <engine/logger.hpp>
 
@@ -121,7 +122,14 @@ animation_node::animation_node()
 	mPlaying = false;
 	mAnimation = nullptr;
 	mSpeed = 1.f;
-	mInterval = 1;
+	mFrame = 0;
+	mPlayer = animation_scheduler::no_handle;
+}
+
+animation_node::~animation_node()
+{
+	if (mScheduler)
+		mScheduler->remove_player(mPlayer);
 }
 
 size_t animation_node::get_frame() const
@@ -134,15 +142,16 @@ size_t animation_node::get_frame() const
 void animation_node::set_frame(frame_t pFrame)
 {
 	mFrame = pFrame;
-	mClock.restart();
-	mInterval = mAnimation->get_interval(mFrame);
+	if (mScheduler)
+		mScheduler->set_player_frame(mPlayer, mFrame);
 	update_frame();
 }
 
 void animation_node::set_animation(animation::ptr pAnimation, bool pSwap)
 {
 	mAnimation = pAnimation;
-	mInterval = pAnimation->get_interval();
+	if (mScheduler)
+		mScheduler->set_player_animation(mPlayer, mAnimation);
 
 	if (!pSwap)
 		set_frame(pAnimation->get_default_frame());
@@ -166,32 +175,6 @@ bool animation_node::set_animation(const std::string& pName, bool pSwap)
 	return true;
 }
 
-bool animation_node::tick()
-{
-	if (!mAnimation) return false;
-	if (mInterval <= 0) return false;
-
-	const float time = mClock.get_elapse().milliseconds();
-	const float scaled_interval = mInterval/mSpeed;
-
-	if (time >= scaled_interval)
-	{
-		mFrame += static_cast<frame_t>(std::floor(time / scaled_interval));
-
-		mInterval = mAnimation->get_interval(mFrame);
-
-		if (mFrame > mAnimation->get_frame_count()
-			&& mAnimation->get_loop() == animation::loop_type::none)
-			pause();
-
-		mClock.restart();
-
-		update_frame();
-		return true;
-	}
-	return false;
-}
-
 bool animation_node::is_playing() const
 {
 	return mPlaying;
@@ -205,37 +188,35 @@ void animation_node::start()
 			&&  mFrame >= mAnimation->get_frame_count())
 			restart();
 
-	if (!mPlaying)
-		mClock.restart();
+	if (mScheduler && !mPlaying)
+		mScheduler->resume_player(mPlayer);
 	mPlaying = true;
 }
 
 void animation_node::pause()
 {
-	mClock.pause();
+	if (mScheduler)
+		mScheduler->pause_player(mPlayer);
 	mPlaying = false;
 }
 
 void animation_node::stop()
 {
-	mPlaying = false;
+	pause();
 	restart();
 }
 
 void animation_node::restart()
 {
 	if (mAnimation)
-	{
 		set_frame(mAnimation->get_default_frame());
-		mClock.restart();
-	}
 }
 
 int animation_node::draw(renderer &pR)
 {
 	if (!mAnimation) return 1;
-	if (mPlaying)
-		tick();
+	if (mScheduler != pR.get_animation_scheduler())
+		attach(pR);
 	sprite_node::draw(pR);
 	return 0;
 }
@@ -253,6 +234,31 @@ void animation_node::set_speed(float pSpeed)
 		return;
 	}
 	mSpeed = pSpeed;
+	if (mScheduler)
+		mScheduler->set_player_speed(mPlayer, mSpeed);
+}
+
+void animation_node::attach(renderer& pR)
+{
+	if (mScheduler)
+		mScheduler->remove_player(mPlayer);
+	mScheduler = pR.get_animation_scheduler();
+
+	// The current frame is timed from now
+	mPlayer = mScheduler->add_player(mAnimation, mFrame,
+		[this](frame_t pFrame) { on_frame(pFrame); });
+	mScheduler->set_player_speed(mPlayer, mSpeed);
+	if (!mPlaying)
+		mScheduler->pause_player(mPlayer);
+}
+
+void animation_node::on_frame(frame_t pFrame)
+{
+	mFrame = pFrame;
+	if (mFrame > mAnimation->get_frame_count()
+		&& mAnimation->get_loop() == animation::loop_type::none)
+		pause();
+	update_frame();
 }
 
 void animation_node::update_frame()
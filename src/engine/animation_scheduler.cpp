@@ -0,0 +1,326 @@
+#define ENGINE_INTERNAL
+
+#include <engine/animation_scheduler.hpp>
+
+#include <cassert>
+
+using namespace engine;
+
+animation_scheduler::animation_scheduler()
+{
+	mTime = 0;
+	mQuad_count = 0;
+}
+
+animation_scheduler::handle animation_scheduler::add_quad(std::shared_ptr<const animation> pAnimation, const vertex_reference& pRef)
+{
+	if (!pAnimation || pAnimation->get_frame_count() < 2 || !pRef.is_valid())
+		return no_handle;
+
+	auto found = mTrack_indices.find(pAnimation.get());
+	if (found == mTrack_indices.end())
+	{
+		found = mTrack_indices.emplace(pAnimation.get(), mTracks.size()).first;
+		mTracks.emplace_back();
+		mTracks.back().definition = pAnimation;
+		mTracks.back().quad_count = 0;
+		mTracks.back().scheduled = false;
+		mTracks.back().generation = 0;
+	}
+	const size_t track_index = found->second;
+	track& t = mTracks[track_index];
+
+	// Stopped animations start over once they are used again
+	if (t.quad_count == 0)
+		restart(track_index);
+
+	size_t list_index = 0;
+	while (list_index < t.lists.size() && t.lists[list_index].batch != pRef.get_batch())
+		++list_index;
+	if (list_index == t.lists.size())
+	{
+		t.lists.emplace_back();
+		t.lists.back().batch = pRef.get_batch();
+	}
+	quad_list& list = t.lists[list_index];
+
+	handle h;
+	if (!mFree_handles.empty())
+	{
+		h = mFree_handles.back();
+		mFree_handles.pop_back();
+	}
+	else
+	{
+		h = mLocations.size();
+		mLocations.emplace_back();
+	}
+	mLocations[h] = { track_index, list_index, list.refs.size() };
+
+	list.refs.push_back(pRef);
+	list.handles.push_back(h);
+	list.batch->set_texture_rect(&list.refs.back(), 1, t.rect);
+
+	++t.quad_count;
+	++mQuad_count;
+	return h;
+}
+
+void animation_scheduler::remove_quad(handle pHandle)
+{
+	if (pHandle == no_handle)
+		return;
+	assert(pHandle < mLocations.size());
+
+	const location loc = mLocations[pHandle];
+	track& t = mTracks[loc.track];
+	quad_list& list = t.lists[loc.list];
+
+	// Swap with the last one so the removal doesn't shift everything
+	if (loc.index != list.refs.size() - 1)
+	{
+		list.refs[loc.index] = list.refs.back();
+		list.handles[loc.index] = list.handles.back();
+		mLocations[list.handles[loc.index]].index = loc.index;
+	}
+	list.refs.pop_back();
+	list.handles.pop_back();
+	mFree_handles.push_back(pHandle);
+
+	--t.quad_count;
+	--mQuad_count;
+}
+
+void animation_scheduler::clear()
+{
+	mTracks.clear();
+	mTrack_indices.clear();
+	mLocations.clear();
+	mFree_handles.clear();
+	mPlayers.clear();
+	mFree_players.clear();
+	mWakes = decltype(mWakes)();
+	mQuad_count = 0;
+}
+
+void animation_scheduler::update(float pDelta)
+{
+	mTime += pDelta;
+
+	// Collected first so an animation is only advanced once per update
+	mDue.clear();
+	mDue_players.clear();
+	while (!mWakes.empty() && mWakes.top().time <= mTime)
+	{
+		const wake w = mWakes.top();
+		mWakes.pop();
+		if (w.is_player)
+		{
+			mDue_players.push_back(w);
+			continue;
+		}
+
+		track& t = mTracks[w.index];
+		if (!t.scheduled || t.generation != w.generation)
+			continue;
+		if (t.quad_count == 0)
+			t.scheduled = false; // Nothing left to animate
+		else
+			mDue.push_back(w.index);
+	}
+
+	for (size_t i : mDue)
+	{
+		track& t = mTracks[i];
+		advance(t);
+		for (auto& j : t.lists)
+			if (!j.refs.empty())
+				j.batch->set_texture_rect(j.refs.data(), j.refs.size(), t.rect);
+		if (t.scheduled)
+			mWakes.push({ t.next, i, t.generation, false });
+	}
+
+	for (const wake& w : mDue_players)
+	{
+		// Checked here since an earlier callback may have changed it
+		player& p = mPlayers[w.index];
+		if (!p.scheduled || p.generation != w.generation)
+			continue;
+
+		do {
+			++p.frame;
+			const double interval = get_interval(p);
+			if (interval <= 0)
+			{
+				p.scheduled = false;
+				p.remaining = 0;
+				break;
+			}
+			p.next += interval;
+		} while (p.next <= mTime);
+		if (p.scheduled)
+			mWakes.push({ p.next, w.index, p.generation, true });
+
+		// The callback may change this player or add others
+		const auto on_frame = p.on_frame;
+		on_frame(p.frame);
+	}
+}
+
+size_t animation_scheduler::get_quad_count() const
+{
+	return mQuad_count;
+}
+
+size_t animation_scheduler::get_player_count() const
+{
+	return mPlayers.size() - mFree_players.size();
+}
+
+void animation_scheduler::restart(size_t pTrack)
+{
+	track& t = mTracks[pTrack];
+	t.frame = 0;
+	t.rect = t.definition->get_frame_at(0);
+	t.next = mTime + t.definition->get_interval()*0.001;
+	t.scheduled = true;
+	mWakes.push({ t.next, pTrack, ++t.generation, false });
+}
+
+void animation_scheduler::advance(track& pTrack)
+{
+	const animation& a = *pTrack.definition;
+	frame_t rendered_frame;
+
+	// Several frames may have passed since the last update
+	do {
+		++pTrack.frame;
+		rendered_frame = pTrack.frame + a.get_default_frame();
+		const float interval = a.get_interval(rendered_frame)*0.001f;
+		if (interval <= 0)
+		{
+			// Changes frame every update
+			pTrack.next = mTime;
+			break;
+		}
+		pTrack.next += interval;
+	} while (pTrack.next <= mTime);
+
+	pTrack.rect = a.get_frame_at(rendered_frame);
+
+	// Stays on the last frame
+	if (a.get_loop() == animation::loop_type::none
+		&& rendered_frame + 1 >= a.get_frame_count())
+		pTrack.scheduled = false;
+}
+
+animation_scheduler::handle animation_scheduler::add_player(std::shared_ptr<const animation> pAnimation, frame_t pFrame, std::function<void(frame_t)> pOn_frame)
+{
+	handle h;
+	if (!mFree_players.empty())
+	{
+		h = mFree_players.back();
+		mFree_players.pop_back();
+	}
+	else
+	{
+		h = mPlayers.size();
+		mPlayers.emplace_back();
+		mPlayers.back().generation = 0;
+	}
+
+	player& p = mPlayers[h];
+	p.definition = pAnimation;
+	p.on_frame = pOn_frame;
+	p.speed = 1;
+	p.playing = true;
+	p.scheduled = false;
+	set_player_frame(h, pFrame);
+	return h;
+}
+
+void animation_scheduler::remove_player(handle pHandle)
+{
+	if (pHandle == no_handle)
+		return;
+	assert(pHandle < mPlayers.size());
+	player& p = mPlayers[pHandle];
+	p.definition.reset();
+	p.on_frame = nullptr;
+	p.scheduled = false;
+	++p.generation;
+	mFree_players.push_back(pHandle);
+}
+
+void animation_scheduler::set_player_animation(handle pHandle, std::shared_ptr<const animation> pAnimation)
+{
+	assert(pHandle < mPlayers.size());
+	mPlayers[pHandle].definition = pAnimation;
+}
+
+void animation_scheduler::set_player_frame(handle pHandle, frame_t pFrame)
+{
+	assert(pHandle < mPlayers.size());
+	player& p = mPlayers[pHandle];
+	p.frame = pFrame;
+	schedule_player(pHandle, get_interval(p));
+}
+
+void animation_scheduler::set_player_speed(handle pHandle, float pSpeed)
+{
+	assert(pHandle < mPlayers.size());
+	player& p = mPlayers[pHandle];
+	if (pSpeed <= 0 || pSpeed == p.speed)
+		return;
+
+	const double scale = p.speed / pSpeed;
+	p.speed = pSpeed;
+	if (p.scheduled)
+		schedule_player(pHandle, (p.next - mTime)*scale);
+	else
+		p.remaining *= scale;
+}
+
+void animation_scheduler::pause_player(handle pHandle)
+{
+	assert(pHandle < mPlayers.size());
+	player& p = mPlayers[pHandle];
+	if (!p.playing)
+		return;
+	if (p.scheduled)
+		p.remaining = p.next - mTime;
+	p.playing = false;
+	p.scheduled = false;
+	++p.generation;
+}
+
+void animation_scheduler::resume_player(handle pHandle)
+{
+	assert(pHandle < mPlayers.size());
+	player& p = mPlayers[pHandle];
+	if (p.playing)
+		return;
+	p.playing = true;
+	schedule_player(pHandle, p.remaining);
+}
+
+double animation_scheduler::get_interval(const player& pPlayer) const
+{
+	if (!pPlayer.definition)
+		return 0;
+	return pPlayer.definition->get_interval(pPlayer.frame)*0.001 / pPlayer.speed;
+}
+
+void animation_scheduler::schedule_player(handle pHandle, double pWait)
+{
+	player& p = mPlayers[pHandle];
+	p.remaining = pWait;
+	++p.generation;
+
+	// Frames without an interval are shown until they are changed
+	p.scheduled = p.playing && pWait > 0;
+	if (!p.scheduled)
+		return;
+	p.next = mTime + pWait;
+	mWakes.push({ p.next, pHandle, p.generation, true });
+}
@@ -271,6 +271,14 @@ inline sf::Int64 sound::sfml_stream::getSize()
 	return stream.size();
 }
 
+sound_file::sound_file()
+{
+	mBuffer_loaded = false;
+	mPrepared_channels = 0;
+	mPrepared_rate = 0;
+	mIs_prepared = false;
+}
+
 bool sound_file::load()
 {
 	bool preload = false;
@@ -287,12 +295,71 @@ bool sound_file::load()
 
 bool sound_file::unload()
 {
+	mPrepared_samples.clear();
+	mIs_prepared = false;
 	mBuffer_loaded = false;
 	mSFML_buffer = sf::SoundBuffer();
 	set_loaded(false);
 	return true;
 }
 
+bool sound_file::prepare_load()
+{
+	sf::InputSoundFile file;
+	pack_view data;
+	if (mPack)
+	{
+		pack_stream stream(*mPack, mSound_source);
+		if (!stream)
+			return false;
+		if (stream.size() >= streaming_threshold)
+			return true; // Streamed, nothing to decode
+		data = mPack->view(mSound_source);
+		if (data.empty() || !file.openFromMemory(data.data(), data.size()))
+			return false;
+	}
+	else
+	{
+		if (!fs::exists(mSound_source))
+			return false;
+		if (fs::file_size(mSound_source) >= streaming_threshold)
+			return true;
+		if (!file.openFromFile(mSound_source))
+			return false;
+	}
+
+	std::vector<sf::Int16> samples(static_cast<size_t>(file.getSampleCount()));
+	samples.resize(static_cast<size_t>(file.read(samples.data(), samples.size())));
+	mPrepared_samples = std::move(samples);
+	mPrepared_channels = file.getChannelCount();
+	mPrepared_rate = file.getSampleRate();
+	mIs_prepared = true;
+	return true;
+}
+
+bool sound_file::finish_load()
+{
+	if (!mIs_prepared || is_loaded())
+	{
+		mPrepared_samples.clear();
+		mIs_prepared = false;
+		return load();
+	}
+
+	mBuffer_loaded = mSFML_buffer.loadFromSamples(mPrepared_samples.data()
+		, mPrepared_samples.size(), mPrepared_channels, mPrepared_rate);
+	mPrepared_samples = std::vector<sf::Int16>();
+	mIs_prepared = false;
+	return set_loaded(mBuffer_loaded);
+}
+
+size_t sound_file::get_memory_usage() const
+{
+	if (!mBuffer_loaded)
+		return 0;
+	return static_cast<size_t>(mSFML_buffer.getSampleCount()) * sizeof(sf::Int16);
+}
+
 void sound_file::set_filepath(const std::string & pPath)
 {
 	mSound_source = pPath;
@@ -305,14 +372,13 @@ bool sound_file::load_buffer()
 
 	if (mPack)
 	{
-		pack_stream stream(*mPack);
-		stream.open(mSound_source);
-		auto data = stream.read_all();
+		auto data = mPack->view(mSound_source);
 		if (data.empty())
 			return false;
-		mBuffer_loaded = mSFML_buffer.loadFromMemory(&data[0], data.size());
+		mBuffer_loaded = mSFML_buffer.loadFromMemory(data.data(), data.size());
 	}
-	mBuffer_loaded = mSFML_buffer.loadFromFile(mSound_source);
+	else
+		mBuffer_loaded = mSFML_buffer.loadFromFile(mSound_source);
 
 	return mBuffer_loaded;
 }
@@ -412,8 +412,11 @@ int formatted_text_node::draw(renderer & pR)
 
 void formatted_text_node::update_effects()
 {
-	for (auto& i : mBlock_handles)
+	mEffect_moves.resize(mBlock_handles.size());
+	bool moved = false;
+	for (size_t j = 0; j < mBlock_handles.size(); j++)
 	{
+		auto& i = mBlock_handles[j];
 		const auto& block = mFormat.get_block(i.mBlock_index);
 
 		fvector offset(0, 0);
@@ -432,9 +435,14 @@ void formatted_text_node::update_effects()
 		{
 			offset += fvector((float)(rand() % 100) / 100 - 0.5f, (float)(rand() % 100) / 100 - 0.5f);
 		}
-		if (offset != fvector(0, 0))
-			i.mVertices.set_position(i.mOriginal_position + offset);
+		mEffect_moves[j] = offset - i.mOffset;
+		moved |= offset != i.mOffset;
+		i.mOffset = offset;
 	}
+
+	// All the characters are moved in one pass
+	if (moved)
+		mVertex_batch.translate_quads(0, mEffect_moves.data(), mEffect_moves.size());
 }
 
 void formatted_text_node::update()
@@ -482,10 +490,11 @@ void formatted_text_node::update()
 			block_handle handle;
 			handle.mBlock_index = i;
 			handle.mVertices = mVertex_batch.add_quad(position + bounds_offset, glyph_rect);
+			handle.mVertices.set_hskew((block.mFormat & text_format::format::italics) ? 0.5f : 0); // Italics
 			handle.mVertices.set_size(fvector(glyph_rect.w, glyph_rect.h) / scale_quality);
 			handle.mVertices.set_color(block.mColor);// Color
-			handle.mVertices.set_hskew((block.mFormat & text_format::format::italics) ? 0.5f : 0); // Italics
 			handle.mOriginal_position = position + bounds_offset;
+			handle.mOffset = fvector(0, 0);
 			mBlock_handles.push_back(handle);
 
 			// Update size
@@ -3,6 +3,7 @@
 #include <fstream>
 #include <iostream>
 #include <cassert>
+#include <mutex>
 
 // For time
 #include <ctime>
@@ -14,6 +15,7 @@ namespace logger {
 static std::string mLog;
 static std::ofstream mLog_file;
 static size_t mSub_routine_level;
+static std::mutex mMutex; // Resources may be loaded from other threads
 
 void initialize(const std::string & pOutput)
 {
@@ -62,6 +64,7 @@ void print(level pType, const std::string& pMessage)
 		message += "| ";
 	message += pMessage + "\n";
 
+	std::lock_guard<std::mutex> lock(mMutex);
 	mLog += message;
 
 	if (mLog_file)
@@ -24,12 +24,43 @@ node::node()
 	mUnit = 1;
 	mRotation = 0;
 	mScale = { 1, 1 };
+	mChild_index = -1;
+	mAbsolute_rotation = 0;
+	mAbsolute_scale = { 1, 1 };
+	mTransform_changed = false;
+}
+
+node::node(const node& pNode)
+	: node()
+{
+	*this = pNode;
+}
+
+node& node::operator=(const node& pNode)
+{
+	if (&pNode == this)
+		return *this;
+	mUnit = pNode.mUnit;
+	mPosition = pNode.mPosition;
+	mRotation = pNode.mRotation;
+	mScale = pNode.mScale;
+	mTransform_changed = false;
+	transform_changed();
+	return *this;
 }
 
 node::~node()
 {
 	//printf("delete\n");
 	detach_children();
+	for (auto i : mInternal_children)
+	{
+		i->mParent.reset();
+		i->mIs_internal = false;
+		i->mChild_index = -1;
+		i->transform_changed();
+	}
+	mInternal_children.clear();
 	detach_parent();
 }
 
@@ -41,8 +72,8 @@ fvector node::get_exact_position() const
 fvector node::get_absolute_position() const
 {
 	if (!mParent) return mPosition;
-	return (mPosition*get_absolute_scale()).rotate(mParent->get_absolute_rotation())
-		+ mParent->get_absolute_position();
+	update_transform();
+	return mAbsolute_position;
 }
 
 fvector node::get_position() const
@@ -57,12 +88,18 @@ fvector node::get_position(const node& pRelative) const
 
 void node::set_rotation(float pRotation)
 {
+	if (mRotation == pRotation)
+		return;
 	mRotation = pRotation;
+	transform_changed();
 }
 
 void node::set_scale(fvector pScale)
 {
+	if (mScale == pScale)
+		return;
 	mScale = pScale;
+	transform_changed();
 }
 
 float node::get_rotation() const
@@ -78,13 +115,48 @@ fvector node::get_scale() const
 float node::get_absolute_rotation() const
 {
 	if (!mParent) return mRotation;
-	return mParent->get_absolute_rotation() + mRotation;
+	update_transform();
+	return mAbsolute_rotation;
 }
 
 fvector node::get_absolute_scale() const
 {
 	if (!mParent) return mScale;
-	return mParent->get_absolute_scale()*mScale;
+	update_transform();
+	return mAbsolute_scale;
+}
+
+void node::update_transform() const
+{
+	if (!mTransform_changed)
+		return;
+
+	if (mParent)
+	{
+		mParent->update_transform();
+		mAbsolute_rotation = mParent->mAbsolute_rotation + mRotation;
+		mAbsolute_scale = mParent->mAbsolute_scale*mScale;
+		mAbsolute_position = (mPosition*mAbsolute_scale).rotate(mParent->mAbsolute_rotation)
+			+ mParent->mAbsolute_position;
+	}
+	else
+	{
+		mAbsolute_rotation = mRotation;
+		mAbsolute_scale = mScale;
+		mAbsolute_position = mPosition;
+	}
+	mTransform_changed = false;
+}
+
+void node::transform_changed()
+{
+	if (mTransform_changed)
+		return;
+	mTransform_changed = true;
+	for (auto i : mChildren)
+		i->transform_changed();
+	for (auto i : mInternal_children)
+		i->transform_changed();
 }
 
 void node::set_internal_parent(node & pNode)
@@ -92,6 +164,9 @@ void node::set_internal_parent(node & pNode)
 	detach_parent();
 	mParent = &pNode;
 	mIs_internal = true;
+	mChild_index = pNode.mInternal_children.size();
+	pNode.mInternal_children.push_back(this);
+	transform_changed();
 }
 
 void node::set_absolute_position(const fvector& pPosition)
@@ -104,35 +179,42 @@ void node::set_absolute_position(const fvector& pPosition)
 
 void node::set_position(const fvector& pPosition)
 {
+	if (mPosition == pPosition)
+		return;
 	mPosition = pPosition;
+	transform_changed();
 }
 
 util::optional_pointer<node> node::detach_parent()
 {
 	if (!mParent) return{};
-	if (mIs_internal)
-	{
-		node* temp = mParent;
-		mParent.reset();
-		mIs_internal = false;
-		return temp;
-	}
-	node* temp = mParent->mChildren[mChild_index];
-	mParent->mChildren.erase(mParent->mChildren.begin() + mChild_index);
-	for (size_t i = 0; i < mParent->mChildren.size(); i++)
-		mParent->mChildren[i]->mChild_index = i;
+	node_arr& siblings = mIs_internal ? mParent->mInternal_children : mParent->mChildren;
+	node* temp = mIs_internal ? static_cast<node*>(mParent) : this;
+
+	// The last sibling takes this slot so no other index changes
+	node* last = siblings.back();
+	siblings[mChild_index] = last;
+	last->mChild_index = mChild_index;
+	siblings.pop_back();
+
 	mChild_index = -1;
 	mParent.reset();
+	mIs_internal = false;
+	transform_changed();
 	return temp;
 }
 
 node_arr node::detach_children()
 {
 	if (!mChildren.size()) return node_arr();
-	node_arr temp = mChildren;
-	for (auto i : mChildren)
+	node_arr temp;
+	temp.swap(mChildren);
+	for (auto i : temp)
+	{
 		i->mParent.reset();
-	mChildren.clear();
+		i->mChild_index = -1;
+		i->transform_changed();
+	}
 	return temp;
 }
 
@@ -141,7 +223,7 @@ util::optional_pointer<node> node::get_parent() const
 	return mParent;
 }
 
-node_arr node::get_children() const
+const node_arr& node::get_children() const
 {
 	return mChildren;
 }
@@ -159,6 +241,7 @@ bool node::add_child(node& obj)
 	obj.mParent = this;
 	obj.set_unit(mUnit);
 	mChildren.push_back(&obj);
+	obj.transform_changed();
 	return true;
 }
 
@@ -4,43 +4,103 @@
 #include <engine/particle_engine.hpp>
 
 #include <cmath>
+#include <algorithm>
 
 using namespace engine;
 
 void particle_emitter::spawn(size_t pCount)
 {
-	for (size_t i = 0; i < pCount; i++)
+	pCount = std::min(pCount, get_capacity() - mCount);
+	for (size_t i = 0; i < pCount; i++, mCount++)
 	{
-		auto nparticle = find_unused_particle();
-		if (!nparticle) {
-			mParticles.emplace_back();
-			nparticle = &mParticles.back();
-		}
-		nparticle->life.start(mLife);
-		nparticle->velocity = mVelocity;
-		nparticle->valid = true;
-
-		fvector position = {
-			std::fmod((float)std::rand(), mRegion_size.x),
-			std::fmod((float)std::rand(), mRegion_size.y)
-		};
-		nparticle->sprite = mSprites.add_quad(position, mTexture_rect);
+		mPosition_x[mCount] = mRegion_size.x > 0 ? std::fmod((float)std::rand(), mRegion_size.x) : 0;
+		mPosition_y[mCount] = mRegion_size.y > 0 ? std::fmod((float)std::rand(), mRegion_size.y) : 0;
+		mVelocity_x[mCount] = mVelocity.x;
+		mVelocity_y[mCount] = mVelocity.y;
+		mLife_left[mCount] = mLife;
 	}
 }
 
-particle_emitter::particle * particle_emitter::find_unused_particle()
+particle_emitter::particle_emitter()
+{
+	mCount = 0;
+	mQuads_shown = 0;
+	mRate = 0;
+	mLife = 1;
+	set_capacity(1000);
+	add_child(mSprites);
+}
+
+void particle_emitter::set_capacity(size_t pCapacity)
+{
+	mCount = std::min(mCount, pCapacity);
+	mPosition_x.resize(pCapacity);
+	mPosition_y.resize(pCapacity);
+	mVelocity_x.resize(pCapacity);
+	mVelocity_y.resize(pCapacity);
+	mLife_left.resize(pCapacity);
+}
+
+size_t particle_emitter::get_capacity() const
 {
-	for (auto &i : mParticles)
+	return mLife_left.size();
+}
+
+size_t particle_emitter::get_count() const
+{
+	return mCount;
+}
+
+void particle_emitter::update(float pDelta)
+{
+	float* position_x = mPosition_x.data();
+	float* position_y = mPosition_y.data();
+	float* velocity_x = mVelocity_x.data();
+	float* velocity_y = mVelocity_y.data();
+	float* life = mLife_left.data();
+	const float acceleration_x = mAcceleration.x*pDelta;
+	const float acceleration_y = mAcceleration.y*pDelta;
+
+	// No branches or calls so the compiler can vectorize this
+	for (size_t i = 0; i < mCount; i++)
+	{
+		velocity_x[i] += acceleration_x;
+		velocity_y[i] += acceleration_y;
+		position_x[i] += velocity_x[i]*pDelta;
+		position_y[i] += velocity_y[i]*pDelta;
+		life[i] -= pDelta;
+	}
+
+	// The last particle takes the place of a dead one
+	for (size_t i = 0; i < mCount;)
 	{
-		if (!i.valid)
-			return &i;
+		if (life[i] > 0)
+		{
+			++i;
+			continue;
+		}
+		--mCount;
+		position_x[i] = position_x[mCount];
+		position_y[i] = position_y[mCount];
+		velocity_x[i] = velocity_x[mCount];
+		velocity_y[i] = velocity_y[mCount];
+		life[i] = life[mCount];
 	}
-	return nullptr;
+
+	update_quads();
 }
 
-particle_emitter::particle_emitter()
+void particle_emitter::update_quads()
 {
-	add_child(mSprites);
+	while (mSprites.get_quad_count() < mCount)
+		mSprites.add_quad({ 0, 0 }, mTexture_rect);
+
+	mSprites.set_quad_positions(0, mPosition_x.data(), mPosition_y.data(), mTexture_rect.get_size(), mCount);
+
+	// Quads left over from particles that died
+	if (mQuads_shown > mCount)
+		mSprites.hide_quads(mCount, mQuads_shown - mCount);
+	mQuads_shown = mCount;
 }
 
 void
@@ -52,24 +112,7 @@ particle_emitter::tick()
 		mSpawn_clock.restart();
 	}
 
-	float time = mFrame_clock.get_elapse().seconds();
-	for (auto &i : mParticles)
-	{
-		if (!i.valid)
-			continue;
-
-		if (i.life.is_reached())
-		{
-			i.sprite.hide();
-			i.valid = false;
-		}
-		else {
-			i.velocity += mAcceleration*time;
-			auto position = i.sprite.get_position();
-			i.sprite.set_position(position + i.velocity*time);
-		}
-	}
-
+	update(mFrame_clock.get_elapse().seconds());
 	mFrame_clock.restart();
 }
 
@@ -113,6 +156,8 @@ void
 particle_emitter::set_texture_rect(frect r)
 {
 	mTexture_rect = r;
+	const std::vector<frect> rects(mSprites.get_quad_count(), r);
+	mSprites.set_quad_texture_rects(0, rects.data(), rects.size());
 }
 
 int
@@ -1,36 +1,47 @@
 #include <engine/pathfinding.hpp>
 #include <cassert>
-#include <iostream>
+#include <array>
+#include <cmath>
+#include <algorithm>
 
 using namespace engine;
 
-enum neighbor_position
+// Only direct neighbors are used. The corners are not
+// useful in a tile like enviroment.
+// TODO: Provide ability to switch corners on and off for whatever reason
+static const std::array<ivector, 4> neighbor_offsets =
 {
-	top,
-	bottom,
-	left,
-	right,
-	topleft,
-	topright,
-	bottomright,
-	bottomleft
+	ivector(0, -1), // top
+	ivector(1, 0),  // right
+	ivector(0, 1),  // bottom
+	ivector(-1, 0)  // left
 };
 
+// Cost of moving to an adjacent cell
+static const float step_cost = 1.f;
+
+// Heap index of nodes that have been removed from the open set
+static const uint32_t closed_index = 0xFFFFFFFF;
 
 path_node::path_node() :
 	mTotal_cost(0),
+	mG(0),
 	mH(0),
-	mPredecessor(nullptr)
+	mPredecessor(no_node),
+	mHeap_index(closed_index)
 {
 }
 
-float path_node::calculate_cost(fvector pStart, fvector pDestination)
+float path_node::calculate_cost(float pG, fvector pDestination)
 {
-	float G = mPosition.distance(pStart);
-	mH = mPosition.distance(pDestination);
-	mTotal_cost = G + mH;
+	// Manhattan distance is admissible since only
+	// the 4 direct neighbors are considered.
+	mG = pG;
+	mH = (pDestination - mPosition).manhattan();
+	mTotal_cost = mG + mH;
 	return mTotal_cost;
 }
+
 void path_node::set_position(fvector pPosition)
 {
 	mPosition = pPosition;
@@ -41,25 +52,30 @@ fvector path_node::get_position() const
 	return mPosition;
 }
 
+void path_node::set_grid_position(ivector pPosition)
+{
+	mGrid_position = pPosition;
+}
+
 ivector path_node::get_grid_position() const
 {
-	return ivector(fvector(mPosition).floor());
+	return mGrid_position;
 }
 
 bool path_node::has_predecessor() const
 {
-	return mPredecessor != nullptr;
+	return mPredecessor != no_node;
 }
 
-void path_node::set_predecessor(path_node& pPath_node)
+void path_node::set_predecessor(uint32_t pIndex)
 {
-	mPredecessor = &pPath_node;
+	mPredecessor = pIndex;
 }
 
-path_node& path_node::get_predecessor()
+uint32_t path_node::get_predecessor() const
 {
-	assert(mPredecessor != nullptr);
-	return *mPredecessor;
+	assert(mPredecessor != no_node);
+	return mPredecessor;
 }
 
 float path_node::get_total_cost() const
@@ -67,6 +83,16 @@ float path_node::get_total_cost() const
 	return mTotal_cost;
 }
 
+float path_node::get_g() const
+{
+	return mG;
+}
+
+float path_node::get_h() const
+{
+	return mH;
+}
+
 bool path_node::is_less_costly(const path_node & pNode) const
 {
 	return (mTotal_cost < pNode.mTotal_cost)
@@ -74,16 +100,24 @@ bool path_node::is_less_costly(const path_node & pNode) const
 			&& mH < pNode.mH);
 }
 
-bool path_node::operator<(const path_node & pNode)
+bool path_node::is_closed() const
+{
+	return mHeap_index == closed_index;
+}
+
+path_set::path_set() :
+	mClosest(path_node::no_node),
+	mFound(path_node::no_node)
 {
-	return false;
 }
 
 void path_set::clean()
 {
+	mNodes.clear();
 	mOpen_set.clear();
-	mClosed_set.clear();
 	mGrid.clean();
+	mClosest = path_node::no_node;
+	mFound = path_node::no_node;
 }
 
 void path_set::new_path(fvector pStart, fvector pDestination)
@@ -94,39 +128,62 @@ void path_set::new_path(fvector pStart, fvector pDestination)
 	mDestination = pDestination;
 
 	// Create first node
-	add_node(pStart);
+	add_node({ 0, 0 }, 0, path_node::no_node);
 }
 
-bool path_set::step(collision_callback pCollision_callback)
+bool path_set::step(const collision_callback& pCollision_callback)
 {
-	auto& current = mOpen_set.front();
+	const uint32_t current = heap_pop();
 
 	// Check if node is on the destination
-	if (current.get_position() == mDestination)
+	if (mNodes[current].get_position() == mDestination)
+	{
+		mFound = current;
 		return true;
+	}
 
-	// Move top node to closed list
-	mClosed_set.splice(mClosed_set.begin(), mOpen_set, mOpen_set.begin());
-	
 	create_neighbors(current, pCollision_callback);
 
 	return false;
 }
 
-void path_set::create_neighbors(path_node& pNode, collision_callback pCollision_callback)
+void path_set::create_neighbors(uint32_t pNode, const collision_callback& pCollision_callback)
 {
-	auto neighbor_positions = mGrid.get_empty_neighbors_positions(pNode);
+	const ivector grid_position = mNodes[pNode].get_grid_position();
+	const float g = mNodes[pNode].get_g() + step_cost;
 
-	for (auto i : neighbor_positions)
+	for (auto& i : neighbor_offsets)
 	{
-		// Check collision with custom function
+		const ivector neighbor = grid_position + i;
+		const uint32_t existing = mGrid.find(neighbor);
+
+		if (existing == grid_set::blocked)
+			continue;
+
+		if (existing != path_node::no_node)
+		{
+			// Found a cheaper way to an open node
+			path_node& node = mNodes[existing];
+			if (!node.is_closed() && g < node.get_g())
+			{
+				node.calculate_cost(g, mDestination);
+				node.set_predecessor(pNode);
+				heap_sift_up(node.mHeap_index);
+			}
+			continue;
+		}
+
+		// Check collision with custom function.
+		// Blocked cells are remembered so they are only checked once.
+		fvector position = mStart + fvector(neighbor);
 		if (pCollision_callback
-			&& pCollision_callback(i))
+			&& pCollision_callback(position))
+		{
+			mGrid.add_node(neighbor, grid_set::blocked);
 			continue;
+		}
 
-		// Create new node
-		path_node& new_node = add_node(i);
-		new_node.set_predecessor(pNode);
+		add_node(neighbor, g, pNode);
 	}
 }
 
@@ -135,93 +192,256 @@ bool path_set::is_openset_empty() const
 	return mOpen_set.empty();
 }
 
-path_node& path_set::add_node(fvector pPosition)
+uint32_t path_set::add_node(ivector pGrid_position, float pG, uint32_t pPredecessor)
 {
-	path_node new_node;
-	new_node.set_position(pPosition);
-	new_node.calculate_cost(mStart, mDestination);
+	const uint32_t index = static_cast<uint32_t>(mNodes.size());
+	mNodes.emplace_back();
+
+	path_node& new_node = mNodes.back();
+	new_node.set_grid_position(pGrid_position);
+	new_node.set_position(mStart + fvector(pGrid_position));
+	new_node.calculate_cost(pG, mDestination);
+	new_node.set_predecessor(pPredecessor);
 
-	// Insert as first node
-	if (!mOpen_set.size())
+	mGrid.add_node(pGrid_position, index);
+	heap_push(index);
+
+	// Remember the closest node for partial paths
+	if (mClosest == path_node::no_node
+		|| new_node.get_h() < mNodes[mClosest].get_h())
+		mClosest = index;
+
+	return index;
+}
+
+void path_set::heap_push(uint32_t pNode)
+{
+	mNodes[pNode].mHeap_index = static_cast<uint32_t>(mOpen_set.size());
+	mOpen_set.push_back(pNode);
+	heap_sift_up(mOpen_set.size() - 1);
+}
+
+uint32_t path_set::heap_pop()
+{
+	assert(!mOpen_set.empty());
+	const uint32_t top = mOpen_set.front();
+	heap_swap(0, mOpen_set.size() - 1);
+	mOpen_set.pop_back();
+	if (!mOpen_set.empty())
+		heap_sift_down(0);
+	mNodes[top].mHeap_index = closed_index;
+	return top;
+}
+
+void path_set::heap_sift_up(size_t pIndex)
+{
+	while (pIndex > 0)
 	{
-		mOpen_set.push_back(new_node);
-		mGrid.add_node(mOpen_set.back());
-		return mOpen_set.back();
+		const size_t parent = (pIndex - 1) / 2;
+		if (!mNodes[mOpen_set[pIndex]].is_less_costly(mNodes[mOpen_set[parent]]))
+			break;
+		heap_swap(pIndex, parent);
+		pIndex = parent;
 	}
+}
 
-	// Insert node according to its cost values
-	// Automatically keeps things sorted without
-	//   calling an expensive sort function every time.
-	for (auto i = mOpen_set.begin(); i != mOpen_set.end(); i++)
+void path_set::heap_sift_down(size_t pIndex)
+{
+	const size_t size = mOpen_set.size();
+	for (;;)
 	{
-		if (new_node.is_less_costly(*i))
-		{
-			mOpen_set.insert(i, new_node);
-			--i;
-			mGrid.add_node(*i);
-			return *i;
-		}
+		const size_t left = pIndex * 2 + 1;
+		const size_t right = left + 1;
+		size_t smallest = pIndex;
+		if (left < size
+			&& mNodes[mOpen_set[left]].is_less_costly(mNodes[mOpen_set[smallest]]))
+			smallest = left;
+		if (right < size
+			&& mNodes[mOpen_set[right]].is_less_costly(mNodes[mOpen_set[smallest]]))
+			smallest = right;
+		if (smallest == pIndex)
+			break;
+		heap_swap(pIndex, smallest);
+		pIndex = smallest;
 	}
+}
 
-	// Insert as last
-	mOpen_set.push_back(new_node);
-	mGrid.add_node(mOpen_set.back());
-	return mOpen_set.back();
+void path_set::heap_swap(size_t pA, size_t pB)
+{
+	std::swap(mOpen_set[pA], mOpen_set[pB]);
+	mNodes[mOpen_set[pA]].mHeap_index = static_cast<uint32_t>(pA);
+	mNodes[mOpen_set[pB]].mHeap_index = static_cast<uint32_t>(pB);
 }
 
 path_t path_set::construct_path()
 {
 	path_t path;
-	path_node* current = &mOpen_set.front(); // The top node should be the least costly
-	path.push_front(current->get_position()); // First node
+
+	// Use the closest node if the destination was never reached
+	uint32_t current = mFound != path_node::no_node ? mFound : mClosest;
+	if (current == path_node::no_node)
+		return path;
+
+	path.push_front(mNodes[current].get_position()); // First node
 
 	// Follow all predecessors to create path
-	while (current->has_predecessor())
+	while (mNodes[current].has_predecessor())
 	{
-		current = &current->get_predecessor();
-		path.push_front(current->get_position());
+		current = mNodes[current].get_predecessor();
+		path.push_front(mNodes[current].get_position());
 	}
 
 	return path;
 }
 
-std::vector<fvector> grid_set::get_empty_neighbors_positions(path_node& pNode) const
+grid_set::grid_set() :
+	mCount(0),
+	mGeneration(1)
 {
-	std::array<fvector, 4> neighbors;
+	mTable.resize(256, { 0, path_node::no_node, 0 });
+}
 
-	// These are the corners but they are not useful in a tile like enviroment
-	// TODO: Provide ability to switch these on and off for whatever reason
-	//neighbors[neighbor_position::topleft]     = position + ivector(-1, -1);
-	//neighbors[neighbor_position::topright]    = position + ivector(1, -1);
-	//neighbors[neighbor_position::bottomright] = position + ivector(1, 1);
-	//neighbors[neighbor_position::bottomleft]  = position + ivector(-1, 1);
+uint32_t grid_set::find(ivector pPosition) const
+{
+	const size_t slot = find_slot(hash_position(pPosition));
+	if (mTable[slot].generation != mGeneration)
+		return path_node::no_node;
+	return mTable[slot].node;
+}
 
-	neighbors[neighbor_position::top]         =  fvector(0, -1);
-	neighbors[neighbor_position::right]       =  fvector(1, 0);
-	neighbors[neighbor_position::bottom]      =  fvector(0, 1);
-	neighbors[neighbor_position::left]        =  fvector(-1, 0);
+void grid_set::add_node(ivector pPosition, uint32_t pNode)
+{
+	// Keep the load factor under a half
+	if ((mCount + 1) * 2 > mTable.size())
+		grow();
 
-	std::vector<fvector> retval;
+	const uint64_t key = hash_position(pPosition);
+	entry& e = mTable[find_slot(key)];
+	if (e.generation != mGeneration)
+		++mCount;
+	e.key = key;
+	e.node = pNode;
+	e.generation = mGeneration;
+}
 
-	const fvector position = pNode.get_position();
+void grid_set::clean()
+{
+	mCount = 0;
+	++mGeneration;
 
-	for (auto i : neighbors)
+	// Generation wrapped around; stale entries could look current
+	if (mGeneration == 0)
 	{
-		if (mMap.find((i + position).floor()) == mMap.end())
-			retval.push_back(i + position);
+		for (auto& i : mTable)
+			i.generation = 0;
+		mGeneration = 1;
 	}
+}
 
-	return retval;
+uint64_t grid_set::hash_position(ivector pPosition)
+{
+	return (static_cast<uint64_t>(static_cast<uint32_t>(pPosition.x)) << 32)
+		| static_cast<uint64_t>(static_cast<uint32_t>(pPosition.y));
 }
 
-void grid_set::add_node(path_node& pNode)
+size_t grid_set::find_slot(uint64_t pKey) const
 {
-	mMap.insert(pNode.get_grid_position());
+	// Table size is always a power of 2
+	const size_t mask = mTable.size() - 1;
+	size_t slot = static_cast<size_t>((pKey * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+	while (mTable[slot].generation == mGeneration
+		&& mTable[slot].key != pKey)
+		slot = (slot + 1) & mask;
+	return slot;
 }
 
-void grid_set::clean()
+void grid_set::grow()
+{
+	std::vector<entry> old;
+	old.swap(mTable);
+	mTable.resize(old.size() * 2, { 0, path_node::no_node, 0 });
+	for (auto& i : old)
+	{
+		if (i.generation != mGeneration)
+			continue;
+		entry& e = mTable[find_slot(i.key)];
+		e = i;
+	}
+}
+
+walkability_grid::walkability_grid()
+{
+}
+
+void walkability_grid::reset(irect pBounds)
+{
+	mBounds = pBounds;
+	mBits.clear();
+	if (mBounds.w <= 0 || mBounds.h <= 0)
+		return;
+
+	// 32 cells per word
+	const size_t cell_count = static_cast<size_t>(mBounds.w) * static_cast<size_t>(mBounds.h);
+	mBits.resize((cell_count + 31) / 32, 0);
+}
+
+void walkability_grid::clear()
 {
-	mMap.clear();
+	reset({ 0, 0, 0, 0 });
+}
+
+const irect& walkability_grid::get_bounds() const
+{
+	return mBounds;
+}
+
+bool walkability_grid::is_inside(ivector pPosition) const
+{
+	return pPosition.x >= mBounds.x
+		&& pPosition.y >= mBounds.y
+		&& pPosition.x < mBounds.x + mBounds.w
+		&& pPosition.y < mBounds.y + mBounds.h;
+}
+
+void walkability_grid::set_cell(ivector pPosition, cell pCell)
+{
+	if (!is_inside(pPosition))
+		return;
+	const size_t index = static_cast<size_t>(pPosition.y - mBounds.y) * mBounds.w
+		+ static_cast<size_t>(pPosition.x - mBounds.x);
+	const size_t shift = (index % 32) * 2;
+	uint64_t& word = mBits[index / 32];
+	word &= ~(static_cast<uint64_t>(3) << shift);
+	word |= static_cast<uint64_t>(pCell) << shift;
+}
+
+walkability_grid::cell walkability_grid::get_cell(ivector pPosition) const
+{
+	if (!is_inside(pPosition))
+		return cell::open;
+	const size_t index = static_cast<size_t>(pPosition.y - mBounds.y) * mBounds.w
+		+ static_cast<size_t>(pPosition.x - mBounds.x);
+	return static_cast<cell>((mBits[index / 32] >> ((index % 32) * 2)) & 3);
+}
+
+walkability_grid::cell walkability_grid::test_region(const frect& pRegion) const
+{
+	const int left = static_cast<int>(std::floor(pRegion.x));
+	const int top = static_cast<int>(std::floor(pRegion.y));
+	const int right = static_cast<int>(std::ceil(pRegion.x + pRegion.w));
+	const int bottom = static_cast<int>(std::ceil(pRegion.y + pRegion.h));
+
+	cell result = cell::open;
+	for (int y = top; y < bottom; y++)
+		for (int x = left; x < right; x++)
+		{
+			const cell c = get_cell({ x, y });
+			if (c == cell::blocked)
+				return cell::blocked;
+			if (c == cell::partial)
+				result = cell::partial;
+		}
+	return result;
 }
 
 pathfinder::pathfinder()
@@ -235,10 +455,10 @@ bool pathfinder::start(engine::fvector pStart, engine::fvector pDestination)
 
 	for (size_t i = 0; i < mPath_limit; i++)
 	{
-		if (mPath_set.step(mCollision_callback))
-			return true;
 		if (mPath_set.is_openset_empty())
 			return false;
+		if (mPath_set.step(mCollision_callback))
+			return true;
 	}
 	return false;
 }
@@ -257,3 +477,694 @@ path_t pathfinder::construct_path()
 {
 	return mPath_set.construct_path();
 }
+
+// Runs of open border tiles longer than this get an
+// entrance at each end instead of one in the middle
+static const int max_single_entrance_width = 6;
+
+static const std::array<ivector, 4> cluster_neighbor_offsets =
+{
+	ivector(0, -1),
+	ivector(1, 0),
+	ivector(0, 1),
+	ivector(-1, 0)
+};
+
+hierarchical_pathfinder::hierarchical_pathfinder() :
+	mCluster_size(16)
+{
+}
+
+void hierarchical_pathfinder::set_cluster_size(int pSize)
+{
+	assert(pSize > 0);
+	mCluster_size = pSize;
+}
+
+void hierarchical_pathfinder::set_tile_callback(tile_callback pCallback)
+{
+	mTile_callback = pCallback;
+}
+
+void hierarchical_pathfinder::build(irect pBounds)
+{
+	clear();
+	if (pBounds.w <= 0 || pBounds.h <= 0)
+		return;
+
+	mBounds = pBounds;
+	mCluster_count.x = (mBounds.w + mCluster_size - 1) / mCluster_size;
+	mCluster_count.y = (mBounds.h + mCluster_size - 1) / mCluster_size;
+
+	mBlocked.resize(static_cast<size_t>(mBounds.w) * mBounds.h);
+	for (int y = 0; y < mBounds.h; y++)
+		for (int x = 0; x < mBounds.w; x++)
+			mBlocked[static_cast<size_t>(y) * mBounds.w + x]
+				= mTile_callback && mTile_callback({ mBounds.x + x, mBounds.y + y });
+
+	mClusters.resize(static_cast<size_t>(mCluster_count.x) * mCluster_count.y);
+	for (int y = 0; y < mCluster_count.y; y++)
+		for (int x = 0; x < mCluster_count.x; x++)
+			build_cluster({ x, y });
+}
+
+void hierarchical_pathfinder::update(irect pRegion)
+{
+	if (!is_built())
+		return;
+
+	// Clip to the bounds
+	const int left = std::max(pRegion.x, mBounds.x);
+	const int top = std::max(pRegion.y, mBounds.y);
+	const int right = std::min(pRegion.x + pRegion.w, mBounds.x + mBounds.w);
+	const int bottom = std::min(pRegion.y + pRegion.h, mBounds.y + mBounds.h);
+	if (left >= right || top >= bottom)
+		return;
+
+	for (int y = top; y < bottom; y++)
+		for (int x = left; x < right; x++)
+			mBlocked[static_cast<size_t>(y - mBounds.y) * mBounds.w + (x - mBounds.x)]
+				= mTile_callback && mTile_callback({ x, y });
+
+	// Entrances depend on tiles on both sides of a border so
+	// every cluster next to a changed one is rebuilt as well.
+	const ivector first = get_cluster_position({ left, top }) - ivector(1, 1);
+	const ivector last = get_cluster_position({ right - 1, bottom - 1 }) + ivector(1, 1);
+	for (int y = std::max(first.y, 0); y <= std::min(last.y, mCluster_count.y - 1); y++)
+		for (int x = std::max(first.x, 0); x <= std::min(last.x, mCluster_count.x - 1); x++)
+			build_cluster({ x, y });
+}
+
+void hierarchical_pathfinder::clear()
+{
+	mBounds = irect();
+	mCluster_count = ivector();
+	mBlocked.clear();
+	mClusters.clear();
+	mNode_lookup.clear();
+	mRoute.clear();
+}
+
+bool hierarchical_pathfinder::is_built() const
+{
+	return !mClusters.empty();
+}
+
+const irect& hierarchical_pathfinder::get_bounds() const
+{
+	return mBounds;
+}
+
+bool hierarchical_pathfinder::start(fvector pStart, fvector pDestination)
+{
+	mRoute.clear();
+	if (!is_built())
+		return false;
+
+	const ivector start_tile = fvector(pStart).floor();
+	const ivector destination_tile = fvector(pDestination).floor();
+	if (is_blocked(start_tile) || is_blocked(destination_tile))
+		return false;
+
+	if (start_tile == destination_tile)
+	{
+		mRoute.push_back(start_tile);
+		return true;
+	}
+
+	const ivector start_cluster = get_cluster_position(start_tile);
+	const ivector destination_cluster = get_cluster_position(destination_tile);
+
+	// Short trips don't need the entrance graph
+	std::vector<ivector> local;
+	if (start_cluster == destination_cluster
+		&& local_path(start_tile, destination_tile, local))
+	{
+		mRoute.push_back(start_tile);
+		mRoute.push_back(destination_tile);
+		return true;
+	}
+
+	// Connect the start and destination to the entrances of their clusters
+	const cluster& start_nodes = get_cluster(start_cluster);
+	std::vector<float> start_costs(start_nodes.nodes.size());
+	const irect start_region = get_cluster_tiles(start_cluster);
+	flood(start_tile, start_region);
+	for (size_t i = 0; i < start_nodes.nodes.size(); i++)
+		start_costs[i] = static_cast<float>(get_flood_distance(start_nodes.nodes[i], start_region));
+
+	const cluster& destination_nodes = get_cluster(destination_cluster);
+	std::vector<float> destination_costs(destination_nodes.nodes.size());
+	const irect destination_region = get_cluster_tiles(destination_cluster);
+	flood(destination_tile, destination_region);
+	for (size_t i = 0; i < destination_nodes.nodes.size(); i++)
+		destination_costs[i] = static_cast<float>(get_flood_distance(destination_nodes.nodes[i], destination_region));
+
+	// A* over the entrance graph
+	struct visit
+	{
+		float g;
+		uint64_t predecessor;
+		ivector tile;
+		bool closed;
+	};
+	std::unordered_map<uint64_t, visit> visited;
+
+	typedef std::pair<float, uint64_t> open_entry;
+	std::vector<open_entry> open;
+	auto open_compare = [](const open_entry& pL, const open_entry& pR) { return pL.first > pR.first; };
+
+	const uint64_t start_key = hash_tile(start_tile);
+	const uint64_t destination_key = hash_tile(destination_tile);
+
+	auto relax = [&](uint64_t pFrom, ivector pTile, float pG)
+	{
+		const uint64_t key = hash_tile(pTile);
+		auto find = visited.find(key);
+		if (find != visited.end()
+			&& (find->second.closed || find->second.g <= pG))
+			return;
+		visited[key] = { pG, pFrom, pTile, false };
+		open.push_back({ pG + static_cast<float>(ivector(destination_tile - pTile).manhattan()), key });
+		std::push_heap(open.begin(), open.end(), open_compare);
+	};
+
+	visited[start_key] = { 0, start_key, start_tile, false };
+	open.push_back({ 0, start_key });
+
+	bool found = false;
+	while (!open.empty())
+	{
+		std::pop_heap(open.begin(), open.end(), open_compare);
+		const uint64_t key = open.back().second;
+		open.pop_back();
+
+		visit& current = visited[key];
+		if (current.closed)
+			continue;
+		current.closed = true;
+
+		if (key == destination_key)
+		{
+			found = true;
+			break;
+		}
+
+		const ivector tile = current.tile;
+		const float g = current.g;
+
+		if (key == start_key)
+		{
+			for (size_t i = 0; i < start_nodes.nodes.size(); i++)
+				if (start_costs[i] >= 0)
+					relax(key, start_nodes.nodes[i], g + start_costs[i]);
+		}
+
+		auto lookup = mNode_lookup.find(key);
+		if (lookup == mNode_lookup.end())
+			continue;
+
+		const ivector cluster_position = get_cluster_position(tile);
+		const cluster& c = get_cluster(cluster_position);
+		const size_t node = lookup->second;
+		const size_t node_count = c.nodes.size();
+
+		// Edges to the other entrances of this cluster
+		for (size_t i = 0; i < node_count; i++)
+		{
+			const float cost = c.distances[node * node_count + i];
+			if (i != node && cost >= 0)
+				relax(key, c.nodes[i], g + cost);
+		}
+
+		// Edges across the cluster border
+		for (auto& i : cluster_neighbor_offsets)
+		{
+			const ivector neighbor = tile + i;
+			if (get_cluster_position(neighbor) != cluster_position
+				&& !is_blocked(neighbor)
+				&& mNode_lookup.count(hash_tile(neighbor)))
+				relax(key, neighbor, g + 1);
+		}
+
+		if (cluster_position == destination_cluster && destination_costs[node] >= 0)
+			relax(key, destination_tile, g + destination_costs[node]);
+	}
+
+	if (!found)
+		return false;
+
+	// Trace the route back to the start
+	for (uint64_t key = destination_key; key != start_key; key = visited[key].predecessor)
+		mRoute.push_back(visited[key].tile);
+	mRoute.push_back(start_tile);
+	std::reverse(mRoute.begin(), mRoute.end());
+	return true;
+}
+
+path_t hierarchical_pathfinder::construct_path()
+{
+	path_t path;
+	if (mRoute.empty())
+		return path;
+
+	path.push_back(fvector(mRoute[0]));
+
+	std::vector<ivector> leg;
+	for (size_t i = 1; i < mRoute.size(); i++)
+	{
+		leg.clear();
+		if (ivector(mRoute[i] - mRoute[i - 1]).manhattan() == 1)
+			leg.push_back(mRoute[i]);
+		else if (!local_path(mRoute[i - 1], mRoute[i], leg))
+			break; // Should not happen unless the map changed in between
+		for (auto& j : leg)
+			path.push_back(fvector(j));
+	}
+	return path;
+}
+
+uint64_t hierarchical_pathfinder::hash_tile(ivector pTile)
+{
+	return (static_cast<uint64_t>(static_cast<uint32_t>(pTile.x)) << 32)
+		| static_cast<uint64_t>(static_cast<uint32_t>(pTile.y));
+}
+
+bool hierarchical_pathfinder::is_blocked(ivector pTile) const
+{
+	// Everything outside of the map is considered blocked
+	if (pTile.x < mBounds.x || pTile.y < mBounds.y
+		|| pTile.x >= mBounds.x + mBounds.w || pTile.y >= mBounds.y + mBounds.h)
+		return true;
+	return mBlocked[static_cast<size_t>(pTile.y - mBounds.y) * mBounds.w + (pTile.x - mBounds.x)];
+}
+
+ivector hierarchical_pathfinder::get_cluster_position(ivector pTile) const
+{
+	// Floor division so tiles left/above the bounds fall outside cluster 0
+	const int x = pTile.x - mBounds.x;
+	const int y = pTile.y - mBounds.y;
+	return{
+		(x >= 0 ? x : x - mCluster_size + 1) / mCluster_size,
+		(y >= 0 ? y : y - mCluster_size + 1) / mCluster_size
+	};
+}
+
+irect hierarchical_pathfinder::get_cluster_tiles(ivector pCluster) const
+{
+	const int x = mBounds.x + pCluster.x * mCluster_size;
+	const int y = mBounds.y + pCluster.y * mCluster_size;
+	return{
+		x, y,
+		std::min(mCluster_size, mBounds.x + mBounds.w - x),
+		std::min(mCluster_size, mBounds.y + mBounds.h - y)
+	};
+}
+
+hierarchical_pathfinder::cluster& hierarchical_pathfinder::get_cluster(ivector pCluster)
+{
+	return mClusters[static_cast<size_t>(pCluster.y) * mCluster_count.x + pCluster.x];
+}
+
+void hierarchical_pathfinder::build_cluster(ivector pCluster)
+{
+	cluster& c = get_cluster(pCluster);
+
+	for (auto& i : c.nodes)
+		mNode_lookup.erase(hash_tile(i));
+	c.nodes.clear();
+
+	for (auto& i : cluster_neighbor_offsets)
+	{
+		const ivector neighbor = pCluster + i;
+		if (neighbor.x >= 0 && neighbor.y >= 0
+			&& neighbor.x < mCluster_count.x && neighbor.y < mCluster_count.y)
+			find_entrances(pCluster, neighbor, c.nodes);
+	}
+
+	// Corner tiles can be an entrance on two borders
+	std::sort(c.nodes.begin(), c.nodes.end());
+	c.nodes.erase(std::unique(c.nodes.begin(), c.nodes.end()), c.nodes.end());
+
+	for (size_t i = 0; i < c.nodes.size(); i++)
+		mNode_lookup[hash_tile(c.nodes[i])] = static_cast<uint32_t>(i);
+
+	// Distances between every pair of entrances
+	const irect region = get_cluster_tiles(pCluster);
+	const size_t node_count = c.nodes.size();
+	c.distances.assign(node_count * node_count, -1.f);
+	for (size_t i = 0; i < node_count; i++)
+	{
+		flood(c.nodes[i], region);
+		for (size_t j = 0; j < node_count; j++)
+			c.distances[i * node_count + j] = static_cast<float>(get_flood_distance(c.nodes[j], region));
+	}
+}
+
+void hierarchical_pathfinder::find_entrances(ivector pCluster, ivector pNeighbor, std::vector<ivector>& pNodes) const
+{
+	const irect tiles = get_cluster_tiles(pCluster);
+	const ivector direction = pNeighbor - pCluster;
+
+	// First border tile on our side and the step along the border
+	ivector border_start;
+	ivector border_step;
+	int length;
+	if (direction.x != 0)
+	{
+		border_start = { direction.x > 0 ? tiles.x + tiles.w - 1 : tiles.x, tiles.y };
+		border_step = { 0, 1 };
+		length = tiles.h;
+	}
+	else
+	{
+		border_start = { tiles.x, direction.y > 0 ? tiles.y + tiles.h - 1 : tiles.y };
+		border_step = { 1, 0 };
+		length = tiles.w;
+	}
+
+	auto is_open = [&](int pIndex)
+	{
+		const ivector tile = border_start + border_step * pIndex;
+		return !is_blocked(tile) && !is_blocked(tile + direction);
+	};
+
+	int run_start = -1;
+	for (int i = 0; i <= length; i++)
+	{
+		const bool open = i < length && is_open(i);
+		if (open && run_start < 0)
+			run_start = i;
+		else if (!open && run_start >= 0)
+		{
+			const int run_end = i - 1;
+			if (run_end - run_start + 1 < max_single_entrance_width)
+				pNodes.push_back(border_start + border_step * ((run_start + run_end) / 2));
+			else
+			{
+				pNodes.push_back(border_start + border_step * run_start);
+				pNodes.push_back(border_start + border_step * run_end);
+			}
+			run_start = -1;
+		}
+	}
+}
+
+void hierarchical_pathfinder::flood(ivector pFrom, const irect& pRegion)
+{
+	mDistance_map.assign(static_cast<size_t>(pRegion.w) * pRegion.h, -1);
+	mQueue.clear();
+
+	auto index = [&](ivector pTile)
+	{
+		return static_cast<size_t>(pTile.y - pRegion.y) * pRegion.w + (pTile.x - pRegion.x);
+	};
+
+	mDistance_map[index(pFrom)] = 0;
+	mQueue.push_back(pFrom);
+	for (size_t head = 0; head < mQueue.size(); head++)
+	{
+		const ivector tile = mQueue[head];
+		const int distance = mDistance_map[index(tile)];
+		for (auto& i : cluster_neighbor_offsets)
+		{
+			const ivector next = tile + i;
+			if (next.x < pRegion.x || next.y < pRegion.y
+				|| next.x >= pRegion.x + pRegion.w || next.y >= pRegion.y + pRegion.h
+				|| is_blocked(next)
+				|| mDistance_map[index(next)] >= 0)
+				continue;
+			mDistance_map[index(next)] = distance + 1;
+			mQueue.push_back(next);
+		}
+	}
+}
+
+int hierarchical_pathfinder::get_flood_distance(ivector pTile, const irect& pRegion) const
+{
+	return mDistance_map[static_cast<size_t>(pTile.y - pRegion.y) * pRegion.w + (pTile.x - pRegion.x)];
+}
+
+bool hierarchical_pathfinder::local_path(ivector pFrom, ivector pTo, std::vector<ivector>& pPath)
+{
+	const irect region = get_cluster_tiles(get_cluster_position(pFrom));
+	flood(pTo, region);
+	if (get_flood_distance(pFrom, region) < 0)
+		return false;
+
+	// Walk downhill towards the destination
+	ivector current = pFrom;
+	int distance = get_flood_distance(pFrom, region);
+	while (distance > 0)
+	{
+		for (auto& i : cluster_neighbor_offsets)
+		{
+			const ivector next = current + i;
+			if (next.x < region.x || next.y < region.y
+				|| next.x >= region.x + region.w || next.y >= region.y + region.h)
+				continue;
+			if (get_flood_distance(next, region) == distance - 1)
+			{
+				current = next;
+				break;
+			}
+		}
+		--distance;
+		pPath.push_back(current);
+	}
+	return true;
+}
+
+walkability_snapshot::walkability_snapshot(const walkability_grid& pGrid, const std::vector<frect>& pObstacles) :
+	mGrid(pGrid)
+{
+	// Only keep obstacles that matter for the exact checks
+	for (auto& i : pObstacles)
+	{
+		const int left = static_cast<int>(std::floor(i.x));
+		const int top = static_cast<int>(std::floor(i.y));
+		const int right = static_cast<int>(std::ceil(i.x + i.w));
+		const int bottom = static_cast<int>(std::ceil(i.y + i.h));
+
+		bool used = false;
+		for (int y = top; y < bottom; y++)
+			for (int x = left; x < right; x++)
+			{
+				if (mGrid.get_cell({ x, y }) != walkability_grid::cell::partial)
+					continue;
+				mPartial_tiles[hash_tile({ x, y })].push_back(static_cast<uint32_t>(mObstacles.size()));
+				used = true;
+			}
+		if (used)
+			mObstacles.push_back(i);
+	}
+}
+
+bool walkability_snapshot::is_blocked(const frect& pRegion) const
+{
+	switch (mGrid.test_region(pRegion))
+	{
+	case walkability_grid::cell::open:
+		return false;
+	case walkability_grid::cell::blocked:
+		return true;
+	default:
+		break;
+	}
+
+	const int left = static_cast<int>(std::floor(pRegion.x));
+	const int top = static_cast<int>(std::floor(pRegion.y));
+	const int right = static_cast<int>(std::ceil(pRegion.x + pRegion.w));
+	const int bottom = static_cast<int>(std::ceil(pRegion.y + pRegion.h));
+	for (int y = top; y < bottom; y++)
+		for (int x = left; x < right; x++)
+		{
+			auto find = mPartial_tiles.find(hash_tile({ x, y }));
+			if (find == mPartial_tiles.end())
+				continue;
+			for (auto i : find->second)
+				if (mObstacles[i].is_intersect(pRegion))
+					return true;
+		}
+	return false;
+}
+
+uint64_t walkability_snapshot::hash_tile(ivector pTile)
+{
+	return (static_cast<uint64_t>(static_cast<uint32_t>(pTile.x)) << 32)
+		| static_cast<uint64_t>(static_cast<uint32_t>(pTile.y));
+}
+
+path_request_queue::path_request_queue() :
+	mStop(false),
+	mIn_progress(0),
+	mPath_limit(1000),
+	mNext_id(1),
+	mDelivered_count(0),
+	mTotal_latency(0),
+	mMax_latency(0)
+{
+}
+
+path_request_queue::~path_request_queue()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mCondition.notify_all();
+	if (mWorker.joinable())
+		mWorker.join();
+}
+
+void path_request_queue::set_path_limit(size_t pLimit)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mPath_limit = pLimit;
+}
+
+int path_request_queue::submit(fvector pStart, fvector pDestination, std::shared_ptr<const walkability_snapshot> pSnapshot)
+{
+	// The worker is only started when it is first needed
+	if (!mWorker.joinable())
+		start_worker();
+
+	const int id = mNext_id++;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mPending.push_back({ id, pStart, pDestination, pSnapshot, engine::clock() });
+	}
+	mCondition.notify_one();
+	return id;
+}
+
+void path_request_queue::deliver()
+{
+	std::vector<finished> finished_paths;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		finished_paths.swap(mFinished);
+	}
+
+	for (auto& i : finished_paths)
+	{
+		const float latency = i.age.get_elapse().milliseconds();
+		mTotal_latency += latency;
+		mMax_latency = std::max(mMax_latency, latency);
+		++mDelivered_count;
+		mDelivered[i.id] = std::move(i.path);
+	}
+}
+
+bool path_request_queue::is_ready(int pId) const
+{
+	return mDelivered.find(pId) != mDelivered.end();
+}
+
+bool path_request_queue::take_result(int pId, result& pResult)
+{
+	auto find = mDelivered.find(pId);
+	if (find == mDelivered.end())
+		return false;
+	pResult = std::move(find->second);
+	mDelivered.erase(find);
+	return true;
+}
+
+void path_request_queue::cancel(int pId)
+{
+	mDelivered.erase(pId);
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (auto i = mPending.begin(); i != mPending.end(); i++)
+		if (i->id == pId)
+		{
+			mPending.erase(i);
+			break;
+		}
+	for (auto i = mFinished.begin(); i != mFinished.end(); i++)
+		if (i->id == pId)
+		{
+			mFinished.erase(i);
+			break;
+		}
+
+	// The worker drops the result when it sees this
+	if (mIn_progress == pId)
+		mIn_progress = 0;
+}
+
+void path_request_queue::cancel_all()
+{
+	mDelivered.clear();
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mPending.clear();
+	mFinished.clear();
+	mIn_progress = 0;
+}
+
+size_t path_request_queue::get_queue_depth() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mPending.size() + (mIn_progress != 0 ? 1 : 0);
+}
+
+float path_request_queue::get_average_latency() const
+{
+	if (mDelivered_count == 0)
+		return 0;
+	return mTotal_latency / mDelivered_count;
+}
+
+float path_request_queue::get_max_latency() const
+{
+	return mMax_latency;
+}
+
+size_t path_request_queue::get_delivered_count() const
+{
+	return mDelivered_count;
+}
+
+void path_request_queue::start_worker()
+{
+	mWorker = std::thread(&path_request_queue::worker_loop, this);
+}
+
+void path_request_queue::worker_loop()
+{
+	pathfinder finder;
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (;;)
+	{
+		mCondition.wait(lock, [&]() { return mStop || !mPending.empty(); });
+		if (mStop)
+			return;
+
+		request current = std::move(mPending.front());
+		mPending.pop_front();
+		mIn_progress = current.id;
+		finder.set_path_limit(mPath_limit);
+		lock.unlock();
+
+		auto snapshot = current.snapshot;
+		finder.set_collision_callback([snapshot](fvector& pPosition)
+		{
+			return snapshot->is_blocked({ pPosition, { 0.9f, 0.9f } });
+		});
+
+		finished done;
+		done.id = current.id;
+		done.path.found = finder.start(current.start, current.destination);
+		done.path.path = finder.construct_path();
+		done.age = current.age;
+
+		lock.lock();
+
+		// Skip if it was cancelled while we were working on it
+		if (mIn_progress == current.id)
+			mFinished.push_back(std::move(done));
+		mIn_progress = 0;
+	}
+}
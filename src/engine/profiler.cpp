@@ -0,0 +1,248 @@
+#include <engine/profiler.hpp>
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+namespace engine {
+namespace profiler {
+
+static std::atomic<bool> mEnabled(false);
+static std::mutex mMutex; // Zones are also recorded on loader threads
+
+// Ring buffer of finished frames
+static std::vector<frame_record> mFrames(300);
+static size_t mNext_frame = 0;
+static size_t mFrame_count = 0;
+
+static frame_record mCurrent = frame_record();
+
+static std::atomic<size_t> mThread_count(0);
+
+static const std::chrono::steady_clock::time_point mEpoch = std::chrono::steady_clock::now();
+
+static size_t get_thread_index()
+{
+	thread_local const size_t index = mThread_count++;
+	return index;
+}
+
+void set_enabled(bool pEnabled)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (pEnabled && !mEnabled)
+	{
+		mCurrent.zones.clear();
+		mCurrent.counters.clear();
+		mCurrent.start = now();
+	}
+	mEnabled = pEnabled;
+}
+
+bool is_enabled()
+{
+	return mEnabled;
+}
+
+void set_history_size(size_t pFrames)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mFrames.clear();
+	mFrames.resize(pFrames == 0 ? 1 : pFrames);
+	mNext_frame = 0;
+	mFrame_count = 0;
+}
+
+size_t get_history_size()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mFrames.size();
+}
+
+void end_frame()
+{
+	if (!mEnabled)
+		return;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	const int64_t time = now();
+	mCurrent.duration = time - mCurrent.start;
+	mCurrent.thread = get_thread_index();
+
+	// Swapping keeps the capacity of the old record so
+	// the vectors stop allocating after a few frames.
+	std::swap(mFrames[mNext_frame], mCurrent);
+	mNext_frame = (mNext_frame + 1) % mFrames.size();
+	if (mFrame_count < mFrames.size())
+		++mFrame_count;
+
+	mCurrent.zones.clear();
+	mCurrent.counters.clear();
+	mCurrent.start = time;
+}
+
+void clear()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mNext_frame = 0;
+	mFrame_count = 0;
+	mCurrent.zones.clear();
+	mCurrent.counters.clear();
+	mCurrent.start = now();
+}
+
+int64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - mEpoch).count();
+}
+
+void add_zone(const char* pName, int64_t pStart, int64_t pEnd)
+{
+	if (!mEnabled)
+		return;
+	zone_record record;
+	record.name = pName;
+	record.start = pStart;
+	record.duration = pEnd - pStart;
+	record.thread = get_thread_index();
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mCurrent.zones.push_back(record);
+}
+
+void add_counter(const char* pName, float pValue)
+{
+	if (!mEnabled)
+		return;
+	std::lock_guard<std::mutex> lock(mMutex);
+	mCurrent.counters.push_back({ pName, pValue });
+}
+
+std::vector<frame_record> get_frames()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::vector<frame_record> frames;
+	frames.reserve(mFrame_count);
+	const size_t first = (mNext_frame + mFrames.size() - mFrame_count) % mFrames.size();
+	for (size_t i = 0; i < mFrame_count; i++)
+		frames.push_back(mFrames[(first + i) % mFrames.size()]);
+	return frames;
+}
+
+std::vector<float> get_frame_times()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::vector<float> times;
+	times.reserve(mFrame_count);
+	const size_t first = (mNext_frame + mFrames.size() - mFrame_count) % mFrames.size();
+	for (size_t i = 0; i < mFrame_count; i++)
+		times.push_back(mFrames[(first + i) % mFrames.size()].duration / 1e6f);
+	return times;
+}
+
+std::string get_summary()
+{
+	const auto frames = get_frames();
+	if (frames.empty())
+		return "No frames recorded";
+
+	// Milliseconds by zone name. Names are compared by content
+	// since the same literal may have different addresses.
+	std::map<std::string, double> totals;
+	double frame_total = 0;
+	for (auto& i : frames)
+	{
+		frame_total += i.duration / 1e6;
+		for (auto& j : i.zones)
+			totals[j.name] += j.duration / 1e6;
+	}
+
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(3);
+	out << "frame: " << frame_total / frames.size() << "ms (" << frames.size() << " frames)\n";
+	for (auto& i : totals)
+		out << i.first << ": " << i.second / frames.size() << "ms\n";
+	return out.str();
+}
+
+static std::string escape_json(const char* pStr)
+{
+	std::string escaped;
+	for (const char* c = pStr; *c; c++)
+	{
+		if (*c == '"' || *c == '\\')
+			escaped += '\\';
+		escaped += *c;
+	}
+	return escaped;
+}
+
+std::string get_chrome_trace()
+{
+	const auto frames = get_frames();
+
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(3);
+	out << "{\"traceEvents\":[";
+
+	bool first = true;
+	auto begin_event = [&]()
+	{
+		if (!first)
+			out << ",";
+		first = false;
+		out << "\n";
+	};
+
+	// Microseconds
+	auto write_complete = [&](const char* pName, int64_t pStart, int64_t pDuration, size_t pThread)
+	{
+		begin_event();
+		out << "{\"name\":\"" << escape_json(pName) << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << pThread
+			<< ",\"ts\":" << pStart / 1e3 << ",\"dur\":" << pDuration / 1e3 << "}";
+	};
+
+	for (auto& i : frames)
+	{
+		write_complete("frame", i.start, i.duration, i.thread);
+		for (auto& j : i.zones)
+			write_complete(j.name, j.start, j.duration, j.thread);
+		for (auto& j : i.counters)
+		{
+			begin_event();
+			out << "{\"name\":\"" << escape_json(j.name) << "\",\"ph\":\"C\",\"pid\":0"
+				<< ",\"ts\":" << i.start / 1e3 << ",\"args\":{\"value\":" << j.value << "}}";
+		}
+	}
+	out << "\n]}\n";
+	return out.str();
+}
+
+bool save_chrome_trace(const std::string& pPath)
+{
+	std::ofstream file(pPath.c_str());
+	if (!file)
+		return false;
+	file << get_chrome_trace();
+	return static_cast<bool>(file);
+}
+
+zone::zone(const char* pName)
+{
+	mName = pName;
+	mStart = mEnabled ? now() : -1;
+}
+
+zone::~zone()
+{
+	if (mStart >= 0)
+		add_zone(mName, mStart, now());
+}
+
+}
+}
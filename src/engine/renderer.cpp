@@ -1,7 +1,12 @@
 #define ENGINE_INTERNAL
 
 #include <engine/renderer.hpp>
+#include <engine/animation_scheduler.hpp>
 #include <engine/logger.hpp>
+#include <engine/profiler.hpp>
+
+#include <algorithm>
+#include <functional>
 
 using namespace engine;
 
@@ -11,7 +16,7 @@ using namespace engine;
 
 int render_object::is_rendered()
 {
-	return mIndex >= 0;
+	return mRenderer && !mManual_render;
 }
 
 void render_object::set_renderer(renderer& pR, bool pManual_render)
@@ -55,10 +60,14 @@ bool render_object::is_visible()
 render_object::render_object()
 {
 	mManual_render = false;
-	mIndex = -1;
 	mVisible = true;
 	mDepth = 0;
 	mRenderer = nullptr;
+	mIndex = -1;
+	mSorted_depth = 0;
+	mSequence = 0;
+	mDepth_changed = false;
+	mChanged_index = 0;
 }
 
 render_object::~render_object()
@@ -68,9 +77,11 @@ render_object::~render_object()
 
 void render_object::set_depth(float pDepth)
 {
+	if (pDepth == mDepth)
+		return;
 	mDepth = pDepth;
-	if (mRenderer)
-		mRenderer->request_resort();
+	if (mRenderer && !mManual_render)
+		mRenderer->depth_changed(*this);
 }
 
 float render_object::get_depth()
@@ -78,6 +89,378 @@ float render_object::get_depth()
 	return mDepth;
 }
 
+// ##########
+// render_list
+// ##########
+
+static const size_t not_listed = static_cast<size_t>(-1);
+
+render_list::render_list()
+{
+	mRemoved = 0;
+	mCount = 0;
+	mNext_sequence = 0;
+}
+
+bool render_list::compare(const render_object* pA, const render_object* pB)
+{
+	if (pA->mSorted_depth != pB->mSorted_depth)
+		return pA->mSorted_depth > pB->mSorted_depth;
+	return pA->mSequence < pB->mSequence;
+}
+
+void render_list::add(render_object& pObject)
+{
+	pObject.mIndex = not_listed;
+	pObject.mSequence = mNext_sequence++;
+	pObject.mDepth_changed = true;
+	pObject.mChanged_index = mChanged.size();
+	mChanged.push_back(&pObject);
+	++mCount;
+}
+
+void render_list::remove(render_object& pObject)
+{
+	const bool listed = pObject.mIndex < mObjects.size() && mObjects[pObject.mIndex] == &pObject;
+	if (pObject.mDepth_changed)
+	{
+		// Added since the last update
+		if (!listed)
+			--mCount;
+		mChanged[pObject.mChanged_index] = nullptr;
+		pObject.mDepth_changed = false;
+	}
+
+	// Left empty until the next update
+	if (listed)
+	{
+		mObjects[pObject.mIndex] = nullptr;
+		++mRemoved;
+		--mCount;
+	}
+	pObject.mIndex = not_listed;
+}
+
+void render_list::depth_changed(render_object& pObject)
+{
+	if (pObject.mDepth_changed)
+		return;
+	pObject.mDepth_changed = true;
+	pObject.mChanged_index = mChanged.size();
+	mChanged.push_back(&pObject);
+}
+
+void render_list::update()
+{
+	if (mChanged.empty() && mRemoved == 0)
+		return;
+
+	mChanged.erase(std::remove(mChanged.begin(), mChanged.end(), nullptr), mChanged.end());
+
+	// Many changes at once are cheaper to merge in a single pass
+	if (mChanged.size() * 16 > mObjects.size())
+	{
+		merge_changed();
+		return;
+	}
+
+	if (mRemoved > 0)
+		remove_empty();
+
+	// The objects that haven't moved yet keep their old depth
+	// so the rest of the list stays in order.
+	size_t shifted = 0;
+	for (size_t i = 0; i < mChanged.size(); i++)
+	{
+		// Far moves end up costing more than a single merge
+		if (shifted > mObjects.size())
+		{
+			mChanged.erase(mChanged.begin(), mChanged.begin() + i);
+			merge_changed();
+			return;
+		}
+		render_object* object = mChanged[i];
+		object->mSorted_depth = object->mDepth;
+		object->mDepth_changed = false;
+		shifted += move(*object);
+	}
+	mChanged.clear();
+}
+
+void render_list::resort()
+{
+	for (auto i : mObjects)
+		if (i && !i->mDepth_changed)
+			depth_changed(*i);
+	update();
+}
+
+void render_list::clear()
+{
+	for (auto i : mObjects)
+		if (i)
+			i->mIndex = not_listed;
+	for (auto i : mChanged)
+		if (i)
+			i->mDepth_changed = false;
+	mObjects.clear();
+	mChanged.clear();
+	mRemoved = 0;
+	mCount = 0;
+}
+
+size_t render_list::move(render_object& pObject)
+{
+	const size_t from = pObject.mIndex;
+	if (from == not_listed)
+	{
+		const size_t to = std::upper_bound(mObjects.begin(), mObjects.end(), &pObject, compare) - mObjects.begin();
+		mObjects.insert(mObjects.begin() + to, &pObject);
+		reindex(to, mObjects.size());
+		return mObjects.size() - to;
+	}
+
+	// Only the objects between the old and new place shift by one
+	const auto current = mObjects.begin() + from;
+	if (from > 0 && compare(&pObject, mObjects[from - 1]))
+	{
+		const auto to = std::upper_bound(mObjects.begin(), current, &pObject, compare);
+		const size_t first = to - mObjects.begin();
+		std::rotate(to, current, current + 1);
+		reindex(first, from + 1);
+		return from + 1 - first;
+	}
+	if (from + 1 < mObjects.size() && compare(mObjects[from + 1], &pObject))
+	{
+		const auto to = std::lower_bound(current + 1, mObjects.end(), &pObject, compare);
+		const size_t last = to - mObjects.begin();
+		std::rotate(current, current + 1, to);
+		reindex(from, last);
+		return last - from;
+	}
+	return 0;
+}
+
+void render_list::merge_changed()
+{
+	// Take out what is moving and what was removed.
+	// Everything left is still in order.
+	mObjects.erase(std::remove_if(mObjects.begin(), mObjects.end(), [](render_object* pObject)
+	{
+		return !pObject || pObject->mDepth_changed;
+	}), mObjects.end());
+	mRemoved = 0;
+
+	for (auto i : mChanged)
+	{
+		i->mSorted_depth = i->mDepth;
+		i->mDepth_changed = false;
+	}
+	std::sort(mChanged.begin(), mChanged.end(), compare);
+
+	mMerged.resize(mObjects.size() + mChanged.size());
+	std::merge(mObjects.begin(), mObjects.end(), mChanged.begin(), mChanged.end(), mMerged.begin(), compare);
+	mObjects.swap(mMerged);
+	mChanged.clear();
+	reindex(0, mObjects.size());
+}
+
+void render_list::remove_empty()
+{
+	// Only the objects after the first hole move
+	const auto first = std::find(mObjects.begin(), mObjects.end(), nullptr);
+	const size_t begin = first - mObjects.begin();
+	mObjects.erase(std::remove(first, mObjects.end(), nullptr), mObjects.end());
+	mRemoved = 0;
+	reindex(begin, mObjects.size());
+}
+
+void render_list::reindex(size_t pBegin, size_t pEnd)
+{
+	for (size_t i = pBegin; i < pEnd; i++)
+		mObjects[i]->mIndex = i;
+}
+
+size_t render_list::size() const
+{
+	return mCount;
+}
+
+render_list::const_iterator render_list::begin() const
+{
+	return mObjects.begin();
+}
+
+render_list::const_iterator render_list::end() const
+{
+	return mObjects.end();
+}
+
+// ##########
+// render_backend
+// ##########
+
+render_backend::render_backend()
+{
+	mStats = render_stats();
+	mLast_texture = nullptr;
+	mLast_shader = nullptr;
+	mView_changed = false;
+}
+
+render_stats& render_backend::get_stats()
+{
+	return mStats;
+}
+
+void render_backend::reset_stats()
+{
+	mStats = render_stats();
+}
+
+void render_backend::set_view(const sf::View& pView)
+{
+	submit_view(pView);
+	mView_changed = true;
+}
+
+void render_backend::draw(const sf::Vertex* pVertices, size_t pCount, sf::PrimitiveType pType, const sf::RenderStates& pStates)
+{
+	count_states(pStates);
+	mStats.vertices += pCount;
+	submit(pVertices, pCount, pType, pStates);
+}
+
+void render_backend::draw(const sf::Drawable& pDrawable, const sf::RenderStates& pStates)
+{
+	count_states(pStates);
+	submit(pDrawable, pStates);
+}
+
+void render_backend::count_states(const sf::RenderStates& pStates)
+{
+	++mStats.draw_calls;
+	if (mView_changed
+		|| pStates.texture != mLast_texture
+		|| pStates.shader != mLast_shader)
+		++mStats.state_changes;
+	mLast_texture = pStates.texture;
+	mLast_shader = pStates.shader;
+	mView_changed = false;
+}
+
+window_backend::window_backend(sf::RenderTarget& pTarget) :
+	mTarget(pTarget)
+{
+}
+
+fvector window_backend::get_size() const
+{
+	return fvector::cast(vector<unsigned int>(mTarget.getSize()));
+}
+
+void window_backend::submit_view(const sf::View& pView)
+{
+	mTarget.setView(pView);
+}
+
+void window_backend::submit(const sf::Vertex* pVertices, size_t pCount, sf::PrimitiveType pType, const sf::RenderStates& pStates)
+{
+	mTarget.draw(pVertices, pCount, pType, pStates);
+}
+
+void window_backend::submit(const sf::Drawable& pDrawable, const sf::RenderStates& pStates)
+{
+	mTarget.draw(pDrawable, pStates);
+}
+
+null_backend::null_backend(fvector pSize)
+{
+	mSize = pSize;
+}
+
+fvector null_backend::get_size() const
+{
+	return mSize;
+}
+
+// ##########
+// render_queue
+// ##########
+
+render_queue::render_queue()
+{
+	mDepth = 0;
+}
+
+void render_queue::set_depth(float pDepth)
+{
+	mDepth = pDepth;
+}
+
+void render_queue::add_quad(const sf::Texture* pTexture, const sf::Shader* pShader, const sf::Vertex* pVertices)
+{
+	item new_item;
+	new_item.depth = mDepth;
+	new_item.texture = pTexture;
+	new_item.shader = pShader;
+	new_item.vertex = mVertices.size();
+	mItems.push_back(new_item);
+	mVertices.insert(mVertices.end(), pVertices, pVertices + 4);
+}
+
+void render_queue::flush(render_backend& pBackend)
+{
+	if (mItems.empty())
+		return;
+
+	// Higher depths are drawn first like the objects in the renderer.
+	// Quads of the same depth keep their order within a texture.
+	std::stable_sort(mItems.begin(), mItems.end(), [](const item& pA, const item& pB)
+	{
+		if (pA.depth != pB.depth)
+			return pA.depth > pB.depth;
+		if (pA.texture != pB.texture)
+			return std::less<const sf::Texture*>()(pA.texture, pB.texture);
+		return std::less<const sf::Shader*>()(pA.shader, pB.shader);
+	});
+
+	size_t first = 0;
+	while (first < mItems.size())
+	{
+		// Gather every following quad that uses the same states
+		size_t last = first;
+		mSorted.clear();
+		while (last < mItems.size()
+			&& mItems[last].texture == mItems[first].texture
+			&& mItems[last].shader == mItems[first].shader)
+		{
+			auto vertex = mVertices.begin() + mItems[last].vertex;
+			mSorted.insert(mSorted.end(), vertex, vertex + 4);
+			++last;
+		}
+
+		sf::RenderStates rs;
+		rs.texture = mItems[first].texture;
+		rs.shader = mItems[first].shader;
+		pBackend.draw(&mSorted[0], mSorted.size(), sf::Quads, rs);
+		++pBackend.get_stats().batches;
+		first = last;
+	}
+	clear();
+}
+
+bool render_queue::is_empty() const
+{
+	return mItems.empty();
+}
+
+void render_queue::clear()
+{
+	mItems.clear();
+	mVertices.clear();
+}
+
 // ##########
 // renderer
 // ##########
@@ -87,16 +470,21 @@ renderer::renderer()
 	mTransparent_gui_input = false;
 	mWindow = nullptr;
 	mRequest_resort = false;
+	mLast_stats = render_stats();
 	mTarget_size = ivector(800, 600); // Some arbitrary default
 
 	mSubwindow_enabled = false;
 	mSubwindow = frect(0, 0, 1, 1);
+
+	mAnimations = std::make_shared<animation_scheduler>();
 }
 
 renderer::~renderer()
 {
+	mObjects.update();
 	for (auto i : mObjects)
-		i->mIndex = -1;
+		i->mRenderer = nullptr;
+	mObjects.clear();
 }
 
 void renderer::set_target_size(fvector pSize)
@@ -117,40 +505,72 @@ void renderer::request_resort()
 
 int renderer::draw_objects()
 {
-	assert(mWindow);
+	assert(mBackend);
+
+	// Objects do not change the view so it is only set once
+	mBackend->set_view(mView);
 	for (auto i : mObjects)
 	{
-		if (i->is_visible())
+		if (i && i->is_visible())
 		{
-			mWindow->mWindow.setView(mView);
+			mQueue.set_depth(i->mSorted_depth);
 			i->draw(*this);
 		}
 	}
+	flush_queue();
 	return 0;
 }
 
 int renderer::draw()
 {
-	assert(mWindow);
-	mFrame_clock.tick();
-	if (mRequest_resort)
+	assert(mBackend);
 	{
-		sort_objects();
-		refresh_objects();
-		mRequest_resort = false;
+		PROFILE_ZONE("renderer::draw");
+		mFrame_clock.tick();
+		mAnimations->update(mFrame_clock.get_delta());
+		if (mRequest_resort)
+		{
+			mObjects.resort();
+			mRequest_resort = false;
+		}
+		else
+			mObjects.update();
+		//mWindow->mWindow.clear(mBackground_color);
+		draw_objects();
+		if (mWindow)
+			mTgui.draw();
 	}
-	//mWindow->mWindow.clear(mBackground_color);
-	draw_objects();
-	mTgui.draw();
+
+	mLast_stats = mBackend->get_stats();
+	mBackend->reset_stats();
+
+	// A frame ends once it is drawn
+	PROFILE_COUNTER("draw calls", mLast_stats.draw_calls);
+	PROFILE_COUNTER("vertices", mLast_stats.vertices);
+	PROFILE_END_FRAME();
 	return 0;
 }
 
 int renderer::draw(render_object& pObject)
 {
-	assert(mWindow);
+	assert(mBackend);
+
+	mBackend->set_view(mView);
+	mQueue.set_depth(pObject.mDepth);
+	const int result = pObject.draw(*this);
+	flush_queue();
+	return result;
+}
+
+const render_stats& renderer::get_render_stats() const
+{
+	return mLast_stats;
+}
 
-	mWindow->mWindow.setView(mView);
-	return pObject.draw(*this);
+void renderer::flush_queue()
+{
+	if (!mQueue.is_empty())
+		mQueue.flush(*mBackend);
 }
 
 tgui::Gui & renderer::get_tgui()
@@ -183,11 +603,11 @@ bool renderer::is_mouse_within_target() const
 
 void renderer::refresh_view()
 {
+	mView = sf::View(sf::FloatRect(0, 0, mTarget_size.x, mTarget_size.y));
 	if (!mWindow)
-		return;
-	const fvector window_size(mSubwindow_enabled ? mSubwindow.get_size() : fvector::cast(vector<unsigned int>(mWindow->mWindow.getSize())));
+		return; // Other backends are covered entirely
 
-	mView = sf::View(sf::FloatRect(0, 0, mTarget_size.x, mTarget_size.y));
+	const fvector window_size(mSubwindow_enabled ? mSubwindow.get_size() : fvector::cast(vector<unsigned int>(mWindow->mWindow.getSize())));
 	sf::FloatRect viewport(0, 0, 0, 0);
 
 	viewport.width = std::min(mTarget_size.x*(window_size.y / mTarget_size.y) / window_size.x, 1.f);
@@ -212,29 +632,15 @@ void renderer::refresh_view()
 
 void renderer::refresh_gui_view()
 {
-	assert(mWindow);
+	if (!mWindow)
+		return;
 	mTgui.setView(sf::View(sf::FloatRect(0, 0, static_cast<float>(mWindow->mWindow.getSize().x), static_cast<float>(mWindow->mWindow.getSize().y))));
 }
 
 
-void renderer::refresh_objects()
+void renderer::depth_changed(render_object& pObject)
 {
-	for (size_t i = 0; i < mObjects.size(); i++)
-		mObjects[i]->mIndex = i;
-}
-
-// Sort items that have a higher depth to be farther behind
-void renderer::sort_objects()
-{
-	struct
-	{
-		bool operator()(render_object* c1, render_object* c2)
-		{
-			return c1->mDepth > c2->mDepth;
-		}
-	}client_sort;
-	std::sort(mObjects.begin(), mObjects.end(), client_sort);
-	refresh_objects();
+	mObjects.depth_changed(pObject);
 }
 
 bool renderer::add_object(render_object& pObject)
@@ -247,10 +653,9 @@ bool renderer::add_object(render_object& pObject)
 	pObject.detach_renderer();
 
 	pObject.mRenderer = this;
-	pObject.mIndex = mObjects.size();
-	mObjects.push_back(&pObject);
+	pObject.mManual_render = false;
+	mObjects.add(pObject);
 	pObject.refresh_renderer(*this);
-	sort_objects();
 	return true;
 }
 
@@ -260,14 +665,15 @@ bool renderer::remove_object(render_object& pObject)
 	if (pObject.mRenderer != this)
 		return false;
 
-	mObjects.erase(mObjects.begin() + pObject.mIndex);
-	refresh_objects();
+	mObjects.remove(pObject);
 	pObject.mRenderer = nullptr;
 	return true;
 }
 
 fvector renderer::get_mouse_position() const
 {
+	if (!mWindow)
+		return{};
 	return mWindow->mWindow.mapPixelToCoords(mMouse_position, mView);
 }
 
@@ -287,12 +693,13 @@ fvector renderer::get_mouse_position(const node & pNode) const
 
 bool renderer::is_focused()
 {
-	return mWindow->mWindow.hasFocus();
+	return mWindow && mWindow->mWindow.hasFocus();
 }
 
 void renderer::set_visible(bool pVisible)
 {
-	mWindow->mWindow.setVisible(pVisible);
+	if (mWindow)
+		mWindow->mWindow.setVisible(pVisible);
 }
 
 void renderer::set_background_color(color pColor)
@@ -310,10 +717,23 @@ float renderer::get_delta() const
 	return mFrame_clock.get_delta();
 }
 
+std::shared_ptr<animation_scheduler> renderer::get_animation_scheduler() const
+{
+	return mAnimations;
+}
+
 void renderer::set_window(display_window & pWindow)
 {
 	mWindow = &pWindow;
 	mTgui.setWindow(pWindow.mWindow);
+	set_backend(std::unique_ptr<render_backend>(new window_backend(pWindow.mWindow)));
+}
+
+void renderer::set_backend(std::unique_ptr<render_backend> pBackend)
+{
+	mQueue.clear();
+	mBackend = std::move(pBackend);
+	refresh_view();
 }
 
 display_window * engine::renderer::get_window() const
@@ -352,14 +772,14 @@ void renderer::refresh_pressed()
 
 bool renderer::is_key_pressed(key_code pKey_type, bool pIgnore_gui)
 {
-	if (!mWindow->mWindow.hasFocus() || (mIs_keyboard_busy && !pIgnore_gui))
+	if (!is_focused() || (mIs_keyboard_busy && !pIgnore_gui))
 		return false;
 	return mPressed_keys[pKey_type] == input_state::pressed;
 }
 
 bool renderer::is_key_down(key_code pKey_type, bool pIgnore_gui)
 {
-	if (!mWindow->mWindow.hasFocus() || (mIs_keyboard_busy && !pIgnore_gui))
+	if (!is_focused() || (mIs_keyboard_busy && !pIgnore_gui))
 		return false;
 	return mPressed_keys[pKey_type] == input_state::pressed
 		|| mPressed_keys[pKey_type] == input_state::hold;
@@ -367,14 +787,14 @@ bool renderer::is_key_down(key_code pKey_type, bool pIgnore_gui)
 
 bool renderer::is_mouse_pressed(mouse_button pButton_type, bool pIgnore_gui)
 {
-	if (!mWindow->mWindow.hasFocus() || (mIs_mouse_busy && !pIgnore_gui) || !is_mouse_within_target())
+	if (!is_focused() || (mIs_mouse_busy && !pIgnore_gui) || !is_mouse_within_target())
 		return false;
 	return mPressed_buttons[pButton_type] == input_state::pressed;
 }
 
 bool renderer::is_mouse_down(mouse_button pButton_type, bool pIgnore_gui)
 {
-	if (!mWindow->mWindow.hasFocus() || (mIs_mouse_busy && !pIgnore_gui) || !is_mouse_within_target())
+	if (!is_focused() || (mIs_mouse_busy && !pIgnore_gui) || !is_mouse_within_target())
 		return false;
 	return mPressed_buttons[pButton_type] == input_state::pressed
 		|| mPressed_buttons[pButton_type] == input_state::hold;
@@ -389,7 +809,7 @@ void renderer::update_events()
 {
 	refresh_pressed();
 
-	if (!mWindow->mWindow.isOpen())
+	if (!mWindow || !mWindow->mWindow.isOpen())
 		return;
 
 	mEntered_text.clear();
@@ -563,9 +983,9 @@ int rectangle_node::draw(renderer & pR)
 	shape.setScale(get_absolute_scale());
 
 	if (mShader)
-		pR.get_sfml_render().draw(shape, mShader->get_sfml_shader());
+		pR.get_backend().draw(shape, mShader->get_sfml_shader());
 	else
-		pR.get_sfml_render().draw(shape);
+		pR.get_backend().draw(shape);
 	return 0;
 }
 
@@ -684,7 +1104,7 @@ int grid::draw(renderer & pR)
 	rs.transform.translate((get_exact_position() % major_size_scaled) - major_size_scaled);
 	rs.transform.rotate(get_absolute_rotation());
 	rs.transform.scale(get_absolute_scale());
-	pR.get_sfml_render().draw(&mVertices[0], mVertices.size(), sf::Lines, rs);
+	pR.get_backend().draw(&mVertices[0], mVertices.size(), sf::Lines, rs);
 	return 0;
 }
 
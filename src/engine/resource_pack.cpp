@@ -5,6 +5,20 @@
 #include <engine/logger.hpp>
 #include <engine/binary_util.hpp>
 
+#include <algorithm>
+#include <cstring>
+
+#if defined(__WIN32__) || defined(WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 using namespace engine;
 
 class packing_ignore
@@ -465,11 +479,13 @@ void encoded_path::simplify()
 pack_header::pack_header()
 {
 	mHeader_size = 0;
+	clear_index();
 }
 
 void pack_header::add_file(file_info pFile)
 {
 	mFiles.push_back(pFile);
+	index_file(mFiles.size() - 1);
 }
 
 bool pack_header::generate(std::ostream & pStream) const
@@ -494,6 +510,7 @@ bool pack_header::generate(std::ostream & pStream) const
 bool pack_header::parse(std::istream & pStream)
 {
 	mFiles.clear();
+	clear_index();
 
 	// File count
 	uint64_t file_count = binary_util::read_unsignedint_binary<uint64_t>(pStream);
@@ -516,7 +533,7 @@ bool pack_header::parse(std::istream & pStream)
 		file.position = binary_util::read_unsignedint_binary<uint64_t>(pStream);
 		file.size = binary_util::read_unsignedint_binary<uint64_t>(pStream);
 
-		mFiles.push_back(file);
+		add_file(file);
 	}
 
 	mHeader_size = pStream.tellg();
@@ -525,22 +542,43 @@ bool pack_header::parse(std::istream & pStream)
 
 util::optional<pack_header::file_info> pack_header::get_file(const encoded_path & pPath) const
 {
-	for (auto& i : mFiles)
-	{
-		if (i.path == pPath)
-			return i;
-	}
-	return{};
+	auto item = mFile_lookup.find(pPath.string());
+	if (item == mFile_lookup.end())
+		return{};
+	return mFiles[item->second];
 }
 
 std::vector<encoded_path> pack_header::recursive_directory(const encoded_path & pPath) const
 {
-	std::vector<encoded_path> retval;
-	for (auto& i : mFiles)
+	// Find the directory
+	size_t dir = 0;
+	for (size_t i = 0; i < pPath.get_sub_length(); i++)
+	{
+		auto subdir = mDirectories[dir].subdirectories.find(pPath.get_section(i));
+		if (subdir == mDirectories[dir].subdirectories.end())
+			return{};
+		dir = subdir->second;
+	}
+
+	// Gather everything under it
+	std::vector<size_t> files;
+	std::vector<size_t> stack = { dir };
+	while (!stack.empty())
 	{
-		if (i.path.in_directory(pPath))
-			retval.push_back(i.path);
+		const directory& current = mDirectories[stack.back()];
+		stack.pop_back();
+		files.insert(files.end(), current.files.begin(), current.files.end());
+		for (auto& i : current.subdirectories)
+			stack.push_back(i.second);
 	}
+
+	// Keep the order they are in the pack
+	std::sort(files.begin(), files.end());
+
+	std::vector<encoded_path> retval;
+	retval.reserve(files.size());
+	for (auto i : files)
+		retval.push_back(mFiles[i].path);
 	return retval;
 }
 
@@ -549,19 +587,64 @@ uint64_t pack_header::get_header_size() const
 	return mHeader_size;
 }
 
+size_t pack_header::get_file_count() const
+{
+	return mFiles.size();
+}
+
+void pack_header::index_file(size_t pIndex)
+{
+	const encoded_path& path = mFiles[pIndex].path;
+
+	// The first file with a path is the one that is found
+	if (!mFile_lookup.emplace(path.string(), pIndex).second)
+		return;
+
+	// Walk down to the file's directory, creating any that are missing
+	size_t dir = 0;
+	for (size_t i = 0; i + 1 < path.get_sub_length(); i++)
+	{
+		const std::string section = path.get_section(i);
+		auto subdir = mDirectories[dir].subdirectories.find(section);
+		if (subdir == mDirectories[dir].subdirectories.end())
+		{
+			const size_t ndir = mDirectories.size();
+			mDirectories[dir].subdirectories[section] = ndir;
+			mDirectories.emplace_back();
+			dir = ndir;
+		}
+		else
+			dir = subdir->second;
+	}
+	mDirectories[dir].files.push_back(pIndex);
+}
+
+void pack_header::clear_index()
+{
+	mFile_lookup.clear();
+	mDirectories.clear();
+	mDirectories.emplace_back(); // Root
+}
+
 pack_stream::pack_stream()
 {
 	mPack = nullptr;
+	mMapped = nullptr;
+	mCursor = 0;
 }
 
 pack_stream::pack_stream(const resource_pack& pPack)
 {
 	mPack = &pPack;
+	mMapped = nullptr;
+	mCursor = 0;
 }
 
 pack_stream::pack_stream(const resource_pack & pPack, const encoded_path & pPath)
 {
 	mPack = &pPack;
+	mMapped = nullptr;
+	mCursor = 0;
 	open(pPath);
 }
 
@@ -569,6 +652,8 @@ pack_stream::pack_stream(const pack_stream & pCopy)
 {
 	mPack = pCopy.mPack;
 	mFile_info = pCopy.mFile_info;
+	mMapped = pCopy.mMapped;
+	mCursor = pCopy.mCursor;
 }
 
 pack_stream::~pack_stream()
@@ -584,6 +669,19 @@ void pack_stream::set_pack(const resource_pack & pPack)
 bool pack_stream::open(const encoded_path & pPath)
 {
 	close();
+
+	// Just a cursor over the mapping
+	if (mPack->is_mapped())
+	{
+		pack_view view = mPack->view(pPath);
+		auto fi = mPack->mHeader.get_file(pPath);
+		if (!fi || view.data() == nullptr)
+			return false;
+		mFile_info = *fi;
+		mMapped = view.data();
+		return true;
+	}
+
 	mStream.open(mPack->mPath.string().c_str(), std::fstream::binary);
 	if (!mStream)
 		return false;
@@ -601,6 +699,8 @@ bool pack_stream::open(const encoded_path & pPath)
 void pack_stream::close()
 {
 	mStream.close();
+	mMapped = nullptr;
+	mCursor = 0;
 }
 
 std::vector<char> pack_stream::read(uint64_t pCount)
@@ -611,6 +711,14 @@ std::vector<char> pack_stream::read(uint64_t pCount)
 	if (pCount == 0)
 		return{};
 
+	if (mMapped)
+	{
+		const uint64_t count = std::min(pCount, mFile_info.size - mCursor);
+		std::vector<char> retval(mMapped + mCursor, mMapped + mCursor + count);
+		mCursor += count;
+		return retval;
+	}
+
 	std::vector<char> retval;
 	retval.resize(static_cast<size_t>(pCount));
 	mStream.read(&retval[0], static_cast<size_t>(pCount));
@@ -622,6 +730,14 @@ int64_t pack_stream::read(char * pData, uint64_t pCount)
 	if (!is_valid() && pCount == 0)
 		return -1;
 
+	if (mMapped)
+	{
+		const uint64_t count = std::min(pCount, mFile_info.size - mCursor);
+		std::memcpy(pData, mMapped + mCursor, static_cast<size_t>(count));
+		mCursor += count;
+		return static_cast<int64_t>(count);
+	}
+
 	// Check bounds
 	uint64_t remaining = mFile_info.size - tell();
 	if (remaining < pCount)
@@ -645,6 +761,12 @@ std::vector<char> pack_stream::read_all()
 {
 	const uint64_t chuck_size = 1024;
 
+	if (mMapped)
+	{
+		mCursor = mFile_info.size;
+		return std::vector<char>(mMapped, mMapped + mFile_info.size);
+	}
+
 	seek(0);
 
 	std::vector<char> retval;
@@ -671,6 +793,14 @@ std::vector<char> pack_stream::read_all()
 
 bool pack_stream::seek(uint64_t pPosition)
 {
+	if (mMapped)
+	{
+		if (pPosition >= mFile_info.size)
+			return false;
+		mCursor = pPosition;
+		return true;
+	}
+
 	if (mStream.eof())
 		mStream.clear();
 	else if (!is_valid())
@@ -687,11 +817,16 @@ uint64_t pack_stream::tell()
 	if (!is_valid())
 		return 0;
 
+	if (mMapped)
+		return mCursor;
+
 	return (uint64_t)mStream.tellg() - mFile_info.position - mPack->mHeader.get_header_size();
 }
 
 bool pack_stream::is_valid()
 {
+	if (mMapped)
+		return mCursor <= mFile_info.size;
 	return mStream.good() 
 		&& (uint64_t)mStream.tellg() - mFile_info.position - mPack->mHeader.get_header_size()
 			< mFile_info.position + mFile_info.size;
@@ -707,23 +842,65 @@ pack_stream & pack_stream::operator=(const pack_stream & pRight)
 	close();
 	mPack = pRight.mPack;
 	mFile_info = pRight.mFile_info;
+	mMapped = pRight.mMapped;
+	mCursor = pRight.mCursor;
 	return *this;
 }
 
 
-bool resource_pack::open(const encoded_path& pPath)
+bool resource_pack::open(const encoded_path& pPath, bool pMemory_map)
 {
+	mMap.close();
+
 	std::ifstream stream(pPath.string().c_str(), std::fstream::binary);
 	if (!stream)
 		return false;
 	mPath = pPath;
-	return mHeader.parse(stream);
+	if (!mHeader.parse(stream))
+		return false;
+
+	if (pMemory_map && !mMap.open(pPath.string()))
+		logger::warning("Could not map pack '" + pPath.string() + "' into memory. Using streams instead.");
+	return true;
+}
+
+bool resource_pack::is_mapped() const
+{
+	return mMap.is_open();
+}
+
+pack_view resource_pack::view(const encoded_path & pPath) const
+{
+	pack_view retval;
+	if (!mMap.is_open())
+	{
+		retval.mCopy = read_all(pPath);
+		retval.mSize = retval.mCopy.size();
+		return retval;
+	}
+
+	auto fi = mHeader.get_file(pPath);
+	if (!fi)
+		return retval;
+
+	// Make sure the file is actually in the mapping
+	const uint64_t offset = mHeader.get_header_size() + fi->position;
+	if (offset + fi->size > mMap.size())
+	{
+		logger::error("File '" + pPath.string() + "' is outside of the pack");
+		return retval;
+	}
+
+	retval.mData = mMap.data() + offset;
+	retval.mSize = static_cast<size_t>(fi->size);
+	return retval;
 }
 
 std::vector<char> resource_pack::read_all(const encoded_path & pPath) const
 {
 	pack_stream stream(*this);
-	stream.open(pPath);
+	if (!stream.open(pPath))
+		return{};
 	return stream.read_all();
 }
 
@@ -731,3 +908,143 @@ std::vector<encoded_path> resource_pack::recursive_directory(const encoded_path
 {
 	return mHeader.recursive_directory(pPath);
 }
+
+
+pack_view::pack_view()
+{
+	mData = nullptr;
+	mSize = 0;
+}
+
+const char* pack_view::data() const
+{
+	return mCopy.empty() ? mData : mCopy.data();
+}
+
+size_t pack_view::size() const
+{
+	return mSize;
+}
+
+bool pack_view::empty() const
+{
+	return mSize == 0;
+}
+
+memory_map::memory_map()
+{
+	mData = nullptr;
+	mSize = 0;
+#if defined(__WIN32__) || defined(WIN32)
+	mFile = nullptr;
+	mMapping = nullptr;
+#endif
+}
+
+memory_map::~memory_map()
+{
+	close();
+}
+
+#if defined(__WIN32__) || defined(WIN32)
+
+bool memory_map::open(const std::string& pPath)
+{
+	close();
+
+	HANDLE file = CreateFileA(pPath.c_str(), GENERIC_READ, FILE_SHARE_READ
+		, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	mFile = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+
+	mMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mMapping)
+	{
+		close();
+		return false;
+	}
+
+	mData = static_cast<const char*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+	if (!mData)
+	{
+		close();
+		return false;
+	}
+	mSize = static_cast<uint64_t>(size.QuadPart);
+	return true;
+}
+
+void memory_map::close()
+{
+	if (mData)
+		UnmapViewOfFile(mData);
+	if (mMapping)
+		CloseHandle(mMapping);
+	if (mFile)
+		CloseHandle(mFile);
+	mData = nullptr;
+	mMapping = nullptr;
+	mFile = nullptr;
+	mSize = 0;
+}
+
+#else
+
+bool memory_map::open(const std::string& pPath)
+{
+	close();
+
+	const int file = ::open(pPath.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size == 0)
+	{
+		::close(file);
+		return false;
+	}
+
+	// The mapping stays valid after the file is closed
+	void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+	::close(file);
+	if (data == MAP_FAILED)
+		return false;
+
+	mData = static_cast<const char*>(data);
+	mSize = static_cast<uint64_t>(info.st_size);
+	return true;
+}
+
+void memory_map::close()
+{
+	if (mData)
+		munmap(const_cast<char*>(mData), static_cast<size_t>(mSize));
+	mData = nullptr;
+	mSize = 0;
+}
+
+#endif
+
+bool memory_map::is_open() const
+{
+	return mData != nullptr;
+}
+
+const char* memory_map::data() const
+{
+	return mData;
+}
+
+uint64_t memory_map::size() const
+{
+	return mSize;
+}
\ No newline at end of file
@@ -6,20 +6,25 @@ using namespace engine;
 
 int sprite_node::draw(renderer &pR)
 {
-	if (!mTexture)
+	// Nothing is drawn until the texture has streamed in
+	if (!mTexture || mTexture->is_loading())
 		return 1;
 
-	sf::RenderStates rs;
-	rs.transform.translate(get_exact_position() - mCenter);
-	rs.transform.rotate(get_absolute_rotation(), mCenter);
-	rs.transform.scale(get_absolute_scale(), mCenter);
-
-	rs.texture = &mTexture->sfml_get_texture();
-
-	if (mShader)
-		rs.shader = mShader->get_sfml_shader();
-
-	pR.get_sfml_render().draw(&mVertices[0], 4, sf::Quads, rs);
+	sf::Transform transform;
+	transform.translate(get_exact_position() - mCenter);
+	transform.rotate(get_absolute_rotation(), mCenter);
+	transform.scale(get_absolute_scale(), mCenter);
+
+	// Transformed here so the quad can be batched with others
+	sf::Vertex vertices[4];
+	for (size_t i = 0; i < 4; i++)
+	{
+		vertices[i] = mVertices[i];
+		vertices[i].position = transform.transformPoint(mVertices[i].position);
+	}
+
+	const sf::Shader* sfml_shader = mShader ? mShader->get_sfml_shader() : nullptr;
+	pR.queue_quad(mTexture->sfml_get_texture(), sfml_shader, vertices);
 	return 0;
 }
 void sprite_node::set_texture(std::shared_ptr<texture> pTexture)
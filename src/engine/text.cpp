@@ -6,6 +6,12 @@
 
 using namespace engine;
 
+font::font()
+{
+	mFont_size = 0;
+	mCharacter_size = 30;
+}
+
 void font::set_font_source(const std::string & pFilepath)
 {
 	mFont_source = pFilepath;
@@ -26,7 +32,8 @@ bool font::load()
 		if (mPack)
 		{
 			mFont_data = mPack->read_all(mFont_source);
-			mSFML_font->loadFromMemory(&mFont_data[0], mFont_data.size());
+			mSFML_font->loadFromMemory(mFont_data.data(), mFont_data.size());
+			mFont_size = mFont_data.size();
 		}
 		else
 		{
@@ -35,6 +42,7 @@ bool font::load()
 				logger::error("Failed to load font");
 				return false;
 			}
+			mFont_size = static_cast<size_t>(fs::file_size(mFont_source));
 		}
 		if (!load_preferences())
 		{
@@ -49,17 +57,24 @@ bool font::load()
 bool font::unload()
 {
 	mSFML_font.reset();
+	mFont_data = std::vector<char>();
+	mFont_size = 0;
 	set_loaded(false);
 	return true;
 }
 
+size_t font::get_memory_usage() const
+{
+	return mFont_size;
+}
+
 bool font::load_preferences()
 {
 	tinyxml2::XMLDocument doc;
 	if (mPack)
 	{
-		const auto data = mPack->read_all(mPreferences_source);
-		doc.Parse(&data[0], data.size());
+		const auto data = mPack->view(mPreferences_source);
+		doc.Parse(data.data(), data.size());
 	}
 	else
 	{
@@ -134,9 +149,9 @@ int text_node::draw(renderer &pR)
 	testrect.draw(pR);*/
 
 	if (mShader)
-		pR.get_sfml_render().draw(mSfml_text, mShader->get_sfml_shader());
+		pR.get_backend().draw(mSfml_text, mShader->get_sfml_shader());
 	else
-		pR.get_sfml_render().draw(mSfml_text);
+		pR.get_backend().draw(mSfml_text);
 	return 0;
 }
 
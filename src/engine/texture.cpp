@@ -6,9 +6,16 @@
 #include "../../3rdparty/tinyxml2/tinyxml2.h"
 
 #include <iostream>
+#include <cmath>
 
 using namespace engine;
 
+// Size in pixels of the cells used to find atlas entries by position
+static const float atlas_cell_size = 64.f;
+
+// Entries covering more cells than this are checked separately
+static const size_t atlas_max_cells = 64;
+
 subtexture::subtexture(const std::string & pName)
 {
 	mName = pName;
@@ -98,6 +105,11 @@ bool subtexture::save(tinyxml2::XMLElement * pEle)
 	return true;
 }
 
+texture_atlas::texture_atlas()
+{
+	mRegions_dirty = false;
+}
+
 bool texture_atlas::load(const std::string & pPath)
 {
 	clear();
@@ -142,39 +154,67 @@ bool texture_atlas::load_memory(const char * pData, size_t pSize)
 void texture_atlas::clear()
 {
 	mAtlas.clear();
+	mNames.clear();
+	mCells.clear();
+	mLarge_entries.clear();
+	mRegions_dirty = false;
 }
 
 std::shared_ptr<subtexture> texture_atlas::get_entry(const std::string & pName) const
 {
-	for (auto& i : mAtlas)
-		if (i->get_name() == pName)
-			return i;
-	return {};
+	auto find = mNames.find(pName);
+	if (find == mNames.end())
+		return {};
+	return find->second;
 }
 
 std::shared_ptr<subtexture> texture_atlas::get_entry(const fvector & pVec) const
 {
-	for (auto& i : mAtlas)
+	if (mRegions_dirty)
+		build_regions();
+
+	// Lowest index wins so the result matches a search through mAtlas
+	uint32_t found = ~uint32_t(0);
+	auto cell = mCells.find(hash_cell(static_cast<int>(std::floor(pVec.x / atlas_cell_size))
+		, static_cast<int>(std::floor(pVec.y / atlas_cell_size))));
+	if (cell != mCells.end())
 	{
-		if (i->get_root_frame().is_intersect(pVec))
-			return i;
+		for (auto i : cell->second)
+			if (mAtlas[i]->get_root_frame().is_intersect(pVec))
+			{
+				found = i;
+				break;
+			}
 	}
-	return{};
+	for (auto i : mLarge_entries)
+	{
+		if (i >= found)
+			break;
+		if (mAtlas[i]->get_root_frame().is_intersect(pVec))
+			found = i;
+	}
+	if (found >= mAtlas.size())
+		return{};
+	return mAtlas[found];
 }
 
 bool texture_atlas::add_entry(const subtexture & pEntry)
 {
 	if (get_entry(pEntry.get_name()))
 		return false;
-	mAtlas.push_back(std::make_shared<subtexture>(pEntry));
-	return true;
+	auto entry = std::make_shared<subtexture>(pEntry);
+	return add_entry(entry);
 }
 
 bool engine::texture_atlas::add_entry(subtexture::ptr & pEntry)
 {
-	if (get_entry(pEntry->get_name()))
+	if (!mNames.emplace(pEntry->get_name(), pEntry).second)
 		return false;
 	mAtlas.push_back(pEntry);
+
+	// The new entry has the highest index so cells stay sorted
+	if (!mRegions_dirty)
+		add_region(mAtlas.size() - 1);
 	return true;
 }
 
@@ -183,24 +223,24 @@ bool texture_atlas::rename_entry(const std::string & pOriginal, const std::strin
 	if (pOriginal == pRename)
 		return false;
 
-	auto entry = get_entry(pOriginal);
-	if (!entry)
+	auto find = mNames.find(pOriginal);
+	if (find == mNames.end() || mNames.count(pRename))
 		return false;
 
+	auto entry = find->second;
+	mNames.erase(find);
 	entry->set_name(pRename);
+	mNames[pRename] = entry;
 
 	return true;
 }
 
 bool texture_atlas::remove_entry(const std::string & pName)
 {
-	for (size_t i = 0; i < mAtlas.size(); i++)
-		if (mAtlas[i]->get_name() == pName)
-		{
-			mAtlas.erase(mAtlas.begin() + i);
-			return true;
-		}
-	return false;
+	auto entry = get_entry(pName);
+	if (!entry)
+		return false;
+	return remove_entry(entry);
 }
 
 bool engine::texture_atlas::remove_entry(subtexture::ptr & pEntry)
@@ -208,12 +248,19 @@ bool engine::texture_atlas::remove_entry(subtexture::ptr & pEntry)
 	for (size_t i = 0; i < mAtlas.size(); i++)
 		if (mAtlas[i] == pEntry)
 		{
+			mNames.erase(pEntry->get_name());
 			mAtlas.erase(mAtlas.begin() + i);
+			mRegions_dirty = true; // Indexes have shifted
 			return true;
 		}
 	return false;
 }
 
+void texture_atlas::update_regions()
+{
+	mRegions_dirty = true;
+}
+
 std::vector<std::string> texture_atlas::compile_list() const
 {
 	std::vector<std::string> list;
@@ -232,6 +279,51 @@ bool texture_atlas::is_empty() const
 	return mAtlas.empty();
 }
 
+uint64_t texture_atlas::hash_cell(int pX, int pY)
+{
+	return (static_cast<uint64_t>(static_cast<uint32_t>(pX)) << 32)
+		| static_cast<uint64_t>(static_cast<uint32_t>(pY));
+}
+
+irect texture_atlas::calculate_cells(const frect & pRect) const
+{
+	irect cells;
+	cells.x = static_cast<int>(std::floor(pRect.x / atlas_cell_size));
+	cells.y = static_cast<int>(std::floor(pRect.y / atlas_cell_size));
+	cells.w = static_cast<int>(std::floor((pRect.x + pRect.w) / atlas_cell_size));
+	cells.h = static_cast<int>(std::floor((pRect.y + pRect.h) / atlas_cell_size));
+	return cells;
+}
+
+void texture_atlas::add_region(size_t pIndex) const
+{
+	const frect frame = mAtlas[pIndex]->get_root_frame();
+	if (frame.w <= 0 || frame.h <= 0)
+		return; // Nothing can hit it
+
+	const irect cells = calculate_cells(frame);
+	const size_t count = static_cast<size_t>(cells.w - cells.x + 1)
+		* static_cast<size_t>(cells.h - cells.y + 1);
+	if (count > atlas_max_cells)
+	{
+		mLarge_entries.push_back(static_cast<uint32_t>(pIndex));
+		return;
+	}
+
+	for (int y = cells.y; y <= cells.h; y++)
+		for (int x = cells.x; x <= cells.w; x++)
+			mCells[hash_cell(x, y)].push_back(static_cast<uint32_t>(pIndex));
+}
+
+void texture_atlas::build_regions() const
+{
+	mCells.clear();
+	mLarge_entries.clear();
+	for (size_t i = 0; i < mAtlas.size(); i++)
+		add_region(i);
+	mRegions_dirty = false;
+}
+
 
 bool texture_atlas::load_entries(tinyxml2::XMLDocument& pDoc)
 {
@@ -253,6 +345,242 @@ bool texture_atlas::load_entries(tinyxml2::XMLDocument& pDoc)
 	return true;
 }
 
+texture_packer::texture_packer()
+{
+	mPage_size = { 2048, 2048 };
+	mPadding = 1;
+	mUsed_area = 0;
+}
+
+void texture_packer::set_page_size(ivector pSize)
+{
+	mPage_size = pSize;
+}
+
+ivector texture_packer::get_page_size() const
+{
+	return mPage_size;
+}
+
+void texture_packer::set_padding(int pPadding)
+{
+	mPadding = pPadding;
+}
+
+int texture_packer::add(ivector pSize, ivector& pPosition)
+{
+	const ivector padded = pSize + ivector(mPadding, mPadding);
+	if (padded.x > mPage_size.x || padded.y > mPage_size.y)
+		return -1;
+
+	// Prefer the page where it sits lowest
+	int best_page = -1;
+	size_t best_node = 0;
+	int best_bottom = 0;
+	ivector best_position;
+	for (size_t i = 0; i < mPages.size(); i++)
+	{
+		ivector position;
+		size_t node;
+		int bottom;
+		if (find_position(mPages[i], padded, position, node, bottom)
+			&& (best_page < 0 || bottom < best_bottom))
+		{
+			best_page = static_cast<int>(i);
+			best_node = node;
+			best_bottom = bottom;
+			best_position = position;
+		}
+	}
+
+	if (best_page < 0)
+	{
+		mPages.push_back({ { 0, 0, mPage_size.x } });
+		best_page = static_cast<int>(mPages.size() - 1);
+		best_node = 0;
+		best_position = { 0, 0 };
+	}
+
+	place(mPages[best_page], best_node, best_position, padded);
+	mUsed_area += static_cast<uint64_t>(pSize.x) * pSize.y;
+	pPosition = best_position;
+	return best_page;
+}
+
+size_t texture_packer::get_page_count() const
+{
+	return mPages.size();
+}
+
+float texture_packer::get_efficiency() const
+{
+	if (mPages.empty())
+		return 0;
+	const uint64_t total = static_cast<uint64_t>(mPage_size.x) * mPage_size.y * mPages.size();
+	return static_cast<float>(mUsed_area) / static_cast<float>(total);
+}
+
+void texture_packer::clear()
+{
+	mPages.clear();
+	mUsed_area = 0;
+}
+
+bool texture_packer::find_position(const skyline& pSkyline, ivector pSize, ivector& pPosition, size_t& pNode, int& pBottom) const
+{
+	bool found = false;
+	for (size_t i = 0; i < pSkyline.size(); i++)
+	{
+		const int x = pSkyline[i].x;
+		if (x + pSize.x > mPage_size.x)
+			break;
+
+		// Rest on the highest segment below the rectangle
+		int y = 0;
+		int width_left = pSize.x;
+		for (size_t j = i; j < pSkyline.size() && width_left > 0; j++)
+		{
+			y = std::max(y, pSkyline[j].y);
+			width_left -= pSkyline[j].width;
+		}
+		if (y + pSize.y > mPage_size.y)
+			continue;
+
+		if (!found || y + pSize.y < pBottom)
+		{
+			found = true;
+			pBottom = y + pSize.y;
+			pPosition = { x, y };
+			pNode = i;
+		}
+	}
+	return found;
+}
+
+void texture_packer::place(skyline& pSkyline, size_t pNode, ivector pPosition, ivector pSize)
+{
+	pSkyline.insert(pSkyline.begin() + pNode, { pPosition.x, pPosition.y + pSize.y, pSize.x });
+
+	// Cut the segments now covered by the new one
+	for (size_t i = pNode + 1; i < pSkyline.size();)
+	{
+		const int covered = pSkyline[i - 1].x + pSkyline[i - 1].width - pSkyline[i].x;
+		if (covered <= 0)
+			break;
+		if (covered >= pSkyline[i].width)
+		{
+			pSkyline.erase(pSkyline.begin() + i);
+			continue;
+		}
+		pSkyline[i].x += covered;
+		pSkyline[i].width -= covered;
+		break;
+	}
+
+	// Merge segments at the same height
+	for (size_t i = 1; i < pSkyline.size();)
+	{
+		if (pSkyline[i - 1].y == pSkyline[i].y)
+		{
+			pSkyline[i - 1].width += pSkyline[i].width;
+			pSkyline.erase(pSkyline.begin() + i);
+		}
+		else
+			++i;
+	}
+}
+
+texture_page::texture_page()
+{
+	mUsers = 0;
+}
+
+void texture_page::set_size(ivector pSize)
+{
+	mSize = pSize;
+}
+
+void texture_page::add_member(const std::string& pSource, ivector pPosition)
+{
+	mMembers.push_back({ pSource, pPosition });
+}
+
+bool texture_page::prepare(resource_pack* pPack)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mSFML_texture || mImage)
+		return true;
+	return compose(pPack);
+}
+
+bool texture_page::acquire(resource_pack* pPack)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (!mSFML_texture)
+	{
+		if (!mImage && !compose(pPack))
+			return false;
+
+		mSFML_texture.reset(new sf::Texture());
+		const bool succ = mSFML_texture->loadFromImage(*mImage);
+		mImage.reset();
+		if (!succ)
+		{
+			mSFML_texture.reset();
+			return false;
+		}
+	}
+
+	++mUsers;
+	return true;
+}
+
+void texture_page::release()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mUsers > 0 && --mUsers == 0)
+		mSFML_texture.reset();
+}
+
+bool texture_page::compose(resource_pack* pPack)
+{
+	std::unique_ptr<sf::Image> page(new sf::Image());
+	page->create(static_cast<unsigned int>(mSize.x), static_cast<unsigned int>(mSize.y), sf::Color::Transparent);
+	for (auto& i : mMembers)
+	{
+		sf::Image image;
+		if (pPack)
+		{
+			auto data = pPack->view(i.source);
+			if (data.empty() || !image.loadFromMemory(data.data(), data.size()))
+				return false;
+		}
+		else if (!image.loadFromFile(i.source))
+			return false;
+		page->copy(image, static_cast<unsigned int>(i.position.x), static_cast<unsigned int>(i.position.y));
+	}
+	mImage = std::move(page);
+	return true;
+}
+
+texture::texture()
+{
+	mAtlas_loaded = false;
+}
+
+void texture::set_page(std::shared_ptr<texture_page> pPage, fvector pOffset, fvector pSize)
+{
+	mPage = pPage;
+	mPage_offset = pOffset;
+	mPage_size = pSize;
+	mAtlas_loaded = false;
+}
+
+bool texture::is_paged() const
+{
+	return mPage != nullptr;
+}
+
 void texture::set_texture_source(const std::string& pFilepath)
 {
 	mTexture_source = pFilepath;
@@ -261,54 +589,132 @@ void texture::set_texture_source(const std::string& pFilepath)
 void texture::set_atlas_source(const std::string & pFilepath)
 {
 	mAtlas_source = pFilepath;
+	mAtlas_loaded = false;
 }
 
 bool texture::load()
 {
-	if (!is_loaded())
+	if (!is_loaded() && mPage)
+	{
+		set_loaded(mPage->acquire(mPack));
+		load_atlas();
+	}
+	else if (!is_loaded())
 	{
 		mSFML_texture.reset(new sf::Texture());
 		if (mPack)
 		{
-			{ // Texture
-				auto data = mPack->read_all(mTexture_source);
-				set_loaded(mSFML_texture->loadFromMemory(&data[0], data.size()));
-			}
-			if (!mAtlas_source.empty())
-			{ // Atlas
-				auto data = mPack->read_all(mAtlas_source);
-				mAtlas.load_memory(&data[0], data.size());
-			}
+			auto data = mPack->view(mTexture_source);
+			set_loaded(mSFML_texture->loadFromMemory(data.data(), data.size()));
 		}
 		else
-		{
 			set_loaded(mSFML_texture->loadFromFile(mTexture_source));
-			if (!mAtlas_source.empty())
-				if (!mAtlas.load(mAtlas_source))
-					logger::error("Failed to load atlas '" + mAtlas_source + "'");
-		}
+		load_atlas();
 	}
 	return is_loaded();
 }
 
 bool texture::unload()
 {
+	if (mPage && is_loaded())
+		mPage->release();
 	mSFML_texture.reset();
+	mPrepared_image.reset();
+	mAtlas_loaded = false; // Atlas is reread on the next load
 	set_loaded(false);
 	return true;
 }
 
+bool texture::prepare_load()
+{
+	if (mPage)
+		return mPage->prepare(mPack);
+
+	std::unique_ptr<sf::Image> image(new sf::Image());
+	if (mPack)
+	{
+		auto data = mPack->view(mTexture_source);
+		if (data.empty() || !image->loadFromMemory(data.data(), data.size()))
+			return false;
+	}
+	else if (!image->loadFromFile(mTexture_source))
+		return false;
+	mPrepared_image = std::move(image);
+	return true;
+}
+
+bool texture::finish_load()
+{
+	// Loaded directly while it was being prepared
+	if (is_loaded())
+	{
+		mPrepared_image.reset();
+		return true;
+	}
+	if (!mPrepared_image || mPage)
+		return load();
+
+	mSFML_texture.reset(new sf::Texture());
+	set_loaded(mSFML_texture->loadFromImage(*mPrepared_image));
+	mPrepared_image.reset();
+	load_atlas();
+	return is_loaded();
+}
+
+void texture::load_atlas() const
+{
+	if (mAtlas_loaded || mAtlas_source.empty())
+		return;
+	mAtlas_loaded = true;
+	if (mPack)
+	{
+		auto data = mPack->view(mAtlas_source);
+		mAtlas.load_memory(data.data(), data.size());
+	}
+	else if (!mAtlas.load(mAtlas_source))
+		logger::error("Failed to load atlas '" + mAtlas_source + "'");
+
+	// Move the entries to where the texture is on its page
+	if (mPage)
+	{
+		for (auto& i : mAtlas.get_all())
+		{
+			frect frame = i->get_root_frame();
+			frame.x += mPage_offset.x;
+			frame.y += mPage_offset.y;
+			i->set_frame_rect(frame);
+		}
+		mAtlas.update_regions();
+	}
+}
+
 std::shared_ptr<subtexture> texture::get_entry(const std::string & pName) const
 {
+	load_atlas();
 	return mAtlas.get_entry(pName);
 }
 
 std::vector<std::string> engine::texture::compile_list() const
 {
+	load_atlas();
 	return mAtlas.compile_list();
 }
 
+size_t texture::get_memory_usage() const
+{
+	// Paged textures count their share of the page
+	if (mPage)
+		return is_loaded() ? static_cast<size_t>(mPage_size.x * mPage_size.y * 4) : 0;
+	if (!mSFML_texture)
+		return 0;
+	return static_cast<size_t>(mSFML_texture->getSize().x) * mSFML_texture->getSize().y * 4;
+}
+
 fvector texture::get_size() const
 {
+	if (mPage)
+		return mPage_size;
+	if (!mSFML_texture)
+		return{};
 	return{ static_cast<float>(mSFML_texture->getSize().x), static_cast<float>(mSFML_texture->getSize().y) };
 }
@@ -1,8 +1,41 @@
 #include <engine/time.hpp>
 #include <cmath>
+#include <atomic>
+#include <cstdint>
 
 using namespace engine;
 
+// Clocks are also read on worker threads
+static std::atomic<bool> fake_time_enabled(false);
+static std::atomic<int64_t> fake_time_point(0); // Nanoseconds since the epoch of the clock
+
+priv::highresclock priv::now()
+{
+	if (fake_time_enabled)
+		return highresclock(std::chrono::duration_cast<highresclock::duration>(
+			std::chrono::nanoseconds(fake_time_point.load())));
+	return std::chrono::high_resolution_clock::now();
+}
+
+void engine::use_fake_time(bool pEnabled)
+{
+	// Starts from the real time so running clocks don't jump
+	if (pEnabled && !fake_time_enabled)
+		fake_time_point = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+	fake_time_enabled = pEnabled;
+}
+
+bool engine::is_fake_time()
+{
+	return fake_time_enabled;
+}
+
+void engine::advance_fake_time(float pSeconds)
+{
+	fake_time_point += static_cast<int64_t>(static_cast<double>(pSeconds) * 1e9);
+}
+
 // Seconds
 float time_converter::seconds() const
 {
@@ -33,12 +66,12 @@ time_converter::time_converter(float pSeconds)
 clock::clock()
 {
 	mPlay = true;
-	mStart_point = std::chrono::high_resolution_clock::now();
+	mStart_point = priv::now();
 }
 
 time_converter clock::get_elapse() const
 {
-	std::chrono::time_point<std::chrono::high_resolution_clock> end_point = std::chrono::high_resolution_clock::now();
+	priv::highresclock end_point = priv::now();
 	std::chrono::duration<float> elapsed_seconds = end_point - mStart_point;
 	return elapsed_seconds.count();
 }
@@ -46,26 +79,26 @@ time_converter clock::get_elapse() const
 void clock::start()
 {
 	if (!mPlay)
-		mStart_point += std::chrono::high_resolution_clock::now() - mPause_point;
+		mStart_point += priv::now() - mPause_point;
 	mPlay = true;
 }
 
 void clock::pause()
 {
 	mPlay = false;
-	mPause_point = std::chrono::high_resolution_clock::now();
+	mPause_point = priv::now();
 }
 
 time_converter clock::restart()
 {
 	const time_converter elapse_time(get_elapse());
-	mStart_point = std::chrono::high_resolution_clock::now();
+	mStart_point = priv::now();
 	return elapse_time;
 }
 
 void timer::start()
 {
-	mStart_point = std::chrono::high_resolution_clock::now();
+	mStart_point = priv::now();
 }
 
 void timer::start(float pSeconds)
@@ -83,13 +116,13 @@ void timer::set_duration(float pSeconds)
 
 bool timer::is_reached() const
 {
-	std::chrono::duration<float> time = std::chrono::high_resolution_clock::now() - mStart_point;
+	std::chrono::duration<float> time = priv::now() - mStart_point;
 	return time.count() >= mSeconds;
 }
 
 void counter_clock::start()
 {
-	mStart_point = std::chrono::high_resolution_clock::now();
+	mStart_point = priv::now();
 }
 
 void counter_clock::set_interval(float pInterval)
@@ -101,7 +134,7 @@ void counter_clock::set_interval(float pInterval)
 
 size_t counter_clock::get_count() const
 {
-	std::chrono::duration<float> time = std::chrono::high_resolution_clock::now() - mStart_point;
+	std::chrono::duration<float> time = priv::now() - mStart_point;
 	return static_cast<size_t>(std::floor(time.count() / mInterval));
 }
 
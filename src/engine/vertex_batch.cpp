@@ -3,6 +3,7 @@
 #include <engine/renderer.hpp>
 
 #include <cassert>
+#include <algorithm>
 
 using namespace engine;
 
@@ -38,10 +39,14 @@ fvector vertex_reference::get_size() const
 
 void vertex_reference::hide()
 {
-	auto ref = get_reference();
+	if (!is_valid())
+		return;
+	const size_t index = get_vertex_index();
+	sf::Vertex* ref = &mBatch->mVertices[index];
 	ref[1] = ref[0];
 	ref[2] = ref[0];
 	ref[3] = ref[0];
+	mBatch->mark_dirty(index, index + 4);
 }
 
 void vertex_reference::set_rotation(int pRotation)
@@ -67,9 +72,32 @@ void vertex_reference::set_color(const color & pColor)
 	update_color();
 }
 
+size_t vertex_reference::get_quad_index() const
+{
+	assert(is_valid());
+	return mBatch->mHandle_quads[mHandle];
+}
+
+bool vertex_reference::is_valid() const
+{
+	return mBatch
+		&& mHandle < mBatch->mHandle_generations.size()
+		&& mBatch->mHandle_generations[mHandle] == mGeneration;
+}
+
+vertex_batch* vertex_reference::get_batch() const
+{
+	return mBatch;
+}
+
+size_t vertex_reference::get_vertex_index() const
+{
+	return get_quad_index() * 4;
+}
+
 void vertex_reference::update_position()
 {
-	if (!mBatch)
+	if (!is_valid())
 		return;
 
 	fvector positions[4];
@@ -99,40 +127,42 @@ void vertex_reference::update_position()
 	positions[2] -= hskew_offset;
 	positions[3] -= hskew_offset;
 
-	auto ref = get_reference();
+	const size_t index = get_vertex_index();
+	sf::Vertex* ref = &mBatch->mVertices[index];
 	for (size_t i = 0; i < 4; i++)
 		ref[i].position = sf::Vector2f(positions[i]);
+	mBatch->mark_dirty(index, index + 4);
 }
 
 void vertex_reference::update_texture()
 {
-	if (!mBatch)
+	if (!is_valid())
 		return;
-	auto ref = get_reference();
+	const size_t index = get_vertex_index();
+	sf::Vertex* ref = &mBatch->mVertices[index];
 	ref[(mRotation    ) % 4].texCoords = mTexture_rect.get_offset();
 	ref[(mRotation + 1) % 4].texCoords = mTexture_rect.get_offset() + fvector(mTexture_rect.w, 0);
 	ref[(mRotation + 2) % 4].texCoords = mTexture_rect.get_offset() + mTexture_rect.get_size();
 	ref[(mRotation + 3) % 4].texCoords = mTexture_rect.get_offset() + fvector(0, mTexture_rect.h);
+	mBatch->mark_dirty(index, index + 4);
 }
 
 void vertex_reference::update_color()
 {
-	if (!mBatch)
+	if (!is_valid())
 		return;
-	auto ref = get_reference();
+	const size_t index = get_vertex_index();
+	sf::Vertex* ref = &mBatch->mVertices[index];
 	for (size_t i = 0; i < 4; i++)
 		ref[i].color = mColor;
-}
-
-sf::Vertex * vertex_reference::get_reference()
-{
-	assert(mBatch != nullptr);
-	return &mBatch->mVertices[mIndex];
+	mBatch->mark_dirty(index, index + 4);
 }
 
 vertex_batch::vertex_batch()
 {
 	mUse_render_texture = false;
+	mResized = false;
+	mCompaction_threshold = 0;
 }
 
 void vertex_batch::set_texture(std::shared_ptr<texture> pTexture)
@@ -142,11 +172,39 @@ void vertex_batch::set_texture(std::shared_ptr<texture> pTexture)
 
 vertex_reference vertex_batch::add_quad(fvector pPosition, frect pTexture_rect, int pRotation)
 {
-	mVertices.resize(mVertices.size() + 4);
+	size_t quad;
+	if (!mFree_quads.empty())
+	{
+		quad = mFree_quads.back();
+		mFree_quads.pop_back();
+	}
+	else
+	{
+		quad = get_quad_count();
+		mVertices.resize(mVertices.size() + 4);
+		mQuad_handles.push_back(no_quad);
+		mResized = true;
+	}
+
+	size_t handle;
+	if (!mFree_handles.empty())
+	{
+		handle = mFree_handles.back();
+		mFree_handles.pop_back();
+	}
+	else
+	{
+		handle = mHandle_quads.size();
+		mHandle_quads.push_back(no_quad);
+		mHandle_generations.push_back(0);
+	}
+	mHandle_quads[handle] = quad;
+	mQuad_handles[quad] = handle;
 
 	vertex_reference ref;
 	ref.mBatch = this;
-	ref.mIndex = mVertices.size() - 4;
+	ref.mHandle = handle;
+	ref.mGeneration = mHandle_generations[handle];
 	ref.set_texture_rect(pTexture_rect);
 	ref.set_rotation(pRotation);
 	ref.set_position(pPosition);
@@ -159,9 +217,271 @@ void vertex_batch::reserve_quads(size_t pAmount)
 	mVertices.reserve(mVertices.size() + pAmount);
 }
 
+bool vertex_batch::remove_quad(const vertex_reference& pRef)
+{
+	if (pRef.mBatch != this || !pRef.is_valid())
+		return false;
+
+	const size_t quad = mHandle_quads[pRef.mHandle];
+	sf::Vertex* vertices = &mVertices[quad * 4];
+	vertices[1] = vertices[0];
+	vertices[2] = vertices[0];
+	vertices[3] = vertices[0];
+	mark_dirty(quad * 4, quad * 4 + 4);
+
+	// Old references to this handle are no longer valid
+	++mHandle_generations[pRef.mHandle];
+	mHandle_quads[pRef.mHandle] = no_quad;
+	mFree_handles.push_back(pRef.mHandle);
+
+	mQuad_handles[quad] = no_quad;
+	mFree_quads.push_back(quad);
+	return true;
+}
+
+void vertex_batch::compact()
+{
+	if (mFree_quads.empty())
+		return;
+
+	size_t next = 0;
+	for (size_t i = 0; i < mQuad_handles.size(); i++)
+	{
+		const size_t handle = mQuad_handles[i];
+		if (handle == no_quad)
+			continue;
+		if (i != next)
+		{
+			std::copy(mVertices.begin() + i * 4, mVertices.begin() + i * 4 + 4, mVertices.begin() + next * 4);
+			mQuad_handles[next] = handle;
+			mHandle_quads[handle] = next;
+		}
+		++next;
+	}
+	mVertices.resize(next * 4);
+	mQuad_handles.resize(next);
+	mFree_quads.clear();
+	mDirty.clear();
+	mResized = true;
+}
+
+void vertex_batch::set_compaction_threshold(float pRatio)
+{
+	mCompaction_threshold = pRatio;
+}
+
+void vertex_batch::compact_if_needed()
+{
+	if (mCompaction_threshold > 0
+		&& get_dead_quad_count() > get_quad_count() * mCompaction_threshold)
+		compact();
+}
+
+size_t vertex_batch::get_quad_count() const
+{
+	return mVertices.size() / 4;
+}
+
+size_t vertex_batch::get_live_quad_count() const
+{
+	return get_quad_count() - mFree_quads.size();
+}
+
+size_t vertex_batch::get_dead_quad_count() const
+{
+	return mFree_quads.size();
+}
+
+void vertex_batch::set_quad_rects(size_t pFirst, const frect* pRects, size_t pCount)
+{
+	if (pCount == 0)
+		return;
+	assert(pFirst + pCount <= get_quad_count());
+	sf::Vertex* vertices = &mVertices[pFirst * 4];
+	for (size_t i = 0; i < pCount; i++, vertices += 4)
+	{
+		const frect& rect = pRects[i];
+		vertices[0].position = { rect.x, rect.y };
+		vertices[1].position = { rect.x + rect.w, rect.y };
+		vertices[2].position = { rect.x + rect.w, rect.y + rect.h };
+		vertices[3].position = { rect.x, rect.y + rect.h };
+	}
+	mark_dirty(pFirst * 4, (pFirst + pCount) * 4);
+}
+
+void vertex_batch::set_quad_texture_rects(size_t pFirst, const frect* pRects, size_t pCount)
+{
+	if (pCount == 0)
+		return;
+	assert(pFirst + pCount <= get_quad_count());
+	sf::Vertex* vertices = &mVertices[pFirst * 4];
+	for (size_t i = 0; i < pCount; i++, vertices += 4)
+	{
+		const frect& rect = pRects[i];
+		vertices[0].texCoords = { rect.x, rect.y };
+		vertices[1].texCoords = { rect.x + rect.w, rect.y };
+		vertices[2].texCoords = { rect.x + rect.w, rect.y + rect.h };
+		vertices[3].texCoords = { rect.x, rect.y + rect.h };
+	}
+	mark_dirty(pFirst * 4, (pFirst + pCount) * 4);
+}
+
+void vertex_batch::set_quad_colors(size_t pFirst, const color* pColors, size_t pCount)
+{
+	if (pCount == 0)
+		return;
+	assert(pFirst + pCount <= get_quad_count());
+	sf::Vertex* vertices = &mVertices[pFirst * 4];
+	for (size_t i = 0; i < pCount; i++, vertices += 4)
+	{
+		const sf::Color color = pColors[i];
+		vertices[0].color = color;
+		vertices[1].color = color;
+		vertices[2].color = color;
+		vertices[3].color = color;
+	}
+	mark_dirty(pFirst * 4, (pFirst + pCount) * 4);
+}
+
+void vertex_batch::translate_quads(size_t pFirst, const fvector* pOffsets, size_t pCount)
+{
+	if (pCount == 0)
+		return;
+	assert(pFirst + pCount <= get_quad_count());
+	sf::Vertex* vertices = &mVertices[pFirst * 4];
+	for (size_t i = 0; i < pCount; i++, vertices += 4)
+	{
+		const sf::Vector2f offset = pOffsets[i];
+		vertices[0].position += offset;
+		vertices[1].position += offset;
+		vertices[2].position += offset;
+		vertices[3].position += offset;
+	}
+	mark_dirty(pFirst * 4, (pFirst + pCount) * 4);
+}
+
+void vertex_batch::set_quad_positions(size_t pFirst, const float* pX, const float* pY, fvector pSize, size_t pCount)
+{
+	if (pCount == 0)
+		return;
+	assert(pFirst + pCount <= get_quad_count());
+	sf::Vertex* vertices = &mVertices[pFirst * 4];
+	for (size_t i = 0; i < pCount; i++, vertices += 4)
+	{
+		const float left = pX[i];
+		const float top = pY[i];
+		const float right = left + pSize.x;
+		const float bottom = top + pSize.y;
+		vertices[0].position = { left, top };
+		vertices[1].position = { right, top };
+		vertices[2].position = { right, bottom };
+		vertices[3].position = { left, bottom };
+	}
+	mark_dirty(pFirst * 4, (pFirst + pCount) * 4);
+}
+
+void vertex_batch::hide_quads(size_t pFirst, size_t pCount)
+{
+	if (pCount == 0)
+		return;
+	assert(pFirst + pCount <= get_quad_count());
+	sf::Vertex* vertices = &mVertices[pFirst * 4];
+	for (size_t i = 0; i < pCount; i++, vertices += 4)
+	{
+		vertices[1].position = vertices[0].position;
+		vertices[2].position = vertices[0].position;
+		vertices[3].position = vertices[0].position;
+	}
+	mark_dirty(pFirst * 4, (pFirst + pCount) * 4);
+}
+
+void vertex_batch::set_texture_rect(vertex_reference* pRefs, size_t pCount, frect pRect)
+{
+	const sf::Vector2f corners[4] = {
+		sf::Vector2f(pRect.get_offset()),
+		sf::Vector2f(pRect.get_offset() + fvector(pRect.w, 0)),
+		sf::Vector2f(pRect.get_offset() + pRect.get_size()),
+		sf::Vector2f(pRect.get_offset() + fvector(0, pRect.h))
+	};
+	for (size_t i = 0; i < pCount; i++)
+	{
+		vertex_reference& ref = pRefs[i];
+		assert(ref.mBatch == this);
+		if (ref.mBatch != this || !ref.is_valid())
+			continue; // Removed quads are left alone
+		ref.mTexture_rect = pRect;
+
+		const size_t index = mHandle_quads[ref.mHandle] * 4;
+		sf::Vertex* vertices = &mVertices[index];
+		for (int j = 0; j < 4; j++)
+			vertices[(ref.mRotation + j) % 4].texCoords = corners[j];
+		mark_dirty(index, index + 4);
+	}
+}
+
+const std::vector<vertex_range>& vertex_batch::get_dirty_ranges() const
+{
+	return mDirty;
+}
+
+void vertex_batch::upload(vertex_upload_sink& pSink)
+{
+	compact_if_needed();
+	if (mResized)
+	{
+		pSink.resize(mVertices.size());
+		if (!mVertices.empty())
+			pSink.update(&mVertices[0], 0, mVertices.size());
+	}
+	else
+	{
+		for (auto& i : mDirty)
+			pSink.update(&mVertices[i.begin], i.begin, i.end - i.begin);
+	}
+	mDirty.clear();
+	mResized = false;
+}
+
+void vertex_batch::mark_dirty(size_t pBegin, size_t pEnd)
+{
+	if (pBegin == pEnd)
+		return;
+
+	// Ranges are kept sorted and apart. Most changes are made
+	// in order so they usually go at the end.
+	if (mDirty.empty() || pBegin > mDirty.back().end)
+		mDirty.push_back({ pBegin, pEnd });
+	else
+	{
+		// First range this touches and the one after the last
+		auto first = std::lower_bound(mDirty.begin(), mDirty.end(), pBegin,
+			[](const vertex_range& pRange, size_t pAt) { return pRange.end < pAt; });
+		auto last = std::upper_bound(first, mDirty.end(), pEnd,
+			[](size_t pAt, const vertex_range& pRange) { return pAt < pRange.begin; });
+		if (first == last)
+			mDirty.insert(first, { pBegin, pEnd });
+		else
+		{
+			first->begin = std::min(first->begin, pBegin);
+			first->end = std::max((last - 1)->end, pEnd);
+			mDirty.erase(first + 1, last);
+		}
+	}
+
+	// Too scattered. Uploading a few unchanged
+	// vertices is cheaper than many small uploads.
+	const size_t max_ranges = 16;
+	if (mDirty.size() > max_ranges)
+	{
+		const vertex_range all = { mDirty.front().begin, mDirty.back().end };
+		mDirty.clear();
+		mDirty.push_back(all);
+	}
+}
+
 int vertex_batch::draw(renderer &pR)
 {
-	if (!mTexture)
+	if (!mTexture || mTexture->is_loading())
 		return 1;
 	return draw(pR, mTexture->sfml_get_texture());
 }
@@ -173,6 +493,7 @@ void vertex_batch::use_render_texture(bool pEnable)
 
 int vertex_batch::draw(renderer & pR, const sf::Texture & pTexture)
 {
+	compact_if_needed();
 	if (mVertices.empty())
 		return 1;
 
@@ -199,14 +520,14 @@ int vertex_batch::draw(renderer & pR, const sf::Texture & pTexture)
 		sf::Sprite final_render(mRender.getTexture());
 		final_render.setPosition((position - position_nondec)
 			- sf::Vector2f(1, 1));
-		pR.get_sfml_render().draw(final_render);
+		pR.get_backend().draw(final_render);
 	}
 	else
 	{
 		rs.transform.translate(position);
 		rs.transform.rotate(get_absolute_rotation());
 		rs.transform.scale(get_absolute_scale());
-		pR.get_sfml_render().draw(&mVertices[0], mVertices.size(), sf::Quads, rs);
+		pR.get_backend().draw(&mVertices[0], mVertices.size(), sf::Quads, rs);
 	}
 	return 0;
 }
@@ -214,6 +535,20 @@ int vertex_batch::draw(renderer & pR, const sf::Texture & pTexture)
 void vertex_batch::clean()
 {
 	mVertices.clear();
+	mDirty.clear();
+	mResized = true;
+
+	// Every reference becomes invalid
+	for (size_t i = 0; i < mHandle_quads.size(); i++)
+	{
+		if (mHandle_quads[i] == no_quad)
+			continue;
+		++mHandle_generations[i];
+		mHandle_quads[i] = no_quad;
+		mFree_handles.push_back(i);
+	}
+	mQuad_handles.clear();
+	mFree_quads.clear();
 }
 
 void vertex_batch::set_color(color pColor)
@@ -222,6 +557,7 @@ void vertex_batch::set_color(color pColor)
 	{
 		i.color = pColor;
 	}
+	mark_dirty(0, mVertices.size());
 }
 
 void vertex_batch::update_texture(renderer& pR)
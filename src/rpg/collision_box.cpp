@@ -1,5 +1,9 @@
 #include <rpg/collision_box.hpp>
 #include <engine/logger.hpp>
+#include <engine/profiler.hpp>
+
+#include <algorithm>
+#include <cmath>
 
 using namespace rpg;
 
@@ -66,12 +70,117 @@ std::shared_ptr<collision_box> trigger::copy()
 	return box;
 }
 
+// ##########
+// collision_box_grid
+// ##########
+
+// Boxes covering more cells than this are not worth indexing
+static const int max_cells_per_box = 64;
+
+collision_box_grid::collision_box_grid(float pCell_size)
+	: mCell_size(pCell_size)
+{
+}
+
+void collision_box_grid::insert(collision_box* pBox)
+{
+	pBox->mCells = calculate_cells(pBox->get_region());
+
+	const int cell_count = (pBox->mCells.w - pBox->mCells.x + 1)
+		* (pBox->mCells.h - pBox->mCells.y + 1);
+	pBox->mIs_large = cell_count > max_cells_per_box;
+	if (pBox->mIs_large)
+	{
+		mLarge.push_back(pBox);
+		return;
+	}
+
+	for (int y = pBox->mCells.y; y <= pBox->mCells.h; y++)
+		for (int x = pBox->mCells.x; x <= pBox->mCells.w; x++)
+			mCells[hash_cell(x, y)].push_back(pBox);
+}
+
+// Swap-remove; order within a bucket does not matter since
+// results are sorted by sequence afterwards
+static void remove_from_bucket(std::vector<collision_box*>& pBucket, collision_box* pBox)
+{
+	for (size_t i = 0; i < pBucket.size(); i++)
+		if (pBucket[i] == pBox)
+		{
+			pBucket[i] = pBucket.back();
+			pBucket.pop_back();
+			return;
+		}
+}
+
+void collision_box_grid::remove(collision_box* pBox)
+{
+	if (pBox->mIs_large)
+	{
+		remove_from_bucket(mLarge, pBox);
+		return;
+	}
+
+	for (int y = pBox->mCells.y; y <= pBox->mCells.h; y++)
+		for (int x = pBox->mCells.x; x <= pBox->mCells.w; x++)
+		{
+			auto find = mCells.find(hash_cell(x, y));
+			if (find == mCells.end())
+				continue;
+			remove_from_bucket(find->second, pBox);
+			if (find->second.empty())
+				mCells.erase(find);
+		}
+}
+
+void collision_box_grid::clear()
+{
+	mCells.clear();
+	mLarge.clear();
+}
+
+size_t collision_box_grid::get_cell_count() const
+{
+	return mCells.size();
+}
+
+uint64_t collision_box_grid::hash_cell(int pX, int pY)
+{
+	return (static_cast<uint64_t>(static_cast<uint32_t>(pX)) << 32)
+		| static_cast<uint64_t>(static_cast<uint32_t>(pY));
+}
+
+engine::irect collision_box_grid::calculate_cells(const engine::frect& pRect) const
+{
+	return{
+		static_cast<int>(std::floor(pRect.x / mCell_size)),
+		static_cast<int>(std::floor(pRect.y / mCell_size)),
+		static_cast<int>(std::floor((pRect.x + pRect.w) / mCell_size)),
+		static_cast<int>(std::floor((pRect.y + pRect.h) / mCell_size))
+	};
+}
+
 // ##########
 // collision_box_container
 // ##########
 
+collision_box_container::collision_box_container()
+	: mSequence_counter(0)
+	, mQuery_counter(0)
+{
+}
+
+collision_box_container::~collision_box_container()
+{
+	clear();
+}
+
 void collision_box_container::clear()
 {
+	for (auto& i : mBoxes)
+		i->mContainer = nullptr;
+	for (auto& i : mGrids)
+		i.clear();
 	mWall_groups.clear();
 	mBoxes.clear();
 }
@@ -99,6 +208,7 @@ std::shared_ptr<collision_box> collision_box_container::add_wall()
 {
 	std::shared_ptr<collision_box> box(new collision_box);
 	mBoxes.push_back(box);
+	attach_box(box.get());
 	return box;
 }
 
@@ -106,6 +216,7 @@ std::shared_ptr<trigger> collision_box_container::add_trigger()
 {
 	std::shared_ptr<trigger> box(new trigger);
 	mBoxes.push_back(box);
+	attach_box(box.get());
 	return box;
 }
 
@@ -113,6 +224,7 @@ std::shared_ptr<button> collision_box_container::add_button()
 {
 	std::shared_ptr<button> box(new button);
 	mBoxes.push_back(box);
+	attach_box(box.get());
 	return box;
 }
 
@@ -120,6 +232,7 @@ std::shared_ptr<door> collision_box_container::add_door()
 {
 	std::shared_ptr<door> box(new door);
 	mBoxes.push_back(box);
+	attach_box(box.get());
 	return box;
 }
 
@@ -141,88 +254,136 @@ std::shared_ptr<collision_box> rpg::collision_box_container::add_collision_box(c
 
 std::shared_ptr<collision_box> collision_box_container::add_collision_box(std::shared_ptr<collision_box> pBox)
 {
+	if (pBox->mContainer)
+		pBox->mContainer->remove_box(pBox);
 	mBoxes.push_back(pBox);
+	attach_box(pBox.get());
 	return pBox;
 }
 
-std::vector<std::shared_ptr<collision_box>> collision_box_container::collision(engine::frect pRect)
+template<typename T>
+std::vector<std::shared_ptr<collision_box>> collision_box_container::gather(collision_box::type* pType, const engine::frect& pRect, T&& pTest)
 {
+	PROFILE_ZONE("collision query");
+	const size_t mark = ++mQuery_counter;
+	std::vector<collision_box*> found;
+	auto callback = [&](collision_box* pBox)
+	{
+		if (pBox->mQuery_mark == mark)
+			return;
+		pBox->mQuery_mark = mark;
+		if (pTest(pBox) && pBox->is_enabled())
+			found.push_back(pBox);
+	};
+
+	if (pType)
+		get_grid(*pType).query(pRect, callback);
+	else
+		for (auto& i : mGrids)
+			i.query(pRect, callback);
+
+	// Keep the same order as mBoxes
+	std::sort(found.begin(), found.end(), [](collision_box* pL, collision_box* pR)
+	{
+		return pL->mSequence < pR->mSequence;
+	});
+
 	std::vector<std::shared_ptr<collision_box>> hits;
-	for (auto& i : mBoxes)
-		if (i->is_enabled()
-			&& i->get_region().is_intersect(pRect))
-			hits.push_back(i);
+	hits.reserve(found.size());
+	for (auto i : found)
+		hits.push_back(i->shared_from_this());
 	return hits;
 }
 
+template<typename T>
+std::shared_ptr<collision_box> collision_box_container::gather_first(collision_box::type* pType, const engine::frect& pRect, T&& pTest)
+{
+	PROFILE_ZONE("collision query");
+	const size_t mark = ++mQuery_counter;
+	collision_box* first = nullptr;
+	auto callback = [&](collision_box* pBox)
+	{
+		if (pBox->mQuery_mark == mark
+			|| (first && first->mSequence < pBox->mSequence))
+			return;
+		pBox->mQuery_mark = mark;
+		if (pTest(pBox) && pBox->is_enabled())
+			first = pBox;
+	};
+
+	if (pType)
+		get_grid(*pType).query(pRect, callback);
+	else
+		for (auto& i : mGrids)
+			i.query(pRect, callback);
+
+	if (!first)
+		return{};
+	return first->shared_from_this();
+}
+
+std::vector<std::shared_ptr<collision_box>> collision_box_container::collision(engine::frect pRect)
+{
+	return gather(nullptr, pRect, [&](collision_box* pBox)
+	{
+		return pBox->get_region().is_intersect(pRect);
+	});
+}
+
 std::vector<std::shared_ptr<collision_box>> collision_box_container::collision(engine::fvector pPoint)
 {
-	std::vector<std::shared_ptr<collision_box>> hits;
-	for (auto& i : mBoxes)
-		if (i->is_enabled()
-			&& i->get_region().is_intersect(pPoint))
-			hits.push_back(i);
-	return hits;
+	return gather(nullptr, { pPoint, { 0, 0 } }, [&](collision_box* pBox)
+	{
+		return pBox->get_region().is_intersect(pPoint);
+	});
 }
 
 std::vector<std::shared_ptr<collision_box>> collision_box_container::collision(collision_box::type pType, engine::frect pRect)
 {
-	std::vector<std::shared_ptr<collision_box>> hits;
-	for (auto& i : mBoxes)
-		if (i->is_enabled()
-			&& i->get_type() == pType
-			&& i->get_region().is_intersect(pRect))
-			hits.push_back(i);
-	return hits;
+	return gather(&pType, pRect, [&](collision_box* pBox)
+	{
+		return pBox->get_region().is_intersect(pRect);
+	});
 }
 
 std::vector<std::shared_ptr<collision_box>> collision_box_container::collision(collision_box::type pType, engine::fvector pPoint)
 {
-	std::vector<std::shared_ptr<collision_box>> hits;
-	for (auto& i : mBoxes)
-		if (i->is_enabled()
-			&& i->get_type() == pType
-			&& i->get_region().is_intersect(pPoint))
-			hits.push_back(i);
-	return hits;
+	return gather(&pType, { pPoint, { 0, 0 } }, [&](collision_box* pBox)
+	{
+		return pBox->get_region().is_intersect(pPoint);
+	});
 }
 
 std::shared_ptr<collision_box> rpg::collision_box_container::first_collision(engine::frect pRect)
 {
-	for (auto& i : mBoxes)
-		if (i->is_enabled()
-			&& i->get_region().is_intersect(pRect))
-			return i;
-	return{};
+	return gather_first(nullptr, pRect, [&](collision_box* pBox)
+	{
+		return pBox->get_region().is_intersect(pRect);
+	});
 }
 
 std::shared_ptr<collision_box> rpg::collision_box_container::first_collision(engine::fvector pPoint)
 {
-	for (auto& i : mBoxes)
-		if (i->is_enabled()
-			&& i->get_region().is_intersect(pPoint))
-			return i;
-	return{};
+	return gather_first(nullptr, { pPoint, { 0, 0 } }, [&](collision_box* pBox)
+	{
+		return pBox->get_region().is_intersect(pPoint);
+	});
 }
 
 std::shared_ptr<collision_box> collision_box_container::first_collision(collision_box::type pType, engine::frect pRect)
 {
-	for (auto& i : mBoxes)
-		if (i->is_enabled()
-			&& i->get_type() == pType
-			&& i->get_region().is_intersect(pRect))
-			return i;
-	return{};
+	return gather_first(&pType, pRect, [&](collision_box* pBox)
+	{
+		return pBox->get_region().is_intersect(pRect);
+	});
 }
 
 std::shared_ptr<collision_box> rpg::collision_box_container::first_collision(collision_box::type pType, engine::fvector pPoint)
 {
-	for (auto& i : mBoxes)
-		if (i->is_enabled()
-			&& i->get_type() == pType
-			&& i->get_region().is_intersect(pPoint))
-			return i;
-	return{};
+	return gather_first(&pType, { pPoint, { 0, 0 } }, [&](collision_box* pBox)
+	{
+		return pBox->get_region().is_intersect(pPoint);
+	});
 }
 
 bool collision_box_container::load_xml(tinyxml2::XMLElement * pEle)
@@ -316,15 +477,15 @@ bool collision_box_container::remove_box(std::shared_ptr<collision_box> pBox)
 {
 	for (size_t i = 0; i < mBoxes.size(); i++)
 		if (mBoxes[i] == pBox)
-		{
-			mBoxes.erase(mBoxes.begin() + i);
-			return true;
-		}
+			return remove_box(i);
 	return false;
 }
 
 bool collision_box_container::remove_box(size_t pIndex)
 {
+	if (pIndex >= mBoxes.size())
+		return false;
+	detach_box(mBoxes[pIndex].get());
 	mBoxes.erase(mBoxes.begin() + pIndex);
 	return true;
 }
@@ -349,20 +510,156 @@ std::vector<std::shared_ptr<collision_box>>::iterator collision_box_container::e
 	return mBoxes.end();
 }
 
+// Returns the tiles that a region overlaps with any area.
+// x and y are the first tile, w and h are one past the last tile.
+static engine::irect overlapping_tiles(const engine::frect& pRegion)
+{
+	return{
+		static_cast<int>(std::floor(pRegion.x)),
+		static_cast<int>(std::floor(pRegion.y)),
+		static_cast<int>(std::ceil(pRegion.x + pRegion.w)),
+		static_cast<int>(std::ceil(pRegion.y + pRegion.h))
+	};
+}
+
+static void rasterize_wall(engine::walkability_grid& pGrid, const engine::frect& pWall, const engine::irect& pClip)
+{
+	const engine::irect tiles = overlapping_tiles(pWall);
+	for (int y = std::max(tiles.y, pClip.y); y < std::min(tiles.h, pClip.h); y++)
+	{
+		for (int x = std::max(tiles.x, pClip.x); x < std::min(tiles.w, pClip.w); x++)
+		{
+			const bool covers = pWall.x <= x && pWall.y <= y
+				&& pWall.x + pWall.w >= x + 1 && pWall.y + pWall.h >= y + 1;
+			if (covers)
+				pGrid.set_cell({ x, y }, engine::walkability_grid::cell::blocked);
+			else if (pGrid.get_cell({ x, y }) == engine::walkability_grid::cell::open)
+				pGrid.set_cell({ x, y }, engine::walkability_grid::cell::partial);
+		}
+	}
+}
+
+void collision_box_container::rasterize_walls(engine::walkability_grid& pGrid)
+{
+	// Disabled walls are included in the bounds so toggling
+	// a wall group never requires the grid to be resized.
+	bool has_wall = false;
+	engine::irect bounds;
+	for (auto& i : mBoxes)
+	{
+		if (i->get_type() != collision_box::type::wall)
+			continue;
+		const engine::irect tiles = overlapping_tiles(i->get_region());
+		if (!has_wall)
+		{
+			bounds = tiles;
+			has_wall = true;
+			continue;
+		}
+		bounds.x = std::min(bounds.x, tiles.x);
+		bounds.y = std::min(bounds.y, tiles.y);
+		bounds.w = std::max(bounds.w, tiles.w);
+		bounds.h = std::max(bounds.h, tiles.h);
+	}
+
+	if (!has_wall)
+	{
+		pGrid.clear();
+		return;
+	}
+
+	pGrid.reset({ bounds.x, bounds.y, bounds.w - bounds.x, bounds.h - bounds.y });
+
+	for (auto& i : mBoxes)
+		if (i->get_type() == collision_box::type::wall
+			&& i->is_enabled())
+			rasterize_wall(pGrid, i->get_region(), bounds);
+}
+
+void collision_box_container::rasterize_walls(engine::walkability_grid& pGrid, engine::frect pRegion)
+{
+	const engine::irect tiles = overlapping_tiles(pRegion);
+	if (tiles.w <= tiles.x || tiles.h <= tiles.y)
+		return;
+
+	const engine::irect& bounds = pGrid.get_bounds();
+
+	// Walls outside the grid need it to grow
+	if (tiles.x < bounds.x || tiles.y < bounds.y
+		|| tiles.w > bounds.x + bounds.w || tiles.h > bounds.y + bounds.h)
+	{
+		rasterize_walls(pGrid);
+		return;
+	}
+
+	for (int y = tiles.y; y < tiles.h; y++)
+		for (int x = tiles.x; x < tiles.w; x++)
+			pGrid.set_cell({ x, y }, engine::walkability_grid::cell::open);
+
+	const engine::frect tile_region(engine::fvector(tiles.get_offset())
+		, engine::fvector(tiles.get_size() - tiles.get_offset()));
+	for (auto& i : collision(collision_box::type::wall, tile_region))
+		rasterize_wall(pGrid, i->get_region(), tiles);
+}
+
+void collision_box_container::attach_box(collision_box* pBox)
+{
+	pBox->mContainer = this;
+	pBox->mSequence = mSequence_counter++;
+	get_grid(pBox->get_type()).insert(pBox);
+}
+
+void collision_box_container::detach_box(collision_box* pBox)
+{
+	get_grid(pBox->get_type()).remove(pBox);
+	pBox->mContainer = nullptr;
+}
+
+void collision_box_container::update_box(collision_box* pBox)
+{
+	collision_box_grid& grid = get_grid(pBox->get_type());
+	grid.remove(pBox);
+	grid.insert(pBox);
+}
+
+collision_box_grid& collision_box_container::get_grid(collision_box::type pType)
+{
+	return mGrids[static_cast<size_t>(pType)];
+}
+
 
 // ##########
 // collision_box
 // ##########
 
 collision_box::collision_box()
-	: mInverted(false){}
+	: mInverted(false)
+	, mContainer(nullptr)
+	, mSequence(0)
+	, mIs_large(false)
+	, mQuery_mark(0)
+{}
 
 collision_box::collision_box(engine::frect pRect)
-	: mInverted(false)
+	: collision_box()
 {
 	mRegion = pRect;
 }
 
+collision_box::collision_box(const collision_box& pBox)
+	: collision_box()
+{
+	*this = pBox;
+}
+
+collision_box& collision_box::operator=(const collision_box& pBox)
+{
+	mInverted = pBox.mInverted;
+	mWall_group = pBox.mWall_group;
+	set_region(pBox.mRegion);
+	return *this;
+}
+
 bool collision_box::is_enabled() const
 {
 	if (!mWall_group.expired())
@@ -378,6 +675,8 @@ const engine::frect& collision_box::get_region() const
 void collision_box::set_region(engine::frect pRegion)
 {
 	mRegion = pRegion;
+	if (mContainer)
+		mContainer->update_box(this);
 }
 
 void collision_box::set_wall_group(std::shared_ptr<wall_group> pWall_group)
@@ -3,6 +3,11 @@
 
 using namespace rpg;
 
+collision_system::collision_system()
+	: mWalkability_version(0)
+{
+}
+
 std::shared_ptr<const door> collision_system::get_door_entry(std::string pName)
 {
 	for (auto& i : mContainer.get_boxes())
@@ -22,11 +27,13 @@ std::shared_ptr<const door> collision_system::get_door_entry(std::string pName)
 void collision_system::clear()
 {
 	mContainer.clear();
+	rebuild_walkability();
 }
 
 int collision_system::load_collision_boxes(tinyxml2::XMLElement* pEle)
 {
 	mContainer.load_xml(pEle);
+	rebuild_walkability();
 	return 0;
 }
 
@@ -65,6 +72,60 @@ collision_box_container& collision_system::get_container()
 	return mContainer;
 }
 
+const engine::walkability_grid& collision_system::get_walkability() const
+{
+	return mWalkability;
+}
+
+size_t collision_system::get_walkability_version() const
+{
+	return mWalkability_version;
+}
+
+const std::vector<engine::frect>& collision_system::get_walkability_changes() const
+{
+	return mWalkability_changes;
+}
+
+void collision_system::rebuild_walkability()
+{
+	mContainer.rasterize_walls(mWalkability);
+	mWalkability_changes.clear();
+	++mWalkability_version;
+}
+
+void collision_system::update_walkability(engine::frect pRegion)
+{
+	const engine::irect old_bounds = mWalkability.get_bounds();
+	mContainer.rasterize_walls(mWalkability, pRegion);
+
+	// The grid had to grow so it counts as a full rebuild
+	const engine::irect& bounds = mWalkability.get_bounds();
+	if (bounds.x != old_bounds.x || bounds.y != old_bounds.y
+		|| bounds.w != old_bounds.w || bounds.h != old_bounds.h)
+	{
+		mWalkability_changes.clear();
+		++mWalkability_version;
+		return;
+	}
+	// Consumers that fall this far behind are better off rebuilding
+	if (mWalkability_changes.size() >= 256)
+	{
+		mWalkability_changes.clear();
+		++mWalkability_version;
+		return;
+	}
+	mWalkability_changes.push_back(pRegion);
+}
+
+void collision_system::update_walkability(std::shared_ptr<wall_group> pGroup)
+{
+	for (auto& i : mContainer.get_boxes())
+		if (i->get_type() == collision_box::type::wall
+			&& i->get_wall_group() == pGroup)
+			update_walkability(i->get_region());
+}
+
 void collision_system::register_collision_type(script_system& pScript)
 {
 	pScript.set_namespace("collision");
@@ -89,7 +150,10 @@ void collision_system::script_set_wall_group_enabled(const std::string& pName, b
 		return;
 	}
 
+	if (group->is_enabled() == pEnabled)
+		return;
 	group->set_enabled(pEnabled);
+	update_walkability(group);
 }
 
 bool collision_system::script_get_wall_group_enabled(const std::string & pName)
@@ -136,6 +200,8 @@ void collision_system::script_set_box_group(std::shared_ptr<collision_box>& pBox
 		return;
 	}
 	pBox->set_wall_group(group);
+	if (pBox->get_type() == collision_box::type::wall)
+		update_walkability(pBox->get_region());
 }
 
 void collision_system::script_set_box_position(std::shared_ptr<collision_box>& pBox, const engine::fvector & pPosition)
@@ -145,9 +211,16 @@ void collision_system::script_set_box_position(std::shared_ptr<collision_box>& p
 		logger::error("Invalid box reference");
 		return;
 	}
-	auto region = pBox->get_region();
+	const auto old_region = pBox->get_region();
+	auto region = old_region;
 	region.set_offset(pPosition);
 	pBox->set_region(region);
+
+	if (pBox->get_type() == collision_box::type::wall)
+	{
+		update_walkability(old_region);
+		update_walkability(region);
+	}
 }
 
 void collision_system::script_set_box_size(std::shared_ptr<collision_box>& pBox, const engine::fvector & pSize)
@@ -157,7 +230,14 @@ void collision_system::script_set_box_size(std::shared_ptr<collision_box>& pBox,
 		logger::error("Invalid box reference");
 		return;
 	}
-	auto region = pBox->get_region();
+	const auto old_region = pBox->get_region();
+	auto region = old_region;
 	region.set_size(pSize);
 	pBox->set_region(region);
+
+	if (pBox->get_type() == collision_box::type::wall)
+	{
+		update_walkability(old_region);
+		update_walkability(region);
+	}
 }
@@ -2179,11 +2179,8 @@ void atlas_editor::setup_gui()
 		// Check if already exists
 		if (pVal != mSelection->get_name())
 		{
-			if (!mAtlas.get_entry(pVal))
-			{
-				mSelection->set_name(pVal);
+			if (mAtlas.rename_entry(mSelection->get_name(), pVal))
 				update_entry_list();
-			}
 			else
 				logger::error("Animation with name '" + pVal + "' already exists");
 		}
@@ -2217,6 +2214,7 @@ void atlas_editor::setup_gui()
 		engine::frect rect = mSelection->get_frame_at(0);
 		rect.x = static_cast<float>(pVal);
 		mSelection->set_frame_rect(rect);
+		mAtlas.update_regions();
 		mAtlas_changed = true;
 	}, false);
 
@@ -2226,6 +2224,7 @@ void atlas_editor::setup_gui()
 		engine::frect rect = mSelection->get_frame_at(0);
 		rect.y = static_cast<float>(pVal);
 		mSelection->set_frame_rect(rect);
+		mAtlas.update_regions();
 		mAtlas_changed = true;
 	}, false);
 
@@ -2235,6 +2234,7 @@ void atlas_editor::setup_gui()
 		engine::frect rect = mSelection->get_frame_at(0);
 		rect.w = static_cast<float>(pVal);
 		mSelection->set_frame_rect(rect);
+		mAtlas.update_regions();
 		mAtlas_changed = true;
 	}, false);
 
@@ -2244,6 +2244,7 @@ void atlas_editor::setup_gui()
 		engine::frect rect = mSelection->get_frame_at(0);
 		rect.h = static_cast<float>(pVal);
 		mSelection->set_frame_rect(rect);
+		mAtlas.update_regions();
 		mAtlas_changed = true;
 	}, false);
 
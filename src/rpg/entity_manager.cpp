@@ -67,7 +67,7 @@ entity_reference entity_manager::script_add_entity(const std::string & pName)
 	if (!new_entity)
 		return{}; // Return empty on error
 
-	auto resource = mResource_manager->get_resource<engine::texture>("texture", pName);
+	auto resource = mResource_manager->get_resource_async<engine::texture>("texture", pName);
 	if (!resource)
 	{
 		logger::warning("Could not load texture '" + pName + "'");
@@ -150,7 +150,7 @@ entity_reference entity_manager::script_add_character(const std::string & pName)
 	if (!new_entity)
 		return entity_reference(); // Return empty on error
 
-	auto resource = mResource_manager->get_resource<engine::texture>("texture", pName);
+	auto resource = mResource_manager->get_resource_async<engine::texture>("texture", pName);
 	if (!resource)
 	{
 		logger::error("Could not load texture '" + pName + "' (Entity will not have a texture)");
@@ -429,7 +429,7 @@ void entity_manager::script_set_texture(entity_reference & e, const std::string
 		logger::warning("Entity is not sprite-based");
 		return;
 	}
-	auto texture = mResource_manager->get_resource<engine::texture>("texture", name);
+	auto texture = mResource_manager->get_resource_async<engine::texture>("texture", name);
 	if (!texture)
 	{
 		logger::warning("Could not load texture '" + name + "'");
@@ -96,7 +96,8 @@ void player_character::movement(engine::controls& pControls, collision_system& p
 	{
 		set_position(get_position() + move);
 		mIs_walking = true;
-		mSprite.tick();
+		if (!mSprite.is_playing())
+			mSprite.start();
 	}
 	else if (mIs_walking) // Reset animation
 	{
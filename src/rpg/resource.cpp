@@ -1,19 +1,33 @@
 #include <engine/resource.hpp>
 #include <engine/utility.hpp>
+#include <engine/time.hpp>
+#include <engine/logger.hpp>
+#include <engine/profiler.hpp>
+
+#include <algorithm>
 
 using namespace engine;
 
 resource::resource()
 {
 	mIs_loaded = false;
+	mIs_loading = false;
+	mLast_used = 0;
 	mPack = nullptr;
+	mManager = nullptr;
+	mCounted_bytes = 0;
 }
 
-bool resource::is_loaded()
+bool resource::is_loaded() const
 {
 	return mIs_loaded;
 }
 
+bool resource::is_loading() const
+{
+	return mIs_loading;
+}
+
 void resource::set_name(const std::string & pName)
 {
 	mName = pName;
@@ -32,57 +46,213 @@ void resource::set_resource_pack(resource_pack * pPack)
 bool resource::set_loaded(bool pIs_loaded)
 {
 	mIs_loaded = pIs_loaded;
+	if (mManager)
+		mManager->update_usage(*this);
 	return pIs_loaded;
 }
 
 resource_manager::resource_manager()
 {
 	mPack = nullptr;
+	mFrame = 0;
+	mMemory_budget = 256 * 1024 * 1024;
+	mGrace_period = 600;
+	mThread_count = 2;
+	mStop_workers = false;
+	mPreparing = 0;
+	mRunning_jobs = 0;
+	mMark_index = 0;
+	mUsage = 0;
+}
+
+resource_manager::~resource_manager()
+{
+	stop_workers();
+	clear_resources();
+}
+
+void resource_batch::add_resource(std::shared_ptr<resource> pResource)
+{
+	mNames.insert(pResource->get_type() + "/" + pResource->get_name());
+	mResources.push_back(pResource);
+}
+
+bool resource_batch::has_resource(const std::string& pType, const std::string& pName) const
+{
+	return mNames.count(pType + "/" + pName) != 0;
+}
+
+const std::vector<std::shared_ptr<resource>>& resource_batch::get_resources() const
+{
+	return mResources;
 }
 
 void resource_manager::add_resource(std::shared_ptr<resource> pResource)
 {
+	// The first resource with a name is the one that is found
+	entry nentry;
+	nentry.index = mResources.size();
+	nentry.cast_type = nullptr;
+	nentry.cast = nullptr;
+	mRegistries[pResource->get_type()].emplace(pResource->get_name(), nentry);
+
 	mResources.push_back(pResource);
 	pResource->set_resource_pack(mPack);
+	pResource->mManager = this;
+	update_usage(*pResource);
 }
 
 bool resource_manager::has_resource(std::shared_ptr<resource> pResource) const
 {
-	for (auto& i : mResources)
-		if (i == pResource)
-			return true;
-	return false;
+	const entry* e = find_entry(pResource->get_type(), pResource->get_name());
+	return e && mResources[e->index] == pResource;
 }
 
 bool resource_manager::has_resource(const std::string& pType, const std::string & pName) const
 {
-	return find_resource(pType, pName) != nullptr;
+	return find_entry(pType, pName) != nullptr;
 }
 
-std::shared_ptr<resource> resource_manager::find_resource(const std::string& pType, const std::string& pName) const
+bool resource_manager::is_resource_loaded(const std::string& pType, const std::string& pName) const
 {
-	for (auto& i : mResources)
-		if (i->get_type() == pType && i->get_name() == pName)
-			return i;
-	return {};
+	const entry* e = find_entry(pType, pName);
+	return e && mResources[e->index]->is_loaded();
+}
+
+resource_manager::entry* resource_manager::find_entry(const std::string& pType, const std::string& pName)
+{
+	auto type = mRegistries.find(pType);
+	if (type == mRegistries.end())
+		return nullptr;
+	auto item = type->second.find(pName);
+	if (item == type->second.end())
+		return nullptr;
+	return &item->second;
+}
+
+const resource_manager::entry* resource_manager::find_entry(const std::string& pType, const std::string& pName) const
+{
+	return const_cast<resource_manager*>(this)->find_entry(pType, pName);
 }
 
 void resource_manager::unload_all()
 {
+	// Resources still loading in the background are left alone
 	for (auto& i : mResources)
-		 i->unload();
+		if (!i->is_loading())
+			i->unload();
 }
 
 void resource_manager::unload_unused()
 {
+	if (mUsage <= mMemory_budget)
+		return;
+
+	std::vector<resource*> unused;
 	for (auto& i : mResources)
-		if (i.use_count() <= 1)
-			i->unload();
+	{
+		if (i.use_count() > 1)
+			i->mLast_used = mFrame;
+		else if (i->is_loaded() && !i->is_loading()
+			&& mFrame - i->mLast_used >= mGrace_period)
+			unused.push_back(i.get());
+	}
+
+	std::sort(unused.begin(), unused.end(),
+		[](const resource* pL, const resource* pR)
+	{
+		return pL->mLast_used < pR->mLast_used;
+	});
+
+	// Unloading updates mUsage
+	for (auto i : unused)
+	{
+		if (mUsage <= mMemory_budget)
+			break;
+		i->unload();
+	}
+}
+
+void resource_manager::update()
+{
+	++mFrame;
+
+	// A few resources are checked every frame so each one is
+	// seen within a quarter of the grace period.
+	const size_t frames = std::max<size_t>(mGrace_period / 4, 1);
+	size_t count = (mResources.size() + frames - 1) / frames;
+	for (; count > 0; --count)
+	{
+		if (mMark_index >= mResources.size())
+			mMark_index = 0;
+		auto& i = mResources[mMark_index++];
+		if (i.use_count() > 1)
+			i->mLast_used = mFrame;
+	}
+
+	// Only scans the resources when over the budget
+	unload_unused();
+}
+
+void resource_manager::set_memory_budget(size_t pBytes)
+{
+	mMemory_budget = pBytes;
+}
+
+size_t resource_manager::get_memory_budget() const
+{
+	return mMemory_budget;
+}
+
+void resource_manager::set_unload_grace_period(size_t pFrames)
+{
+	mGrace_period = pFrames;
+}
+
+size_t resource_manager::get_memory_usage() const
+{
+	return mUsage;
+}
+
+void resource_manager::update_usage(resource& pResource)
+{
+	const size_t bytes = pResource.is_loaded() ? pResource.get_memory_usage() : 0;
+	if (bytes == pResource.mCounted_bytes)
+		return;
+
+	size_t& type_usage = mType_usage[pResource.get_type()];
+	type_usage = type_usage - pResource.mCounted_bytes + bytes;
+	mUsage = mUsage - pResource.mCounted_bytes + bytes;
+	pResource.mCounted_bytes = bytes;
+
+	size_t& peak = mPeak_usage[pResource.get_type()];
+	peak = std::max(peak, type_usage);
 }
 
 void resource_manager::clear_resources()
 {
+	{
+		// Resources already being prepared are finished as usual
+		std::lock_guard<std::mutex> lock(mLoad_mutex);
+		for (auto& i : mLoad_queue)
+			i->mIs_loading = false;
+		for (auto& i : mPrepared)
+			i.res->mIs_loading = false;
+		mLoad_queue.clear();
+		mPrepared.clear();
+	}
+
+	// Resources can outlive the manager
+	for (auto& i : mResources)
+	{
+		i->mManager = nullptr;
+		i->mCounted_bytes = 0;
+	}
+	mRegistries.clear();
 	mResources.clear();
+	mMark_index = 0;
+	mUsage = 0;
+	mType_usage.clear();
 }
 
 void resource_manager::set_resource_pack(resource_pack * pPack)
@@ -92,11 +262,35 @@ void resource_manager::set_resource_pack(resource_pack * pPack)
 		 i->set_resource_pack(pPack);
 }
 
+static std::string format_bytes(size_t pBytes)
+{
+	if (pBytes >= 1024 * 1024)
+		return std::to_string(pBytes / (1024 * 1024)) + " MB";
+	if (pBytes >= 1024)
+		return std::to_string(pBytes / 1024) + " KB";
+	return std::to_string(pBytes) + " B";
+}
+
 std::string resource_manager::get_resource_log() const
 {
 	std::string val;
 	for (auto& i : mResources)
-		 val += (i->is_loaded() ? "(loaded)   [" : "(unloaded) [") + i->get_type() + "] " + i->get_name() + "\n";
+	{
+		const char* state = "(unloaded) [";
+		if (i->is_loading())
+			state = "(loading)  [";
+		else if (i->is_loaded())
+			state = "(loaded)   [";
+		val += state + i->get_type() + "] " + i->get_name() + "\n";
+	}
+
+	for (auto& i : mType_usage)
+	{
+		auto peak = mPeak_usage.find(i.first);
+		const size_t peak_bytes = std::max(i.second, peak == mPeak_usage.end() ? 0 : peak->second);
+		val += "[" + i.first + "] " + format_bytes(i.second) + " (peak " + format_bytes(peak_bytes) + ")\n";
+	}
+	val += "Total: " + format_bytes(get_memory_usage()) + " of " + format_bytes(mMemory_budget) + "\n";
 	return val;
 }
 
@@ -124,21 +318,61 @@ void resource_manager::remove_loader(std::shared_ptr<resource_loader> pLoader)
 
 bool resource_manager::reload_all()
 {
-	mResources.clear();
-	for (auto& i : mLoaders)
+	clear_resources();
+
+	// The loaders scan concurrently on the workers
+	engine::clock scan_clock;
+	std::vector<resource_batch> batches(mLoaders.size());
+	std::vector<float> times(mLoaders.size(), 0);
+	std::vector<char> results(mLoaders.size(), false);
+	std::vector<std::string> errors(mLoaders.size());
+	std::vector<std::function<void()>> jobs;
+	for (size_t i = 0; i < mLoaders.size(); i++)
 	{
-		if (mPack)
+		jobs.push_back([&, i]()
 		{
-			if (!i->load_pack(*this, *mPack))
-				return false;
-		}
-		else
+			engine::clock loader_clock;
+			try
+			{
+				if (mPack)
+					results[i] = mLoaders[i]->load_pack(batches[i], *mPack);
+				else
+					results[i] = mLoaders[i]->load(batches[i], mData_filepath);
+			}
+			catch (const std::exception& e)
+			{
+				// Logged on the calling thread once every loader is done
+				results[i] = false;
+				errors[i] = e.what();
+			}
+			times[i] = loader_clock.get_elapse().milliseconds();
+		});
+	}
+	run_jobs(jobs);
+	const float scan_time = scan_clock.get_elapse().milliseconds();
+
+	// Registered in the order of the loaders so lookups stay the same
+	engine::clock register_clock;
+	bool succ = true;
+	for (size_t i = 0; i < batches.size(); i++)
+	{
+		logger::info("Loader " + std::to_string(i) + " found "
+			+ std::to_string(batches[i].get_resources().size()) + " resources in "
+			+ std::to_string(times[i]) + " ms");
+		if (!errors[i].empty())
+			logger::error("Loader " + std::to_string(i) + " failed: " + errors[i]);
+		if (!results[i])
 		{
-			if (!i->load(*this, mData_filepath))
-				return false;
+			succ = false;
+			continue;
 		}
+		mResources.reserve(mResources.size() + batches[i].get_resources().size());
+		for (auto& j : batches[i].get_resources())
+			add_resource(j);
 	}
-	return true;
+	logger::info("Scanned resources in " + std::to_string(scan_time) + " ms, registered in "
+		+ std::to_string(register_clock.get_elapse().milliseconds()) + " ms");
+	return succ;
 }
 
 void resource_manager::clear_loaders()
@@ -148,7 +382,170 @@ void resource_manager::clear_loaders()
 
 void resource_manager::ensure_load()
 {
+	PROFILE_ZONE("resource_manager::ensure_load");
 	for (auto& i : mResources)
 		if (i.use_count() > 1)
 			i->load();
 }
+
+void resource_manager::load_async(std::shared_ptr<resource> pResource)
+{
+	if (!pResource || pResource->is_loaded() || pResource->is_loading())
+		return;
+	pResource->mIs_loading = true;
+
+	// Workers are only started when they are first needed
+	if (mWorkers.empty())
+		start_workers();
+	{
+		std::lock_guard<std::mutex> lock(mLoad_mutex);
+		mLoad_queue.push_back(pResource);
+	}
+	mLoad_condition.notify_one();
+}
+
+void resource_manager::finish_loading(float pBudget)
+{
+	PROFILE_ZONE("resource_manager::finish_loading");
+	engine::clock budget;
+	for (;;)
+	{
+		prepared current;
+		{
+			std::lock_guard<std::mutex> lock(mLoad_mutex);
+			if (mPrepared.empty())
+				return;
+			current = std::move(mPrepared.front());
+			mPrepared.pop_front();
+		}
+
+		current.res->mIs_loading = false;
+		if (!current.success || !current.res->finish_load())
+			logger::error("Failed to load resource '" + current.res->get_name() + "'");
+
+		// At least one resource is finished every call
+		if (budget.get_elapse().milliseconds() >= pBudget)
+			return;
+	}
+}
+
+size_t resource_manager::get_loading_count() const
+{
+	std::lock_guard<std::mutex> lock(mLoad_mutex);
+	return mLoad_queue.size() + mPreparing + mPrepared.size();
+}
+
+void resource_manager::cancel_loading()
+{
+	// Joining waits for the resources the workers are preparing
+	const bool running = !mWorkers.empty();
+	stop_workers();
+	{
+		std::lock_guard<std::mutex> lock(mLoad_mutex);
+		for (auto& i : mLoad_queue)
+			i->mIs_loading = false;
+		for (auto& i : mPrepared)
+			i.res->mIs_loading = false;
+		mLoad_queue.clear();
+		mPrepared.clear();
+	}
+	if (running)
+		start_workers();
+}
+
+void resource_manager::set_loader_thread_count(size_t pCount)
+{
+	if (pCount == 0)
+		pCount = 1;
+	if (pCount == mThread_count)
+		return;
+	mThread_count = pCount;
+
+	// Queued resources are kept. The new workers pick them up.
+	if (!mWorkers.empty())
+	{
+		stop_workers();
+		start_workers();
+	}
+}
+
+void resource_manager::start_workers()
+{
+	mStop_workers = false;
+	for (size_t i = 0; i < mThread_count; i++)
+		mWorkers.emplace_back(&resource_manager::worker_loop, this);
+}
+
+void resource_manager::stop_workers()
+{
+	{
+		std::lock_guard<std::mutex> lock(mLoad_mutex);
+		mStop_workers = true;
+	}
+	mLoad_condition.notify_all();
+	for (auto& i : mWorkers)
+		if (i.joinable())
+			i.join();
+	mWorkers.clear();
+}
+
+void resource_manager::worker_loop()
+{
+	std::unique_lock<std::mutex> lock(mLoad_mutex);
+	for (;;)
+	{
+		mLoad_condition.wait(lock, [&]() { return mStop_workers || !mJobs.empty() || !mLoad_queue.empty(); });
+		if (mStop_workers)
+			return;
+
+		if (!mJobs.empty())
+		{
+			run_job(lock);
+			continue;
+		}
+
+		prepared current;
+		current.res = std::move(mLoad_queue.front());
+		mLoad_queue.pop_front();
+		++mPreparing;
+		lock.unlock();
+
+		{
+			PROFILE_ZONE("resource prepare_load");
+			current.success = current.res->prepare_load();
+		}
+
+		lock.lock();
+		--mPreparing;
+		mPrepared.push_back(std::move(current));
+	}
+}
+
+void resource_manager::run_jobs(std::vector<std::function<void()>>& pJobs)
+{
+	if (mWorkers.empty())
+		start_workers();
+
+	std::unique_lock<std::mutex> lock(mLoad_mutex);
+	for (auto& i : pJobs)
+		mJobs.push_back(std::move(i));
+	mLoad_condition.notify_all();
+
+	while (!mJobs.empty())
+		run_job(lock);
+	mJobs_condition.wait(lock, [&]() { return mRunning_jobs == 0; });
+}
+
+void resource_manager::run_job(std::unique_lock<std::mutex>& pLock)
+{
+	auto job = std::move(mJobs.front());
+	mJobs.pop_front();
+	++mRunning_jobs;
+	pLock.unlock();
+
+	job();
+
+	pLock.lock();
+	if (--mRunning_jobs == 0)
+		mJobs_condition.notify_all();
+}
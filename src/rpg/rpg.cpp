@@ -1,6 +1,7 @@
 #include <rpg/rpg.hpp>
 
 #include <engine/logger.hpp>
+#include <engine/profiler.hpp>
 
 #include <algorithm>
 #include <fstream>
@@ -14,10 +15,10 @@ using namespace rpg;
 
 static int add_section_from_pack(const engine::encoded_path& pPath, engine::resource_pack& pPack,  AS::CScriptBuilder& pBuilder)
 {
-	auto data = pPack.read_all(pPath);
+	auto data = pPack.view(pPath);
 	if (data.empty())
 		return -1;
-	return pBuilder.AddSectionFromMemory(pPath.string().c_str(), &data[0], data.size());
+	return pBuilder.AddSectionFromMemory(pPath.string().c_str(), data.data(), data.size());
 }
 
 static int pack_include_callback(const char *include, const char *from, AS::CScriptBuilder *pBuilder, void *pUser)
@@ -228,7 +229,8 @@ game::game()
 
 	mScene.set_resource_manager(mResource_manager);
 
-	mResource_manager.add_loader(std::make_shared<texture_loader>());
+	mTexture_loader = std::make_shared<texture_loader>();
+	mResource_manager.add_loader(mTexture_loader);
 	mResource_manager.add_loader(std::make_shared<font_loader>());
 	mResource_manager.add_loader(std::make_shared<audio_loader>());
 }
@@ -436,13 +438,15 @@ void game::load_script_interface()
 
 void game::load_icon()
 {
-	get_renderer()->get_window()->set_icon((mData_directory / "icon.png").string());
+	if (auto window = get_renderer()->get_window())
+		window->set_icon((mData_directory / "icon.png").string());
 }
 
 void game::load_icon_pack()
 {
 	auto data = mPack.read_all("icon.png");
-	get_renderer()->get_window()->set_icon(data);
+	if (auto window = get_renderer()->get_window())
+		window->set_icon(data);
 }
 
 #ifndef LOCKED_RELEASE_MODE
@@ -596,10 +600,62 @@ void game::load_terminal_interface(engine::terminal_system& pTerminal)
 		return true;
 	}, "<Slot #> - Open game from slot");
 
+	mGroup_profile = std::make_shared<engine::terminal_command_group>();
+	mGroup_profile->set_root_command("profile");
+	mGroup_profile->add_command("start",
+		[&](const engine::terminal_arglist& pArgs)->bool
+	{
+		if (!pArgs.empty())
+		{
+			try {
+				engine::profiler::set_history_size(static_cast<size_t>(
+					std::max(util::to_numeral<int>(pArgs[0].get_raw()), 1)));
+			}
+			catch (...)
+			{
+				logger::error("Failed to parse frame count");
+				return false;
+			}
+		}
+		engine::profiler::clear();
+		engine::profiler::set_enabled(true);
+		logger::info("Profiling the last " + std::to_string(engine::profiler::get_history_size()) + " frames");
+		return true;
+	}, "[Frames] - Start recording frames (Default: 300)");
+
+	mGroup_profile->add_command("stop",
+		[&](const engine::terminal_arglist& pArgs)->bool
+	{
+		engine::profiler::set_enabled(false);
+		logger::info("Profiling stopped");
+		return true;
+	}, "- Stop recording frames. Recorded frames are kept.");
+
+	mGroup_profile->add_command("summary",
+		[&](const engine::terminal_arglist& pArgs)->bool
+	{
+		logger::info(engine::profiler::get_summary());
+		return true;
+	}, "- Display the average time of each zone");
+
+	mGroup_profile->add_command("save",
+		[&](const engine::terminal_arglist& pArgs)->bool
+	{
+		const std::string destination = pArgs.empty() ? "./profile.json" : pArgs[0].get_raw();
+		if (!engine::profiler::save_chrome_trace(destination))
+		{
+			logger::error("Failed to write profile to '" + destination + "'");
+			return false;
+		}
+		logger::info("Profile saved to '" + destination + "'");
+		return true;
+	}, "[Destination] - Save recorded frames as a Chrome trace (Default: ./profile.json)");
+
 	pTerminal.add_group(mGroup_flags);
 	pTerminal.add_group(mGroup_game);
 	pTerminal.add_group(mGroup_global1);
 	pTerminal.add_group(mGroup_slot);
+	pTerminal.add_group(mGroup_profile);
 }
 #endif
 
@@ -632,6 +688,16 @@ bool game::load(engine::fs::path pData_dir)
 	
 	mData_directory = pData_dir;
 
+	engine::clock phase_clock;
+	std::string startup_timings;
+	auto end_phase = [&](const std::string& pName)
+	{
+		startup_timings += " " + pName + " " + std::to_string(phase_clock.restart().milliseconds()) + " ms";
+	};
+
+	// The workers may still be reading from the old pack
+	mResource_manager.cancel_loading();
+
 	game_settings_loader settings;
 	if (engine::fs::is_directory(pData_dir)) // Data folder 
 	{
@@ -651,15 +717,15 @@ bool game::load(engine::fs::path pData_dir)
 	{
 		logger::info("Loading settings from pack...");
 
-		if (!mPack.open(pData_dir.string()))
+		if (!mPack.open(pData_dir.string(), true))
 		{
 			logger::error("Could not load pack");
 			return (mIs_ready = false, false);
 		}
 
-		const auto settings_data = mPack.read_all("game.xml");
+		const auto settings_data = mPack.view("game.xml");
 
-		if (!settings.load_memory(&settings_data[0], settings_data.size()))
+		if (!settings.load_memory(settings_data.data(), settings_data.size()))
 			return (mIs_ready = false, false);
 
 		mResource_manager.set_resource_pack(&mPack);
@@ -669,8 +735,10 @@ bool game::load(engine::fs::path pData_dir)
 	}
 
 	logger::info("Settings loaded");
+	end_phase("settings");
 
-	get_renderer()->get_window()->set_title(settings.get_title());
+	if (auto window = get_renderer()->get_window()) // Not there when running headless
+		window->set_title(settings.get_title());
 
 	get_renderer()->set_target_size(settings.get_screen_size());
 
@@ -678,6 +746,8 @@ bool game::load(engine::fs::path pData_dir)
 
 	logger::info("Loading Resources...");
 
+	mTexture_loader->set_packing(settings.get_texture_page_size(), settings.get_texture_max_packed_size());
+
 	if (!mResource_manager.reload_all()) // Load the resources from the loaders
 	{
 		logger::error("Resources failed to load");
@@ -685,9 +755,11 @@ bool game::load(engine::fs::path pData_dir)
 	}
 
 	logger::info("Resources loaded");
+	end_phase("resources");
 
 	if (!mScene.load_settings(settings))
 		return (mIs_ready = false, false);
+	end_phase("scene_settings");
 
 	mIs_ready = true;
 
@@ -695,6 +767,9 @@ bool game::load(engine::fs::path pData_dir)
 
 	mScene.clean(true);
 	mScene.load_scene(settings.get_start_scene());
+	end_phase("start_scene");
+
+	logger::info("Startup timings:" + startup_timings);
 	return true;
 }
 
@@ -712,6 +787,7 @@ void game::clear_scene()
 
 bool game::tick()
 {
+	PROFILE_ZONE("game::tick");
 	if (!mIs_ready || !mScene.is_ready())
 		return false;
 
@@ -719,6 +795,11 @@ bool game::tick()
 
 	engine::renderer& renderer = *get_renderer();
 
+	// Textures and sounds streamed in the background
+	mResource_manager.finish_loading();
+	mResource_manager.update();
+	PROFILE_COUNTER("loading resources", mResource_manager.get_loading_count());
+
 	mScene.tick(mControls);
 
 	mScript.tick();
@@ -1303,12 +1384,22 @@ void colored_overlay::script_set_overlay_opacity(float a)
 // ##########
 
 pathfinding_system::pathfinding_system()
+	: mCollision_system(nullptr)
+	, mWalkability_version(0)
+	, mWalkability_changes_applied(0)
+	, mSnapshot_version(0)
+	, mSnapshot_changes(0)
 {
 	mPathfinder.set_collision_callback(
 		[&](engine::fvector& pos) ->bool
 	{
-		auto hit = mCollision_system->get_container().first_collision(collision_box::type::wall, { pos, { 0.9f, 0.9f } });
-		return (bool)hit;
+		return is_blocked(pos);
+	});
+
+	mHierarchical_pathfinder.set_tile_callback(
+		[&](engine::ivector pTile) ->bool
+	{
+		return is_blocked(pTile);
 	});
 }
 
@@ -1321,6 +1412,103 @@ void pathfinding_system::load_script_interface(script_system & pScript)
 {	
 	pScript.add_function("find_path", &pathfinding_system::script_find_path, this);
 	pScript.add_function("find_path_partial", &pathfinding_system::script_find_path_partial, this);
+	pScript.add_function("find_path_hierarchical", &pathfinding_system::script_find_path_hierarchical, this);
+	pScript.add_function("find_path_async", &pathfinding_system::script_find_path_async, this);
+	pScript.add_function("is_path_ready", &pathfinding_system::script_is_path_ready, this);
+	pScript.add_function("get_path_result", &pathfinding_system::script_get_path_result, this);
+	pScript.add_function("cancel_path", &pathfinding_system::script_cancel_path, this);
+}
+
+void pathfinding_system::tick()
+{
+	mRequests.deliver();
+}
+
+void pathfinding_system::clear()
+{
+	mRequests.cancel_all();
+	mSnapshot.reset();
+}
+
+std::string pathfinding_system::get_request_log() const
+{
+	std::string log;
+	log += "Async path requests\n";
+	log += "  Queue depth     : " + std::to_string(mRequests.get_queue_depth()) + "\n";
+	log += "  Delivered       : " + std::to_string(mRequests.get_delivered_count()) + "\n";
+	log += "  Average latency : " + std::to_string(mRequests.get_average_latency()) + " ms\n";
+	log += "  Max latency     : " + std::to_string(mRequests.get_max_latency()) + " ms";
+	return log;
+}
+
+std::shared_ptr<const engine::walkability_snapshot> pathfinding_system::get_snapshot()
+{
+	// Reuse the last snapshot until the walls change
+	if (mSnapshot
+		&& mSnapshot_version == mCollision_system->get_walkability_version()
+		&& mSnapshot_changes == mCollision_system->get_walkability_changes().size())
+		return mSnapshot;
+
+	std::vector<engine::frect> walls;
+	for (auto& i : mCollision_system->get_container().get_boxes())
+		if (i->get_type() == collision_box::type::wall
+			&& i->is_enabled())
+			walls.push_back(i->get_region());
+
+	mSnapshot = std::make_shared<const engine::walkability_snapshot>(mCollision_system->get_walkability(), walls);
+	mSnapshot_version = mCollision_system->get_walkability_version();
+	mSnapshot_changes = mCollision_system->get_walkability_changes().size();
+	return mSnapshot;
+}
+
+bool pathfinding_system::is_blocked(engine::fvector pPosition) const
+{
+	const engine::frect region(pPosition, { 0.9f, 0.9f });
+
+	// Only tiles partially covered by a wall need the exact check
+	switch (mCollision_system->get_walkability().test_region(region))
+	{
+	case engine::walkability_grid::cell::open:
+		return false;
+	case engine::walkability_grid::cell::blocked:
+		return true;
+	default:
+		return (bool)mCollision_system->get_container().first_collision(collision_box::type::wall, region);
+	}
+}
+
+void pathfinding_system::update_hierarchical_pathfinder()
+{
+	const auto& changes = mCollision_system->get_walkability_changes();
+
+	// Scene was reloaded or the walls grew past the old bounds
+	if (mWalkability_version != mCollision_system->get_walkability_version())
+	{
+		// Leave a margin so routes can go around the outer walls
+		engine::irect bounds = mCollision_system->get_walkability().get_bounds();
+		bounds.x -= 1;
+		bounds.y -= 1;
+		bounds.w += 2;
+		bounds.h += 2;
+		mHierarchical_pathfinder.build(bounds);
+
+		mWalkability_version = mCollision_system->get_walkability_version();
+		mWalkability_changes_applied = changes.size();
+		return;
+	}
+
+	for (; mWalkability_changes_applied < changes.size(); mWalkability_changes_applied++)
+	{
+		const engine::frect& region = changes[mWalkability_changes_applied];
+
+		// Tiles are tested with a slightly smaller box so tiles
+		// just outside the region can be affected as well
+		mHierarchical_pathfinder.update({
+			static_cast<int>(std::floor(region.x)) - 1,
+			static_cast<int>(std::floor(region.y)) - 1,
+			static_cast<int>(std::ceil(region.w)) + 3,
+			static_cast<int>(std::ceil(region.h)) + 3 });
+	}
 }
 
 bool pathfinding_system::script_find_path(AS_array<engine::fvector>& pScript_path, engine::fvector pStart, engine::fvector pDestination)
@@ -1337,6 +1525,55 @@ bool pathfinding_system::script_find_path(AS_array<engine::fvector>& pScript_pat
 	return false;
 }
 
+bool pathfinding_system::script_find_path_hierarchical(AS_array<engine::fvector>& pScript_path, engine::fvector pStart, engine::fvector pDestination)
+{
+	update_hierarchical_pathfinder();
+
+	// The clusters only cover the area around the walls
+	const engine::irect& bounds = mHierarchical_pathfinder.get_bounds();
+	const engine::frect area(engine::fvector(bounds.get_offset()), engine::fvector(bounds.get_size()));
+	if (!area.is_intersect(pStart) || !area.is_intersect(pDestination))
+		return script_find_path(pScript_path, pStart, pDestination);
+
+	if (mHierarchical_pathfinder.start(pStart, pDestination))
+	{
+		auto path = mHierarchical_pathfinder.construct_path();
+		for (auto& i : path)
+			pScript_path.InsertLast(&i);
+		return true;
+	}
+	return false;
+}
+
+int pathfinding_system::script_find_path_async(engine::fvector pStart, engine::fvector pDestination)
+{
+	return mRequests.submit(pStart, pDestination, get_snapshot());
+}
+
+bool pathfinding_system::script_is_path_ready(int pId)
+{
+	return mRequests.is_ready(pId);
+}
+
+bool pathfinding_system::script_get_path_result(AS_array<engine::fvector>& pScript_path, int pId)
+{
+	engine::path_request_queue::result result;
+	if (!mRequests.take_result(pId, result))
+	{
+		logger::warning("Path request " + std::to_string(pId) + " is not ready");
+		return false;
+	}
+
+	for (auto& i : result.path)
+		pScript_path.InsertLast(&i);
+	return result.found;
+}
+
+void pathfinding_system::script_cancel_path(int pId)
+{
+	mRequests.cancel(pId);
+}
+
 bool pathfinding_system::script_find_path_partial(AS_array<engine::fvector>& pScript_path, engine::fvector pStart, engine::fvector pDestination, int pCount)
 {
 	mPathfinder.set_path_limit(pCount);
@@ -1533,6 +1770,16 @@ const engine::controls& game_settings_loader::get_key_bindings() const
 	return mKey_bindings;
 }
 
+int game_settings_loader::get_texture_page_size() const
+{
+	return mTexture_page_size;
+}
+
+int game_settings_loader::get_texture_max_packed_size() const
+{
+	return mTexture_max_packed_size;
+}
+
 bool game_settings_loader::parse_settings(tinyxml2::XMLDocument & pDoc, const std::string& pPrefix_path)
 {
 	auto ele_root = pDoc.RootElement();
@@ -1588,6 +1835,18 @@ bool game_settings_loader::parse_settings(tinyxml2::XMLDocument & pDoc, const st
 		ele_screen_size->FloatAttribute("x"),
 		ele_screen_size->FloatAttribute("y")
 	};
+
+	// Optional
+	if (auto ele_texture_packing = ele_root->FirstChildElement("texture_packing"))
+	{
+		mTexture_page_size = ele_texture_packing->IntAttribute("page_size", 2048);
+		mTexture_max_packed_size = ele_texture_packing->IntAttribute("max_size", 512);
+	}
+	else
+	{
+		mTexture_page_size = 0;
+		mTexture_max_packed_size = 0;
+	}
 	
 	auto ele_controls = ele_root->FirstChildElement("controls");
 	if (!ele_controls)
@@ -1763,6 +2022,16 @@ terminal_gui::terminal_gui()
 	mLb_autocomplete = std::make_shared<tgui::ListBox>();
 	mLb_autocomplete->setTextSize(10);
 	mLb_autocomplete->hide();
+
+	mCv_frame_graph = std::make_shared<tgui::Canvas>();
+	mCv_frame_graph->setSize(300, 100);
+	mCv_frame_graph->hide();
+
+	mLb_profile = std::make_shared<tgui::Label>();
+	mLb_profile->setTextSize(10);
+	mLb_profile->setTextColor({ 255, 255, 255, 255 });
+	mLb_profile->getRenderer()->setBackgroundColor({ 0, 0, 0, 180 });
+	mLb_profile->hide();
 }
 
 void terminal_gui::set_terminal_system(engine::terminal_system & pTerminal_system)
@@ -1808,6 +2077,13 @@ void terminal_gui::load_gui(engine::renderer & pR)
 	mLb_autocomplete->setPosition(tgui::bindLeft(mEb_input), tgui::bindTop(mEb_input) - 200);
 	mLb_autocomplete->setSize(tgui::bindWidth(mEb_input), 200);
 	pR.get_tgui().add(mLb_autocomplete);
+
+	mCv_frame_graph->setPosition(0, 0);
+	pR.get_tgui().add(mCv_frame_graph);
+
+	mLb_profile->setPosition(0, tgui::bindBottom(mCv_frame_graph));
+	mLb_profile->setSize(tgui::bindWidth(mCv_frame_graph), 200);
+	pR.get_tgui().add(mLb_profile);
 }
 
 inline std::string snip_bottom_string(const std::string& pStr, size_t pLines)
@@ -1865,8 +2141,29 @@ void terminal_gui::update(engine::renderer& pR)
 		}
 	}
 
+	if (pR.is_key_down(engine::renderer::key_code::LControl, true) // Toggle frame graph
+		&& pR.is_key_pressed(engine::renderer::key_code::P, true))
+	{
+		if (mCv_frame_graph->isVisible())
+		{
+			mCv_frame_graph->hide();
+			mLb_profile->hide();
+		}
+		else
+		{
+			// The graph needs something to show
+			engine::profiler::set_enabled(true);
+			mCv_frame_graph->show();
+			mLb_profile->show();
+		}
+		refresh_frame_graph();
+	}
+
 	if (mRefresh_timer.is_reached())
 		refresh_log();
+
+	if (mGraph_timer.is_reached())
+		refresh_frame_graph();
 }
 
 void terminal_gui::refresh_autocomplete()
@@ -1897,4 +2194,44 @@ void terminal_gui::refresh_log()
 	if (log != mLb_log->getText())
 		mLb_log->setText(log);
 }
+
+void terminal_gui::refresh_frame_graph()
+{
+	if (!mCv_frame_graph->isVisible())
+		return;
+	mGraph_timer.start(0.1f);
+
+	const auto times = engine::profiler::get_frame_times();
+	const engine::fvector size = mCv_frame_graph->getSize();
+
+	// 33ms at the top of the graph
+	const float scale = size.y / 33.3f;
+	const float bar_width = size.x / std::max<float>(static_cast<float>(times.size()), 1.f);
+
+	sf::VertexArray bars(sf::Quads, times.size() * 4);
+	for (size_t i = 0; i < times.size(); i++)
+	{
+		const float left = i * bar_width;
+		const float top = size.y - std::min(times[i] * scale, size.y);
+		const sf::Color color = times[i] > 16.7f ? sf::Color(255, 100, 100) : sf::Color(100, 255, 100);
+		bars[i * 4].position = { left, size.y };
+		bars[i * 4 + 1].position = { left, top };
+		bars[i * 4 + 2].position = { left + bar_width, top };
+		bars[i * 4 + 3].position = { left + bar_width, size.y };
+		for (size_t j = 0; j < 4; j++)
+			bars[i * 4 + j].color = color;
+	}
+
+	// Line at 60 fps
+	sf::RectangleShape target({ size.x, 1 });
+	target.setPosition(0, size.y - 16.7f * scale);
+	target.setFillColor({ 255, 255, 255, 150 });
+
+	mCv_frame_graph->clear({ 0, 0, 0, 180 });
+	mCv_frame_graph->draw(bars);
+	mCv_frame_graph->draw(target);
+	mCv_frame_graph->display();
+
+	mLb_profile->setText(engine::profiler::get_summary());
+}
 #endif
@@ -14,10 +14,124 @@
 #include <vector>
 #include <list>
 #include <set>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
 
 using namespace rpg;
 
-bool texture_loader::load(engine::resource_manager& pResource_manager, const std::string& mData_filepath)
+// Walk a directory once and keep every file path so existence checks
+// for companion files don't need to touch the disk again.
+static std::vector<engine::fs::path> scan_directory(const engine::fs::path& pPath, std::set<std::string>& pFiles)
+{
+	std::vector<engine::fs::path> files;
+	for (const auto& i : engine::fs::recursive_directory_iterator(pPath))
+	{
+		files.push_back(i.path());
+		pFiles.insert(i.path().string());
+	}
+	return files;
+}
+
+// Read the size from the header of a png without decoding it
+static bool read_png_size(const char* pHeader, size_t pSize, engine::ivector& pResult)
+{
+	static const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	if (pSize < 24 || std::memcmp(pHeader, signature, sizeof(signature)) != 0
+		|| std::memcmp(pHeader + 12, "IHDR", 4) != 0)
+		return false;
+
+	auto read_uint32 = [&](size_t pOffset)
+	{
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(pHeader + pOffset);
+		return (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16)
+			| (static_cast<uint32_t>(bytes[2]) << 8) | static_cast<uint32_t>(bytes[3]);
+	};
+	pResult.x = static_cast<int>(read_uint32(16));
+	pResult.y = static_cast<int>(read_uint32(20));
+	return true;
+}
+
+texture_loader::texture_loader()
+{
+	mPage_size = 0;
+	mMax_size = 512;
+}
+
+void texture_loader::set_packing(int pPage_size, int pMax_size)
+{
+	mPage_size = pPage_size;
+	mMax_size = pMax_size;
+}
+
+void texture_loader::pack_textures(std::vector<packing_entry>& pEntries) const
+{
+	// Tallest first packs tightest with a skyline
+	std::vector<packing_entry*> candidates;
+	for (auto& i : pEntries)
+		if (i.size.x > 0 && i.size.y > 0 && i.size.x <= mMax_size && i.size.y <= mMax_size)
+			candidates.push_back(&i);
+	std::sort(candidates.begin(), candidates.end(),
+		[](const packing_entry* pL, const packing_entry* pR)
+	{
+		if (pL->size.y != pR->size.y)
+			return pL->size.y > pR->size.y;
+		if (pL->size.x != pR->size.x)
+			return pL->size.x > pR->size.x;
+		return pL->source < pR->source;
+	});
+
+	engine::texture_packer packer;
+	packer.set_page_size({ mPage_size, mPage_size });
+	std::vector<int> pages(candidates.size());
+	std::vector<engine::ivector> positions(candidates.size());
+	for (size_t i = 0; i < candidates.size(); i++)
+		pages[i] = packer.add(candidates[i]->size, positions[i]);
+
+	// Pages with a single texture are not worth it
+	std::vector<size_t> member_count(packer.get_page_count(), 0);
+	std::vector<engine::ivector> extents(packer.get_page_count());
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		if (pages[i] < 0)
+			continue;
+		++member_count[pages[i]];
+		extents[pages[i]].x = std::max(extents[pages[i]].x, positions[i].x + candidates[i]->size.x);
+		extents[pages[i]].y = std::max(extents[pages[i]].y, positions[i].y + candidates[i]->size.y);
+	}
+
+	std::vector<std::shared_ptr<engine::texture_page>> texture_pages(packer.get_page_count());
+	size_t packed_count = 0;
+	uint64_t packed_area = 0;
+	uint64_t page_area = 0;
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		if (pages[i] < 0 || member_count[pages[i]] < 2)
+			continue;
+
+		auto& page = texture_pages[pages[i]];
+		if (!page)
+		{
+			// Only as large as what was put on it
+			page = std::make_shared<engine::texture_page>();
+			page->set_size(extents[pages[i]]);
+			page_area += static_cast<uint64_t>(extents[pages[i]].x) * extents[pages[i]].y;
+		}
+		page->add_member(candidates[i]->source, positions[i]);
+		candidates[i]->texture->set_page(page, engine::fvector(positions[i]), engine::fvector(candidates[i]->size));
+
+		++packed_count;
+		packed_area += static_cast<uint64_t>(candidates[i]->size.x) * candidates[i]->size.y;
+	}
+
+	const size_t page_count = std::count_if(texture_pages.begin(), texture_pages.end()
+		, [](const std::shared_ptr<engine::texture_page>& pPage) { return pPage != nullptr; });
+	const int efficiency = page_area == 0 ? 0 : static_cast<int>(packed_area * 100 / page_area);
+	logger::info("Packed " + std::to_string(packed_count) + " of " + std::to_string(pEntries.size())
+		+ " textures into " + std::to_string(page_count) + " pages (" + std::to_string(efficiency) + "% used)");
+}
+
+bool texture_loader::load(engine::resource_batch& pBatch, const std::string& mData_filepath)
 {
 	const engine::fs::path folder_path = mData_filepath + "/" + defs::DEFAULT_TEXTURES_PATH.string();
 
@@ -27,16 +141,16 @@ bool texture_loader::load(engine::resource_manager& pResource_manager, const std
 		return false;
 	}
 
-	for (const auto& i : engine::fs::recursive_directory_iterator(folder_path))
+	std::vector<packing_entry> entries;
+	std::set<std::string> files;
+	for (const auto& texture_path : scan_directory(folder_path, files))
 	{
-		auto& texture_path = i.path();
-
 		if (texture_path.extension() == ".png")
 		{
 			const std::string texture_name = texture_path.stem().string();
 
 			// Check if unique
-			if (pResource_manager.has_resource("texture", texture_name))
+			if (pBatch.has_resource("texture", texture_name))
 			{
 				logger::warning("Texture '" + texture_name + "' is not unique. Please give it a unique name.");
 				continue;
@@ -49,7 +163,7 @@ bool texture_loader::load(engine::resource_manager& pResource_manager, const std
 			// Parse atlas (if it exists)
 			auto atlas_path = texture_path.parent_path();
 			atlas_path /= texture_name + ".xml";
-			if (engine::fs::exists(atlas_path))
+			if (files.count(atlas_path.string()))
 			{
 				texture->set_atlas_source(atlas_path.string());
 			}
@@ -59,15 +173,30 @@ bool texture_loader::load(engine::resource_manager& pResource_manager, const std
 				continue; // Texture requires atlas
 			}
 
-			pResource_manager.add_resource(texture);
+			pBatch.add_resource(texture);
+
+			if (mPage_size > 0)
+			{
+				char header[24];
+				std::ifstream stream(texture_path.string().c_str(), std::ios::binary);
+				stream.read(header, sizeof(header));
+				packing_entry entry;
+				entry.texture = texture;
+				entry.source = texture_path.string();
+				if (read_png_size(header, static_cast<size_t>(stream.gcount()), entry.size))
+					entries.push_back(entry);
+			}
 		}
 	}
 
+	if (!entries.empty())
+		pack_textures(entries);
 	return true;
 }
 
-bool texture_loader::load_pack(engine::resource_manager & pResource_manager, engine::resource_pack & pPack)
+bool texture_loader::load_pack(engine::resource_batch& pBatch, engine::resource_pack & pPack)
 {
+	std::vector<packing_entry> entries;
 	auto file_list = pPack.recursive_directory(defs::DEFAULT_TEXTURES_PATH.string());
 	for (auto &i : file_list)
 	{
@@ -83,13 +212,28 @@ bool texture_loader::load_pack(engine::resource_manager & pResource_manager, eng
 			auto atlas_path = i.parent() / (texture_name + ".xml");
 			texture->set_atlas_source(atlas_path.string());
 
-			pResource_manager.add_resource(texture);
+			pBatch.add_resource(texture);
+
+			if (mPage_size > 0)
+			{
+				char header[24];
+				engine::pack_stream stream(pPack, i);
+				packing_entry entry;
+				entry.texture = texture;
+				entry.source = i.string();
+				const int64_t read = stream ? stream.read(header, sizeof(header)) : -1;
+				if (read > 0 && read_png_size(header, static_cast<size_t>(read), entry.size))
+					entries.push_back(entry);
+			}
 		}
 	}
+
+	if (!entries.empty())
+		pack_textures(entries);
 	return true;
 }
 
-bool font_loader::load(engine::resource_manager& pResource_manager, const std::string& mData_filepath)
+bool font_loader::load(engine::resource_batch& pBatch, const std::string& mData_filepath)
 {
 	const engine::fs::path folder_path = mData_filepath + "/" + defs::DEFAULT_FONTS_PATH.string();
 
@@ -99,16 +243,15 @@ bool font_loader::load(engine::resource_manager& pResource_manager, const std::s
 		return false;
 	}
 
-	for (const auto& i : engine::fs::recursive_directory_iterator(folder_path))
+	std::set<std::string> files;
+	for (const auto& font_path : scan_directory(folder_path, files))
 	{
-		auto& font_path = i.path();
-
 		if (font_path.extension() == ".ttf")
 		{
 			const std::string font_name = font_path.stem().string();
 
 			// Check if unique
-			if (pResource_manager.has_resource("font", font_name))
+			if (pBatch.has_resource("font", font_name))
 			{
 				logger::warning("Font '" + font_name + "' is not unique. Please give it a unique name.");
 				continue;
@@ -121,16 +264,16 @@ bool font_loader::load(engine::resource_manager& pResource_manager, const std::s
 			// Parse preferences xml file (if it exists)
 			auto preferences_path = font_path.parent_path();
 			preferences_path /= font_name + ".xml";
-			if (engine::fs::exists(preferences_path))
+			if (files.count(preferences_path.string()))
 				font->set_preferences_source(preferences_path.string());
 
-			pResource_manager.add_resource(font);
+			pBatch.add_resource(font);
 		}
 	}
 	return true;
 }
 
-bool font_loader::load_pack(engine::resource_manager & pResource_manager, engine::resource_pack & pPack)
+bool font_loader::load_pack(engine::resource_batch& pBatch, engine::resource_pack & pPack)
 {
 	auto file_list = pPack.recursive_directory(defs::DEFAULT_FONTS_PATH.string());
 	for (auto& i : file_list)
@@ -146,7 +289,7 @@ bool font_loader::load_pack(engine::resource_manager & pResource_manager, engine
 			auto preferences_path = i.parent() / (font_name + ".xml");
 			font->set_preferences_source(preferences_path.string());
 
-			pResource_manager.add_resource(font);
+			pBatch.add_resource(font);
 		}
 	}
 	return true;
@@ -160,7 +303,7 @@ static const std::set<std::string> supported_sound_extensions =
 };
 
 
-bool audio_loader::load(engine::resource_manager & pResource_manager, const std::string& mData_filepath)
+bool audio_loader::load(engine::resource_batch& pBatch, const std::string& mData_filepath)
 {
 	const engine::fs::path folder_path = engine::fs::path(mData_filepath) / defs::DEFAULT_AUDIO_PATH;
 
@@ -178,13 +321,13 @@ bool audio_loader::load(engine::resource_manager & pResource_manager, const std:
 			std::shared_ptr<engine::sound_file> buffer(std::make_shared<engine::sound_file>());
 			buffer->set_name(sound_path.stem().string());
 			buffer->set_filepath(sound_path.string());
-			pResource_manager.add_resource(buffer);
+			pBatch.add_resource(buffer);
 		}
 	}
 	return true;
 }
 
-bool audio_loader::load_pack(engine::resource_manager & pResource_manager, engine::resource_pack & pPack)
+bool audio_loader::load_pack(engine::resource_batch& pBatch, engine::resource_pack & pPack)
 {
 	auto file_list = pPack.recursive_directory(defs::DEFAULT_AUDIO_PATH);
 	for (auto& i : file_list)
@@ -194,13 +337,13 @@ bool audio_loader::load_pack(engine::resource_manager & pResource_manager, engin
 			std::shared_ptr<engine::sound_file> buffer(std::make_shared<engine::sound_file>());
 			buffer->set_name(i.stem());
 			buffer->set_filepath(i.string());
-			pResource_manager.add_resource(buffer);
+			pBatch.add_resource(buffer);
 		}
 	}
 	return true;
 }
 
-bool script_loader::load(engine::resource_manager & pResource_manager, const std::string & mData_filepath)
+bool script_loader::load(engine::resource_batch& pBatch, const std::string & mData_filepath)
 {
 	return false;
 }
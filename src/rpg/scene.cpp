@@ -1,9 +1,111 @@
 #include <rpg/scene.hpp>
 #include <rpg/rpg_config.hpp>
 #include <engine/logger.hpp>
+#include <engine/profiler.hpp>
+
+#include <algorithm>
 
 using namespace rpg;
 
+// #########
+// scene_prefetch
+// #########
+
+scene_prefetch::scene_prefetch()
+{
+	mIs_parsed = false;
+	mIs_warmed = false;
+	mScript_attempted = false;
+}
+
+void scene_prefetch::set_directory(const engine::encoded_path& pDirectory)
+{
+	mDirectory = pDirectory;
+}
+
+bool scene_prefetch::load()
+{
+	if (is_loaded())
+		return true;
+	prepare_load();
+	return finish_load();
+}
+
+bool scene_prefetch::unload()
+{
+	mLoader.reset();
+	mIs_parsed = false;
+	mDependencies.clear();
+	mIs_warmed = false;
+	set_loaded(false);
+	return true;
+}
+
+bool scene_prefetch::prepare_load()
+{
+	std::unique_ptr<scene_loader> loader(new scene_loader());
+	mIs_parsed = loader->parse(mDirectory, get_name(), mPack);
+	mLoader = std::move(loader);
+	return true;
+}
+
+bool scene_prefetch::finish_load()
+{
+	if (!mIs_parsed || !mLoader->load_settings())
+	{
+		mLoader.reset();
+		return set_loaded(false);
+	}
+	return set_loaded(true);
+}
+
+std::unique_ptr<scene_loader> scene_prefetch::take_loader()
+{
+	std::unique_ptr<scene_loader> loader = std::move(mLoader);
+	unload();
+	return loader;
+}
+
+const scene_loader& scene_prefetch::get_loader() const
+{
+	return *mLoader;
+}
+
+void scene_prefetch::add_dependency(std::shared_ptr<engine::resource> pResource)
+{
+	mDependencies.push_back(pResource);
+}
+
+void scene_prefetch::set_door_position(engine::fvector pPosition)
+{
+	mDoor_position = pPosition;
+}
+
+engine::fvector scene_prefetch::get_door_position() const
+{
+	return mDoor_position;
+}
+
+bool scene_prefetch::is_warmed() const
+{
+	return mIs_warmed;
+}
+
+void scene_prefetch::set_warmed(bool pWarmed)
+{
+	mIs_warmed = pWarmed;
+}
+
+bool scene_prefetch::is_script_attempted() const
+{
+	return mScript_attempted;
+}
+
+void scene_prefetch::set_script_attempted(bool pAttempted)
+{
+	mScript_attempted = pAttempted;
+}
+
 // #########
 // scene
 // #########
@@ -30,6 +132,14 @@ scene::scene()
 
 	mSound_FX.attach_mixer(mMixer);
 	mBackground_music.set_mixer(mMixer);
+
+	mLoader.reset(new scene_loader());
+
+	mPrefetch_requested = false;
+	mPrefetch_loads = 0;
+	mPrefetch_scene_hits = 0;
+	mPrefetch_script_hits = 0;
+	mPrefetch_texture_hits = 0;
 }
 
 scene::~scene()
@@ -61,6 +171,7 @@ void scene::clean(bool pFull)
 	mTilemap_display.clear();
 	mTilemap_manipulator.clear();
 	mCollision_system.clear();
+	mPathfinding_system.clear();
 	mEntity_manager.clear();
 	mColored_overlay.reset();
 	mSound_FX.stop_all();
@@ -74,6 +185,9 @@ void scene::clean(bool pFull)
 	{
 		mBackground_music.clean();
 
+		mPrefetches.clear();
+		mPrefetch_requested = false;
+
 		// Clear all contexts for recompiling
 		for (auto &i : pScript_contexts)
 			i.second.clean();
@@ -95,9 +209,16 @@ bool scene::load_scene(std::string pName)
 	logger::info("Loading scene '" + pName + "'");
 	logger::sub_routine _srtn_loading_scene;
 
-	if (mPack)
+	++mPrefetch_loads;
+	if (auto prefetch = take_prefetch(pName))
+	{
+		logger::info("Using prefetched scene");
+		mLoader = prefetch->take_loader();
+		++mPrefetch_scene_hits;
+	}
+	else if (mPack)
 	{
-		if (!mLoader.load(defs::DEFAULT_SCENES_PATH.string(), pName, *mPack))
+		if (!mLoader->load(get_scene_directory(), pName, *mPack))
 		{
 			logger::error("Unable to open scene '" + pName + "'");
 			return false;
@@ -105,33 +226,27 @@ bool scene::load_scene(std::string pName)
 	}
 	else
 	{
-		if (!mLoader.load((defs::DEFAULT_DATA_PATH / defs::DEFAULT_SCENES_PATH).string(), pName))
+		if (!mLoader->load(get_scene_directory(), pName))
 		{
 			logger::error("Unable to open scene '" + pName + "'");
 			return false;
 		}
 	}
 
-	auto collision_boxes = mLoader.get_collisionboxes();
+	auto collision_boxes = mLoader->get_collisionboxes();
 	if (collision_boxes)
 		mCollision_system.load_collision_boxes(collision_boxes);
 
-	mWorld_node.set_boundary_enable(mLoader.has_boundary());
-	mWorld_node.set_boundary(mLoader.get_boundary());
+	mWorld_node.set_boundary_enable(mLoader->has_boundary());
+	mWorld_node.set_boundary(mLoader->get_boundary());
 
-	auto &context = pScript_contexts[mLoader.get_name()];
-
-	// Compile script if not already
-	if (!context.is_valid())
+	auto found_context = pScript_contexts.find(mLoader->get_name());
+	if (found_context != pScript_contexts.end() && found_context->second.is_valid())
 	{
-		context.set_script_system(*mScript);
-		if (mPack)
-			context.build_script(mLoader.get_script_path(), *mPack);
-		else
-			context.build_script(mLoader.get_script_path());
-	}
-	else
 		logger::info("Script is already compiled");
+		++mPrefetch_script_hits;
+	}
+	auto &context = get_script_context(mLoader->get_name(), mLoader->get_script_path());
 
 	// Setup context if still valid
 	if (context.is_valid())
@@ -142,7 +257,7 @@ bool scene::load_scene(std::string pName)
 		mEnd_functions = context.get_all_with_tag("door");
 	}
 
-	if (mLoader.get_tilemap_texture().empty())
+	if (mLoader->get_tilemap_texture().empty())
 	{
 		logger::info("No tilemap texture");
 	}
@@ -151,7 +266,10 @@ bool scene::load_scene(std::string pName)
 		logger::info("Loading Tilemap...");
 		logger::sub_routine _srtn_loading_tilemap;
 
-		auto tilemap_texture = mResource_manager->get_resource<engine::texture>("texture", mLoader.get_tilemap_texture());
+		if (mResource_manager->is_resource_loaded("texture", mLoader->get_tilemap_texture()))
+			++mPrefetch_texture_hits;
+
+		auto tilemap_texture = mResource_manager->get_resource<engine::texture>("texture", mLoader->get_tilemap_texture());
 		if (!tilemap_texture)
 		{
 			logger::error("Invalid tilemap texture");
@@ -159,7 +277,7 @@ bool scene::load_scene(std::string pName)
 		}
 		mTilemap_display.set_texture(tilemap_texture);
 
-		mTilemap_manipulator.load_tilemap_xml(mLoader.get_tilemap());
+		mTilemap_manipulator.load_tilemap_xml(mLoader->get_tilemap());
 		mTilemap_display.update(mTilemap_manipulator);
 	}
 
@@ -179,6 +297,12 @@ bool scene::load_scene(std::string pName)
 
 	logger::end_sub_routine();
 
+	// The walls are rasterized by now, including any the script added
+	mPathfinding_system.update_hierarchical_pathfinder();
+
+	// Start on the neighbors once the player is placed
+	mPrefetch_requested = true;
+
 	mIs_ready = true;
 	return true;
 }
@@ -244,12 +368,12 @@ bool scene::reload_scene()
 
 const std::string& scene::get_path()
 {
-	return mLoader.get_name();
+	return mLoader->get_name();
 }
 
 const std::string& scene::get_name()
 {
-	return mLoader.get_name();
+	return mLoader->get_name();
 }
 
 void scene::load_script_interface(script_system& pScript)
@@ -338,6 +462,41 @@ void scene::load_terminal_interface(engine::terminal_system & pTerminal)
 		return true;
 	}, "- Display resource info");
 
+	mTerminal_cmd_group->add_command("paths",
+		[&](const engine::terminal_arglist& pArgs)->bool
+	{
+		logger::info(mPathfinding_system.get_request_log());
+		return true;
+	}, "- Display asynchronous pathfinding info");
+
+	mTerminal_cmd_group->add_command("prefetch",
+		[&](const engine::terminal_arglist& pArgs)->bool
+	{
+		logger::info(get_prefetch_log());
+		return true;
+	}, "- Display door prefetching hit rates");
+
+	mTerminal_cmd_group->add_command("tilemap",
+		[&](const engine::terminal_arglist& pArgs)->bool
+	{
+		logger::info("Tiles drawn: " + std::to_string(mTilemap_display.get_submitted_quad_count())
+			+ ", culled: " + std::to_string(mTilemap_display.get_culled_quad_count()));
+		return true;
+	}, "- Display tilemap culling info");
+
+	mTerminal_cmd_group->add_command("render",
+		[&](const engine::terminal_arglist& pArgs)->bool
+	{
+		if (!get_renderer())
+			return false;
+		const engine::render_stats& stats = get_renderer()->get_render_stats();
+		logger::info("Draw calls: " + std::to_string(stats.draw_calls)
+			+ ", batches: " + std::to_string(stats.batches)
+			+ ", quads: " + std::to_string(stats.quads)
+			+ ", vertices: " + std::to_string(stats.vertices));
+		return true;
+	}, "- Display draw calls and batching of the last frame");
+
 	pTerminal.add_group(mTerminal_cmd_group);
 
 }
@@ -379,10 +538,13 @@ player_character& scene::get_player()
 
 void scene::tick(engine::controls &pControls)
 {
+	PROFILE_ZONE("scene::tick");
 	assert(get_renderer() != nullptr);
 	mPlayer.movement(pControls, mCollision_system, get_renderer()->get_delta());
 	update_focus();
 	update_collision_interaction(pControls);
+	mPathfinding_system.tick();
+	update_prefetch();
 }
 
 void scene::focus_player(bool pFocus)
@@ -410,6 +572,154 @@ engine::mixer & rpg::scene::get_mixer()
 	return mMixer;
 }
 
+static std::string hit_rate(size_t pHits, size_t pTotal)
+{
+	const size_t percent = pTotal == 0 ? 0 : pHits * 100 / pTotal;
+	return std::to_string(pHits) + "/" + std::to_string(pTotal) + " (" + std::to_string(percent) + "%)";
+}
+
+std::string scene::get_prefetch_log() const
+{
+	std::string val;
+	val += "Scene loads: " + std::to_string(mPrefetch_loads) + "\n";
+	val += "Prefetched scenes: " + hit_rate(mPrefetch_scene_hits, mPrefetch_loads) + "\n";
+	val += "Compiled scripts: " + hit_rate(mPrefetch_script_hits, mPrefetch_loads) + "\n";
+	val += "Loaded tilemap textures: " + hit_rate(mPrefetch_texture_hits, mPrefetch_loads) + "\n";
+	for (auto& i : mPrefetches)
+		val += (i->is_loading() ? "(loading) " : (i->is_loaded() ? "(ready)   " : "(failed)  ")) + i->get_name() + "\n";
+	return val;
+}
+
+engine::encoded_path scene::get_scene_directory() const
+{
+	if (mPack)
+		return defs::DEFAULT_SCENES_PATH.string();
+	return (defs::DEFAULT_DATA_PATH / defs::DEFAULT_SCENES_PATH).string();
+}
+
+scene_script_context& scene::get_script_context(const std::string& pName, const std::string& pScript_path)
+{
+	auto &context = pScript_contexts[pName];
+	if (!context.is_valid())
+	{
+		context.set_script_system(*mScript);
+		if (mPack)
+			context.build_script(pScript_path, *mPack);
+		else
+			context.build_script(pScript_path);
+	}
+	return context;
+}
+
+void scene::update_prefetch()
+{
+	if (mPrefetch_requested)
+	{
+		mPrefetch_requested = false;
+		start_prefetch();
+	}
+
+	for (auto& i : mPrefetches)
+	{
+		if (!i->is_loaded() || i->is_warmed())
+			continue;
+		i->set_warmed(true);
+
+		// Stream the tilemap texture in as well
+		const std::string texture = i->get_loader().get_tilemap_texture();
+		if (!texture.empty())
+			if (auto res = mResource_manager->get_resource_async<engine::texture>("texture", texture))
+				i->add_dependency(res);
+	}
+
+	// Scripts can only be compiled on this thread so only
+	// the one behind the nearest door is compiled each frame.
+	std::shared_ptr<scene_prefetch> nearest;
+	float nearest_distance = 0;
+	for (auto& i : mPrefetches)
+	{
+		if (!i->is_loaded() || i->is_script_attempted())
+			continue;
+		const float distance = (i->get_door_position() - mPlayer.get_position()).distance();
+		if (!nearest || distance < nearest_distance)
+		{
+			nearest = i;
+			nearest_distance = distance;
+		}
+	}
+	if (nearest)
+	{
+		nearest->set_script_attempted(true);
+		get_script_context(nearest->get_name(), nearest->get_loader().get_script_path());
+	}
+}
+
+void scene::start_prefetch()
+{
+	// Find the nearest door to every neighboring scene
+	std::vector<std::pair<float, std::shared_ptr<door>>> doors;
+	for (auto& i : mCollision_system.get_container().get_boxes())
+	{
+		if (i->get_type() != collision_box::type::door)
+			continue;
+		auto d = std::dynamic_pointer_cast<door>(i);
+		if (d->get_scene().empty() || d->get_scene() == mCurrent_scene_name)
+			continue;
+		const float distance = (d->get_region().get_center() - mPlayer.get_position()).distance();
+		doors.push_back({ distance, d });
+	}
+	std::sort(doors.begin(), doors.end(),
+		[](const std::pair<float, std::shared_ptr<door>>& pL, const std::pair<float, std::shared_ptr<door>>& pR)
+	{
+		return pL.first < pR.first;
+	});
+
+	// Queued nearest first. Scenes that are already prefetched are kept.
+	std::vector<std::shared_ptr<scene_prefetch>> prefetches;
+	for (auto& i : doors)
+	{
+		const std::string& name = i.second->get_scene();
+		auto listed = std::find_if(prefetches.begin(), prefetches.end(),
+			[&](const std::shared_ptr<scene_prefetch>& pPrefetch) { return pPrefetch->get_name() == name; });
+		if (listed != prefetches.end())
+			continue;
+
+		auto existing = std::find_if(mPrefetches.begin(), mPrefetches.end(),
+			[&](const std::shared_ptr<scene_prefetch>& pPrefetch) { return pPrefetch->get_name() == name; });
+		std::shared_ptr<scene_prefetch> prefetch;
+		if (existing != mPrefetches.end())
+			prefetch = *existing;
+		else
+		{
+			prefetch = std::make_shared<scene_prefetch>();
+			prefetch->set_name(name);
+			prefetch->set_directory(get_scene_directory());
+			prefetch->set_resource_pack(mPack);
+			mResource_manager->load_async(prefetch);
+		}
+		prefetch->set_door_position(i.second->get_region().get_center());
+		prefetches.push_back(prefetch);
+	}
+	mPrefetches = std::move(prefetches);
+}
+
+std::shared_ptr<scene_prefetch> scene::take_prefetch(const std::string& pName)
+{
+	for (auto i = mPrefetches.begin(); i != mPrefetches.end(); i++)
+	{
+		if ((*i)->get_name() != pName)
+			continue;
+		std::shared_ptr<scene_prefetch> prefetch = *i;
+		mPrefetches.erase(i);
+
+		// Still being read in the background
+		if (!prefetch->is_loaded())
+			return{};
+		return prefetch;
+	}
+	return{};
+}
+
 void scene::script_set_focus(engine::fvector pPosition)
 {
 	mFocus_player = false;
@@ -467,14 +777,24 @@ void scene::script_set_boundary_position(engine::fvector pPosition)
 void scene::script_set_tile(const std::string& pAtlas, engine::fvector pPosition
 	, int pLayer, int pRotation)
 {
+	if (pLayer < 0 || static_cast<size_t>(pLayer) >= mTilemap_manipulator.get_layer_count())
+	{
+		logger::error("Tile layer " + std::to_string(pLayer) + " does not exist");
+		return;
+	}
 	mTilemap_manipulator.get_layer(pLayer).set_tile(pPosition, pAtlas, pRotation);
-	mTilemap_display.update(mTilemap_manipulator);
+	mTilemap_display.set_tile(pPosition, pAtlas, pLayer, pRotation);
 }
 
 void scene::script_remove_tile(engine::fvector pPosition, int pLayer)
 {
+	if (pLayer < 0 || static_cast<size_t>(pLayer) >= mTilemap_manipulator.get_layer_count())
+	{
+		logger::error("Tile layer " + std::to_string(pLayer) + " does not exist");
+		return;
+	}
 	mTilemap_manipulator.get_layer(pLayer).remove_tile(pPosition);
-	mTilemap_display.update(mTilemap_manipulator);
+	mTilemap_display.remove_tile(pPosition, pLayer);
 }
 
 void scene::refresh_renderer(engine::renderer& pR)
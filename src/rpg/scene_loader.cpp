@@ -34,22 +34,25 @@ scene_loader::scene_loader()
 
 bool scene_loader::load(const engine::encoded_path& pDir, const std::string & pName)
 {
-	clean();
-	
-	mScene_path = pDir / (pName + ".xml");
-	mScript_path = pDir / (pName + ".as");
-	mScene_name = pName;
-
-	if (mXml_Document.LoadFile(mScene_path.string().c_str()))
+	if (!parse(pDir, pName, nullptr))
 	{
 		logger::error("Unable to open scene XML file.");
 		return false;
 	}
-
 	return load_settings();
 }
 
 bool scene_loader::load(const engine::encoded_path& pDir, const std::string & pName, engine::resource_pack& pPack)
+{
+	if (!parse(pDir, pName, &pPack))
+	{
+		logger::error("Unable to open scene XML file.");
+		return false;
+	}
+	return load_settings();
+}
+
+bool scene_loader::parse(const engine::encoded_path& pDir, const std::string& pName, engine::resource_pack* pPack)
 {
 	clean();
 
@@ -57,17 +60,14 @@ bool scene_loader::load(const engine::encoded_path& pDir, const std::string & pN
 	mScript_path = pDir / (pName + ".as");
 	mScene_name = pName;
 
-	auto data = pPack.read_all(mScene_path.string());
-	if (data.empty())
-		return false;
-
-	if (mXml_Document.Parse(&data[0], data.size()))
+	if (pPack)
 	{
-		logger::error("Unable to open scene XML file.");
-		return false;
+		auto data = pPack->view(mScene_path.string());
+		if (data.empty())
+			return false;
+		return !mXml_Document.Parse(data.data(), data.size());
 	}
-
-	return load_settings();
+	return !mXml_Document.LoadFile(mScene_path.string().c_str());
 }
 
 bool scene_loader::save()
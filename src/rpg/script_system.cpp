@@ -1,6 +1,7 @@
 
 #include <engine/logger.hpp>
 #include <engine/utility.hpp>
+#include <engine/profiler.hpp>
 
 #include <rpg/script_system.hpp>
 
@@ -196,6 +197,10 @@ script_system::script_system()
 	mEngine = asCreateScriptEngine();
 
 	mEngine->SetEngineProperty(asEP_REQUIRE_ENUM_SCOPE, true);
+
+	// Scene scripts reset their globals before they start. This way scripts
+	// can be compiled ahead of time without running any of their code.
+	mEngine->SetEngineProperty(asEP_INIT_GLOBAL_VARS_AFTER_BUILD, false);
 	//mEngine->SetEngineProperty(asEP_BUILD_WITHOUT_LINE_CUES, true);
 
 	mEngine->SetMessageCallback(asMETHOD(script_system, message_callback), this, asCALL_THISCALL);
@@ -250,6 +255,8 @@ void script_system::abort_all()
 
 int script_system::tick()
 {
+	PROFILE_ZONE("script_system::tick");
+	PROFILE_COUNTER("script threads", mThread_contexts.size());
 	for (size_t i = 0; i < mThread_contexts.size(); i++)
 	{
 		mCurrect_thread_context = mThread_contexts[i];
@@ -3,9 +3,27 @@
 
 #include <engine/logger.hpp>
 #include <cassert>
+#include <cmath>
+#include <algorithm>
 
 using namespace rpg;
 
+// Grow a rect to cover another
+static engine::frect merge_rect(const engine::frect& pA, const engine::frect& pB)
+{
+	if (pA.w <= 0 || pA.h <= 0)
+		return pB;
+	const engine::fvector offset(std::min(pA.x, pB.x), std::min(pA.y, pB.y));
+	const engine::fvector corner(std::max(pA.x + pA.w, pB.x + pB.w), std::max(pA.y + pA.h, pB.y + pB.h));
+	return{ offset, corner - offset };
+}
+
+tilemap_display::tilemap_display()
+{
+	mSubmitted_quads = 0;
+	mCulled_quads = 0;
+}
+
 void tilemap_display::set_texture(std::shared_ptr<engine::texture> pTexture)
 {
 	mTexture = pTexture;
@@ -16,76 +34,162 @@ std::shared_ptr<engine::texture> tilemap_display::get_texture()
 	return mTexture;
 }
 
-bool tilemap_display::add_tile(engine::fvector pPosition, const std::string& pAtlas, int pLayer, int pRotation)
+bool tilemap_display::set_tile(engine::fvector pPosition, const std::string& pAtlas, size_t pLayer, int pRotation)
 {
 	assert(mTexture != nullptr);
 
 	auto animation = mTexture->get_entry(pAtlas);
 	if (!animation)
+	{
+		remove_tile(pPosition, pLayer);
 		return false;
+	}
 
-	// Go to the layer
-	auto layer_iter = mLayers.begin();
-	std::advance(layer_iter, pLayer);
-
-	// Add quad to vertex batch
-	auto ntile = layer_iter->add_quad(pPosition*get_unit()
-		, animation->get_frame_at(0)
-		, pRotation);
+	layer& l = get_layer(pLayer);
+	const uint64_t key = tilemap_layer::hash_position(pPosition);
+	const engine::frect texture_rect = animation->get_frame_at(0);
 
-	// Register animated tile
-	if (animation->get_frame_count() > 1)
+	auto existing = l.tiles.find(key);
+	if (existing != l.tiles.end())
+	{
+		// Retarget the quad that is already there
+		tile_slot& slot = existing->second;
+		mAnimations.remove_quad(slot.animation);
+		slot.ref.set_texture_rect(texture_rect);
+		slot.ref.set_rotation(pRotation);
+	}
+	else
 	{
-		animated_tile n_anim_tile;
-		n_anim_tile.mRef = ntile;
-		n_anim_tile.set_animation(animation);
-		mAnimated_tiles.push_back(n_anim_tile);
+		chunk& c = l.chunks[hash_chunk(pPosition)];
+		tile_slot& slot = l.tiles[key];
+		slot.owner = &c;
+		slot.animation = engine::animation_scheduler::no_handle;
+		slot.ref = c.batch.add_quad(pPosition*get_unit(), texture_rect, pRotation); // Reuses removed quads
+		++c.tile_count;
 	}
+
+	// Quads are sized by their texture and may be larger than a tile
+	tile_slot& slot = l.tiles[key];
+	engine::fvector size = texture_rect.get_size();
+	if (std::abs(pRotation) % 2 != 0)
+		size = engine::fvector(size.y, size.x);
+	slot.owner->bounds = merge_rect(slot.owner->bounds, { pPosition*get_unit(), size });
+
+	// Tiles without frames are not animated
+	slot.animation = mAnimations.add_quad(animation, slot.ref);
+	return true;
+}
+
+bool tilemap_display::remove_tile(engine::fvector pPosition, size_t pLayer)
+{
+	if (pLayer >= mLayers.size())
+		return false;
+
+	layer& l = *std::next(mLayers.begin(), pLayer);
+	auto existing = l.tiles.find(tilemap_layer::hash_position(pPosition));
+	if (existing == l.tiles.end())
+		return false;
+
+	tile_slot& slot = existing->second;
+	mAnimations.remove_quad(slot.animation);
+	slot.owner->batch.remove_quad(slot.ref);
+	--slot.owner->tile_count;
+	l.tiles.erase(existing);
 	return true;
 }
 
+tilemap_display::layer& tilemap_display::get_layer(size_t pIndex)
+{
+	while (mLayers.size() <= pIndex)
+		mLayers.emplace_back();
+	return *std::next(mLayers.begin(), pIndex);
+}
+
+uint64_t tilemap_display::hash_chunk(engine::fvector pPosition)
+{
+	const auto x = static_cast<int32_t>(std::floor(pPosition.x / chunk_size));
+	const auto y = static_cast<int32_t>(std::floor(pPosition.y / chunk_size));
+
+	// Flipping the sign bits puts negative coordinates first
+	const uint32_t row = static_cast<uint32_t>(y) ^ 0x80000000u;
+	const uint32_t column = static_cast<uint32_t>(x) ^ 0x80000000u;
+	return (static_cast<uint64_t>(row) << 32) | column;
+}
+
 int tilemap_display::draw(engine::renderer& pR)
 {
 	if (!mTexture) return 1;
 	update_animations();
-	for (auto &i : mLayers)
+	cull(get_view(pR));
+	for (auto i : mVisible_chunks)
 	{
-		if (!i.is_visible())
-			continue;
-
 		// Ensure it is a child of this object
-		if (!i.get_parent())
+		if (!i->get_parent())
 		{
-			i.set_unit(get_unit());
-			i.set_internal_parent(*this);
+			i->set_unit(get_unit());
+			i->set_internal_parent(*this);
 		}
 		
-		i.set_texture(mTexture);
-		//i.use_render_texture(true);
+		i->set_texture(mTexture);
+		//i->use_render_texture(true);
 
-		i.draw(pR);
+		i->draw(pR);
 	}
 	return 0;
 }
 
-void tilemap_display::update_animations()
+void tilemap_display::cull(engine::frect pView)
 {
-	try {
-		for (auto& i : mAnimated_tiles)
-			i.update_animation();
-	}
-	catch (const std::exception& e)
+	mVisible_chunks.clear();
+	mSubmitted_quads = 0;
+	mCulled_quads = 0;
+	for (auto& l : mLayers)
 	{
-		logger::error("Exception '" + std::string(e.what()) + "'");
-		logger::error("Failed to animate tiles");
-		mAnimated_tiles.clear();
+		if (!l.visible)
+			continue;
+		for (auto& i : l.chunks)
+		{
+			chunk& c = i.second;
+			if (c.tile_count == 0)
+				continue;
+			if (c.bounds.is_intersect(pView))
+			{
+				mVisible_chunks.push_back(&c.batch);
+				mSubmitted_quads += c.tile_count;
+			}
+			else
+				mCulled_quads += c.tile_count;
+		}
 	}
 }
 
+size_t tilemap_display::get_submitted_quad_count() const
+{
+	return mSubmitted_quads;
+}
+
+size_t tilemap_display::get_culled_quad_count() const
+{
+	return mCulled_quads;
+}
+
+engine::frect tilemap_display::get_view(engine::renderer& pR) const
+{
+	// The camera moves this node so the screen starts at the inverse of its position
+	const engine::fvector scale = get_absolute_scale();
+	return{ -get_exact_position() / scale, pR.get_target_size() / scale };
+}
+
+void tilemap_display::update_animations()
+{
+	mAnimations.update(mAnimation_clock.restart().seconds());
+}
+
 void tilemap_display::clear()
 {
+	mVisible_chunks.clear();
 	mLayers.clear();
-	mAnimated_tiles.clear();
+	mAnimations.clear();
 }
 
 void tilemap_display::highlight_layer(size_t pLayer, engine::color pHighlight, engine::color pOthers)
@@ -93,10 +197,8 @@ void tilemap_display::highlight_layer(size_t pLayer, engine::color pHighlight, e
 	size_t index = 0;
 	for (auto& i : mLayers)
 	{
-		if (index == pLayer)
-			i.set_color(pHighlight);
-		else
-			i.set_color(pOthers);
+		for (auto& c : i.chunks)
+			c.second.batch.set_color(index == pLayer ? pHighlight : pOthers);
 		++index;
 	}
 }
@@ -104,7 +206,8 @@ void tilemap_display::highlight_layer(size_t pLayer, engine::color pHighlight, e
 void tilemap_display::remove_highlight()
 {
 	for (auto& l : mLayers)
-		l.set_color({ 255, 255, 255, 255 });
+		for (auto& c : l.chunks)
+			c.second.batch.set_color({ 255, 255, 255, 255 });
 }
 
 void tilemap_display::update(tilemap_manipulator& pTile_manipulator)
@@ -118,7 +221,7 @@ void tilemap_display::update(tilemap_manipulator& pTile_manipulator)
 		for (size_t j = 0; j < layer.get_tile_count(); j++)
 		{
 			tile& t = *layer.get_tile(j);
-			add_tile(t.get_position(), t.get_atlas(), i, t.get_rotation());
+			set_tile(t.get_position(), t.get_atlas(), i, t.get_rotation());
 		}
 	}
 }
@@ -126,33 +229,11 @@ void tilemap_display::update(tilemap_manipulator& pTile_manipulator)
 void tilemap_display::set_layer_visible(size_t pIndex, bool pIs_visible)
 {
 	assert(pIndex < mLayers.size());
-	std::next(mLayers.begin(), pIndex)->set_visible(pIs_visible);
+	std::next(mLayers.begin(), pIndex)->visible = pIs_visible;
 }
 
 bool tilemap_display::is_layer_visible(size_t pIndex)
 {
 	assert(pIndex < mLayers.size());
-	return std::next(mLayers.begin(), pIndex)->is_visible();
-}
-
-void tilemap_display::animated_tile::set_animation(std::shared_ptr<const engine::animation> pAnimation)
-{
-	mAnimation = pAnimation;
-	mFrame = 0;
-
-	if (pAnimation->get_frame_count() > 0) // Start timer if this is an animation
-		mTimer.start(pAnimation->get_interval()*0.001f);
-}
-
-void tilemap_display::animated_tile::update_animation()
-{
-	if (!mAnimation) return;
-	if (!mAnimation->get_frame_count()) return;
-	if (mTimer.is_reached())
-	{
-		++mFrame;
-		const size_t rendered_frame = mFrame + mAnimation->get_default_frame();
-		mTimer.start(mAnimation->get_interval(rendered_frame)*0.001f);
-		mRef.set_texture_rect(mAnimation->get_frame_at(rendered_frame));
-	}
+	return std::next(mLayers.begin(), pIndex)->visible;
 }
@@ -2,6 +2,8 @@
 #include <rpg/rpg_config.hpp>
 #include <engine/logger.hpp>
 
+#include <cstring>
+
 using namespace rpg;
 
 void tile::load_xml(tinyxml2::XMLElement * pEle, tile_atlas_pool& pPool)
@@ -283,6 +285,11 @@ const std::string& tile::get_atlas() const
 	return *mAtlas_handle;
 }
 
+tilemap_layer::tilemap_layer()
+{
+	mIndex_dirty = false;
+}
+
 void tilemap_layer::set_name(const std::string & pName)
 {
 	mName = pName;
@@ -298,6 +305,7 @@ tile* tilemap_layer::new_tile(const std::string & pAtlas)
 	tile ntile;
 	ntile.set_atlas(pAtlas, mAtlas_pool);
 	mTiles.push_back(ntile);
+	mIndex_dirty = true; // The caller will most likely move it
 	return &mTiles.back();
 }
 
@@ -313,11 +321,14 @@ tile* tilemap_layer::set_tile(engine::fvector pPosition, engine::fvector pFill,
 	}
 
 	// Add a new one
-	tile* ntile = new_tile(pAtlas);
-	ntile->set_fill(pFill);
-	ntile->set_position(pPosition);
-	ntile->set_rotation(pRotation);
-	return ntile;
+	tile ntile;
+	ntile.set_atlas(pAtlas, mAtlas_pool);
+	ntile.set_fill(pFill);
+	ntile.set_position(pPosition);
+	ntile.set_rotation(pRotation);
+	mTiles.push_back(ntile);
+	mIndex[hash_position(pPosition)] = mTiles.size() - 1;
+	return &mTiles.back();
 }
 
 tile* tilemap_layer::set_tile(engine::fvector pPosition, const std::string & pAtlas, int pRotation)
@@ -332,10 +343,11 @@ tile* tilemap_layer::set_tile(const tile & pTile)
 
 tile* tilemap_layer::find_tile(engine::fvector pPosition)
 {
-	for (auto& i : mTiles)
-		if (i.get_position() == pPosition)
-			return &i;
-	return nullptr;
+	update_index();
+	auto iter = mIndex.find(hash_position(pPosition));
+	if (iter == mIndex.end())
+		return nullptr;
+	return &mTiles[iter->second];
 }
 
 size_t tilemap_layer::get_tile_count() const
@@ -355,13 +367,22 @@ const tile* tilemap_layer::get_tile(size_t pIndex) const
 
 bool tilemap_layer::remove_tile(engine::fvector pPosition)
 {
-	for (size_t i = 0; i < mTiles.size(); i++)
-		if (mTiles[i].get_position() == pPosition)
-		{
-			mTiles.erase(mTiles.begin() + i);
-			return true;
-		}
-	return false;
+	update_index();
+	auto iter = mIndex.find(hash_position(pPosition));
+	if (iter == mIndex.end())
+		return false;
+
+	// Move the last tile into the hole instead of shifting everything.
+	// The order doesn't matter as tiles are sorted when loaded.
+	const size_t index = iter->second;
+	mIndex.erase(iter);
+	if (index != mTiles.size() - 1)
+	{
+		mTiles[index] = mTiles.back();
+		mIndex[hash_position(mTiles[index].get_position())] = index;
+	}
+	mTiles.pop_back();
+	return true;
 }
 
 float tilemap_layer::condense()
@@ -371,6 +392,7 @@ float tilemap_layer::condense()
 		return 1.f;
 
 	size_t original_size = mTiles.size();
+	mIndex_dirty = true;
 
 	// Sort the tiles, adjacent tiles will naturally be adjacent left to right in the array.
 	std::sort(mTiles.begin(), mTiles.end(), [](const tile& l, const tile& r)
@@ -418,6 +440,7 @@ void tilemap_layer::explode_tile(tile * pTile)
 {
 	assert(pTile);
 	tile cp_tile = *pTile; // Make a copy because mTiles gets modified
+	mIndex_dirty = true;
 	pTile->set_fill({ 1, 1 });
 	for (int x = 0; x < cp_tile.get_fill().x; x++)
 	{
@@ -451,6 +474,7 @@ bool tilemap_layer::load_xml(tinyxml2::XMLElement * pRoot)
 		mTiles.push_back(ntile);
 		i = i->NextSiblingElement();
 	}
+	mIndex_dirty = true;
 	sort();
 	return true;
 }
@@ -492,6 +516,31 @@ void tilemap_layer::sort()
 		{
 			return l.get_position() < r.get_position(); 
 		});
+	mIndex_dirty = true;
+}
+
+uint64_t tilemap_layer::hash_position(engine::fvector pPosition)
+{
+	// Adding zero turns -0 into 0 so they hash the same
+	const float x = pPosition.x + 0.f;
+	const float y = pPosition.y + 0.f;
+	uint32_t x_bits, y_bits;
+	std::memcpy(&x_bits, &x, sizeof(x_bits));
+	std::memcpy(&y_bits, &y, sizeof(y_bits));
+	return (static_cast<uint64_t>(x_bits) << 32) | y_bits;
+}
+
+void tilemap_layer::update_index()
+{
+	if (!mIndex_dirty)
+		return;
+	mIndex.clear();
+	mIndex.reserve(mTiles.size());
+
+	// Keep the first tile at each position like a linear search would
+	for (size_t i = 0; i < mTiles.size(); i++)
+		mIndex.emplace(hash_position(mTiles[i].get_position()), i);
+	mIndex_dirty = false;
 }
 
 tile_atlas_pool::handle tile_atlas_pool::get(const std::string & pAtlas)
@@ -0,0 +1,138 @@
+// Runs the game without a display for a number of frames and reports
+// frame times and draw statistics. Time is faked so every run
+// does the same work and the results can be compared between builds.
+//
+// WolfGangEngine_Frames [data directory] [frame count]
+//
+// The average time of each profiler zone is also reported.
+
+#include <engine/renderer.hpp>
+#include <engine/time.hpp>
+#include <engine/logger.hpp>
+#include <engine/profiler.hpp>
+
+#include <rpg/rpg.hpp>
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+struct frame_result
+{
+	float time; // Real time in milliseconds
+	engine::render_stats stats;
+};
+
+bool run_frames(const std::string& pData, size_t pCount, std::vector<frame_result>& pResults)
+{
+	engine::use_fake_time(true);
+
+	engine::renderer renderer;
+	renderer.set_backend(std::unique_ptr<engine::render_backend>(new engine::null_backend()));
+
+	rpg::game game;
+	game.set_renderer(renderer);
+	if (!game.load(pData))
+		return false;
+
+	pResults.clear();
+	for (size_t i = 0; i < pCount; i++)
+	{
+		engine::advance_fake_time(1.f / 60);
+
+		const auto start = std::chrono::steady_clock::now();
+		renderer.update_events();
+		game.tick();
+		renderer.draw();
+		const std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+		frame_result result;
+		result.time = elapsed.count();
+		result.stats = renderer.get_render_stats();
+		pResults.push_back(result);
+	}
+
+	engine::use_fake_time(false);
+	return true;
+}
+
+void report(const std::vector<frame_result>& pResults)
+{
+	if (pResults.empty())
+		return;
+
+	float total = 0;
+	float worst = 0;
+	engine::render_stats sum = engine::render_stats();
+	for (auto& i : pResults)
+	{
+		total += i.time;
+		worst = std::max(worst, i.time);
+		sum.draw_calls += i.stats.draw_calls;
+		sum.batches += i.stats.batches;
+		sum.quads += i.stats.quads;
+		sum.vertices += i.stats.vertices;
+		sum.state_changes += i.stats.state_changes;
+	}
+
+	const size_t count = pResults.size();
+	logger::info(std::to_string(count) + " frames: average " + std::to_string(total / count)
+		+ "ms, worst " + std::to_string(worst) + "ms");
+	logger::info("Per frame: draw calls " + std::to_string(sum.draw_calls / count)
+		+ ", batches " + std::to_string(sum.batches / count)
+		+ ", quads " + std::to_string(sum.quads / count)
+		+ ", vertices " + std::to_string(sum.vertices / count)
+		+ ", state changes " + std::to_string(sum.state_changes / count));
+}
+
+// The same frames should draw the same things every run.
+// Resources streamed in on loader threads can still arrive
+// a frame early or late.
+bool is_same_work(const std::vector<frame_result>& pA, const std::vector<frame_result>& pB)
+{
+	if (pA.size() != pB.size())
+		return false;
+	for (size_t i = 0; i < pA.size(); i++)
+	{
+		if (pA[i].stats.draw_calls != pB[i].stats.draw_calls
+			|| pA[i].stats.vertices != pB[i].stats.vertices)
+			return false;
+	}
+	return true;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	const std::string data = argc > 1 ? argv[1] : "./data";
+	const size_t count = argc > 2 ? std::stoul(argv[2]) : 600;
+
+	std::vector<frame_result> first;
+	std::vector<frame_result> second;
+	if (!run_frames(data, count, first))
+	{
+		logger::error("Failed to load game from '" + data + "'");
+		return 1;
+	}
+
+	// Only the second run is profiled. The first run warms up the caches.
+	engine::profiler::set_history_size(count);
+	engine::profiler::set_enabled(true);
+	if (!run_frames(data, count, second))
+	{
+		logger::error("Failed to load game from '" + data + "'");
+		return 1;
+	}
+	engine::profiler::set_enabled(false);
+
+	report(second);
+	logger::info(engine::profiler::get_summary());
+
+	if (!is_same_work(first, second))
+		logger::warning("Runs did not draw the same frames");
+	return 0;
+}
@@ -5,8 +5,28 @@
 #include <engine/renderer.hpp>
 #include <engine/utility.hpp>
 #include <engine/binary_util.hpp>
+#include <engine/time.hpp>
+#include <engine/logger.hpp>
+#include <engine/pathfinding.hpp>
+#include <engine/resource.hpp>
+#include <engine/resource_pack.hpp>
+#include <engine/profiler.hpp>
+#include <engine/node.hpp>
+#include <engine/particle_engine.hpp>
+#include <engine/animation_scheduler.hpp>
+
+#include <rpg/collision_box.hpp>
+#include <rpg/tilemap_manipulator.hpp>
+#include <rpg/tilemap_display.hpp>
 
 #include <sstream>
+#include <random>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
 
 engine::renderer::key_code key_name_to_code(const std::string& pName);
 std::string key_code_to_name(engine::renderer::key_code pCode);
@@ -124,4 +144,1862 @@ TEST_CASE("key_code_to_name")
 	}
 }
 
-}
\ No newline at end of file
+namespace collision_test {
+
+// Fills a container with walls scattered over a square map
+void fill_walls(rpg::collision_box_container& pContainer, size_t pCount, float pMap_size)
+{
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> position(0, pMap_size);
+	std::uniform_real_distribution<float> size(0.5f, 3.f);
+	for (size_t i = 0; i < pCount; i++)
+	{
+		auto box = pContainer.add_collision_box(i % 4 == 0
+			? rpg::collision_box::type::trigger : rpg::collision_box::type::wall);
+		box->set_region({ position(rng), position(rng), size(rng), size(rng) });
+	}
+}
+
+// The old behavior; scans every box
+std::shared_ptr<rpg::collision_box> linear_first_collision(rpg::collision_box_container& pContainer
+	, rpg::collision_box::type pType, engine::frect pRect)
+{
+	for (auto& i : pContainer.get_boxes())
+		if (i->is_enabled()
+			&& i->get_type() == pType
+			&& i->get_region().is_intersect(pRect))
+			return i;
+	return{};
+}
+
+}
+
+TEST_CASE("collision_box_container spatial index")
+{
+	rpg::collision_box_container container;
+	collision_test::fill_walls(container, 2000, 200);
+
+	SECTION("Queries match a linear scan")
+	{
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<float> position(-5, 205);
+		for (int i = 0; i < 500; i++)
+		{
+			const engine::frect query = { position(rng), position(rng), 1.5f, 1.5f };
+			REQUIRE(container.first_collision(rpg::collision_box::type::wall, query)
+				== collision_test::linear_first_collision(container, rpg::collision_box::type::wall, query));
+
+			size_t expected = 0;
+			for (auto& j : container.get_boxes())
+				if (j->get_region().is_intersect(query))
+					++expected;
+			REQUIRE(container.collision(query).size() == expected);
+		}
+	}
+
+	SECTION("Moved and removed boxes are reindexed")
+	{
+		auto box = container.add_wall();
+		box->set_region({ -100, -100, 1, 1 });
+		REQUIRE(container.first_collision(rpg::collision_box::type::wall, engine::fvector(-99.5f, -99.5f)) == box);
+
+		box->set_region({ -50, -50, 1, 1 });
+		REQUIRE(!container.first_collision(rpg::collision_box::type::wall, engine::fvector(-99.5f, -99.5f)));
+		REQUIRE(container.first_collision(rpg::collision_box::type::wall, engine::fvector(-49.5f, -49.5f)) == box);
+
+		container.remove_box(box);
+		REQUIRE(!container.first_collision(engine::fvector(-49.5f, -49.5f)));
+
+		// Detached boxes can still be modified safely
+		box->set_region({ 0, 0, 1, 1 });
+	}
+
+	SECTION("Results keep insertion order")
+	{
+		const auto hits = container.collision(engine::frect(0, 0, 200, 200));
+		for (size_t i = 1; i < hits.size(); i++)
+		{
+			auto& boxes = container.get_boxes();
+			REQUIRE(std::find(boxes.begin(), boxes.end(), hits[i - 1])
+				< std::find(boxes.begin(), boxes.end(), hits[i]));
+		}
+	}
+}
+
+TEST_CASE("collision_box_container benchmark", "[.][benchmark]")
+{
+	for (size_t count : { 1000, 10000, 100000 })
+	{
+		rpg::collision_box_container container;
+		const float map_size = std::sqrt(static_cast<float>(count)) * 4;
+		collision_test::fill_walls(container, count, map_size);
+
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<float> position(0, map_size);
+		std::vector<engine::frect> queries;
+		for (int i = 0; i < 1000; i++)
+			queries.push_back({ position(rng), position(rng), 0.9f, 0.9f });
+
+		size_t linear_hits = 0;
+		engine::clock linear_clock;
+		for (auto& i : queries)
+			if (collision_test::linear_first_collision(container, rpg::collision_box::type::wall, i))
+				++linear_hits;
+		const float linear_time = linear_clock.get_elapse().milliseconds();
+
+		size_t index_hits = 0;
+		engine::clock index_clock;
+		for (auto& i : queries)
+			if (container.first_collision(rpg::collision_box::type::wall, i))
+				++index_hits;
+		const float index_time = index_clock.get_elapse().milliseconds();
+
+		REQUIRE(linear_hits == index_hits);
+		logger::info(std::to_string(count) + " boxes, 1000 queries: linear "
+			+ std::to_string(linear_time) + "ms, indexed " + std::to_string(index_time) + "ms");
+	}
+}
+
+TEST_CASE("pathfinder")
+{
+	engine::pathfinder pathfinder;
+
+	// A wall at x=5 with a single opening at y=9
+	pathfinder.set_collision_callback([](engine::fvector& pPosition)
+	{
+		return (pPosition.x >= 5 && pPosition.x < 6 && pPosition.y < 9)
+			|| pPosition.x < -20 || pPosition.y < -20
+			|| pPosition.x > 40 || pPosition.y > 40;
+	});
+
+	SECTION("Shortest path goes through the opening")
+	{
+		REQUIRE(pathfinder.start({ 0.5f, 0.5f }, { 10.5f, 0.5f }));
+		const auto path = pathfinder.construct_path();
+		REQUIRE(path.size() == 29);
+		REQUIRE(path.front() == engine::fvector(0.5f, 0.5f));
+		REQUIRE(path.back() == engine::fvector(10.5f, 0.5f));
+	}
+
+	SECTION("Pathfinder is reusable and gives partial paths")
+	{
+		pathfinder.set_path_limit(5);
+		REQUIRE(!pathfinder.start({ 0.5f, 0.5f }, { 10.5f, 0.5f }));
+		REQUIRE(!pathfinder.construct_path().empty());
+
+		pathfinder.set_path_limit(1000);
+		REQUIRE(pathfinder.start({ 0.5f, 0.5f }, { 3.5f, 0.5f }));
+		REQUIRE(pathfinder.construct_path().size() == 4);
+	}
+}
+
+namespace walkability_test {
+
+// Rows of walls with a single random gap in each
+void make_maze(rpg::collision_box_container& pContainer, int pSize)
+{
+	std::mt19937 rng(7);
+	for (int y = 2; y < pSize; y += 2)
+	{
+		const int gap = static_cast<int>(rng() % pSize);
+		for (int x = 0; x < pSize; x++)
+			if (x != gap)
+				pContainer.add_wall()->set_region({ static_cast<float>(x), static_cast<float>(y), 1, 1 });
+	}
+
+	// A few walls that don't line up with tiles
+	for (int i = 0; i < 50; i++)
+		pContainer.add_wall()->set_region({ static_cast<float>(rng() % pSize) + 0.3f
+			, static_cast<float>(rng() % pSize / 2 * 2 + 1) + 0.2f, 0.5f, 0.5f });
+}
+
+bool out_of_maze(const engine::fvector& pPosition, int pSize)
+{
+	return pPosition.x < 0 || pPosition.y < 0 || pPosition.x > pSize || pPosition.y > pSize;
+}
+
+}
+
+TEST_CASE("walkability_grid")
+{
+	const int size = 64;
+	rpg::collision_box_container container;
+	walkability_test::make_maze(container, size);
+
+	engine::walkability_grid grid;
+	container.rasterize_walls(grid);
+
+	auto exact = [&](engine::fvector& pPosition)
+	{
+		return (bool)container.first_collision(rpg::collision_box::type::wall, { pPosition, { 0.9f, 0.9f } });
+	};
+
+	auto rasterized = [&](engine::fvector& pPosition)
+	{
+		const engine::frect region(pPosition, { 0.9f, 0.9f });
+		switch (grid.test_region(region))
+		{
+		case engine::walkability_grid::cell::open:
+			return false;
+		case engine::walkability_grid::cell::blocked:
+			return true;
+		default:
+			return (bool)container.first_collision(rpg::collision_box::type::wall, region);
+		}
+	};
+
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<float> position(-2, size + 2.f);
+	for (int pass = 0; pass < 3; pass++)
+	{
+		for (int i = 0; i < 10000; i++)
+		{
+			engine::fvector point(position(rng), position(rng));
+			REQUIRE(exact(point) == rasterized(point));
+		}
+
+		// Move a wall and only update around it
+		auto box = container.get_boxes()[rng() % container.get_count()];
+		const auto old_region = box->get_region();
+		box->set_region({ position(rng), position(rng), 1.5f, 2.f });
+		container.rasterize_walls(grid, old_region);
+		container.rasterize_walls(grid, box->get_region());
+	}
+}
+
+TEST_CASE("path_request_queue")
+{
+	// A wall at x=10 with a single opening at y=19
+	engine::walkability_grid grid;
+	grid.reset({ -5, -5, 30, 30 });
+	for (int y = -5; y < 19; y++)
+		grid.set_cell({ 10, y }, engine::walkability_grid::cell::blocked);
+	auto snapshot = std::make_shared<const engine::walkability_snapshot>(grid, std::vector<engine::frect>());
+
+	auto wait_for_worker = [](const engine::path_request_queue& pQueue)
+	{
+		while (pQueue.get_queue_depth() > 0)
+			std::this_thread::yield();
+	};
+
+	engine::path_request_queue queue;
+	const int found = queue.submit({ 2, 2 }, { 15, 2 }, snapshot);
+	const int blocked = queue.submit({ 2, 2 }, { 10, 5 }, snapshot);
+	const int cancelled = queue.submit({ 2, 2 }, { 3, 2 }, snapshot);
+	queue.cancel(cancelled);
+	wait_for_worker(queue);
+
+	// Results only arrive in deliver()
+	REQUIRE(!queue.is_ready(found));
+	queue.deliver();
+	REQUIRE(queue.get_delivered_count() == 2);
+
+	engine::path_request_queue::result result;
+	REQUIRE(queue.take_result(found, result));
+	REQUIRE(result.found);
+	REQUIRE(result.path.back() == engine::fvector(15, 2));
+	for (auto& i : result.path)
+		REQUIRE(!snapshot->is_blocked({ i, { 0.9f, 0.9f } }));
+	REQUIRE(!queue.take_result(found, result));
+
+	REQUIRE(queue.take_result(blocked, result));
+	REQUIRE(!result.found);
+	REQUIRE(!queue.is_ready(cancelled));
+
+	// An unreachable destination keeps the worker busy until the limit
+	queue.set_path_limit(200000);
+	const int running = queue.submit({ 2, 2 }, { 10, 5 }, snapshot);
+	const int waiting = queue.submit({ 2, 2 }, { 15, 2 }, snapshot);
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	queue.cancel_all();
+	REQUIRE(queue.get_queue_depth() == 0);
+
+	// Submitted after the cancel so it is only done once the
+	// worker has dropped the cancelled search
+	queue.set_path_limit(1000);
+	const int after = queue.submit({ 2, 2 }, { 15, 2 }, snapshot);
+	wait_for_worker(queue);
+	queue.deliver();
+	REQUIRE(!queue.is_ready(running));
+	REQUIRE(!queue.is_ready(waiting));
+	REQUIRE(queue.is_ready(after));
+	REQUIRE(queue.get_delivered_count() == 3);
+}
+
+TEST_CASE("find_path maze benchmark", "[.][benchmark]")
+{
+	const int size = 256;
+	rpg::collision_box_container container;
+	walkability_test::make_maze(container, size);
+
+	engine::walkability_grid grid;
+	container.rasterize_walls(grid);
+
+	engine::pathfinder before;
+	before.set_path_limit(1000000);
+	before.set_collision_callback([&](engine::fvector& pPosition)
+	{
+		return walkability_test::out_of_maze(pPosition, size)
+			|| (bool)container.first_collision(rpg::collision_box::type::wall, { pPosition, { 0.9f, 0.9f } });
+	});
+
+	engine::pathfinder after;
+	after.set_path_limit(1000000);
+	after.set_collision_callback([&](engine::fvector& pPosition)
+	{
+		if (walkability_test::out_of_maze(pPosition, size))
+			return true;
+		const engine::frect region(pPosition, { 0.9f, 0.9f });
+		switch (grid.test_region(region))
+		{
+		case engine::walkability_grid::cell::open:
+			return false;
+		case engine::walkability_grid::cell::blocked:
+			return true;
+		default:
+			return (bool)container.first_collision(rpg::collision_box::type::wall, region);
+		}
+	});
+
+	engine::clock before_clock;
+	REQUIRE(before.start({ 0, 0 }, { size - 1.f, size - 1.f }));
+	const float before_time = before_clock.get_elapse().milliseconds();
+
+	engine::clock after_clock;
+	REQUIRE(after.start({ 0, 0 }, { size - 1.f, size - 1.f }));
+	const float after_time = after_clock.get_elapse().milliseconds();
+
+	REQUIRE(before.construct_path() == after.construct_path());
+	logger::info("256x256 maze find_path: container queries " + std::to_string(before_time)
+		+ "ms, walkability grid " + std::to_string(after_time) + "ms");
+}
+
+TEST_CASE("hierarchical_pathfinder")
+{
+	const int size = 100;
+	std::vector<char> blocked(size * size);
+	std::mt19937 rng(5);
+	for (auto& i : blocked)
+		i = rng() % 100 < 28;
+
+	auto is_tile_blocked = [&](int pX, int pY)
+	{
+		return pX < 0 || pY < 0 || pX >= size || pY >= size
+			|| blocked[pY * size + pX] != 0;
+	};
+
+	// Same test as the pathfinding system: a 0.9 box at the position
+	auto is_blocked = [&](engine::fvector pPosition)
+	{
+		const engine::ivector first = engine::fvector(pPosition).floor();
+		const engine::ivector last = engine::fvector(pPosition + engine::fvector(0.9f, 0.9f)).floor();
+		for (int y = first.y; y <= last.y; y++)
+			for (int x = first.x; x <= last.x; x++)
+				if (is_tile_blocked(x, y))
+					return true;
+		return false;
+	};
+
+	engine::hierarchical_pathfinder hierarchical;
+	hierarchical.set_tile_callback([&](engine::ivector pTile)
+	{
+		return is_blocked(pTile);
+	});
+	hierarchical.build({ 0, 0, size, size });
+
+	engine::pathfinder reference;
+	reference.set_path_limit(1000000);
+	reference.set_collision_callback([&](engine::fvector& pPosition)
+	{
+		return is_blocked(pPosition);
+	});
+
+	for (int i = 0; i < 200; i++)
+	{
+		// Toggle some tiles halfway through to exercise incremental updates
+		if (i == 100)
+		{
+			for (int j = 0; j < 500; j++)
+			{
+				const int x = rng() % size;
+				const int y = rng() % size;
+				blocked[y * size + x] ^= 1;
+				hierarchical.update({ x, y, 1, 1 });
+			}
+		}
+
+		// Starts in the middle of a tile where the box covers four of them
+		const engine::fvector start(rng() % size + 0.5f, rng() % size + 0.5f);
+		const engine::fvector destination(rng() % size + 0.5f, rng() % size + 0.5f);
+		const engine::fvector start_tile = engine::fvector(start).floor();
+		const engine::fvector destination_tile = engine::fvector(destination).floor();
+		if (is_blocked(start_tile) || is_blocked(destination_tile))
+			continue;
+
+		// Routes are planned between the tile origins
+		const bool found = reference.start(start_tile, destination_tile);
+		REQUIRE(hierarchical.start(start, destination) == found);
+		if (!found)
+			continue;
+
+		// Every waypoint is free for the same box find_path uses
+		const auto path = hierarchical.construct_path();
+		REQUIRE(path.front() == start_tile);
+		REQUIRE(path.back() == destination_tile);
+		for (size_t j = 1; j < path.size(); j++)
+		{
+			REQUIRE((path[j] - path[j - 1]).manhattan() == 1);
+			REQUIRE(!is_blocked(path[j]));
+		}
+	}
+}
+
+TEST_CASE("tilemap_layer position index")
+{
+	rpg::tilemap_layer layer;
+	for (int i = 0; i < 10; i++)
+		layer.set_tile({ static_cast<float>(i), 0 }, "a", 0);
+	layer.set_tile({ 3, 0 }, "b", 1);
+	REQUIRE(layer.get_tile_count() == 10);
+	REQUIRE(layer.find_tile({ 3, 0 })->get_atlas() == "b");
+
+	// Removing swaps the last tile into the hole
+	REQUIRE(layer.remove_tile({ 3, 0 }));
+	REQUIRE(!layer.remove_tile({ 3, 0 }));
+	REQUIRE(layer.find_tile({ 3, 0 }) == nullptr);
+	REQUIRE(layer.find_tile({ 9, 0 })->get_position() == engine::fvector(9, 0));
+
+	// Condensing and exploding rebuilds the index
+	layer.condense();
+	REQUIRE(layer.find_tile({ 5, 0 }) == nullptr);
+	layer.explode();
+	REQUIRE(layer.get_tile_count() == 9);
+	REQUIRE(layer.find_tile({ 5, 0 }) != nullptr);
+	REQUIRE(layer.find_tile({ -0.f, 0 }) == layer.find_tile({ 0, 0 }));
+}
+
+class dummy_resource :
+	public engine::resource
+{
+public:
+	const std::string type = "dummy";
+	bool load() override { return set_loaded(true); }
+	bool unload() override { return set_loaded(false); }
+	const std::string& get_type() const override { return type; }
+};
+
+TEST_CASE("resource_manager lookup")
+{
+	engine::resource_manager manager;
+	for (int i = 0; i < 100; i++)
+	{
+		auto res = std::make_shared<dummy_resource>();
+		res->set_name(std::to_string(i));
+		manager.add_resource(res);
+	}
+
+	// The first resource with a name wins
+	auto duplicate = std::make_shared<dummy_resource>();
+	duplicate->set_name("5");
+	manager.add_resource(duplicate);
+
+	REQUIRE(manager.has_resource("dummy", "42"));
+	REQUIRE(!manager.has_resource("dummy", "100"));
+	REQUIRE(!manager.has_resource("texture", "42"));
+	REQUIRE(!manager.has_resource(duplicate));
+
+	auto res = manager.get_resource<dummy_resource>("dummy", "5");
+	REQUIRE(res != nullptr);
+	REQUIRE(res != duplicate);
+	REQUIRE(res->is_loaded());
+	REQUIRE(manager.get_resource<dummy_resource>("dummy", "5") == res);
+	REQUIRE(manager.get_resource<engine::resource>("dummy", "5") == res);
+
+	// Casting to the wrong type fails
+	REQUIRE(manager.get_resource<engine::texture>("dummy", "5") == nullptr);
+
+	// The manager only holds one reference
+	res.reset();
+	REQUIRE(manager.get_resource<dummy_resource>("dummy", "7").use_count() == 2);
+
+	manager.clear_resources();
+	REQUIRE(!manager.has_resource("dummy", "42"));
+}
+
+TEST_CASE("resource_manager async loading")
+{
+	engine::resource_manager manager;
+	manager.set_loader_thread_count(2);
+	std::vector<std::shared_ptr<dummy_resource>> resources;
+	for (int i = 0; i < 50; i++)
+	{
+		auto res = std::make_shared<dummy_resource>();
+		res->set_name(std::to_string(i));
+		manager.add_resource(res);
+		resources.push_back(res);
+	}
+
+	auto res = manager.get_resource_async<dummy_resource>("dummy", "3");
+	REQUIRE(res == resources[3]);
+	REQUIRE(res->is_loading());
+	REQUIRE(!res->is_loaded());
+	for (auto& i : resources)
+		manager.load_async(i);
+
+	while (manager.get_loading_count() > 0)
+		manager.finish_loading(100.f);
+	for (auto& i : resources)
+	{
+		REQUIRE(i->is_loaded());
+		REQUIRE(!i->is_loading());
+	}
+
+	// Loaded resources are not queued again
+	manager.get_resource_async<dummy_resource>("dummy", "3");
+	REQUIRE(manager.get_loading_count() == 0);
+
+	// Cancelled loads are dropped and can be queued again
+	for (auto& i : resources)
+		i->unload();
+	for (auto& i : resources)
+		manager.load_async(i);
+	manager.cancel_loading();
+	REQUIRE(manager.get_loading_count() == 0);
+	for (auto& i : resources)
+		REQUIRE(!i->is_loading());
+	manager.load_async(resources[0]);
+	while (manager.get_loading_count() > 0)
+		manager.finish_loading(100.f);
+	REQUIRE(resources[0]->is_loaded());
+}
+
+class dummy_loader :
+	public engine::resource_loader
+{
+public:
+	dummy_loader(int pCount) : mCount(pCount) {}
+
+	bool load(engine::resource_batch& pBatch, const std::string& pData_filepath) override
+	{
+		for (int i = 0; i < mCount; i++)
+		{
+			auto res = std::make_shared<dummy_resource>();
+			res->set_name(std::to_string(i));
+			pBatch.add_resource(res);
+		}
+		return true;
+	}
+
+	bool load_pack(engine::resource_batch& pBatch, engine::resource_pack& pPack) override
+	{
+		return false;
+	}
+
+private:
+	int mCount;
+};
+
+// Like a directory that vanishes during the scan
+class throwing_loader :
+	public engine::resource_loader
+{
+public:
+	bool load(engine::resource_batch& pBatch, const std::string& pData_filepath) override
+	{
+		throw std::runtime_error("Directory is gone");
+	}
+
+	bool load_pack(engine::resource_batch& pBatch, engine::resource_pack& pPack) override
+	{
+		return false;
+	}
+};
+
+TEST_CASE("resource_manager parallel loaders")
+{
+	engine::resource_manager manager;
+	manager.add_loader(std::make_shared<dummy_loader>(100));
+	manager.add_loader(std::make_shared<dummy_loader>(200));
+	REQUIRE(manager.reload_all());
+
+	REQUIRE(manager.has_resource("dummy", "99"));
+	REQUIRE(manager.has_resource("dummy", "150"));
+	REQUIRE(!manager.has_resource("dummy", "200"));
+
+	// More loaders than workers. A loader that throws only fails itself.
+	manager.set_loader_thread_count(1);
+	manager.add_loader(std::make_shared<throwing_loader>());
+	for (int i = 0; i < 4; i++)
+		manager.add_loader(std::make_shared<dummy_loader>(300));
+	REQUIRE(!manager.reload_all());
+	REQUIRE(manager.has_resource("dummy", "250"));
+}
+
+class sized_resource :
+	public engine::resource
+{
+public:
+	const std::string type = "sized";
+	bool load() override { return set_loaded(true); }
+	bool unload() override { return set_loaded(false); }
+	size_t get_memory_usage() const override { return 100; }
+	const std::string& get_type() const override { return type; }
+};
+
+TEST_CASE("resource_manager memory budget")
+{
+	engine::resource_manager manager;
+	manager.set_memory_budget(250);
+	manager.set_unload_grace_period(2);
+	for (auto name : { "a", "b", "c" })
+	{
+		auto res = std::make_shared<sized_resource>();
+		res->set_name(name);
+		manager.add_resource(res);
+	}
+
+	manager.get_resource("sized", "a");
+	manager.update();
+	manager.get_resource("sized", "b");
+	manager.update();
+	auto c = manager.get_resource("sized", "c");
+	REQUIRE(manager.get_memory_usage() == 300);
+
+	// Only the least recently used is evicted to meet the budget
+	manager.update();
+	REQUIRE(!manager.is_resource_loaded("sized", "a"));
+	REQUIRE(manager.is_resource_loaded("sized", "b"));
+	REQUIRE(manager.is_resource_loaded("sized", "c"));
+
+	// Resources in use or within the grace period are kept
+	manager.set_memory_budget(0);
+	manager.get_resource("sized", "a");
+	manager.update();
+	REQUIRE(manager.is_resource_loaded("sized", "a"));
+	REQUIRE(!manager.is_resource_loaded("sized", "b"));
+	REQUIRE(manager.is_resource_loaded("sized", "c"));
+	REQUIRE(manager.get_resource_log().find("[sized] 200 B (peak 300 B)") != std::string::npos);
+
+	// The usage follows loads and unloads without an update
+	REQUIRE(manager.get_memory_usage() == 200);
+	c->unload();
+	REQUIRE(manager.get_memory_usage() == 100);
+	manager.get_resource("sized", "b");
+	REQUIRE(manager.get_memory_usage() == 200);
+	manager.unload_all();
+	REQUIRE(manager.get_memory_usage() == 0);
+}
+
+namespace pack_test
+{
+
+engine::encoded_path file_path(int pIndex)
+{
+	return "data/dir" + std::to_string(pIndex % 50) + "/sub" + std::to_string(pIndex % 7)
+		+ "/file" + std::to_string(pIndex) + ".png";
+}
+
+// Generate and parse back a header with this many files
+void make_header(engine::pack_header& pHeader, int pCount)
+{
+	engine::pack_header header;
+	for (int i = 0; i < pCount; i++)
+	{
+		engine::pack_header::file_info file;
+		file.path = file_path(i);
+		file.position = static_cast<uint64_t>(i) * 10;
+		file.size = 10;
+		header.add_file(file);
+	}
+	std::stringstream stream;
+	header.generate(stream);
+	pHeader.parse(stream);
+}
+
+}
+
+TEST_CASE("pack_header lookup")
+{
+	engine::pack_header header;
+	pack_test::make_header(header, 1000);
+	REQUIRE(header.get_file_count() == 1000);
+
+	auto file = header.get_file(pack_test::file_path(3));
+	REQUIRE(file.has_value());
+	REQUIRE(file->position == 30);
+	REQUIRE(!header.get_file("data/dir3/sub3/file4.png").has_value());
+
+	// Results are in the order of the pack
+	auto list = header.recursive_directory("data/dir3");
+	REQUIRE(list.size() == 20);
+	for (size_t i = 0; i < list.size(); i++)
+		REQUIRE(list[i] == pack_test::file_path(static_cast<int>(i) * 50 + 3));
+
+	REQUIRE(header.recursive_directory("data").size() == 1000);
+	REQUIRE(header.recursive_directory("data/dir3/sub3").size() == 3);
+	REQUIRE(header.recursive_directory("data/dir3/sub3/file3.png").empty());
+	REQUIRE(header.recursive_directory("nothing").empty());
+}
+
+TEST_CASE("pack_header benchmark", "[.][benchmark]")
+{
+	engine::pack_header header;
+	pack_test::make_header(header, 50000);
+
+	std::vector<engine::encoded_path> paths;
+	for (int i = 0; i < 1000; i++)
+		paths.push_back(pack_test::file_path(i * 37 % 50000));
+
+	engine::clock lookup_clock;
+	for (auto& i : paths)
+		REQUIRE(header.get_file(i).has_value());
+	const float lookup_time = lookup_clock.get_elapse().milliseconds();
+
+	size_t listed = 0;
+	engine::clock directory_clock;
+	for (int i = 0; i < 100; i++)
+		listed += header.recursive_directory("data/dir" + std::to_string(i % 50) + "/sub1").size();
+	const float directory_time = directory_clock.get_elapse().milliseconds();
+
+	logger::info("50000 files: 1000 lookups " + std::to_string(lookup_time) + "ms, 100 directory listings ("
+		+ std::to_string(listed) + " files) " + std::to_string(directory_time) + "ms");
+}
+
+TEST_CASE("resource_pack memory map")
+{
+	const std::vector<std::string> names = { "a/one.txt", "a/b/two.bin", "three.xml" };
+	const std::vector<std::string> contents = { "hello world", std::string(5000, 'x') + "end", "<a/>" };
+
+	engine::pack_header header;
+	uint64_t position = 0;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		engine::pack_header::file_info file;
+		file.path = names[i];
+		file.position = position;
+		file.size = contents[i].size();
+		position += file.size;
+		header.add_file(file);
+	}
+
+	{
+		std::ofstream stream("test_pack.pack", std::fstream::binary);
+		header.generate(stream);
+		for (auto& i : contents)
+			stream.write(i.c_str(), i.size());
+	}
+
+	// Both modes should read the same thing
+	for (bool memory_map : { false, true })
+	{
+		engine::resource_pack pack;
+		REQUIRE(pack.open("test_pack.pack", memory_map));
+		REQUIRE(pack.is_mapped() == memory_map);
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			auto view = pack.view(names[i]);
+			REQUIRE(std::string(view.data(), view.size()) == contents[i]);
+
+			engine::pack_stream stream(pack, names[i]);
+			REQUIRE(stream.is_valid());
+			char data[4];
+			REQUIRE(stream.read(data, 4) == 4);
+			REQUIRE(std::string(data, 4) == contents[i].substr(0, 4));
+			REQUIRE(stream.tell() == 4);
+			auto all = stream.read_all();
+			REQUIRE(std::string(all.begin(), all.end()) == contents[i]);
+		}
+		REQUIRE(pack.view("missing").empty());
+	}
+	std::remove("test_pack.pack");
+}
+
+TEST_CASE("tilemap_display culling")
+{
+	engine::texture_atlas atlas;
+	engine::subtexture grass("grass");
+	grass.set_frame_rect({ 0, 0, 1, 1 });
+	grass.set_frame_count(1);
+	atlas.add_entry(grass);
+	REQUIRE(atlas.save("test_atlas.xml"));
+
+	auto texture = std::make_shared<engine::texture>();
+	texture->set_atlas_source("test_atlas.xml");
+
+	// One tile in each chunk of a 4x4 grid
+	rpg::tilemap_display display;
+	display.set_texture(texture);
+	const float chunk = static_cast<float>(rpg::tilemap_display::chunk_size);
+	for (int x = 0; x < 4; x++)
+		for (int y = 0; y < 4; y++)
+			REQUIRE(display.set_tile({ x*chunk, y*chunk }, "grass", 0, 0));
+	REQUIRE(!display.set_tile({ 0, 0 }, "missing", 1, 0));
+
+	display.cull({ 0, 0, chunk * 2 - 1, chunk * 2 - 1 });
+	REQUIRE(display.get_submitted_quad_count() == 4);
+	REQUIRE(display.get_culled_quad_count() == 12);
+
+	display.cull({ -10, -10, chunk * 10, chunk * 10 });
+	REQUIRE(display.get_submitted_quad_count() == 16);
+	REQUIRE(display.get_culled_quad_count() == 0);
+
+	display.cull({ chunk * 10, chunk * 10, chunk, chunk });
+	REQUIRE(display.get_submitted_quad_count() == 0);
+	REQUIRE(display.get_culled_quad_count() == 16);
+
+	// Hidden layers are neither submitted nor culled
+	REQUIRE(display.remove_tile({ 0, 0 }, 0));
+	display.set_tile({ 0, 0 }, "grass", 1, 0);
+	display.set_layer_visible(1, false);
+	display.cull({ 0, 0, chunk - 1, chunk - 1 });
+	REQUIRE(display.get_submitted_quad_count() == 0);
+	REQUIRE(display.get_culled_quad_count() == 15);
+
+	std::remove("test_atlas.xml");
+}
+
+TEST_CASE("texture_packer")
+{
+	struct placed
+	{
+		int page;
+		engine::ivector position;
+		engine::ivector size;
+	};
+
+	std::mt19937 rng(7);
+	engine::texture_packer packer;
+	packer.set_page_size({ 256, 256 });
+	std::vector<placed> rects;
+	for (int i = 0; i < 300; i++)
+	{
+		placed rect;
+		rect.size = { 1 + static_cast<int>(rng() % 64), 1 + static_cast<int>(rng() % 64) };
+		rect.page = packer.add(rect.size, rect.position);
+		REQUIRE(rect.page >= 0);
+		rects.push_back(rect);
+	}
+
+	engine::ivector position;
+	REQUIRE(packer.add({ 300, 10 }, position) == -1);
+
+	// Everything is inside its page and padded from its neighbors
+	for (size_t i = 0; i < rects.size(); i++)
+	{
+		const auto& a = rects[i];
+		REQUIRE(a.position.x >= 0);
+		REQUIRE(a.position.y >= 0);
+		REQUIRE(a.position.x + a.size.x <= 256);
+		REQUIRE(a.position.y + a.size.y <= 256);
+		for (size_t j = i + 1; j < rects.size(); j++)
+		{
+			const auto& b = rects[j];
+			const bool overlap = a.page == b.page
+				&& a.position.x < b.position.x + b.size.x + 1 && b.position.x < a.position.x + a.size.x + 1
+				&& a.position.y < b.position.y + b.size.y + 1 && b.position.y < a.position.y + a.size.y + 1;
+			REQUIRE(!overlap);
+		}
+	}
+	REQUIRE(packer.get_efficiency() > 0.5f);
+}
+
+namespace atlas_test {
+
+// Grid of tiles with a few larger entries spread over it
+void fill_atlas(engine::texture_atlas& pAtlas, size_t pCount)
+{
+	const int columns = static_cast<int>(std::sqrt(static_cast<float>(pCount)));
+	for (size_t i = 0; i < pCount; i++)
+	{
+		engine::subtexture entry("entry" + std::to_string(i));
+		const float x = static_cast<float>(i % columns) * 32;
+		const float y = static_cast<float>(i / columns) * 32;
+		if (i % 97 == 0)
+			entry.set_frame_rect({ x, y, 1200, 200 });
+		else
+			entry.set_frame_rect({ x, y, 32, 32 });
+		entry.set_frame_count(1);
+		pAtlas.add_entry(entry);
+	}
+}
+
+engine::subtexture::ptr linear_get_entry(const engine::texture_atlas& pAtlas, engine::fvector pPosition)
+{
+	for (auto& i : pAtlas.get_all())
+		if (i->get_root_frame().is_intersect(pPosition))
+			return i;
+	return{};
+}
+
+}
+
+TEST_CASE("texture_atlas index")
+{
+	engine::texture_atlas atlas;
+	atlas_test::fill_atlas(atlas, 400);
+
+	REQUIRE(atlas.get_entry("entry5"));
+	REQUIRE(atlas.get_entry("entry5")->get_name() == "entry5");
+	REQUIRE(!atlas.get_entry("missing"));
+
+	REQUIRE(atlas.rename_entry("entry5", "renamed"));
+	REQUIRE(!atlas.get_entry("entry5"));
+	REQUIRE(atlas.get_entry("renamed"));
+	REQUIRE(!atlas.rename_entry("entry6", "renamed"));
+
+	REQUIRE(atlas.remove_entry("entry7"));
+	REQUIRE(!atlas.get_entry("entry7"));
+	REQUIRE(!atlas.add_entry(engine::subtexture("entry8")));
+
+	auto moved = atlas.get_entry("entry9");
+	moved->set_frame_rect({ 2000, 2000, 8, 8 });
+	atlas.update_regions();
+
+	// Position lookups find the same entry as a search in order
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<float> position(-16, 700);
+	for (int i = 0; i < 2000; i++)
+	{
+		const engine::fvector point(position(rng), position(rng));
+		REQUIRE(atlas.get_entry(point) == atlas_test::linear_get_entry(atlas, point));
+	}
+	REQUIRE(atlas.get_entry(engine::fvector(2004, 2004)) == moved);
+}
+
+TEST_CASE("texture_atlas benchmark", "[.][benchmark]")
+{
+	engine::texture_atlas atlas;
+	atlas_test::fill_atlas(atlas, 5000);
+
+	std::mt19937 rng(42);
+	std::vector<std::string> names;
+	std::vector<engine::fvector> points;
+	std::uniform_int_distribution<size_t> index(0, 4999);
+	std::uniform_real_distribution<float> position(0, 71 * 32);
+	for (int i = 0; i < 10000; i++)
+	{
+		names.push_back("entry" + std::to_string(index(rng)));
+		points.push_back({ position(rng), position(rng) });
+	}
+
+	size_t linear_hits = 0;
+	engine::clock linear_clock;
+	for (auto& i : names)
+		for (auto& j : atlas.get_all())
+			if (j->get_name() == i)
+			{
+				++linear_hits;
+				break;
+			}
+	for (auto& i : points)
+		if (atlas_test::linear_get_entry(atlas, i))
+			++linear_hits;
+	const float linear_time = linear_clock.get_elapse().milliseconds();
+
+	size_t index_hits = 0;
+	engine::clock index_clock;
+	for (auto& i : names)
+		if (atlas.get_entry(i))
+			++index_hits;
+	for (auto& i : points)
+		if (atlas.get_entry(i))
+			++index_hits;
+	const float index_time = index_clock.get_elapse().milliseconds();
+
+	REQUIRE(linear_hits == index_hits);
+	logger::info("5000 entries, 10000 name and 10000 position lookups: linear "
+		+ std::to_string(linear_time) + "ms, indexed " + std::to_string(index_time) + "ms");
+}
+
+namespace render_list_test {
+
+// Order the list should have. Equal depths keep the order they were added in.
+std::vector<engine::render_object*> expected_order(std::vector<engine::render_object*> pObjects)
+{
+	std::stable_sort(pObjects.begin(), pObjects.end(), [](engine::render_object* pA, engine::render_object* pB)
+	{
+		return pA->get_depth() > pB->get_depth();
+	});
+	return pObjects;
+}
+
+}
+
+TEST_CASE("render_list")
+{
+	std::vector<std::unique_ptr<engine::render_object>> storage;
+	std::vector<engine::render_object*> objects;
+	engine::render_list list;
+	for (int i = 0; i < 200; i++)
+	{
+		storage.emplace_back(new engine::render_object());
+		storage.back()->set_depth(static_cast<float>(i % 7));
+		objects.push_back(storage.back().get());
+		list.add(*objects.back());
+	}
+	list.update();
+	REQUIRE(std::vector<engine::render_object*>(list.begin(), list.end())
+		== render_list_test::expected_order(objects));
+
+	// Changes are only applied in update()
+	objects[3]->set_depth(100);
+	list.depth_changed(*objects[3]);
+	REQUIRE(*list.begin() != objects[3]);
+	list.update();
+	REQUIRE(*list.begin() == objects[3]);
+
+	std::mt19937 rng(5);
+	for (int frame = 0; frame < 20; frame++)
+	{
+		for (int i = 0; i < 30; i++)
+		{
+			auto object = objects[rng() % objects.size()];
+			object->set_depth(static_cast<float>(rng() % 7));
+			list.depth_changed(*object);
+		}
+		list.update();
+	}
+
+	list.remove(*objects[10]);
+	list.remove(*objects[10]);
+	objects.erase(objects.begin() + 10);
+	REQUIRE(list.size() == objects.size());
+	list.update();
+	REQUIRE(std::vector<engine::render_object*>(list.begin(), list.end())
+		== render_list_test::expected_order(objects));
+
+	// A few changes a frame are moved one at a time
+	for (int frame = 0; frame < 50; frame++)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			auto object = objects[rng() % objects.size()];
+			object->set_depth(static_cast<float>(rng() % 7));
+			list.depth_changed(*object);
+		}
+		if (frame % 10 == 5)
+		{
+			// Far moves switch to merging part way through
+			for (int i = 0; i < 9; i++)
+			{
+				auto object = objects[rng() % objects.size()];
+				object->set_depth(i % 2 ? -1.f : 8.f);
+				list.depth_changed(*object);
+			}
+		}
+		if (frame % 10 == 0)
+		{
+			// Removed while waiting to move
+			const size_t index = rng() % objects.size();
+			list.depth_changed(*objects[index]);
+			list.remove(*objects[index]);
+			objects.erase(objects.begin() + index);
+
+			storage.emplace_back(new engine::render_object());
+			storage.back()->set_depth(static_cast<float>(rng() % 7));
+			objects.push_back(storage.back().get());
+			list.add(*objects.back());
+		}
+		REQUIRE(list.size() == objects.size());
+		list.update();
+		REQUIRE(std::vector<engine::render_object*>(list.begin(), list.end())
+			== render_list_test::expected_order(objects));
+	}
+
+	// Equal depths are ordered by when the objects were added
+	std::vector<engine::render_object*> by_sequence = objects;
+	for (auto i : objects)
+	{
+		i->set_depth(1);
+		list.depth_changed(*i);
+	}
+	list.update();
+	REQUIRE(std::vector<engine::render_object*>(list.begin(), list.end()) == by_sequence);
+}
+
+TEST_CASE("render_list benchmark", "[.][benchmark]")
+{
+	for (size_t count : { 100, 1000, 10000 })
+	{
+		std::vector<std::unique_ptr<engine::render_object>> storage;
+		std::vector<engine::render_object*> objects;
+		engine::render_list list;
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<float> depth(0, 100);
+		for (size_t i = 0; i < count; i++)
+		{
+			storage.emplace_back(new engine::render_object());
+			storage.back()->set_depth(depth(rng));
+			objects.push_back(storage.back().get());
+			list.add(*objects.back());
+		}
+		list.update();
+
+		// A hundredth of the objects move every frame. Like walking
+		// characters sorted by height, they only move a little.
+		const size_t frames = 100;
+		std::uniform_real_distribution<float> step(-1, 1);
+		std::vector<std::vector<std::pair<size_t, float>>> moves(frames);
+		for (auto& i : moves)
+			for (size_t j = 0; j < count / 100; j++)
+				i.push_back({ rng() % count, step(rng) });
+
+		std::vector<engine::render_object*> sorted = objects;
+		engine::clock sort_clock;
+		for (auto& i : moves)
+		{
+			for (auto& j : i)
+				objects[j.first]->set_depth(objects[j.first]->get_depth() + j.second);
+			std::sort(sorted.begin(), sorted.end(), [](engine::render_object* pA, engine::render_object* pB)
+			{
+				return pA->get_depth() > pB->get_depth();
+			});
+		}
+		const float sort_time = sort_clock.get_elapse().milliseconds();
+
+		// Moved back the same way
+		engine::clock list_clock;
+		for (auto& i : moves)
+		{
+			for (auto& j : i)
+			{
+				objects[j.first]->set_depth(objects[j.first]->get_depth() - j.second);
+				list.depth_changed(*objects[j.first]);
+			}
+			list.update();
+		}
+		const float list_time = list_clock.get_elapse().milliseconds();
+
+		REQUIRE(list.size() == count);
+		logger::info(std::to_string(count) + " objects, 100 frames: full sort "
+			+ std::to_string(sort_time) + "ms, render_list " + std::to_string(list_time) + "ms");
+	}
+}
+
+TEST_CASE("fake time")
+{
+	engine::use_fake_time(true);
+	engine::clock clock;
+	engine::timer timer;
+	timer.start(0.5f);
+	REQUIRE(clock.get_elapse().seconds() == 0);
+
+	engine::advance_fake_time(0.25f);
+	REQUIRE(clock.get_elapse().milliseconds() == Approx(250).epsilon(0.001));
+	REQUIRE(!timer.is_reached());
+
+	engine::advance_fake_time(0.25f);
+	REQUIRE(timer.is_reached());
+	engine::use_fake_time(false);
+}
+
+TEST_CASE("null_backend")
+{
+	engine::null_backend backend;
+	sf::Texture texture_a;
+	sf::Texture texture_b;
+	sf::Vertex vertices[8];
+
+	sf::RenderStates states_a;
+	states_a.texture = &texture_a;
+	sf::RenderStates states_b;
+	states_b.texture = &texture_b;
+
+	backend.set_view(sf::View());
+	backend.draw(vertices, 8, sf::Quads, states_a);
+	backend.draw(vertices, 4, sf::Quads, states_a);
+	backend.draw(vertices, 4, sf::Quads, states_b);
+
+	REQUIRE(backend.get_stats().draw_calls == 3);
+	REQUIRE(backend.get_stats().vertices == 16);
+	REQUIRE(backend.get_stats().state_changes == 2);
+
+	backend.reset_stats();
+	REQUIRE(backend.get_stats().draw_calls == 0);
+}
+
+namespace render_queue_test {
+
+// Keeps the texture, shader and first vertex of every draw
+class recording_backend :
+	public engine::null_backend
+{
+public:
+	struct draw_call
+	{
+		const sf::Texture* texture;
+		const sf::Shader* shader;
+		std::vector<float> quads; // x of the first vertex of each quad
+	};
+	std::vector<draw_call> calls;
+
+protected:
+	using engine::null_backend::submit;
+	void submit(const sf::Vertex* pVertices, size_t pCount, sf::PrimitiveType pType, const sf::RenderStates& pStates) override
+	{
+		calls.push_back({ pStates.texture, pStates.shader, {} });
+		for (size_t i = 0; i < pCount; i += 4)
+			calls.back().quads.push_back(pVertices[i].position.x);
+	}
+};
+
+}
+
+TEST_CASE("render_queue")
+{
+	render_queue_test::recording_backend backend;
+	engine::render_queue queue;
+
+	// In address order so the texture order is known
+	sf::Texture textures[2];
+	const sf::Texture* a = &textures[0];
+	const sf::Texture* b = &textures[1];
+	sf::Shader shader;
+
+	// The position of each quad identifies it
+	auto add = [&](const sf::Texture* pTexture, const sf::Shader* pShader, float pId)
+	{
+		sf::Vertex vertices[4];
+		for (auto& i : vertices)
+			i.position.x = pId;
+		queue.add_quad(pTexture, pShader, vertices);
+	};
+	queue.set_depth(1);
+	add(b, nullptr, 0);
+	add(a, nullptr, 1);
+	add(b, nullptr, 2);
+	add(a, &shader, 3);
+	queue.set_depth(2);
+	add(b, nullptr, 4);
+	queue.set_depth(1);
+	add(a, nullptr, 5);
+	queue.set_depth(0);
+	add(b, nullptr, 6);
+
+	queue.flush(backend);
+	REQUIRE(queue.is_empty());
+
+	// Higher depths first, then by texture and shader.
+	// Quads with the same states keep the order they were added in
+	// and neighbouring runs are drawn together even across depths.
+	REQUIRE(backend.get_stats().batches == 4);
+	REQUIRE(backend.get_stats().draw_calls == 4);
+	REQUIRE(backend.get_stats().vertices == 28);
+	auto& calls = backend.calls;
+	REQUIRE(calls.size() == 4);
+	REQUIRE(calls[0].texture == b);
+	REQUIRE(calls[0].quads == std::vector<float>{ 4 });
+	REQUIRE(calls[1].texture == a);
+	REQUIRE(calls[1].shader == nullptr);
+	REQUIRE(calls[1].quads == std::vector<float>{ 1, 5 });
+	REQUIRE(calls[2].shader == &shader);
+	REQUIRE(calls[2].quads == std::vector<float>{ 3 });
+	REQUIRE(calls[3].texture == b);
+	REQUIRE(calls[3].quads == std::vector<float>{ 0, 2, 6 });
+
+	// Nothing is drawn for an empty queue
+	queue.flush(backend);
+	REQUIRE(calls.size() == 4);
+}
+
+TEST_CASE("profiler")
+{
+	engine::profiler::set_history_size(3);
+	engine::profiler::set_enabled(true);
+	for (int i = 0; i < 5; i++)
+	{
+		{
+			engine::profiler::zone zone("outer");
+			engine::profiler::zone inner("inner");
+		}
+		engine::profiler::add_counter("count", static_cast<float>(i));
+		engine::profiler::end_frame();
+	}
+	engine::profiler::set_enabled(false);
+
+	// Only the newest frames are kept
+	const auto frames = engine::profiler::get_frames();
+	REQUIRE(frames.size() == 3);
+	REQUIRE(frames[0].counters.size() == 1);
+	REQUIRE(frames[0].counters[0].value == 2);
+	REQUIRE(frames[2].counters[0].value == 4);
+	REQUIRE(frames[1].start >= frames[0].start + frames[0].duration);
+
+	// The inner zone ends first
+	REQUIRE(frames[0].zones.size() == 2);
+	REQUIRE(std::string(frames[0].zones[0].name) == "inner");
+	REQUIRE(frames[0].zones[1].duration >= frames[0].zones[0].duration);
+
+	const std::string trace = engine::profiler::get_chrome_trace();
+	REQUIRE(trace.find("\"traceEvents\"") != std::string::npos);
+	REQUIRE(trace.find("\"name\":\"outer\",\"ph\":\"X\"") != std::string::npos);
+	REQUIRE(trace.find("\"ph\":\"C\"") != std::string::npos);
+
+	// Nothing is recorded while disabled
+	engine::profiler::clear();
+	{
+		engine::profiler::zone zone("outer");
+	}
+	engine::profiler::end_frame();
+	REQUIRE(engine::profiler::get_frames().empty());
+	engine::profiler::set_history_size(300);
+}
+
+// Absolute position without the cached transforms
+engine::fvector node_reference_position(const engine::node& pNode)
+{
+	float rotation = pNode.get_rotation();
+	engine::fvector scale = pNode.get_scale();
+	for (auto i = pNode.get_parent(); i; i = i->get_parent())
+	{
+		rotation += i->get_rotation();
+		scale = scale*i->get_scale();
+	}
+	if (!pNode.get_parent())
+		return pNode.get_position();
+	const float parent_rotation = rotation - pNode.get_rotation();
+	return (pNode.get_position()*scale).rotate(parent_rotation)
+		+ node_reference_position(*pNode.get_parent());
+}
+
+TEST_CASE("node transforms")
+{
+	std::vector<std::unique_ptr<engine::node>> nodes;
+	for (size_t i = 0; i < 32; i++)
+		nodes.emplace_back(new engine::node());
+
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> value(-10, 10);
+	for (size_t step = 0; step < 2000; step++)
+	{
+		engine::node& a = *nodes[rng() % nodes.size()];
+		engine::node& b = *nodes[rng() % nodes.size()];
+
+		// Parenting must not make a loop
+		bool is_ancestor = &a == &b;
+		for (auto i = b.get_parent(); i; i = i->get_parent())
+			is_ancestor |= i == &a;
+
+		switch (rng() % 7)
+		{
+		case 0: a.set_position({ value(rng), value(rng) }); break;
+		case 1: a.set_rotation(value(rng) * 10); break;
+		case 2: a.set_scale({ value(rng) / 5, value(rng) / 5 }); break;
+		case 3: a.detach_parent(); break;
+		case 4: a.detach_children(); break;
+		case 5:
+			if (!is_ancestor)
+				a.set_internal_parent(b);
+			break;
+		case 6:
+			if (!is_ancestor)
+				b.add_child(a);
+			break;
+		}
+
+		engine::node& check = *nodes[rng() % nodes.size()];
+		const engine::fvector expected = node_reference_position(check);
+		REQUIRE(check.get_absolute_position().x == Approx(expected.x).margin(0.001));
+		REQUIRE(check.get_absolute_position().y == Approx(expected.y).margin(0.001));
+	}
+
+	// Children keep their index when a sibling is detached
+	engine::node parent;
+	engine::node child_a, child_b, child_c;
+	parent.add_child(child_a);
+	parent.add_child(child_b);
+	parent.add_child(child_c);
+	child_a.detach_parent();
+	REQUIRE(parent.get_children().size() == 2);
+	child_b.detach_parent();
+	REQUIRE(parent.get_children().size() == 1);
+	REQUIRE(parent.get_children()[0] == &child_c);
+	child_c.detach_parent();
+	REQUIRE(parent.get_children().empty());
+}
+
+TEST_CASE("node transforms benchmark", "[.][benchmark]")
+{
+	// Chains of 8 like entities attached to each other
+	std::vector<std::unique_ptr<engine::node>> nodes;
+	for (size_t i = 0; i < 8000; i++)
+	{
+		nodes.emplace_back(new engine::node());
+		nodes.back()->set_position({ 1, 1 });
+		if (i % 8 != 0)
+			nodes[i - 1]->add_child(*nodes.back());
+	}
+
+	float sum = 0;
+	engine::clock reference_clock;
+	for (size_t frame = 0; frame < 100; frame++)
+		for (auto& i : nodes)
+			sum += node_reference_position(*i).x;
+	const float reference_time = reference_clock.get_elapse().milliseconds();
+
+	engine::clock cached_clock;
+	for (size_t frame = 0; frame < 100; frame++)
+	{
+		// One root of ten moves every frame
+		for (size_t i = frame % 10 * 8; i < nodes.size(); i += 80)
+			nodes[i]->set_position({ static_cast<float>(frame), 1 });
+		for (auto& i : nodes)
+			sum += i->get_absolute_position().x;
+	}
+	const float cached_time = cached_clock.get_elapse().milliseconds();
+
+	REQUIRE(sum != 0);
+	logger::info("8000 nodes, 100 frames: uncached " + std::to_string(reference_time)
+		+ "ms, cached " + std::to_string(cached_time) + "ms");
+}
+
+// Keeps a copy of the vertices like a buffer on the graphics card would
+class vertex_copy_sink :
+	public engine::vertex_upload_sink
+{
+public:
+	std::vector<sf::Vertex> vertices;
+	size_t uploaded;
+
+	vertex_copy_sink() : uploaded(0) {}
+
+	void resize(size_t pVertex_count) override
+	{
+		vertices.resize(pVertex_count);
+	}
+
+	void update(const sf::Vertex* pVertices, size_t pOffset, size_t pCount) override
+	{
+		std::copy(pVertices, pVertices + pCount, vertices.begin() + pOffset);
+		uploaded += pCount;
+	}
+};
+
+TEST_CASE("vertex_batch bulk updates")
+{
+	engine::vertex_batch single;
+	engine::vertex_batch bulk;
+	std::vector<engine::vertex_reference> refs;
+	std::vector<engine::frect> rects;
+	std::vector<engine::color> colors;
+	for (size_t i = 0; i < 100; i++)
+	{
+		refs.push_back(single.add_quad({ 0, 0 }, { 0, 0, 8, 8 }));
+		bulk.add_quad({ 0, 0 }, { 0, 0, 8, 8 });
+		rects.push_back({ static_cast<float>(i), 2.f * i, 8, 8 });
+		colors.push_back({ 1, 0.5f, 0, 1 });
+	}
+
+	vertex_copy_sink single_copy;
+	vertex_copy_sink bulk_copy;
+	single.upload(single_copy);
+	bulk.upload(bulk_copy);
+	REQUIRE(bulk_copy.vertices.size() == 400);
+	REQUIRE(bulk.get_dirty_ranges().empty());
+
+	for (size_t i = 10; i < 20; i++)
+	{
+		refs[i].set_position(rects[i].get_offset());
+		refs[i].set_color(colors[i]);
+	}
+	bulk.set_quad_rects(10, &rects[10], 10);
+	bulk.set_quad_colors(10, &colors[10], 10);
+
+	// Neighbouring quads are merged into one range
+	REQUIRE(bulk.get_dirty_ranges().size() == 1);
+	REQUIRE(bulk.get_dirty_ranges()[0].begin == 40);
+	REQUIRE(bulk.get_dirty_ranges()[0].end == 80);
+	REQUIRE(single.get_dirty_ranges().size() == 1);
+
+	// Only the changed quads are uploaded
+	single_copy.uploaded = 0;
+	bulk_copy.uploaded = 0;
+	single.upload(single_copy);
+	bulk.upload(bulk_copy);
+	REQUIRE(bulk_copy.uploaded == 40);
+	REQUIRE(single_copy.uploaded == 40);
+	for (size_t i = 0; i < 400; i++)
+	{
+		REQUIRE(single_copy.vertices[i].position == bulk_copy.vertices[i].position);
+		REQUIRE(single_copy.vertices[i].color == bulk_copy.vertices[i].color);
+	}
+
+	// Changes out of order are sorted and merged with both neighbours
+	refs[50].set_color(colors[50]);
+	refs[30].set_color(colors[30]);
+	refs[70].set_color(colors[70]);
+	refs[31].set_color(colors[31]);
+	refs[49].set_color(colors[49]);
+	auto& dirty = single.get_dirty_ranges();
+	REQUIRE(dirty.size() == 3);
+	REQUIRE(dirty[0].begin == 120);
+	REQUIRE(dirty[0].end == 128);
+	REQUIRE(dirty[1].begin == 196);
+	REQUIRE(dirty[2].begin == 280);
+	single.set_quad_colors(32, &colors[32], 17);
+	REQUIRE(dirty.size() == 2);
+	REQUIRE(dirty[0].begin == 120);
+	REQUIRE(dirty[0].end == 204);
+	REQUIRE(dirty[1].end == 284);
+	single.upload(single_copy);
+
+	// Too many ranges become one
+	for (size_t i = 0; i < 17; i++)
+		refs[98 - i * 2].set_color(colors[0]);
+	REQUIRE(dirty.size() == 1);
+	REQUIRE(dirty[0].begin == 66 * 4);
+	REQUIRE(dirty[0].end == 99 * 4);
+	single.upload(single_copy);
+
+	std::vector<engine::fvector> moves(100, { 1, 1 });
+	bulk.translate_quads(0, moves.data(), moves.size());
+	bulk.upload(bulk_copy);
+	REQUIRE(bulk_copy.vertices[40].position.x == 11);
+	REQUIRE(bulk_copy.vertices[40].position.y == 21);
+}
+
+TEST_CASE("vertex_batch bulk updates benchmark", "[.][benchmark]")
+{
+	const size_t count = 100000;
+	engine::vertex_batch batch;
+	std::vector<engine::vertex_reference> refs;
+	batch.reserve_quads(count);
+	for (size_t i = 0; i < count; i++)
+		refs.push_back(batch.add_quad({ 0, 0 }, { 0, 0, 8, 8 }));
+
+	std::vector<engine::frect> rects(count);
+	std::vector<engine::color> colors(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		rects[i] = { static_cast<float>(i % 1000), static_cast<float>(i / 1000), 8, 8 };
+		colors[i] = { 1, 1, 1, (i % 100) / 100.f };
+	}
+
+	vertex_copy_sink copy;
+	batch.upload(copy);
+
+	const size_t frames = 10;
+	engine::clock single_clock;
+	for (size_t frame = 0; frame < frames; frame++)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			refs[i].set_position(rects[i].get_offset());
+			refs[i].set_color(colors[i]);
+		}
+		batch.upload(copy);
+	}
+	const float single_time = single_clock.get_elapse().milliseconds();
+
+	engine::clock bulk_clock;
+	for (size_t frame = 0; frame < frames; frame++)
+	{
+		batch.set_quad_rects(0, rects.data(), count);
+		batch.set_quad_colors(0, colors.data(), count);
+		batch.upload(copy);
+	}
+	const float bulk_time = bulk_clock.get_elapse().milliseconds();
+
+	// A tenth of the quads change
+	engine::clock partial_clock;
+	for (size_t frame = 0; frame < frames; frame++)
+	{
+		batch.set_quad_rects(frame * 1000, &rects[frame * 1000], count / 10);
+		batch.upload(copy);
+	}
+	const float partial_time = partial_clock.get_elapse().milliseconds();
+
+	logger::info("100k quads, 10 frames: per reference " + std::to_string(single_time)
+		+ "ms, bulk " + std::to_string(bulk_time)
+		+ "ms, bulk on a tenth " + std::to_string(partial_time) + "ms");
+}
+
+TEST_CASE("vertex_batch quad slots")
+{
+	engine::vertex_batch batch;
+	std::vector<engine::vertex_reference> refs;
+	for (size_t i = 0; i < 10; i++)
+		refs.push_back(batch.add_quad({ static_cast<float>(i), 0 }, { 0, 0, 1, 1 }));
+
+	REQUIRE(batch.remove_quad(refs[2]));
+	REQUIRE(batch.remove_quad(refs[5]));
+	REQUIRE(!batch.remove_quad(refs[5]));
+	REQUIRE(!refs[5].is_valid());
+	refs[5].set_position({ 100, 100 });
+	refs[5].set_color({ 0, 0, 0, 0 });
+	refs[5].hide();
+	REQUIRE(batch.get_live_quad_count() == 8);
+	REQUIRE(batch.get_dead_quad_count() == 2);
+
+	// Removed slots are reused before the batch grows
+	engine::vertex_reference reused = batch.add_quad({ 20, 0 }, { 0, 0, 1, 1 });
+	REQUIRE(batch.get_quad_count() == 10);
+	REQUIRE(reused.get_quad_index() == 5);
+	REQUIRE(!refs[5].is_valid());
+	refs[5] = reused;
+
+	// Compacting keeps the order and the references
+	batch.compact();
+	REQUIRE(batch.get_quad_count() == 9);
+	REQUIRE(batch.get_dead_quad_count() == 0);
+	vertex_copy_sink copy;
+	batch.upload(copy);
+	REQUIRE(copy.vertices.size() == 36);
+	for (size_t i = 0; i < refs.size(); i++)
+	{
+		if (i == 2)
+			continue;
+		REQUIRE(refs[i].is_valid());
+		REQUIRE(copy.vertices[refs[i].get_quad_index() * 4].position.x == refs[i].get_position().x);
+	}
+	REQUIRE(refs[3].get_quad_index() == 2);
+
+	// Adding and removing forever does not grow the batch
+	for (size_t i = 0; i < 1000; i++)
+		batch.remove_quad(batch.add_quad({ 0, 0 }, { 0, 0, 1, 1 }));
+	REQUIRE(batch.get_quad_count() == 10);
+
+	batch.set_compaction_threshold(0.05f);
+	batch.upload(copy);
+	REQUIRE(batch.get_quad_count() == 9);
+
+	batch.clean();
+	REQUIRE(!refs[0].is_valid());
+	REQUIRE(batch.add_quad({ 0, 0 }, { 0, 0, 1, 1 }).is_valid());
+}
+
+TEST_CASE("particle_emitter")
+{
+	engine::particle_emitter emitter;
+	emitter.set_capacity(10);
+	emitter.set_life(1);
+	emitter.set_texture_rect({ 0, 0, 2, 2 });
+
+	// Spawning stops at the capacity
+	emitter.spawn(20);
+	REQUIRE(emitter.get_count() == 10);
+
+	emitter.update(0.5f);
+	REQUIRE(emitter.get_count() == 10);
+
+	// Later particles live longer and fill the places of the dead ones
+	emitter.set_life(2);
+	emitter.spawn(5);
+	REQUIRE(emitter.get_count() == 10);
+	emitter.set_capacity(15);
+	emitter.spawn(5);
+	REQUIRE(emitter.get_count() == 15);
+	emitter.update(0.6f);
+	REQUIRE(emitter.get_count() == 5);
+
+	emitter.update(2.f);
+	REQUIRE(emitter.get_count() == 0);
+}
+
+TEST_CASE("particle_emitter benchmark", "[.][benchmark]")
+{
+	engine::particle_emitter emitter;
+	emitter.set_capacity(100000);
+	emitter.set_life(1000);
+	emitter.set_region({ 1000, 1000 });
+	emitter.set_velocity({ 10, -20 });
+	emitter.set_acceleration({ 0, 50 });
+	emitter.set_texture_rect({ 0, 0, 4, 4 });
+	emitter.spawn(100000);
+	emitter.update(1.f / 60); // Creates the quads
+
+	engine::clock clock;
+	for (size_t i = 0; i < 100; i++)
+		emitter.update(1.f / 60);
+	const float time = clock.get_elapse().milliseconds() / 100;
+	REQUIRE(emitter.get_count() == 100000);
+
+	logger::info("100k particles: " + std::to_string(time) + "ms per update");
+}
+
+TEST_CASE("animation_scheduler")
+{
+	auto water = std::make_shared<engine::animation>();
+	water->set_frame_count(4);
+	water->set_frame_rect({ 0, 0, 16, 16 });
+	water->add_interval(0, 100);
+
+	engine::vertex_batch batch;
+	engine::vertex_batch other;
+	engine::animation_scheduler scheduler;
+	const auto first = scheduler.add_quad(water, batch.add_quad({ 0, 0 }, { 0, 0, 16, 16 }));
+	scheduler.add_quad(water, batch.add_quad({ 16, 0 }, { 0, 0, 16, 16 }, 1));
+	scheduler.add_quad(water, other.add_quad({ 0, 0 }, { 0, 0, 16, 16 }));
+	REQUIRE(scheduler.get_quad_count() == 3);
+
+	// Nothing to animate
+	auto still = std::make_shared<engine::animation>();
+	still->set_frame_count(1);
+	REQUIRE(scheduler.add_quad(still, batch.add_quad({ 32, 0 }, { 0, 0, 16, 16 }))
+		== engine::animation_scheduler::no_handle);
+
+	vertex_copy_sink copy;
+	vertex_copy_sink other_copy;
+	scheduler.update(0.05f);
+	batch.upload(copy);
+	REQUIRE(copy.vertices[0].texCoords.x == 0);
+
+	scheduler.update(0.06f);
+	batch.upload(copy);
+	other.upload(other_copy);
+	REQUIRE(copy.vertices[0].texCoords.x == 16);
+	REQUIRE(other_copy.vertices[0].texCoords.x == 16);
+
+	// Rotated quads keep their rotation
+	REQUIRE(copy.vertices[5].texCoords.x == 16);
+	REQUIRE(copy.vertices[5].texCoords.y == 0);
+
+	// Frames skipped by a long update are not written
+	scheduler.update(0.2f);
+	batch.upload(copy);
+	REQUIRE(copy.vertices[0].texCoords.x == 48);
+
+	scheduler.remove_quad(first);
+	scheduler.update(0.1f);
+	batch.upload(copy);
+	REQUIRE(copy.vertices[0].texCoords.x == 48);
+	REQUIRE(copy.vertices[5].texCoords.x == 0);
+
+	// New quads start on the frame the others are on
+	scheduler.add_quad(water, batch.add_quad({ 48, 0 }, { 0, 0, 16, 16 }));
+	batch.upload(copy);
+	REQUIRE(copy.vertices[12].texCoords.x == 0);
+	REQUIRE(scheduler.get_quad_count() == 3);
+
+	// Intervals of 0 change frame every update
+	auto fast = std::make_shared<engine::animation>();
+	fast->set_frame_count(2);
+	fast->set_frame_rect({ 0, 16, 16, 16 });
+	scheduler.add_quad(fast, batch.add_quad({ 64, 0 }, { 0, 16, 16, 16 }));
+	scheduler.update(0.f);
+	batch.upload(copy);
+	REQUIRE(copy.vertices[16].texCoords.x == 16);
+	scheduler.update(0.f);
+	batch.upload(copy);
+	REQUIRE(copy.vertices[16].texCoords.x == 0);
+}
+
+TEST_CASE("animation_scheduler players")
+{
+	auto walk = std::make_shared<engine::animation>();
+	walk->set_frame_count(4);
+	walk->add_interval(0, 100);
+
+	engine::animation_scheduler scheduler;
+	std::vector<engine::frame_t> frames;
+	std::vector<engine::frame_t> fast_frames;
+	const auto player = scheduler.add_player(walk, 0,
+		[&](engine::frame_t pFrame) { frames.push_back(pFrame); });
+	const auto fast = scheduler.add_player(walk, 0,
+		[&](engine::frame_t pFrame) { fast_frames.push_back(pFrame); });
+	scheduler.set_player_speed(fast, 2);
+	REQUIRE(scheduler.get_player_count() == 2);
+
+	scheduler.update(0.06f);
+	REQUIRE(frames.empty());
+	REQUIRE(fast_frames == std::vector<engine::frame_t>{ 1 });
+
+	// Skipped frames are only reported once
+	scheduler.update(0.25f);
+	REQUIRE(frames == std::vector<engine::frame_t>{ 3 });
+	REQUIRE(fast_frames == std::vector<engine::frame_t>{ 1, 6 });
+
+	// Paused players keep the time left of their frame
+	scheduler.pause_player(player);
+	scheduler.update(1.f);
+	REQUIRE(frames.size() == 1);
+	scheduler.resume_player(player);
+	scheduler.update(0.08f);
+	REQUIRE(frames.size() == 1);
+	scheduler.update(0.02f);
+	REQUIRE(frames == std::vector<engine::frame_t>{ 3, 4 });
+
+	// Frames are timed from when they are set
+	scheduler.set_player_frame(player, 0);
+	scheduler.update(0.09f);
+	REQUIRE(frames.size() == 2);
+	scheduler.update(0.02f);
+	REQUIRE(frames.back() == 1);
+
+	// Players can remove themselves
+	engine::animation_scheduler::handle self = engine::animation_scheduler::no_handle;
+	size_t self_calls = 0;
+	self = scheduler.add_player(walk, 0, [&](engine::frame_t)
+	{
+		++self_calls;
+		scheduler.remove_player(self);
+	});
+	scheduler.remove_player(fast);
+	scheduler.update(0.2f);
+	scheduler.update(0.2f);
+	REQUIRE(self_calls == 1);
+	REQUIRE(scheduler.get_player_count() == 1);
+
+	// Frames without an interval stay
+	auto still = std::make_shared<engine::animation>();
+	still->set_frame_count(2);
+	scheduler.set_player_animation(player, still);
+	scheduler.set_player_frame(player, 0);
+	const size_t count = frames.size();
+	scheduler.update(1.f);
+	REQUIRE(frames.size() == count);
+}
+
+TEST_CASE("animation_scheduler benchmark", "[.][benchmark]")
+{
+	std::vector<std::shared_ptr<engine::animation>> animations;
+	for (size_t i = 0; i < 4; i++)
+	{
+		auto a = std::make_shared<engine::animation>();
+		a->set_frame_count(4);
+		a->set_frame_rect({ 0, static_cast<float>(i) * 16, 16, 16 });
+		a->add_interval(0, 100.f + i * 50);
+		animations.push_back(a);
+	}
+
+	// 100k tiles spread over 100 chunks
+	std::vector<engine::vertex_batch> batches(100);
+	std::vector<engine::vertex_reference> refs;
+	engine::animation_scheduler scheduler;
+	for (size_t i = 0; i < 100000; i++)
+	{
+		auto& a = animations[i % animations.size()];
+		refs.push_back(batches[i % batches.size()].add_quad({ 0, 0 }, a->get_frame_at(0)));
+		scheduler.add_quad(a, refs.back());
+	}
+
+	// The old way: a timer for every tile
+	std::vector<engine::timer> timers(refs.size());
+	std::vector<engine::frame_t> frames(refs.size(), 0);
+	for (auto& i : timers)
+		i.start(0);
+	engine::clock per_tile_clock;
+	for (size_t frame = 0; frame < 60; frame++)
+	{
+		for (size_t i = 0; i < refs.size(); i++)
+		{
+			if (timers[i].is_reached())
+			{
+				auto& a = animations[i % animations.size()];
+				timers[i].start(a->get_interval(++frames[i])*0.001f);
+				refs[i].set_texture_rect(a->get_frame_at(frames[i]));
+			}
+		}
+	}
+	const float per_tile_time = per_tile_clock.get_elapse().milliseconds() / 60;
+
+	engine::clock scheduler_clock;
+	for (size_t frame = 0; frame < 60; frame++)
+		scheduler.update(1.f / 60);
+	const float scheduler_time = scheduler_clock.get_elapse().milliseconds() / 60;
+
+	logger::info("100k animated tiles: per tile timers " + std::to_string(per_tile_time)
+		+ "ms, scheduler " + std::to_string(scheduler_time) + "ms per frame");
+}
+
+}